@@ -41,9 +41,174 @@ template<class T> T MaxDifference(const Array<T,2> &a,const Array<T,2> &b)
 //due to huge memory requirements with gcc when using blitz.
 #define __VFN_GEOM_STRUCT_FACTOR_USE_POINTERS
 
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
 #include "ObjCryst/Quirks/VFNDebug.h"
 #include "ObjCryst/Quirks/VFNStreamFormat.h"
 
+//######################################################################
+//  Aligned memory allocation
+//######################################################################
+void* CrystVectorAlignedMalloc(const size_t nbBytes)
+{
+   // Always allocate at least one block, as new T[0] does
+   size_t nb=((nbBytes+CRYSTVECTOR_ALIGNMENT-1)/CRYSTVECTOR_ALIGNMENT)*CRYSTVECTOR_ALIGNMENT;
+   if(nb==0) nb=CRYSTVECTOR_ALIGNMENT;
+   #ifdef _MSC_VER
+   void *p=_aligned_malloc(nb,CRYSTVECTOR_ALIGNMENT);
+   if(p==0) throw std::bad_alloc();
+   #else
+   void *p=0;
+   if(posix_memalign(&p,CRYSTVECTOR_ALIGNMENT,nb)!=0) throw std::bad_alloc();
+   #endif
+   // Zero the padding, so that vectorised code can safely read up to the end of the block
+   memset((char*)p+nbBytes,0,nb-nbBytes);
+   ObjCryst::ProfilerCountAllocation(nbBytes);
+   return p;
+}
+
+void CrystVectorFree(void *p)
+{
+   #ifdef _MSC_VER
+   _aligned_free(p);
+   #else
+   free(p);
+   #endif
+}
+
+//######################################################################
+//  Vectorised kernels
+//######################################################################
+// With gcc on x86-64 linux, several versions of the kernels are compiled
+// for different instruction sets, and the best one is selected when the
+// library is loaded (using the ifunc mechanism).
+#if defined(__GNUC__) && (__GNUC__>=6) && !defined(__clang__) && !defined(__INTEL_COMPILER) \
+    && defined(__x86_64__) && defined(__linux__)
+#define CRYSTVECTOR_KERNEL __attribute__((target_clones("avx512f","avx2","default")))
+#else
+#define CRYSTVECTOR_KERNEL
+#endif
+
+// Reductions use 8 independent partial sums, which allows the compiler to
+// vectorise them even without -ffast-math.
+#define CRYSTVECTOR_REDUCE(expr) \
+   REAL s[8]={0,0,0,0,0,0,0,0}; \
+   long i=0; \
+   for(;i+8<=nb;i+=8) \
+      for(int j=0;j<8;++j) {const long k=i+j; s[j] += expr;} \
+   REAL sum=((s[0]+s[4])+(s[1]+s[5]))+((s[2]+s[6])+(s[3]+s[7])); \
+   for(long k=i;k<nb;++k) sum += expr; \
+   return sum;
+
+CRYSTVECTOR_KERNEL REAL CrystVectorKernelSum(const REAL * RESTRICT a,const long nb)
+{
+   CRYSTVECTOR_REDUCE(a[k])
+}
+
+CRYSTVECTOR_KERNEL void CrystVectorKernelScale(REAL * RESTRICT y,const REAL a,const long nb)
+{
+   for(long i=0;i<nb;++i) y[i] *= a;
+}
+
+CRYSTVECTOR_KERNEL void CrystVectorKernelMult(REAL * RESTRICT y,const REAL * RESTRICT x,const long nb)
+{
+   for(long i=0;i<nb;++i) y[i] *= x[i];
+}
+
+CRYSTVECTOR_KERNEL void CrystVectorKernelSub(REAL * RESTRICT y,const REAL * RESTRICT x,const long nb)
+{
+   for(long i=0;i<nb;++i) y[i] -= x[i];
+}
+
+CRYSTVECTOR_KERNEL void AddScaled(REAL * RESTRICT y,const REAL a,const REAL * RESTRICT x,const long nb)
+{
+   for(long i=0;i<nb;++i) y[i] += a*x[i];
+}
+
+CRYSTVECTOR_KERNEL REAL SumProduct(const REAL * RESTRICT a,const REAL * RESTRICT b,const long nb)
+{
+   CRYSTVECTOR_REDUCE(a[k]*b[k])
+}
+
+CRYSTVECTOR_KERNEL REAL SumProduct(const REAL * RESTRICT a,const REAL * RESTRICT b,
+                                   const REAL * RESTRICT c,const long nb)
+{
+   CRYSTVECTOR_REDUCE(a[k]*b[k]*c[k])
+}
+
+CRYSTVECTOR_KERNEL REAL SumDiffProduct(const REAL * RESTRICT a,const REAL * RESTRICT b,
+                                       const REAL * RESTRICT c,const long nb)
+{
+   CRYSTVECTOR_REDUCE((a[k]-b[k])*c[k])
+}
+
+CRYSTVECTOR_KERNEL REAL SumDiffProduct(const REAL * RESTRICT a,const REAL * RESTRICT b,
+                                       const REAL * RESTRICT c,const REAL * RESTRICT d,const long nb)
+{
+   CRYSTVECTOR_REDUCE((a[k]-b[k])*c[k]*d[k])
+}
+
+CRYSTVECTOR_KERNEL REAL SumWeightedSquaredDiff(const REAL * RESTRICT w,const REAL * RESTRICT a,
+                                               const REAL * RESTRICT b,const long nb)
+{
+   CRYSTVECTOR_REDUCE(w[k]*(a[k]-b[k])*(a[k]-b[k]))
+}
+
+void AddScaled(CrystVector_REAL &y,const REAL a,const CrystVector_REAL &x)
+{
+   AddScaled(y.data(),a,x.data(),y.numElements());
+}
+
+REAL SumProduct(const CrystVector_REAL &a,const CrystVector_REAL &b)
+{
+   return SumProduct(a.data(),b.data(),a.numElements());
+}
+
+REAL SumProduct(const CrystVector_REAL &a,const CrystVector_REAL &b,const CrystVector_REAL &c)
+{
+   return SumProduct(a.data(),b.data(),c.data(),a.numElements());
+}
+
+REAL SumWeightedSquaredDiff(const CrystVector_REAL &w,const CrystVector_REAL &a,const CrystVector_REAL &b)
+{
+   return SumWeightedSquaredDiff(w.data(),a.data(),b.data(),w.numElements());
+}
+
+// Generic versions of the kernels used by CrystVector and CrystMatrix. For
+// REAL, the overloaded vectorised versions are used instead.
+template<class T> T CrystVectorKernelSum(const T *a,const long nb)
+{
+   T tmp=0;
+   for(long i=0;i<nb;i++) tmp += *a++ ;
+   return tmp;
+}
+
+template<class T> void CrystVectorKernelScale(T * RESTRICT y,const T a,const long nb)
+{
+   for(long i=0;i<nb;i++) *y++ *= a;
+}
+
+template<class T> void CrystVectorKernelMult(T * RESTRICT y,const T * RESTRICT x,const long nb)
+{
+   for(long i=0;i<nb;i++) *y++ *= *x++;
+}
+
+// Not AddScaled(y,(T)-1,x), which would be an addition for bool
+template<class T> void CrystVectorKernelSub(T * RESTRICT y,const T * RESTRICT x,const long nb)
+{
+   for(long i=0;i<nb;i++) *y++ -= *x++;
+}
+
+template<class T> void AddScaled(T * RESTRICT y,const T a,const T * RESTRICT x,const long nb)
+{
+   for(long i=0;i<nb;i++) *y++ += a * *x++;
+}
+
 //######################################################################
 //  CrystVector
 //######################################################################
@@ -52,13 +217,13 @@ template<class T> CrystVector<T>::CrystVector():mpData(0),mNumElements(0),mIsAre
 template<class T> CrystVector<T>::CrystVector(const long nbElements):
 mNumElements(nbElements),mIsAreference(false)
 {
-   mpData=new T[mNumElements];
+   mpData=CrystVectorAlloc<T>(mNumElements);
 }
 
 template<class T> CrystVector<T>::CrystVector(const CrystVector &old):
 mNumElements(old.numElements()),mIsAreference(false)
 {
-   mpData=new T[mNumElements];
+   mpData=CrystVectorAlloc<T>(mNumElements);
    T *p1=mpData;
    const T *p2=old.data();
    for(long i=0;i<mNumElements;i++) *p1++=*p2++;
@@ -68,7 +233,7 @@ template<class T> CrystVector<T>::~CrystVector()
 {
    if(!mIsAreference)
    {
-      delete[] mpData;
+      CrystVectorFree(mpData);
    }
 }
 template<class T> void CrystVector<T>::operator=(const CrystVector &old)
@@ -85,7 +250,7 @@ template<class T> void CrystVector<T>::reference(CrystVector &old, const long im
 {
    if(!mIsAreference)
    {
-      delete[] mpData ;
+      CrystVectorFree(mpData);
    }
    if(imax>imin)
    {
@@ -105,10 +270,7 @@ template<class T> long CrystVector<T>::size()const {return mNumElements;}
 
 template<class T> T CrystVector<T>::sum()const
 {
-   T tmp=0;
-   const T *p=this->data();
-   for(long i=0;i<this->numElements();i++) tmp += *p++ ;
-   return tmp;
+   return CrystVectorKernelSum(mpData,mNumElements);
 }
 template<class T> T CrystVector<T>::min()const
 {
@@ -184,13 +346,13 @@ template<class T> void CrystVector<T>::resize(const long newNbElements)
       <<newNbElements<<").",0)
    if(!mIsAreference)
    {
-      delete[] mpData ;
+      CrystVectorFree(mpData);
    }
    mpData=0;
    mNumElements=newNbElements;
    if(mNumElements>0)
    {
-      mpData=new T[mNumElements];
+      mpData=CrystVectorAlloc<T>(mNumElements);
    }
    mIsAreference=false;
 }
@@ -202,14 +364,14 @@ template<class T> void CrystVector<T>::resizeAndPreserve(const long newNbElement
    T * RESTRICT p=mpData;
    T * RESTRICT p2,*p1;
    mpData=0;
-   mpData=new T[newNbElements];
+   mpData=CrystVectorAlloc<T>(newNbElements);
    p2=mpData;
    p1=p;
    const long tmp= (newNbElements > mNumElements) ? mNumElements : newNbElements ;
    for(long i=tmp;i>0;i--) *p2++ = *p1++ ;
    if(mIsAreference==false)
    {
-      delete[] p ;
+      CrystVectorFree(p);
    }
    mNumElements=newNbElements;
    mIsAreference=false;
@@ -217,8 +379,7 @@ template<class T> void CrystVector<T>::resizeAndPreserve(const long newNbElement
 
 template<class T> void CrystVector<T>::operator*=(const T num)
 {
-   T * RESTRICT p=mpData;
-   for(int i=mNumElements;i>0;i--) *p++ *= num;
+   CrystVectorKernelScale(mpData,num,mNumElements);
 }
 
 template<class T> void CrystVector<T>::operator*=(const CrystVector<T> &vect)
@@ -231,12 +392,7 @@ template<class T> void CrystVector<T>::operator*=(const CrystVector<T> &vect)
       //throw 0;
    }
    #endif
-   if(mpData!=vect.data())
-   {
-      T * RESTRICT p=mpData;
-      const T * RESTRICT rhs=vect.data();
-      for(int i=mNumElements;i>0;i--) { *p *= *rhs; p++ ; rhs++;}
-   }
+   if(mpData!=vect.data()) CrystVectorKernelMult(mpData,vect.data(),mNumElements);
    else
    {
       T *p=mpData;
@@ -286,12 +442,7 @@ template<class T> void CrystVector<T>::operator+=(const CrystVector<T> &vect)
       //throw 0;
    }
    #endif
-   if(mpData!=vect.data())
-   {
-      T * RESTRICT p=mpData;
-      const T * RESTRICT rhs=vect.data();
-      for(int i=mNumElements;i>0;i--) *p++ += *rhs++;
-   }
+   if(mpData!=vect.data()) AddScaled(mpData,(T)1,vect.data(),mNumElements);
    else
    {
       T *p=mpData;
@@ -309,12 +460,7 @@ template<class T> void CrystVector<T>::operator-=(const CrystVector<T> &vect)
       //throw 0;
    }
    #endif
-   if(mpData!=vect.data())
-   {
-      T * RESTRICT p=mpData;
-      const T * RESTRICT rhs=vect.data();
-      for(int i=mNumElements;i>0;i--) *p++ -= *rhs++;
-   }
+   if(mpData!=vect.data()) CrystVectorKernelSub(mpData,vect.data(),mNumElements);
    else (*this)=0;
 }
 
@@ -376,7 +522,7 @@ template<class T> long QuickSortSubs(CrystVector<T> &vect,
                                      long last,long first, int depth)
 {
    //assert(depth++ <50);//for up to 2^50 elements
-   static long count=0;
+   static thread_local long count=0;
    long low, high;
    T tmpT, sepValeur ;
    long tmpSubs;
@@ -440,13 +586,13 @@ mpData(0),mNumElements(0),mXSize(0),mYSize(0),mIsAreference(false){}
 template<class T> CrystMatrix<T>::CrystMatrix(const long ySize,const long xSize):
 mNumElements(xSize*ySize),mXSize(xSize),mYSize(ySize),mIsAreference(false)
 {
-   mpData=new T[mNumElements];
+   mpData=CrystVectorAlloc<T>(mNumElements);
 }
 
 template<class T> CrystMatrix<T>::CrystMatrix(const CrystMatrix &old):
 mNumElements(old.numElements()),mXSize(old.cols()),mYSize(old.rows()),mIsAreference(false)
 {
-   mpData=new T[mNumElements];
+   mpData=CrystVectorAlloc<T>(mNumElements);
    T *p1=mpData;
    const T *p2=old.data();
    for(long i=0;i<mNumElements;i++) *p1++=*p2++;
@@ -456,7 +602,7 @@ template<class T> CrystMatrix<T>::~CrystMatrix()
 {
    if(!mIsAreference)
    {
-      delete[] mpData;
+      CrystVectorFree(mpData);
    }
 }
 
@@ -469,10 +615,10 @@ template<class T> void CrystMatrix<T>::operator=(const CrystMatrix<T> &old)
    {
       if(mIsAreference==false)
       {
-         delete[] mpData ;
+         CrystVectorFree(mpData);
       }
       mNumElements=old.numElements();
-      mpData=new T[mNumElements];
+      mpData=CrystVectorAlloc<T>(mNumElements);
    }
    T *p1=mpData;
    const T *p2=old.data();
@@ -483,7 +629,7 @@ template<class T> void CrystMatrix<T>::reference(CrystMatrix<T> &old)
 {
    if(mIsAreference==false)
    {
-      delete[] mpData ;
+      CrystVectorFree(mpData);
    }
    mIsAreference=true;
    mNumElements=old.numElements();
@@ -495,10 +641,7 @@ template<class T> long CrystMatrix<T>::size()const {return mNumElements;}
 
 template<class T> T CrystMatrix<T>::sum()const
 {
-   T tmp=0;
-   const T *p=this->data();
-   for(long i=0;i<this->numElements();i++) tmp += *p++ ;
-   return tmp;
+   return CrystVectorKernelSum(mpData,mNumElements);
 }
 
 template<class T> T CrystMatrix<T>::min()const
@@ -541,7 +684,7 @@ template<class T> void CrystMatrix<T>::resize(const long ySize,const long xSize)
    if(xSize*ySize == mNumElements) return;
    if(!mIsAreference)
    {
-      delete[] mpData ;
+      CrystVectorFree(mpData);
    }
    mpData=0;
    mXSize=xSize;
@@ -549,7 +692,7 @@ template<class T> void CrystMatrix<T>::resize(const long ySize,const long xSize)
    mNumElements=xSize*ySize;
    if(mNumElements>0)
    {
-      mpData=new T[mNumElements];
+      mpData=CrystVectorAlloc<T>(mNumElements);
    }
 }
 
@@ -561,14 +704,14 @@ template<class T> void CrystMatrix<T>::resizeAndPreserve(const long ySize,const
    T *p=mpData;
    T *p2,*p1;
    mpData=0;
-   mpData=new T[xSize*ySize];
+   mpData=CrystVectorAlloc<T>(xSize*ySize);
    p2=mpData;
    p1=p;
    long tmp= ( (xSize*ySize) > mNumElements) ? mNumElements : xSize*ySize;
    for(long i=0;i<tmp;i++) *p2++ = *p1++ ;
    if(!mIsAreference)
    {
-      delete[] p ;
+      CrystVectorFree(p);
    }
    mNumElements=xSize*ySize;
    mIsAreference=false;
@@ -582,8 +725,7 @@ template<class T> void CrystMatrix<T>::operator=(const T num)
 */
 template<class T> void CrystMatrix<T>::operator*=(const T num)
 {
-   T *p=mpData;
-   for(int i=0;i<mNumElements;i++) *p++ *= num;
+   CrystVectorKernelScale(mpData,num,mNumElements);
 }
 
 template<class T> void CrystMatrix<T>::operator*=(const CrystMatrix<T> &vect)
@@ -705,7 +847,7 @@ template<class T> CrystArray3D<T>::CrystArray3D(const long zSize,
 mNumElements(xSize*ySize*zSize),mXSize(xSize),mYSize(ySize),mZSize(zSize),
 mIsAreference(false)
 {
-   mpData=new T[mNumElements];
+   mpData=CrystVectorAlloc<T>(mNumElements);
 }
 
 template<class T> CrystArray3D<T>::CrystArray3D(const CrystArray3D &old):
@@ -713,14 +855,14 @@ mNumElements(old.numElements()),
 mXSize(old.cols()),mYSize(old.rows()),mZSize(old.depth()),
 mIsAreference(false)
 {
-   mpData=new T[mNumElements];
+   mpData=CrystVectorAlloc<T>(mNumElements);
    T *p1=mpData;
    const T *p2=old.data();
    for(long i=0;i<mNumElements;i++) *p1++=*p2++;
 }
 
 template<class T> CrystArray3D<T>::~CrystArray3D()
-{ if(!mIsAreference)delete[] mpData;}
+{ if(!mIsAreference)CrystVectorFree(mpData);}
 
 template<class T> void CrystArray3D<T>::operator=(const CrystArray3D<T> &old)
 {
@@ -731,8 +873,8 @@ template<class T> void CrystArray3D<T>::operator=(const CrystArray3D<T> &old)
    if(mNumElements!=old.numElements())
    {
       mNumElements=old.numElements();
-      if(mIsAreference==false)delete[] mpData ;
-      mpData=new T[mNumElements];
+      if(mIsAreference==false)CrystVectorFree(mpData);
+      mpData=CrystVectorAlloc<T>(mNumElements);
    }
    T *p1=mpData;
    const T *p2=old.data();
@@ -741,7 +883,7 @@ template<class T> void CrystArray3D<T>::operator=(const CrystArray3D<T> &old)
 
 template<class T> void CrystArray3D<T>::reference(CrystArray3D<T> &old)
 {
-   if(mIsAreference==false) delete[] mpData ;
+   if(mIsAreference==false) CrystVectorFree(mpData);
    mIsAreference=true;
    mNumElements=old.numElements();
    mpData=old.data();
@@ -801,10 +943,13 @@ template<class T> void CrystArray3D<T>::resize(const long zSize,
    mYSize=ySize;
    mZSize=zSize;
    if(xSize*ySize*zSize == mNumElements) return;
-   if(!mIsAreference)delete[] mpData ;
+   if(!mIsAreference)CrystVectorFree(mpData);
    mpData=0;
    mNumElements=xSize*ySize*zSize;
-   if(mNumElements>0) mpData=new T[mNumElements];
+   if(mNumElements>0)
+   {
+      mpData=CrystVectorAlloc<T>(mNumElements);
+   }
 }
 
 template<class T> void CrystArray3D<T>::resizeAndPreserve(const long zSize,
@@ -817,13 +962,13 @@ template<class T> void CrystArray3D<T>::resizeAndPreserve(const long zSize,
    if(xSize*ySize*zSize == mNumElements) return;
    T *p=mpData;
    T *p2,*p1;
-   mpData=new T[xSize*ySize*zSize];
+   mpData=CrystVectorAlloc<T>(xSize*ySize*zSize);
    p2=mpData;
    p1=p;
    long tmp= ( (xSize*ySize*zSize) > mNumElements) ? mNumElements : xSize*ySize*zSize;
    for(long i=0;i<tmp;i++) *p2++ = *p1++ ;
    mNumElements=xSize*ySize*zSize;
-   if(!mIsAreference)delete[] p ;
+   if(!mIsAreference)CrystVectorFree(p);
    mIsAreference=false;
 }
 
@@ -84,6 +84,19 @@ template<class T> T MaxDifference(const Array<T,2> &a,const Array<T,2> &b);
 #define CrystMatrix_T    CrystMatrix<T>
 #define CrystArray3D_T    CrystMatrix<T>
 
+/// Alignment (in bytes) of the data of CrystVector, CrystMatrix and CrystArray3D.
+/// The allocated memory is also padded with zeros up to a multiple of this size.
+#define CRYSTVECTOR_ALIGNMENT 64
+
+/// \internal Allocate memory aligned on CRYSTVECTOR_ALIGNMENT bytes, and padded with zeros
+/// up to a multiple of CRYSTVECTOR_ALIGNMENT. This must be freed with CrystVectorFree().
+void* CrystVectorAlignedMalloc(const size_t nbBytes);
+/// \internal Free memory allocated by CrystVectorAlignedMalloc() or CrystVectorAlloc()
+void CrystVectorFree(void *p);
+/// \internal Allocate aligned memory for nb (uninitialized) elements
+template<class T> inline T* CrystVectorAlloc(const long nb)
+{return (T*)CrystVectorAlignedMalloc(nb*sizeof(T));}
+
 #define __VFN_GEOM_STRUCT_FACTOR_USE_POINTERS
 
 #include <iostream>
@@ -137,8 +150,8 @@ template<class T> class CrystVector
       if(mNumElements != old.numElements())
       {
          mNumElements = old.numElements();
-         delete[] mpData;
-         mpData=new T[mNumElements];
+         if(!mIsAreference) CrystVectorFree(mpData);
+         mpData=CrystVectorAlloc<T>(mNumElements);
       };
       mIsAreference=false;
       T *p1=mpData;
@@ -314,6 +327,36 @@ template<class T> CrystVector<T> tan(const CrystVector<T> &vect);
 ///Square root (slow routine, not memory-savy...)
 template<class T> CrystVector<T> sqrt(const CrystVector<T> &vect);
 
+/** \name Fused kernels
+* These compute in a single pass, without temporary arrays, the expressions
+* used for chi^2, scale factor and background calculations. They are vectorised,
+* with a runtime selection of the instruction set (using gcc on x86-64 linux).
+*
+* The pointer versions use nb consecutive elements, which do not need to be aligned.
+*/
+//@{
+/// y += a*x
+void AddScaled(REAL *y,const REAL a,const REAL *x,const long nb);
+/// y += a*x
+void AddScaled(CrystVector_REAL &y,const REAL a,const CrystVector_REAL &x);
+/// Sum of a*b
+REAL SumProduct(const REAL *a,const REAL *b,const long nb);
+/// Sum of a*b
+REAL SumProduct(const CrystVector_REAL &a,const CrystVector_REAL &b);
+/// Sum of a*b*c
+REAL SumProduct(const REAL *a,const REAL *b,const REAL *c,const long nb);
+/// Sum of a*b*c
+REAL SumProduct(const CrystVector_REAL &a,const CrystVector_REAL &b,const CrystVector_REAL &c);
+/// Sum of (a-b)*c
+REAL SumDiffProduct(const REAL *a,const REAL *b,const REAL *c,const long nb);
+/// Sum of (a-b)*c*d
+REAL SumDiffProduct(const REAL *a,const REAL *b,const REAL *c,const REAL *d,const long nb);
+/// Sum of w*(a-b)^2, i.e. the chi^2 with weights w
+REAL SumWeightedSquaredDiff(const REAL *w,const REAL *a,const REAL *b,const long nb);
+/// Sum of w*(a-b)^2, i.e. the chi^2 with weights w
+REAL SumWeightedSquaredDiff(const CrystVector_REAL &w,const CrystVector_REAL &a,const CrystVector_REAL &b);
+//@}
+
 //######################################################################
 //  CrystMatrix
 //######################################################################
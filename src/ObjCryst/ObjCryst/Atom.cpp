@@ -132,7 +132,7 @@ void Atom::Init(const REAL x, const REAL y, const REAL z,
             const REAL popu)
 {
    VFN_DEBUG_MESSAGE("Atom::Init():"<<name,3)
-   mName=name;
+   this->RefinableObj::SetName(name);
    mpScattPowAtom=pow;
    mScattCompList(0).mpScattPow=mpScattPowAtom;
    mXYZ(0)=x;
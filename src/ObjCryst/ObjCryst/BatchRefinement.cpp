@@ -0,0 +1,154 @@
+/*  ObjCryst++ Object-Oriented Crystallographic Library
+    (c) 2000-2002 Vincent Favre-Nicolin vincefn@users.sourceforge.net
+        2000-2001 University of Geneva (Switzerland)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+/*
+*  source file for the concurrent refinement of independent structures
+*
+*/
+#include <thread>
+#include <exception>
+
+#include "ObjCryst/ObjCryst/BatchRefinement.h"
+#include "ObjCryst/ObjCryst/Crystal.h"
+#include "ObjCryst/ObjCryst/PowderPattern.h"
+#include "ObjCryst/ObjCryst/DiffractionDataSingleCrystal.h"
+#include "ObjCryst/RefinableObj/GlobalOptimObj.h"
+#include "ObjCryst/Quirks/VFNDebug.h"
+
+namespace ObjCryst
+{
+//######################################################################
+//    BatchRefinementJob
+//######################################################################
+BatchRefinementJob::~BatchRefinementJob(){}
+
+//######################################################################
+//    BatchRefinement
+//######################################################################
+BatchRefinement::BatchRefinement():
+mNextJob(0),mDeleteJobObjects(true)
+{}
+
+BatchRefinement::~BatchRefinement(){}
+
+void BatchRefinement::AddJob(BatchRefinementJob &job){mvpJob.push_back(&job);}
+
+void BatchRefinement::ClearJobs()
+{
+   mvpJob.clear();
+   mvError.clear();
+   mvFailed.clear();
+}
+
+unsigned long BatchRefinement::GetNbJob()const{return mvpJob.size();}
+
+void BatchRefinement::SetDeleteJobObjects(const bool b){mDeleteJobObjects=b;}
+
+unsigned long BatchRefinement::Run(const unsigned int nbThread)
+{
+   TAU_PROFILE("BatchRefinement::Run()","void ()",TAU_DEFAULT);
+   VFN_DEBUG_ENTRY("BatchRefinement::Run():"<<mvpJob.size()<<" jobs",5)
+   const unsigned long nb=mvpJob.size();
+   mvError.assign(nb,"");
+   mvFailed.assign(nb,0);
+   mNextJob=0;
+   unsigned int nbt=nbThread;
+   if(nbt==0) nbt=thread::hardware_concurrency();
+   if(nbt==0) nbt=1;
+   if(nbt>nb) nbt=nb;
+   vector<thread> vThread;
+   for(unsigned int i=0;i<nbt;i++) vThread.push_back(thread(&BatchRefinement::RunJobs,this));
+   for(unsigned int i=0;i<nbt;i++) vThread[i].join();
+   unsigned long nbFailed=0;
+   for(unsigned long i=0;i<nb;i++) if(mvFailed[i]!=0) nbFailed++;
+   VFN_DEBUG_EXIT("BatchRefinement::Run():"<<nbFailed<<" jobs failed",5)
+   return nbFailed;
+}
+
+const string& BatchRefinement::GetError(const unsigned long i)const{return mvError.at(i);}
+
+bool BatchRefinement::HasFailed(const unsigned long i)const{return mvFailed.at(i)!=0;}
+
+void BatchRefinement::RunJobs()
+{
+   const unsigned long nb=mvpJob.size();
+   while(true)
+   {
+      const unsigned long i=mNextJob++;
+      if(i>=nb) break;
+      this->RunJob(i);
+   }
+}
+
+void BatchRefinement::RunJob(const unsigned long i)
+{
+   VFN_DEBUG_ENTRY("BatchRefinement::RunJob():"<<i,5)
+   ObjRegistryIsolation isolation;
+   try
+   {
+      mvpJob[i]->Run();
+   }
+   catch(const ObjCrystException &except)
+   {
+      mvFailed[i]=1;
+      mvError[i]=except.message;
+   }
+   catch(const std::exception &except)
+   {
+      mvFailed[i]=1;
+      mvError[i]=except.what();
+   }
+   catch(...)
+   {
+      mvFailed[i]=1;
+      mvError[i]="BatchRefinement::RunJob(): unknown exception";
+   }
+   if(mDeleteJobObjects)
+   {
+      try
+      {
+         DeleteJobObjects();
+      }
+      catch(const std::exception &except)
+      {
+         if(mvFailed[i]==0)
+            mvError[i]=string("BatchRefinement::RunJob(): error deleting objects: ")+except.what();
+         mvFailed[i]=1;
+      }
+   }
+   // The error message of a failed job is never empty
+   if((mvFailed[i]!=0)&&(mvError[i]=="")) mvError[i]="BatchRefinement::RunJob(): job failed, no error message";
+   VFN_DEBUG_EXIT("BatchRefinement::RunJob():"<<i,5)
+}
+
+void BatchRefinement::DeleteJobObjects()
+{
+   // Objects using others (optimizations, then data objects) are deleted first
+   gOptimizationObjRegistry.DeleteAll();
+   gPowderPatternRegistry.DeleteAll();
+   gDiffractionDataSingleCrystalRegistry.DeleteAll();
+   // Components which were not added to a powder pattern
+   gPowderPatternComponentRegistry.DeleteAll();
+   gCrystalRegistry.DeleteAll();
+   // Scatterers and scattering powers which do not belong to a crystal, or were
+   // not deleted with it (see Crystal::SetDeleteSubObjInDestructor())
+   gScattererRegistry.DeleteAll();
+   gScatteringPowerRegistry.DeleteAll();
+}
+
+}//namespace
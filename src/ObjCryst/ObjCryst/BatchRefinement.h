@@ -0,0 +1,151 @@
+/*  ObjCryst++ Object-Oriented Crystallographic Library
+    (c) 2000-2002 Vincent Favre-Nicolin vincefn@users.sourceforge.net
+        2000-2001 University of Geneva (Switzerland)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+/*   BatchRefinement.h
+*  Concurrent refinement of many independent structures in one process
+*
+*/
+#ifndef __BATCHREFINEMENT_H
+#define __BATCHREFINEMENT_H
+
+#include "ObjCryst/RefinableObj/RefinableObj.h"
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+namespace ObjCryst
+{
+/** \brief One job of a BatchRefinement.
+*
+* Derive this class and implement Run(). See BatchRefinement.
+*/
+class BatchRefinementJob
+{
+   public:
+      virtual ~BatchRefinementJob();
+      /** Do the job: create the objects (crystal structures, powder patterns...),
+      * refine them and keep the results in the job object.
+      *
+      * This is called from a worker thread, with private global registries
+      * (see ObjRegistryIsolation). An exception thrown from Run() marks the job
+      * as failed (see BatchRefinement::HasFailed() and BatchRefinement::GetError()).
+      */
+      virtual void Run()=0;
+};
+
+/** \brief Run many independent refinements concurrently, in one process.
+*
+* Each job (BatchRefinementJob) is run in one of the worker threads, inside its own
+* ObjRegistryIsolation scope: the objects created by a job are only listed in
+* private registries, so that jobs can use the same object names, load XML files,
+* etc... without interfering. Read-only global data (tabulated functions, scattering
+* factor tables, space group tables) is shared by all jobs.
+*
+* Rules for jobs:
+* - all ObjCryst++ objects used by a job must be created within its Run() function, and
+*   must not be shared with other jobs or with the calling thread. The objects which
+*   are still listed in the job's registries when Run() returns (optimization objects,
+*   powder patterns and their components, single crystal data, crystal structures,
+*   scatterers and scattering powers) are deleted by the BatchRefinement, unless
+*   SetDeleteJobObjects(false) is used. Any other object (e.g. a RefinableObj
+*   created with new, only listed in gRefinableObjRegistry) must be deleted by Run(),
+*   or it is leaked.
+* - the results must be copied to the job object (values, R factors, XML text...).
+* - no graphical interface can be used.
+* - a job can use the library's parallel features (multi-threaded log-likelihood,
+*   simplex or Le Bail, file loaders, XML autosave): the threads they start share the
+*   job's isolation scope. Threads started by Run() itself must be created with
+*   ObjRegistryIsolation::StartThread() if they use ObjCryst++ objects.
+* - it is best to disable ObjCrystException::verbose, to avoid all jobs saving
+*   their environment to a file when an error occurs.
+*
+* \code
+* class MyJob:public BatchRefinementJob
+* {
+*    public:
+*       MyJob(const string &filename):mFileName(filename),mRw(0){}
+*       virtual void Run()
+*       {
+*          XMLCrystFileLoadAllObject(mFileName);
+*          PowderPattern *pPattern=&(gPowderPatternRegistry.GetObj(0));
+*          pPattern->Prepare();
+*          LSQNumObj lsq;
+*          lsq.SetRefinedObj(*pPattern,0,true,true);
+*          lsq.PrepareRefParList();
+*          lsq.Refine(-20,true,true);
+*          mRw=pPattern->GetRw();
+*       }
+*       string mFileName;
+*       REAL mRw;
+* };
+*
+* vector<MyJob*> vJob; // one job per file
+* BatchRefinement batch;
+* for(unsigned int i=0;i<vJob.size();i++) batch.AddJob(*vJob[i]);
+* batch.Run();
+* \endcode
+*/
+class BatchRefinement
+{
+   public:
+      BatchRefinement();
+      ~BatchRefinement();
+      /// Add a job. The job is not copied, and must exist until Run() has returned.
+      void AddJob(BatchRefinementJob &job);
+      /// Remove all jobs
+      void ClearJobs();
+      /// Number of jobs
+      unsigned long GetNbJob()const;
+      /// If true (the default), the objects left in a job's registries after its Run()
+      /// function are deleted. Otherwise Run() must delete all the objects it created.
+      void SetDeleteJobObjects(const bool b);
+      /** Run all the jobs.
+      *
+      * \param nbThread: number of worker threads. If 0, the number of hardware threads
+      * is used.
+      * \return the number of jobs which failed.
+      */
+      unsigned long Run(const unsigned int nbThread=0);
+      /// Error message for a job, or an empty string if it was successful.
+      const string& GetError(const unsigned long i)const;
+      /// Did a job fail ?
+      bool HasFailed(const unsigned long i)const;
+      /// Delete the objects left in the registries of the current job. This can also
+      /// be used to delete all objects inside any other ObjRegistryIsolation scope.
+      static void DeleteJobObjects();
+   protected:
+      /// Worker thread: run the next job until there is none left.
+      void RunJobs();
+      /// Run one job, inside its own ObjRegistryIsolation scope
+      void RunJob(const unsigned long i);
+      /// The jobs
+      vector<BatchRefinementJob*> mvpJob;
+      /// Error messages for each job
+      vector<string> mvError;
+      /// Has each job failed ? (not a vector<bool>, whose elements cannot be
+      /// written concurrently by the worker threads)
+      vector<char> mvFailed;
+      /// Index of the next job to be run
+      std::atomic<unsigned long> mNextJob;
+      /// Delete the objects left in a job's registries ?
+      bool mDeleteJobObjects;
+};
+
+}//namespace
+#endif //__BATCHREFINEMENT_H
@@ -42,6 +42,7 @@
 
 #include <fstream>
 #include <iomanip>
+#include <mutex>
 
 namespace ObjCryst
 {
@@ -52,7 +53,7 @@ long NiftyStaticGlobalObjectsInitializer_Crystal::mCount=0;
 //    CRYSTAL : the crystal (Unit cell, spaceGroup, scatterers)
 //
 ////////////////////////////////////////////////////////////////////////
-ObjRegistry<Crystal> gCrystalRegistry("List of all Crystals");
+ObjRegistry<Crystal> gCrystalRegistry("List of all Crystals",true);
 
 Crystal::Crystal():
 mScattererRegistry("List of Crystal Scatterers"),
@@ -1815,6 +1816,8 @@ void Crystal::InitOptions()
    static string DisplayEnantiomerchoices[2];
 
    static bool needInitNames=true;
+   static mutex needInitNamesMutex;
+   lock_guard<mutex> needInitNamesLock(needInitNamesMutex);
    if(true==needInitNames)
    {
       UseDynPopCorrname="Use Dynamical Occupancy Correction";
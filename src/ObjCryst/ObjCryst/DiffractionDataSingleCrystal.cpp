@@ -37,6 +37,7 @@
 
 #include <fstream>
 #include <iomanip>
+#include <mutex>
 #include <stdio.h> //for sprintf()
 
 //#include <xmmintrin.h>
@@ -52,7 +53,7 @@ namespace ObjCryst
 //    DiffractionDataSingleCrystal
 //######################################################################
 ObjRegistry<DiffractionDataSingleCrystal>
-   gDiffractionDataSingleCrystalRegistry("Global DiffractionDataSingleCrystal Registry");
+   gDiffractionDataSingleCrystalRegistry("Global DiffractionDataSingleCrystal Registry",true);
 
 DiffractionDataSingleCrystal::DiffractionDataSingleCrystal(const bool regist):
 mHasObservedData(false),mScaleFactor(1.)
@@ -766,42 +767,7 @@ REAL DiffractionDataSingleCrystal::GetChi2()const
       nb=mGroupIobs.numElements();
    }
 
-   for(long i=nb;i>0;i--)
-   {
-      mChi2 += *p3++ * ( *p1 - *p2) * ( *p1 - *p2);
-      p1++;p2++;
-   }
-   /*
-   // SSE code gives about 30% faster code on P3 (tested with 10000 reflections),
-   // but scarcely any improvement on athlon-xp
-   union sse4f
-   {
-      __m128 m128;
-      struct
-      {
-         float x, y, z, w;
-      };
-   } ;
-   const long nb=mNbReflUsed/4;
-   const float* p1=mCalcIntensity.data();
-   const float* p2=mObsIntensity.data();
-   const float* p3=mWeight.data();
-   for(long i=0;i<nb;i++)
-   {
-      //segfaults with _mm_load_ps() instead of _mm_loadu_ps? Alignment problem ?
-      __m128 a = _mm_sub_ps(_mm_loadu_ps(p1),_mm_loadu_ps(p2));
-      union sse4f b;
-      b.m128= _mm_mul_ps(_mm_loadu_ps(p3),_mm_mul_ps(a,a));
-      mChi2 += b.x+b.y+b.z+b.w;
-      p1+=4;p2+=4;p3+=4;
-   }
-   p1-=4;p2-=4;p3-=4;
-   for(long i=nb*4;i<mNbReflUsed;i++)
-   {
-      mChi2 += *p3++ * ( *p1 - *p2) * ( *p1 - *p2);
-      p1++;p2++;
-   }
-   */
+   mChi2 += SumWeightedSquaredDiff(p3,p1,p2,nb);
    mClockChi2.Click();
    VFN_DEBUG_EXIT("DiffractionData::Chi2()="<<mChi2,3);
    return mChi2;
@@ -1015,6 +981,8 @@ REAL DiffractionDataSingleCrystal::GetLogLikelihood()const
    return this->GetChi2();
 }
 
+unsigned int DiffractionDataSingleCrystal::GetLogLikelihoodTier()const{return 1;}
+
 void DiffractionDataSingleCrystal::InitRefParList()
 {
    VFN_DEBUG_MESSAGE("DiffractionDataSingleCrystal::InitRefParList()",5)
@@ -1289,6 +1257,8 @@ void DiffractionDataSingleCrystal::InitOptions()
    static string GroupOption;
    static string GroupOptionChoices[3];
    static bool needInitNames=true;
+   static mutex needInitNamesMutex;
+   lock_guard<mutex> needInitNamesLock(needInitNamesMutex);
    if(true==needInitNames)
    {
       GroupOption="Group Reflections";
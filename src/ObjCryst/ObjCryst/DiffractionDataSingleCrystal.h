@@ -248,6 +248,8 @@ class DiffractionDataSingleCrystal:public ScatteringData
       virtual void GlobalOptRandomMove(const REAL mutationAmplitude,
                                        const RefParType *type=gpRefParTypeObjCryst);
       virtual REAL GetLogLikelihood()const;
+      /// Returns 1: the single crystal data cost is computed after cheap (tier 0) terms.
+      virtual unsigned int GetLogLikelihoodTier()const;
       //LSQ functions
          virtual unsigned int GetNbLSQFunction()const;
          virtual const CrystVector_REAL& GetLSQCalc(const unsigned int) const;
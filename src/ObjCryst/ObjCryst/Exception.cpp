@@ -48,7 +48,7 @@ ObjCrystException::ObjCrystException(const string & _message)
        return;
    }
 
-   static bool inException;
+   static thread_local bool inException=false;
    cout << "LibCryst ++ exception thrown!!" << endl;
    cout << "  Message: " + message <<endl;
    if(false==inException)
@@ -57,7 +57,13 @@ ObjCrystException::ObjCrystException(const string & _message)
       string saveFileName="ObjCryst";
       time_t date=time(0);
       char strDate[40];
-      strftime(strDate,sizeof(strDate),"%Y-%m-%d_%H-%M-%S",gmtime(&date));//%Y-%m-%dT%H:%M:%S%Z
+      struct tm tmDate;
+      #ifdef _WIN32
+      gmtime_s(&tmDate,&date);
+      #else
+      gmtime_r(&date,&tmDate);
+      #endif
+      strftime(strDate,sizeof(strDate),"%Y-%m-%d_%H-%M-%S",&tmDate);//%Y-%m-%dT%H:%M:%S%Z
       saveFileName=saveFileName+strDate+".xml";
       cout << "Attempting to save ObjCryst++ environment to file:"<<saveFileName<<endl;
       try
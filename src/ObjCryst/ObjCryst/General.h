@@ -48,15 +48,17 @@
 #include "Profile/Profiler.h"
 #else
 
-#define TAU_PROFILE(name, type, group)
-#define TAU_PROFILE_START(var)
-#define TAU_PROFILE_TIMER(var, name, type, group)
-#define TAU_PROFILE_STOP(var)
+// Use the built-in profiler (disabled by default, see ObjCryst::ProfilerEnable())
+#include "ObjCryst/Quirks/Profiler.h"
+#define TAU_PROFILE(name, type, group) ObjCryst::ProfilerScope objcrystProfilerScope(name)
+#define TAU_PROFILE_START(var) var.Start()
+#define TAU_PROFILE_TIMER(var, name, type, group) ObjCryst::ProfilerTimer var(name)
+#define TAU_PROFILE_STOP(var) var.Stop()
 #define TAU_PROFILE_INIT(argc, argv)
 #define TAU_PROFILE_SET_NODE(node)
 #define TAU_PROFILE_SET_CONTEXT(context)
 #define TAU_EVENT(event, data)
-#define TAU_REPORT_STATISTICS()
+#define TAU_REPORT_STATISTICS() ObjCryst::ProfilerPrintReport(std::cout)
 #define TAU_REPORT_THREAD_STATISTICS()
 
 #endif
@@ -121,7 +121,13 @@ void XMLCrystFileSaveGlobal(ostream &out)
    XMLCrystTag tag("ObjCryst");
    time_t date=time(0);
    char strDate[40];
-   strftime(strDate,sizeof(strDate),"%Y-%m-%dT%H:%M:%S%Z",gmtime(&date));//%Y-%m-%dT%H:%M:%S%Z
+   struct tm tmDate;// gmtime() is not thread-safe
+   #ifdef _WIN32
+   gmtime_s(&tmDate,&date);
+   #else
+   gmtime_r(&date,&tmDate);
+   #endif
+   strftime(strDate,sizeof(strDate),"%Y-%m-%dT%H:%M:%S%Z",&tmDate);//%Y-%m-%dT%H:%M:%S%Z
    tag.AddAttribute("Date",strDate);
    tag.AddAttribute("Revision","2021001");
    out<<tag<<endl;
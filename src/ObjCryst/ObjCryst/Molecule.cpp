@@ -25,6 +25,19 @@
 #include <algorithm>
 #include <iomanip>
 #include <ctime>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
+#include <cerrno>
+#include <memory>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#endif
 #include <boost/format.hpp>
 
 #include "ObjCryst/Quirks/VFNStreamFormat.h"
@@ -182,6 +195,264 @@ void ExpandAtomGroupRecursive(MolAtom* atom,
    }
 }
 
+/** \internal Flags for the atoms of a group (e.g. the atoms moved by a stretch mode),
+* with the index of the atoms of all restraints, so that the number of atoms of a
+* restraint which belong to the group can be found without searching the group.
+*/
+class RestraintAtomGroupFlags
+{
+   public:
+      RestraintAtomGroupFlags(const vector<MolAtom*> &vpAtom,const vector<MolBond*> &vb,
+                              const vector<MolBondAngle*> &va,const vector<MolDihedralAngle*> &vd):
+      mvFlag(vpAtom.size(),0)
+      {
+         for(unsigned long i=0;i<vpAtom.size();++i) mvIndex[vpAtom[i]]=i;
+         for(vector<MolBond*>::const_iterator pos=vb.begin();pos!=vb.end();++pos)
+         {
+            mvBondAtom.push_back(this->GetIndex(&((*pos)->GetAtom1())));
+            mvBondAtom.push_back(this->GetIndex(&((*pos)->GetAtom2())));
+         }
+         for(vector<MolBondAngle*>::const_iterator pos=va.begin();pos!=va.end();++pos)
+         {
+            mvBondAngleAtom.push_back(this->GetIndex(&((*pos)->GetAtom1())));
+            mvBondAngleAtom.push_back(this->GetIndex(&((*pos)->GetAtom2())));
+            mvBondAngleAtom.push_back(this->GetIndex(&((*pos)->GetAtom3())));
+         }
+         for(vector<MolDihedralAngle*>::const_iterator pos=vd.begin();pos!=vd.end();++pos)
+         {
+            mvDihedralAngleAtom.push_back(this->GetIndex(&((*pos)->GetAtom1())));
+            mvDihedralAngleAtom.push_back(this->GetIndex(&((*pos)->GetAtom2())));
+            mvDihedralAngleAtom.push_back(this->GetIndex(&((*pos)->GetAtom3())));
+            mvDihedralAngleAtom.push_back(this->GetIndex(&((*pos)->GetAtom4())));
+         }
+      }
+      /// Index of an atom in the Molecule's list
+      unsigned long GetIndex(const MolAtom *pAtom)const
+      {
+         map<const MolAtom*,unsigned long>::const_iterator pos=mvIndex.find(pAtom);
+         if(pos==mvIndex.end()) throw ObjCrystException("RestraintAtomGroupFlags: atom "+pAtom->GetName()+" is not in the Molecule");
+         return pos->second;
+      }
+      /// Set the group of atoms
+      void SetGroup(const set<MolAtom*> &group)
+      {
+         for(vector<unsigned long>::const_iterator pos=mvFlagged.begin();pos!=mvFlagged.end();++pos) mvFlag[*pos]=0;
+         mvFlagged.clear();
+         for(set<MolAtom*>::const_iterator pos=group.begin();pos!=group.end();++pos)
+         {
+            const unsigned long i=this->GetIndex(*pos);
+            mvFlag[i]=1;
+            mvFlagged.push_back(i);
+         }
+      }
+      /// Number of atoms of the i-th bond in the group
+      unsigned int NbBondAtom(const unsigned long i)const
+      {return mvFlag[mvBondAtom[2*i]]+mvFlag[mvBondAtom[2*i+1]];}
+      /// Number of atoms of the i-th bond angle in the group
+      unsigned int NbBondAngleAtom(const unsigned long i)const
+      {return mvFlag[mvBondAngleAtom[3*i]]+mvFlag[mvBondAngleAtom[3*i+1]]+mvFlag[mvBondAngleAtom[3*i+2]];}
+      /// Number of atoms of the i-th dihedral angle in the group
+      unsigned int NbDihedralAngleAtom(const unsigned long i)const
+      {
+         return  mvFlag[mvDihedralAngleAtom[4*i]]  +mvFlag[mvDihedralAngleAtom[4*i+1]]
+                +mvFlag[mvDihedralAngleAtom[4*i+2]]+mvFlag[mvDihedralAngleAtom[4*i+3]];
+      }
+   private:
+      map<const MolAtom*,unsigned long> mvIndex;
+      vector<unsigned char> mvFlag;
+      vector<unsigned long> mvFlagged;
+      vector<unsigned long> mvBondAtom,mvBondAngleAtom,mvDihedralAngleAtom;
+};
+
+//######################################################################
+//
+//      Restraint kernels, shared by the restraint objects and the
+//      molecular dynamics engine (MDTopology)
+//
+//######################################################################
+
+/** \internal Log-likelihood of a flat-bottom restraint on a value v: 0 inside [v0-delta;v0+delta],
+* and (dv/sigma)^2 (or x^2+x^4 with RESTRAINT_X2_X4_X6) outside. If periodic, the deviation
+* is brought back in [-pi;pi].
+*
+* \param derivLLKCoeff: if not null, the derivative of the log-likelihood versus v is stored here.
+*/
+static inline REAL RestraintLogLikelihood(const REAL v,const REAL v0,const REAL delta,const REAL sigma,
+                                          REAL *derivLLKCoeff,const bool periodic=false)
+{
+   if(sigma<1e-6)
+   {
+      if(derivLLKCoeff!=0) *derivLLKCoeff=0;
+      return 0;
+   }
+   REAL llk=v-(v0+delta);
+   if(periodic)
+   {
+      if(llk<(-M_PI)) llk += 2*M_PI;
+      if(llk>  M_PI ) llk -= 2*M_PI;
+   }
+   if(llk<=0)
+   {
+      llk=v-(v0-delta);
+      if(periodic)
+      {
+         if(llk<(-M_PI)) llk += 2*M_PI;
+         if(llk>  M_PI ) llk -= 2*M_PI;
+      }
+      if(llk>=0)
+      {
+         if(derivLLKCoeff!=0) *derivLLKCoeff=0;
+         return 0;
+      }
+   }
+   llk /= sigma;
+   #ifdef RESTRAINT_X2_X4_X6
+   const float llk2=llk*llk;
+   if(derivLLKCoeff!=0) *derivLLKCoeff=(2*llk+4*llk2)/sigma;
+   return llk2*(1+llk2);
+   #else
+   if(derivLLKCoeff!=0) *derivLLKCoeff=2*llk/sigma;
+   return llk*llk;
+   #endif
+}
+
+/** \internal Bond length between atoms at p1 and p2. If d1 and d2 are not null,
+* the derivatives of the length versus the coordinates of each atom are stored there.
+*/
+static inline REAL CalcBondLength(const XYZ &p1,const XYZ &p2,XYZ *d1,XYZ *d2)
+{
+   const REAL x=p2.x-p1.x;
+   const REAL y=p2.y-p1.y;
+   const REAL z=p2.z-p1.z;
+   const REAL length=sqrt(abs(x*x+y*y+z*z));
+   if(d1!=0)
+   {
+      const REAL tmp2=1/(length+1e-10);
+      d1->x=-x*tmp2;
+      d1->y=-y*tmp2;
+      d1->z=-z*tmp2;
+
+      d2->x=-d1->x;
+      d2->y=-d1->y;
+      d2->z=-d1->z;
+   }
+   return length;
+}
+
+/** \internal Bond angle p1-p2-p3. If d1,d2,d3 are not null, the derivatives of the angle
+* versus the coordinates of each atom are stored there.
+*/
+static inline REAL CalcBondAngle(const XYZ &p1,const XYZ &p2,const XYZ &p3,XYZ *d1,XYZ *d2,XYZ *d3)
+{
+   const REAL x21=p1.x-p2.x;
+   const REAL y21=p1.y-p2.y;
+   const REAL z21=p1.z-p2.z;
+   const REAL x23=p3.x-p2.x;
+   const REAL y23=p3.y-p2.y;
+   const REAL z23=p3.z-p2.z;
+
+   const REAL n1=sqrt(abs(x21*x21+y21*y21+z21*z21));
+   const REAL n3=sqrt(abs(x23*x23+y23*y23+z23*z23));
+   const REAL p=x21*x23+y21*y23+z21*z23;
+
+   const REAL a0=p/(n1*n3+1e-10);
+   REAL angle;
+   if(a0>=1)  angle=0;
+   else
+   {
+      if(a0<=-1) angle=M_PI;
+      else angle=acos(a0);
+   }
+
+   if(d1!=0)
+   {
+      const REAL s=1/(sqrt(1-a0*a0+1e-6));
+      const REAL s0=-s/(n1*n3+1e-10);
+      const REAL s1= s*p/(n3*n1*n1*n1+1e-10);
+      const REAL s3= s*p/(n1*n3*n3*n3+1e-10);
+      d1->x=s0*x23+s1*x21;
+      d1->y=s0*y23+s1*y21;
+      d1->z=s0*z23+s1*z21;
+
+      d3->x=s0*x21+s3*x23;
+      d3->y=s0*y21+s3*y23;
+      d3->z=s0*z21+s3*z23;
+
+      d2->x=-(d1->x+d3->x);
+      d2->y=-(d1->y+d3->y);
+      d2->z=-(d1->z+d3->z);
+   }
+   return angle;
+}
+
+/** \internal Dihedral angle p1-p2-p3-p4, in [-pi;pi]. If d1,d2,d3,d4 are not null,
+* the derivatives of the angle versus the coordinates of each atom are stored there.
+*/
+static inline REAL CalcDihedralAngle(const XYZ &p1,const XYZ &p2,const XYZ &p3,const XYZ &p4,
+                                     XYZ *d1,XYZ *d2,XYZ *d3,XYZ *d4)
+{
+   const REAL x21=p1.x-p2.x;
+   const REAL y21=p1.y-p2.y;
+   const REAL z21=p1.z-p2.z;
+
+   const REAL x34=p4.x-p3.x;
+   const REAL y34=p4.y-p3.y;
+   const REAL z34=p4.z-p3.z;
+
+   const REAL x23=p3.x-p2.x;
+   const REAL y23=p3.y-p2.y;
+   const REAL z23=p3.z-p2.z;
+
+   // v21 x v23
+   const REAL x123= y21*z23-z21*y23;
+   const REAL y123= z21*x23-x21*z23;
+   const REAL z123= x21*y23-y21*x23;
+
+   // v32 x v34 (= -v23 x v34)
+   const REAL x234= -(y23*z34-z23*y34);
+   const REAL y234= -(z23*x34-x23*z34);
+   const REAL z234= -(x23*y34-y23*x34);
+
+   const REAL n123= sqrt(x123*x123+y123*y123+z123*z123+1e-7);
+   const REAL n234= sqrt(x234*x234+y234*y234+z234*z234+1e-6);
+
+   const REAL p=x123*x234+y123*y234+z123*z234;
+   const REAL a0=p/(n123*n234+1e-10);
+   REAL angle;
+   if(a0>= 1) angle=0;
+   else
+   {
+      if(a0<=-1) angle=M_PI;
+      else angle=acos(a0);
+   }
+   REAL sgn=1.0;
+   if((x21*x34 + y21*y34 + z21*z34)<0) {angle=-angle;sgn=-1;}
+
+   if(d1!=0)
+   {
+      const REAL s=sgn/(sqrt(1-a0*a0+1e-6));
+      const REAL s0=-s/(n123*n234+1e-10);
+      const REAL s1= s*p/(n234*n123*n123*n123+1e-10);
+      const REAL s3= s*p/(n123*n234*n234*n234+1e-10);
+      d1->x=s0*(-z23*y234+y23*z234)+s1*(-z23*y123+y23*z123);
+      d1->y=s0*(-x23*z234+z23*x234)+s1*(-x23*z123+z23*x123);
+      d1->z=s0*(-y23*x234+x23*y234)+s1*(-y23*x123+x23*y123);
+
+      d4->x=s0*(-z23*y123+y23*z123)+s3*(-z23*y234+y23*z234);
+      d4->y=s0*(-x23*z123+z23*x123)+s3*(-x23*z234+z23*x234);
+      d4->z=s0*(-y23*x123+x23*y123)+s3*(-y23*x234+x23*y234);
+
+      d2->x=s0*((z23-z21)*y234-y123*z34+(y21-y23)*z234+z123*y34)+s1*(y123*(z23-z21)+z123*(y21-y23))+s3*(-y234*z34+z234*y34);
+      d2->y=s0*((x23-x21)*z234-z123*x34+(z21-z23)*x234+x123*z34)+s1*(z123*(x23-x21)+x123*(z21-z23))+s3*(-z234*x34+x234*z34);
+      d2->z=s0*((y23-y21)*x234-x123*y34+(x21-x23)*y234+y123*x34)+s1*(x123*(y23-y21)+y123*(x21-x23))+s3*(-x234*y34+y234*x34);
+
+      d3->x=-(d1->x+d2->x+d4->x);
+      d3->y=-(d1->y+d2->y+d4->y);
+      d3->z=-(d1->z+d2->z+d4->z);
+   }
+   return angle;
+}
+
 //######################################################################
 //
 //      MolAtom
@@ -489,67 +760,10 @@ REAL MolBond::GetLogLikelihood(const bool calcDeriv, const bool recalc)const
    if(!recalc) return mLLK;
    VFN_DEBUG_ENTRY("MolBond::GetLogLikelihood():",2)
    //TAU_PROFILE("MolBond::GetLogLikelihood()","REAL (bool,bool)",TAU_DEFAULT);
-   //const REAL length=this->GetLength();
-   const REAL x=this->GetAtom2().GetX()-this->GetAtom1().GetX();
-   const REAL y=this->GetAtom2().GetY()-this->GetAtom1().GetY();
-   const REAL z=this->GetAtom2().GetZ()-this->GetAtom1().GetZ();
-   const REAL length=sqrt(abs(x*x+y*y+z*z));
-
-   if(calcDeriv)
-   {
-      const REAL tmp2=1/(length+1e-10);
-      mDerivAtom1.x=-x*tmp2;
-      mDerivAtom1.y=-y*tmp2;
-      mDerivAtom1.z=-z*tmp2;
-
-      mDerivAtom2.x=-mDerivAtom1.x;
-      mDerivAtom2.y=-mDerivAtom1.y;
-      mDerivAtom2.z=-mDerivAtom1.z;
-   }
-
-   if(mSigma<1e-6)
-   {
-      if(calcDeriv) mDerivLLKCoeff=0;
-      mLLK=0;
-      return 0;
-   }
-   mLLK=length-(mLength0+mDelta);
-   if(mLLK>0)
-   {
-      mLLK /= mSigma;
-      if(calcDeriv) mDerivLLKCoeff=2*mLLK/mSigma;
-      #ifdef RESTRAINT_X2_X4_X6
-      const float mLLK2=mLLK*mLLK;
-      //if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2+6*mLLK2*mLLK2)/mSigma;
-      //mLLK=mLLK2*(1+mLLK2+mLLK2*mLLK2);
-      if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2)/mSigma;
-      mLLK=mLLK2*(1+mLLK2);
-      #else
-      if(calcDeriv) mDerivLLKCoeff=2*mLLK/mSigma;
-      mLLK *= mLLK;
-      #endif
-      VFN_DEBUG_EXIT("MolBond::GetLogLikelihood():",2)
-      return mLLK;
-   }
-   mLLK=length-(mLength0-mDelta);
-   if(mLLK<0)
-   {
-      mLLK /= mSigma;
-      #ifdef RESTRAINT_X2_X4_X6
-      const float mLLK2=mLLK*mLLK;
-      //if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2+6*mLLK2*mLLK2)/mSigma;
-      //mLLK=mLLK2*(1+mLLK2+mLLK2*mLLK2);
-      if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2)/mSigma;
-      mLLK=mLLK2*(1+mLLK2);
-      #else
-      if(calcDeriv) mDerivLLKCoeff=2*mLLK/mSigma;
-      mLLK *= mLLK;
-      #endif
-      VFN_DEBUG_EXIT("MolBond::GetLogLikelihood():",2)
-      return mLLK;
-   }
-   if(calcDeriv) mDerivLLKCoeff=0;
-   mLLK=0;
+   const REAL length=CalcBondLength(XYZ(this->GetAtom1().GetX(),this->GetAtom1().GetY(),this->GetAtom1().GetZ()),
+                                    XYZ(this->GetAtom2().GetX(),this->GetAtom2().GetY(),this->GetAtom2().GetZ()),
+                                    calcDeriv ? &mDerivAtom1 : 0,&mDerivAtom2);
+   mLLK=RestraintLogLikelihood(length,mLength0,mDelta,mSigma,calcDeriv ? &mDerivLLKCoeff : 0);
    VFN_DEBUG_EXIT("MolBond::GetLogLikelihood():",2)
    return mLLK;
 }
@@ -783,90 +997,12 @@ REAL MolBondAngle::GetLogLikelihood(const bool calcDeriv, const bool recalc)cons
    if(!recalc) return mLLK;
    VFN_DEBUG_ENTRY("MolBondAngle::GetLogLikelihood():",2)
    //TAU_PROFILE("MolBondAngle::GetLogLikelihood()","REAL (bool,bool)",TAU_DEFAULT);
-   //const REAL angle=this->GetAngle();
-   const REAL x21=this->GetAtom1().GetX()-this->GetAtom2().GetX();
-   const REAL y21=this->GetAtom1().GetY()-this->GetAtom2().GetY();
-   const REAL z21=this->GetAtom1().GetZ()-this->GetAtom2().GetZ();
-   const REAL x23=this->GetAtom3().GetX()-this->GetAtom2().GetX();
-   const REAL y23=this->GetAtom3().GetY()-this->GetAtom2().GetY();
-   const REAL z23=this->GetAtom3().GetZ()-this->GetAtom2().GetZ();
-
-   const REAL n1=sqrt(abs(x21*x21+y21*y21+z21*z21));
-   const REAL n3=sqrt(abs(x23*x23+y23*y23+z23*z23));
-   const REAL p=x21*x23+y21*y23+z21*z23;
-
-   const REAL a0=p/(n1*n3+1e-10);
-   REAL angle;
-   if(a0>=1)  angle=0;
-   else
-   {
-      if(a0<=-1) angle=M_PI;
-      else angle=acos(a0);
-   }
-
-   if(calcDeriv)
-   {
-      const REAL s=1/(sqrt(1-a0*a0+1e-6));
-      const REAL s0=-s/(n1*n3+1e-10);
-      const REAL s1= s*p/(n3*n1*n1*n1+1e-10);
-      const REAL s3= s*p/(n1*n3*n3*n3+1e-10);
-      mDerivAtom1.x=s0*x23+s1*x21;
-      mDerivAtom1.y=s0*y23+s1*y21;
-      mDerivAtom1.z=s0*z23+s1*z21;
-
-      mDerivAtom3.x=s0*x21+s3*x23;
-      mDerivAtom3.y=s0*y21+s3*y23;
-      mDerivAtom3.z=s0*z21+s3*z23;
-
-      mDerivAtom2.x=-(mDerivAtom1.x+mDerivAtom3.x);
-      mDerivAtom2.y=-(mDerivAtom1.y+mDerivAtom3.y);
-      mDerivAtom2.z=-(mDerivAtom1.z+mDerivAtom3.z);
-   }
-
-   if(mSigma<1e-6)
-   {
-      if(calcDeriv) mDerivLLKCoeff=0;
-      mLLK=0;
-      return 0;
-   }
-
-   mLLK=angle-(mAngle0+mDelta);
-   if(mLLK>0)
-   {
-      mLLK/=mSigma;
-      #ifdef RESTRAINT_X2_X4_X6
-      const float mLLK2=mLLK*mLLK;
-      //if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2+6*mLLK2*mLLK2)/mSigma;
-      //mLLK=mLLK2*(1+mLLK2+mLLK2*mLLK2);
-      if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2)/mSigma;
-      mLLK=mLLK2*(1+mLLK2);
-      #else
-      if(calcDeriv) mDerivLLKCoeff=2*mLLK/mSigma;
-      mLLK *= mLLK;
-      #endif
-      VFN_DEBUG_EXIT("MolBondAngle::GetLogLikelihood():",2)
-      return mLLK;
-   }
-   mLLK=angle-(mAngle0-mDelta);
-   if(mLLK<0)
-   {
-      mLLK/=mSigma;
-      #ifdef RESTRAINT_X2_X4_X6
-      const float mLLK2=mLLK*mLLK;
-      //if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2+6*mLLK2*mLLK2)/mSigma;
-      //mLLK=mLLK2*(1+mLLK2+mLLK2*mLLK2);
-      if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2)/mSigma;
-      mLLK=mLLK2*(1+mLLK2);
-      #else
-      if(calcDeriv) mDerivLLKCoeff=2*mLLK/mSigma;
-      mLLK *= mLLK;
-      #endif
-      VFN_DEBUG_EXIT("MolBondAngle::GetLogLikelihood():",2)
-      return mLLK;
-   }
+   const REAL angle=CalcBondAngle(XYZ(this->GetAtom1().GetX(),this->GetAtom1().GetY(),this->GetAtom1().GetZ()),
+                                  XYZ(this->GetAtom2().GetX(),this->GetAtom2().GetY(),this->GetAtom2().GetZ()),
+                                  XYZ(this->GetAtom3().GetX(),this->GetAtom3().GetY(),this->GetAtom3().GetZ()),
+                                  calcDeriv ? &mDerivAtom1 : 0,&mDerivAtom2,&mDerivAtom3);
+   mLLK=RestraintLogLikelihood(angle,mAngle0,mDelta,mSigma,calcDeriv ? &mDerivLLKCoeff : 0);
    VFN_DEBUG_EXIT("MolBondAngle::GetLogLikelihood():",2)
-   if(calcDeriv) mDerivLLKCoeff=0;
-   mLLK=0;
    return mLLK;
 }
 
@@ -1110,115 +1246,14 @@ REAL MolDihedralAngle::GetLogLikelihood(const bool calcDeriv, const bool recalc)
    if(!recalc) return mLLK;
    VFN_DEBUG_ENTRY("MolDihedralAngle::GetLogLikelihood():",2)
    //TAU_PROFILE("MolDihedralAngle::GetLogLikelihood()","REAL (bool,bool)",TAU_DEFAULT);
-   const REAL x21=this->GetAtom1().GetX()-this->GetAtom2().GetX();
-   const REAL y21=this->GetAtom1().GetY()-this->GetAtom2().GetY();
-   const REAL z21=this->GetAtom1().GetZ()-this->GetAtom2().GetZ();
-
-   const REAL x34=this->GetAtom4().GetX()-this->GetAtom3().GetX();
-   const REAL y34=this->GetAtom4().GetY()-this->GetAtom3().GetY();
-   const REAL z34=this->GetAtom4().GetZ()-this->GetAtom3().GetZ();
-
-   const REAL x23=this->GetAtom3().GetX()-this->GetAtom2().GetX();
-   const REAL y23=this->GetAtom3().GetY()-this->GetAtom2().GetY();
-   const REAL z23=this->GetAtom3().GetZ()-this->GetAtom2().GetZ();
-
-   // v21 x v23
-   const REAL x123= y21*z23-z21*y23;
-   const REAL y123= z21*x23-x21*z23;
-   const REAL z123= x21*y23-y21*x23;
-
-   // v32 x v34 (= -v23 x v34)
-   const REAL x234= -(y23*z34-z23*y34);
-   const REAL y234= -(z23*x34-x23*z34);
-   const REAL z234= -(x23*y34-y23*x34);
-
-   const REAL n123= sqrt(x123*x123+y123*y123+z123*z123+1e-7);
-   const REAL n234= sqrt(x234*x234+y234*y234+z234*z234+1e-6);
-
-   const REAL p=x123*x234+y123*y234+z123*z234;
-   const REAL a0=p/(n123*n234+1e-10);
-   REAL angle;
-   if(a0>= 1) angle=0;
-   else
-   {
-      if(a0<=-1) angle=M_PI;
-      else angle=acos(a0);
-   }
-   REAL sgn=1.0;
-   if((x21*x34 + y21*y34 + z21*z34)<0) {angle=-angle;sgn=-1;}
-
-
-   if(calcDeriv)
-   {
-      const REAL s=sgn/(sqrt(1-a0*a0+1e-6));
-      const REAL s0=-s/(n123*n234+1e-10);
-      const REAL s1= s*p/(n234*n123*n123*n123+1e-10);
-      const REAL s3= s*p/(n123*n234*n234*n234+1e-10);
-      mDerivAtom1.x=s0*(-z23*y234+y23*z234)+s1*(-z23*y123+y23*z123);
-      mDerivAtom1.y=s0*(-x23*z234+z23*x234)+s1*(-x23*z123+z23*x123);
-      mDerivAtom1.z=s0*(-y23*x234+x23*y234)+s1*(-y23*x123+x23*y123);
-
-      mDerivAtom4.x=s0*(-z23*y123+y23*z123)+s3*(-z23*y234+y23*z234);
-      mDerivAtom4.y=s0*(-x23*z123+z23*x123)+s3*(-x23*z234+z23*x234);
-      mDerivAtom4.z=s0*(-y23*x123+x23*y123)+s3*(-y23*x234+x23*y234);
-
-      mDerivAtom2.x=s0*((z23-z21)*y234-y123*z34+(y21-y23)*z234+z123*y34)+s1*(y123*(z23-z21)+z123*(y21-y23))+s3*(-y234*z34+z234*y34);
-      mDerivAtom2.y=s0*((x23-x21)*z234-z123*x34+(z21-z23)*x234+x123*z34)+s1*(z123*(x23-x21)+x123*(z21-z23))+s3*(-z234*x34+x234*z34);
-      mDerivAtom2.z=s0*((y23-y21)*x234-x123*y34+(x21-x23)*y234+y123*x34)+s1*(x123*(y23-y21)+y123*(x21-x23))+s3*(-x234*y34+y234*x34);
-
-      mDerivAtom3.x=-(mDerivAtom1.x+mDerivAtom2.x+mDerivAtom4.x);
-      mDerivAtom3.y=-(mDerivAtom1.y+mDerivAtom2.y+mDerivAtom4.y);
-      mDerivAtom3.z=-(mDerivAtom1.z+mDerivAtom2.z+mDerivAtom4.z);
-   }
-
-   if(mSigma<1e-6)
-   {
-      if(calcDeriv) mDerivLLKCoeff=0;
-      mLLK=0;
-      return mLLK;
-   }
-   mLLK=angle-(mAngle0+mDelta);
-   if(mLLK<(-M_PI)) mLLK += 2*M_PI;
-   if(mLLK>  M_PI ) mLLK -= 2*M_PI;
-   if(mLLK>0)
-   {
-      mLLK/=mSigma;
-      #ifdef RESTRAINT_X2_X4_X6
-      const float mLLK2=mLLK*mLLK;
-      //if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2+6*mLLK2*mLLK2)/mSigma;
-      //mLLK=mLLK2*(1+mLLK2+mLLK2*mLLK2);
-      if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2)/mSigma;
-      mLLK=mLLK2*(1+mLLK2);
-      #else
-      if(calcDeriv) mDerivLLKCoeff=2*mLLK/mSigma;
-      mLLK *= mLLK;
-      #endif
-      VFN_DEBUG_EXIT("MolDihedralAngle::GetLogLikelihood():",2)
-      return mLLK;
-   }
-   mLLK=angle-(mAngle0-mDelta);
-   if(mLLK<(-M_PI)) mLLK += 2*M_PI;
-   if(mLLK>  M_PI ) mLLK -= 2*M_PI;
-   if(mLLK<0)
-   {
-      mLLK/=mSigma;
-      #ifdef RESTRAINT_X2_X4_X6
-      const float mLLK2=mLLK*mLLK;
-      //if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2+6*mLLK2*mLLK2)/mSigma;
-      //mLLK=mLLK2*(1+mLLK2+mLLK2*mLLK2);
-      if(calcDeriv) mDerivLLKCoeff=(2*mLLK+4*mLLK2)/mSigma;
-      mLLK=mLLK2*(1+mLLK2);
-      #else
-      if(calcDeriv) mDerivLLKCoeff=2*mLLK/mSigma;
-      mLLK *= mLLK;
-      #endif
-      VFN_DEBUG_EXIT("MolDihedralAngle::GetLogLikelihood():",2)
-      return mLLK;
-   }
+   const REAL angle=CalcDihedralAngle(XYZ(this->GetAtom1().GetX(),this->GetAtom1().GetY(),this->GetAtom1().GetZ()),
+                                      XYZ(this->GetAtom2().GetX(),this->GetAtom2().GetY(),this->GetAtom2().GetZ()),
+                                      XYZ(this->GetAtom3().GetX(),this->GetAtom3().GetY(),this->GetAtom3().GetZ()),
+                                      XYZ(this->GetAtom4().GetX(),this->GetAtom4().GetY(),this->GetAtom4().GetZ()),
+                                      calcDeriv ? &mDerivAtom1 : 0,&mDerivAtom2,&mDerivAtom3,&mDerivAtom4);
+   mLLK=RestraintLogLikelihood(angle,mAngle0,mDelta,mSigma,calcDeriv ? &mDerivLLKCoeff : 0,true);
    VFN_DEBUG_EXIT("MolDihedralAngle::GetLogLikelihood():",2)
-   if(calcDeriv) mDerivLLKCoeff=0;
-   mLLK=0;
-   return 0;
+   return mLLK;
 }
 
 REAL MolDihedralAngle::GetDeriv(const std::map<const MolAtom*,XYZ> &m,const bool llk)const
@@ -1532,6 +1567,17 @@ void Quaternion::Normalize()const
    mQ2 /= norm;
    mQ3 /= norm;
 }
+void Quaternion::GetRotationMatrix(REAL *m)const
+{
+   // Same as RotateVector(), which does not assume a unit quaternion
+   const REAL q00=mQ0*mQ0,q11=mQ1*mQ1,q22=mQ2*mQ2,q33=mQ3*mQ3;
+   const REAL q01=mQ0*mQ1,q02=mQ0*mQ2,q03=mQ0*mQ3;
+   const REAL q12=mQ1*mQ2,q13=mQ1*mQ3,q23=mQ2*mQ3;
+   m[0]=q00+q11-q22-q33; m[1]=2*(q12-q03);     m[2]=2*(q13+q02);
+   m[3]=2*(q12+q03);     m[4]=q00-q11+q22-q33; m[5]=2*(q23-q01);
+   m[6]=2*(q13-q02);     m[7]=2*(q23+q01);     m[8]=q00-q11-q22+q33;
+}
+
 REAL Quaternion::GetNorm()const
 {return sqrt( this->Q0()*this->Q0()
              +this->Q1()*this->Q1()
@@ -1916,6 +1962,8 @@ mvpAtom(vat)
       mvpBondAngle.push_back(*pos);
    for(set<MolDihedralAngle*>::iterator pos=vd.begin();pos!=vd.end();++pos)
       mvpDihedralAngle.push_back(*pos);
+   const vector<MolAtom*> vpAtom(mvpAtom.begin(),mvpAtom.end());
+   mTopology.Build(vpAtom,mvpBond,mvpBondAngle,mvpDihedralAngle);
 }
 
 void MDAtomGroup::Print(ostream &os,bool full)const
@@ -1938,6 +1986,354 @@ void MDAtomGroup::Print(ostream &os,bool full)const
    }
 }
 
+//######################################################################
+//
+//      MDTopology
+//
+//######################################################################
+MDTopology::MDTopology():mNbMovedAtom(0){}
+
+void MDTopology::Build(const vector<MolAtom*> &vpMovedAtom,
+                       const vector<MolBond*> &vb,const vector<MolBondAngle*> &va,
+                       const vector<MolDihedralAngle*> &vd)
+{
+   TAU_PROFILE("MDTopology::Build()","void (...)",TAU_DEFAULT);
+   mvpAtom=vpMovedAtom;
+   mNbMovedAtom=mvpAtom.size();
+   map<const MolAtom*,unsigned long> vIndex;
+   for(unsigned long i=0;i<mNbMovedAtom;++i) vIndex[mvpAtom[i]]=i;
+   // Atoms which are not moved but are needed by restraints are appended
+   #define MDTOPOLOGY_INDEX(at) \
+      ((vIndex.count(&(at))==0) ? (mvpAtom.push_back(&(at)),vIndex[&(at)]=mvpAtom.size()-1) : vIndex[&(at)])
+   mvBondAtom.clear();
+   mvpBond.clear();
+   for(vector<MolBond*>::const_iterator pos=vb.begin();pos!=vb.end();++pos)
+   {
+      mvpBond.push_back(*pos);
+      mvBondAtom.push_back(MDTOPOLOGY_INDEX((*pos)->GetAtom1()));
+      mvBondAtom.push_back(MDTOPOLOGY_INDEX((*pos)->GetAtom2()));
+   }
+   mvBondAngleAtom.clear();
+   mvpBondAngle.clear();
+   for(vector<MolBondAngle*>::const_iterator pos=va.begin();pos!=va.end();++pos)
+   {
+      mvpBondAngle.push_back(*pos);
+      mvBondAngleAtom.push_back(MDTOPOLOGY_INDEX((*pos)->GetAtom1()));
+      mvBondAngleAtom.push_back(MDTOPOLOGY_INDEX((*pos)->GetAtom2()));
+      mvBondAngleAtom.push_back(MDTOPOLOGY_INDEX((*pos)->GetAtom3()));
+   }
+   mvDihedralAngleAtom.clear();
+   mvpDihedralAngle.clear();
+   for(vector<MolDihedralAngle*>::const_iterator pos=vd.begin();pos!=vd.end();++pos)
+   {
+      mvpDihedralAngle.push_back(*pos);
+      mvDihedralAngleAtom.push_back(MDTOPOLOGY_INDEX((*pos)->GetAtom1()));
+      mvDihedralAngleAtom.push_back(MDTOPOLOGY_INDEX((*pos)->GetAtom2()));
+      mvDihedralAngleAtom.push_back(MDTOPOLOGY_INDEX((*pos)->GetAtom3()));
+      mvDihedralAngleAtom.push_back(MDTOPOLOGY_INDEX((*pos)->GetAtom4()));
+   }
+   #undef MDTOPOLOGY_INDEX
+   const unsigned long nbAtom=mvpAtom.size();
+   mX.resize(nbAtom);mY.resize(nbAtom);mZ.resize(nbAtom);
+   mGradX.resize(nbAtom);mGradY.resize(nbAtom);mGradZ.resize(nbAtom);
+   mVX.resize(mNbMovedAtom);mVY.resize(mNbMovedAtom);mVZ.resize(mNbMovedAtom);
+   mvBondPar.resize(3*mvpBond.size());
+   mvBondAnglePar.resize(3*mvpBondAngle.size());
+   mvDihedralAnglePar.resize(3*mvpDihedralAngle.size());
+}
+
+void MDTopology::Evolve(const unsigned nbStep,const REAL dt,REAL nrj0)
+{
+   TAU_PROFILE("MDTopology::Evolve()","void (...)",TAU_DEFAULT);
+   if(nbStep==0) return;
+   const unsigned long nbAtom=mvpAtom.size();
+   for(unsigned long i=0;i<nbAtom;++i)
+   {
+      mX[i]=mvpAtom[i]->GetX();
+      mY[i]=mvpAtom[i]->GetY();
+      mZ[i]=mvpAtom[i]->GetZ();
+   }
+   // Restraint parameters may have been changed since Build()
+   for(unsigned long i=0;i<mvpBond.size();++i)
+   {
+      mvBondPar[3*i  ]=mvpBond[i]->GetLength0();
+      mvBondPar[3*i+1]=mvpBond[i]->GetLengthDelta();
+      mvBondPar[3*i+2]=mvpBond[i]->GetLengthSigma();
+   }
+   for(unsigned long i=0;i<mvpBondAngle.size();++i)
+   {
+      mvBondAnglePar[3*i  ]=mvpBondAngle[i]->GetAngle0();
+      mvBondAnglePar[3*i+1]=mvpBondAngle[i]->GetAngleDelta();
+      mvBondAnglePar[3*i+2]=mvpBondAngle[i]->GetAngleSigma();
+   }
+   for(unsigned long i=0;i<mvpDihedralAngle.size();++i)
+   {
+      mvDihedralAnglePar[3*i  ]=mvpDihedralAngle[i]->GetAngle0();
+      mvDihedralAnglePar[3*i+1]=mvpDihedralAngle[i]->GetAngleDelta();
+      mvDihedralAnglePar[3*i+2]=mvpDihedralAngle[i]->GetAngleSigma();
+   }
+   REAL *RESTRICT px=mX.data(),*RESTRICT py=mY.data(),*RESTRICT pz=mZ.data();
+   REAL *RESTRICT pgx=mGradX.data(),*RESTRICT pgy=mGradY.data(),*RESTRICT pgz=mGradZ.data();
+   REAL *RESTRICT pvx=mVX.data(),*RESTRICT pvy=mVY.data(),*RESTRICT pvz=mVZ.data();
+
+   const REAL m=500;// mass
+   const REAL im=1./m;
+
+   // Try to keep total energy constant
+   REAL e_v,e_k,v_r=1.0;
+   XYZ d1,d2,d3,d4;
+   REAL derivLLKCoeff;
+   for(unsigned i = 0; i < nbStep; ++i)
+   {
+      // Calc full gradient
+      for(unsigned long j=0;j<nbAtom;++j) {pgx[j]=0;pgy[j]=0;pgz[j]=0;}
+      e_v=0;
+      #define MDTOPOLOGY_ADDGRAD(idx,d) \
+         {const unsigned long k=idx;pgx[k]+=derivLLKCoeff*d.x;pgy[k]+=derivLLKCoeff*d.y;pgz[k]+=derivLLKCoeff*d.z;}
+      {
+         const unsigned long *pa=mvBondAtom.data();
+         const REAL *ppar=mvBondPar.data();
+         for(unsigned long j=mvpBond.size();j>0;--j)
+         {
+            const REAL v=CalcBondLength(XYZ(px[pa[0]],py[pa[0]],pz[pa[0]]),
+                                        XYZ(px[pa[1]],py[pa[1]],pz[pa[1]]),&d1,&d2);
+            e_v+=RestraintLogLikelihood(v,ppar[0],ppar[1],ppar[2],&derivLLKCoeff);
+            MDTOPOLOGY_ADDGRAD(pa[0],d1);
+            MDTOPOLOGY_ADDGRAD(pa[1],d2);
+            pa+=2;ppar+=3;
+         }
+      }
+      {
+         const unsigned long *pa=mvBondAngleAtom.data();
+         const REAL *ppar=mvBondAnglePar.data();
+         for(unsigned long j=mvpBondAngle.size();j>0;--j)
+         {
+            const REAL v=CalcBondAngle(XYZ(px[pa[0]],py[pa[0]],pz[pa[0]]),
+                                       XYZ(px[pa[1]],py[pa[1]],pz[pa[1]]),
+                                       XYZ(px[pa[2]],py[pa[2]],pz[pa[2]]),&d1,&d2,&d3);
+            e_v+=RestraintLogLikelihood(v,ppar[0],ppar[1],ppar[2],&derivLLKCoeff);
+            MDTOPOLOGY_ADDGRAD(pa[0],d1);
+            MDTOPOLOGY_ADDGRAD(pa[1],d2);
+            MDTOPOLOGY_ADDGRAD(pa[2],d3);
+            pa+=3;ppar+=3;
+         }
+      }
+      {
+         const unsigned long *pa=mvDihedralAngleAtom.data();
+         const REAL *ppar=mvDihedralAnglePar.data();
+         for(unsigned long j=mvpDihedralAngle.size();j>0;--j)
+         {
+            const REAL v=CalcDihedralAngle(XYZ(px[pa[0]],py[pa[0]],pz[pa[0]]),
+                                           XYZ(px[pa[1]],py[pa[1]],pz[pa[1]]),
+                                           XYZ(px[pa[2]],py[pa[2]],pz[pa[2]]),
+                                           XYZ(px[pa[3]],py[pa[3]],pz[pa[3]]),&d1,&d2,&d3,&d4);
+            e_v+=RestraintLogLikelihood(v,ppar[0],ppar[1],ppar[2],&derivLLKCoeff,true);
+            MDTOPOLOGY_ADDGRAD(pa[0],d1);
+            MDTOPOLOGY_ADDGRAD(pa[1],d2);
+            MDTOPOLOGY_ADDGRAD(pa[2],d3);
+            MDTOPOLOGY_ADDGRAD(pa[3],d4);
+            pa+=4;ppar+=3;
+         }
+      }
+      #undef MDTOPOLOGY_ADDGRAD
+
+      //kinetic energy
+      e_k=0;
+      for(unsigned long j=0;j<mNbMovedAtom;++j)
+         e_k += 0.5*m*(pvx[j]*pvx[j] + pvy[j]*pvy[j] + pvz[j]*pvz[j]);
+
+      if(nrj0==0) nrj0=e_k+e_v;
+      else
+      {
+         // Apply a coefficient to the speed to keep the overall energy constant
+         const REAL de=e_k+e_v-nrj0;
+         if(de<e_k) v_r=sqrt((e_k-de)/e_k);
+         else v_r=0.0;
+      }
+      // Move according to max step to minimize LLK, and compute new speed
+      for(unsigned long j=0;j<mNbMovedAtom;++j)
+      {
+         px[j]=px[j]+pvx[j]*dt*v_r-0.5*im*dt*dt*pgx[j];
+         py[j]=py[j]+pvy[j]*dt*v_r-0.5*im*dt*dt*pgy[j];
+         pz[j]=pz[j]+pvz[j]*dt*v_r-0.5*im*dt*dt*pgz[j];
+         pvx[j] = v_r*pvx[j] - pgx[j]*dt*im;
+         pvy[j] = v_r*pvy[j] - pgy[j]*dt*im;
+         pvz[j] = v_r*pvz[j] - pgz[j]*dt*im;
+      }
+   }
+   for(unsigned long i=0;i<mNbMovedAtom;++i)
+   {
+      mvpAtom[i]->SetX(mX[i]);
+      mvpAtom[i]->SetY(mY[i]);
+      mvpAtom[i]->SetZ(mZ[i]);
+   }
+}
+
+//######################################################################
+//
+//      MolRestraintTable
+//
+//######################################################################
+MolRestraintTable::MolRestraintTable(){}
+
+void MolRestraintTable::Build(const vector<MolAtom*> &vpAtom,const vector<Restraint*> &vpRestraint)
+{
+   TAU_PROFILE("MolRestraintTable::Build()","void (...)",TAU_DEFAULT);
+   VFN_DEBUG_ENTRY("MolRestraintTable::Build()",5)
+   mvpAtom.assign(vpAtom.begin(),vpAtom.end());
+   map<const MolAtom*,unsigned long> vIndex;
+   for(unsigned long i=0;i<mvpAtom.size();++i) vIndex[mvpAtom[i]]=i;
+   #define MOLRESTRAINTTABLE_INDEX(at) \
+      ((vIndex.count(&(at))==0) ? (mvpAtom.push_back(&(at)),vIndex[&(at)]=mvpAtom.size()-1) : vIndex[&(at)])
+   mvpRestraint.assign(vpRestraint.begin(),vpRestraint.end());
+   mvpBond.clear();mvpBondAngle.clear();mvpDihedralAngle.clear();
+   mvBondIndex.clear();mvBondAngleIndex.clear();mvDihedralAngleIndex.clear();
+   mvBondAtom.clear();mvBondAngleAtom.clear();mvDihedralAngleAtom.clear();
+   mvOtherIndex.clear();
+   // atoms involved in each restraint
+   vector<vector<unsigned long> > vRestraintAtom(mvpRestraint.size());
+   for(unsigned long i=0;i<mvpRestraint.size();++i)
+   {
+      if(const MolBond *p=dynamic_cast<const MolBond*>(mvpRestraint[i]))
+      {
+         mvpBond.push_back(p);
+         mvBondIndex.push_back(i);
+         mvBondAtom.push_back(MOLRESTRAINTTABLE_INDEX(p->GetAtom1()));
+         mvBondAtom.push_back(MOLRESTRAINTTABLE_INDEX(p->GetAtom2()));
+         vRestraintAtom[i].assign(mvBondAtom.end()-2,mvBondAtom.end());
+      }
+      else if(const MolBondAngle *p=dynamic_cast<const MolBondAngle*>(mvpRestraint[i]))
+      {
+         mvpBondAngle.push_back(p);
+         mvBondAngleIndex.push_back(i);
+         mvBondAngleAtom.push_back(MOLRESTRAINTTABLE_INDEX(p->GetAtom1()));
+         mvBondAngleAtom.push_back(MOLRESTRAINTTABLE_INDEX(p->GetAtom2()));
+         mvBondAngleAtom.push_back(MOLRESTRAINTTABLE_INDEX(p->GetAtom3()));
+         vRestraintAtom[i].assign(mvBondAngleAtom.end()-3,mvBondAngleAtom.end());
+      }
+      else if(const MolDihedralAngle *p=dynamic_cast<const MolDihedralAngle*>(mvpRestraint[i]))
+      {
+         mvpDihedralAngle.push_back(p);
+         mvDihedralAngleIndex.push_back(i);
+         mvDihedralAngleAtom.push_back(MOLRESTRAINTTABLE_INDEX(p->GetAtom1()));
+         mvDihedralAngleAtom.push_back(MOLRESTRAINTTABLE_INDEX(p->GetAtom2()));
+         mvDihedralAngleAtom.push_back(MOLRESTRAINTTABLE_INDEX(p->GetAtom3()));
+         mvDihedralAngleAtom.push_back(MOLRESTRAINTTABLE_INDEX(p->GetAtom4()));
+         vRestraintAtom[i].assign(mvDihedralAngleAtom.end()-4,mvDihedralAngleAtom.end());
+      }
+      else mvOtherIndex.push_back(i);
+   }
+   #undef MOLRESTRAINTTABLE_INDEX
+   // Restraints involving each atom
+   const unsigned long nbAtom=mvpAtom.size();
+   mvAtomRestraintBegin.assign(nbAtom+1,0);
+   for(unsigned long i=0;i<vRestraintAtom.size();++i)
+      for(vector<unsigned long>::const_iterator pos=vRestraintAtom[i].begin();pos!=vRestraintAtom[i].end();++pos)
+         mvAtomRestraintBegin[*pos+1]++;
+   for(unsigned long i=0;i<nbAtom;++i) mvAtomRestraintBegin[i+1]+=mvAtomRestraintBegin[i];
+   mvAtomRestraint.resize(mvAtomRestraintBegin[nbAtom]);
+   {
+      vector<unsigned long> vPos(mvAtomRestraintBegin.begin(),mvAtomRestraintBegin.end()-1);
+      for(unsigned long i=0;i<vRestraintAtom.size();++i)
+         for(vector<unsigned long>::const_iterator pos=vRestraintAtom[i].begin();pos!=vRestraintAtom[i].end();++pos)
+            mvAtomRestraint[vPos[*pos]++]=i;
+   }
+   mX.resize(nbAtom);mY.resize(nbAtom);mZ.resize(nbAtom);
+   for(unsigned long i=0;i<nbAtom;++i)
+   {
+      mX[i]=mvpAtom[i]->GetX();
+      mY[i]=mvpAtom[i]->GetY();
+      mZ[i]=mvpAtom[i]->GetZ();
+   }
+   mvBondPar.resize(3*mvpBond.size());
+   mvBondAnglePar.resize(3*mvpBondAngle.size());
+   mvDihedralAnglePar.resize(3*mvpDihedralAngle.size());
+   mvLLK.assign(mvpRestraint.size(),0);
+   mvNeedRecalc.assign(mvpRestraint.size(),true);
+   VFN_DEBUG_EXIT("MolRestraintTable::Build():"<<mvpBond.size()<<" bonds,"<<mvpBondAngle.size()
+                  <<" bond angles,"<<mvpDihedralAngle.size()<<" dihedral angles,"<<mvOtherIndex.size()
+                  <<" other restraints",5)
+}
+
+REAL MolRestraintTable::GetLogLikelihood()
+{
+   TAU_PROFILE("MolRestraintTable::GetLogLikelihood()","REAL ()",TAU_DEFAULT);
+   // Find the atoms which have moved
+   const unsigned long nbAtom=mvpAtom.size();
+   for(unsigned long i=0;i<nbAtom;++i)
+   {
+      const REAL x=mvpAtom[i]->GetX(),y=mvpAtom[i]->GetY(),z=mvpAtom[i]->GetZ();
+      if((x!=mX[i])||(y!=mY[i])||(z!=mZ[i]))
+      {
+         mX[i]=x;mY[i]=y;mZ[i]=z;
+         for(unsigned long j=mvAtomRestraintBegin[i];j<mvAtomRestraintBegin[i+1];++j)
+            mvNeedRecalc[mvAtomRestraint[j]]=true;
+      }
+   }
+   const REAL *px=mX.data(),*py=mY.data(),*pz=mZ.data();
+   {
+      const unsigned long *pa=mvBondAtom.data();
+      REAL *ppar=mvBondPar.data();
+      for(unsigned long i=0;i<mvpBond.size();++i,pa+=2,ppar+=3)
+      {
+         const MolBond *p=mvpBond[i];
+         const unsigned long j=mvBondIndex[i];
+         if(  (ppar[0]!=p->GetLength0())||(ppar[1]!=p->GetLengthDelta())
+            ||(ppar[2]!=p->GetLengthSigma())) mvNeedRecalc[j]=true;
+         if(!mvNeedRecalc[j]) continue;
+         ppar[0]=p->GetLength0();ppar[1]=p->GetLengthDelta();ppar[2]=p->GetLengthSigma();
+         const REAL v=CalcBondLength(XYZ(px[pa[0]],py[pa[0]],pz[pa[0]]),
+                                     XYZ(px[pa[1]],py[pa[1]],pz[pa[1]]),0,0);
+         mvLLK[j]=RestraintLogLikelihood(v,ppar[0],ppar[1],ppar[2],0);
+         mvNeedRecalc[j]=false;
+      }
+   }
+   {
+      const unsigned long *pa=mvBondAngleAtom.data();
+      REAL *ppar=mvBondAnglePar.data();
+      for(unsigned long i=0;i<mvpBondAngle.size();++i,pa+=3,ppar+=3)
+      {
+         const MolBondAngle *p=mvpBondAngle[i];
+         const unsigned long j=mvBondAngleIndex[i];
+         if(  (ppar[0]!=p->GetAngle0())||(ppar[1]!=p->GetAngleDelta())
+            ||(ppar[2]!=p->GetAngleSigma())) mvNeedRecalc[j]=true;
+         if(!mvNeedRecalc[j]) continue;
+         ppar[0]=p->GetAngle0();ppar[1]=p->GetAngleDelta();ppar[2]=p->GetAngleSigma();
+         const REAL v=CalcBondAngle(XYZ(px[pa[0]],py[pa[0]],pz[pa[0]]),
+                                    XYZ(px[pa[1]],py[pa[1]],pz[pa[1]]),
+                                    XYZ(px[pa[2]],py[pa[2]],pz[pa[2]]),0,0,0);
+         mvLLK[j]=RestraintLogLikelihood(v,ppar[0],ppar[1],ppar[2],0);
+         mvNeedRecalc[j]=false;
+      }
+   }
+   {
+      const unsigned long *pa=mvDihedralAngleAtom.data();
+      REAL *ppar=mvDihedralAnglePar.data();
+      for(unsigned long i=0;i<mvpDihedralAngle.size();++i,pa+=4,ppar+=3)
+      {
+         const MolDihedralAngle *p=mvpDihedralAngle[i];
+         const unsigned long j=mvDihedralAngleIndex[i];
+         if(  (ppar[0]!=p->GetAngle0())||(ppar[1]!=p->GetAngleDelta())
+            ||(ppar[2]!=p->GetAngleSigma())) mvNeedRecalc[j]=true;
+         if(!mvNeedRecalc[j]) continue;
+         ppar[0]=p->GetAngle0();ppar[1]=p->GetAngleDelta();ppar[2]=p->GetAngleSigma();
+         const REAL v=CalcDihedralAngle(XYZ(px[pa[0]],py[pa[0]],pz[pa[0]]),
+                                        XYZ(px[pa[1]],py[pa[1]],pz[pa[1]]),
+                                        XYZ(px[pa[2]],py[pa[2]],pz[pa[2]]),
+                                        XYZ(px[pa[3]],py[pa[3]],pz[pa[3]]),0,0,0,0);
+         mvLLK[j]=RestraintLogLikelihood(v,ppar[0],ppar[1],ppar[2],0,true);
+         mvNeedRecalc[j]=false;
+      }
+   }
+   for(vector<unsigned long>::const_iterator pos=mvOtherIndex.begin();pos!=mvOtherIndex.end();++pos)
+      mvLLK[*pos]=mvpRestraint[*pos]->GetLogLikelihood();
+   REAL llk=0;
+   for(vector<REAL>::const_iterator pos=mvLLK.begin();pos!=mvLLK.end();++pos) llk+=*pos;
+   return llk;
+}
+
+unsigned long MolRestraintTable::GetNbRestraint()const{return mvpRestraint.size();}
+
 //######################################################################
 //
 //      Molecule
@@ -2335,7 +2731,7 @@ void Molecule::XMLInput(istream &is,const XMLCrystTag &tag)
    {
       if("Name"==tag.GetAttributeName(i))
       {
-         mName=tag.GetAttributeValue(i);
+         this->RefinableObj::SetName(tag.GetAttributeValue(i));
       }
       if("MDMoveFreq"==tag.GetAttributeName(i))
       {
@@ -2446,6 +2842,36 @@ void Molecule::UpdateDisplay()const
    this->RefinableObj::UpdateDisplay();
 }
 
+/** \internal Exclusive lock on a Molecule topology cache file, held while the
+* cache is read and (if needed) written, so that several processes (or threads)
+* optimizing the same molecule build its topology only once: the others wait,
+* and then load it from the cache.
+*
+* This uses a separate lock file (the cache file name +".lock"), which is never
+* removed. Nothing is locked on platforms without flock().
+*/
+class MoleculeTopologyCacheLock
+{
+   public:
+      MoleculeTopologyCacheLock(const string &cacheFile):mFd(-1)
+      {
+         #ifndef _WIN32
+         const string lockFile=cacheFile+".lock";
+         mFd=open(lockFile.c_str(),O_RDWR|O_CREAT,0666);
+         if(mFd<0) return;// Read-only directory ? Just go on without the lock
+         while((flock(mFd,LOCK_EX)!=0)&&(errno==EINTR));
+         #endif
+      }
+      ~MoleculeTopologyCacheLock()
+      {
+         #ifndef _WIN32
+         if(mFd>=0) close(mFd);// This releases the lock
+         #endif
+      }
+   private:
+      int mFd;
+};
+
 void Molecule::BeginOptimization(const bool allowApproximations,const bool enableRestraints)
 {
    if(this->IsBeingRefined())
@@ -2495,15 +2921,51 @@ void Molecule::BeginOptimization(const bool allowApproximations,const bool enabl
       #endif
       if(mFlexModel.GetChoice()!=1)
       {
-         this->BuildFlipGroup();
-         this->BuildRingList();
-         this->BuildStretchModeBondLength();
-         this->BuildStretchModeBondAngle();
-         this->BuildStretchModeTorsion();
-         //this->BuildStretchModeTwist();
-         this->TuneGlobalOptimRotationAmplitude();
-         this->BuildStretchModeGroups();
-         this->BuildMDAtomGroups();
+         // Try first the topology cache
+         string cacheFile;
+         bool loaded=false;
+         const string cacheDir=GetMoleculeTopologyCacheDir();
+         if(cacheDir!="")
+            cacheFile=cacheDir+"/molecule-topology-"
+                      +(boost::format("%016x")%this->GetTopologyHash()).str()+".txt";
+         // Only one process builds and saves a given topology at a time
+         std::unique_ptr<MoleculeTopologyCacheLock> cacheLock;
+         if(cacheFile!="")
+         {
+            cacheLock.reset(new MoleculeTopologyCacheLock(cacheFile));
+            ifstream fin(cacheFile.c_str());
+            if(fin.good()) loaded=this->LoadTopology(fin);
+            if(loaded) (*fpObjCrystInformUser)("Loaded Molecule topology from: "+cacheFile);
+         }
+         if(!loaded)
+         {
+            this->BuildFlipGroup();
+            this->BuildRingList();
+            this->BuildStretchModeBondLength();
+            this->BuildStretchModeBondAngle();
+            this->BuildStretchModeTorsion();
+            //this->BuildStretchModeTwist();
+            this->TuneGlobalOptimRotationAmplitude();
+            this->BuildStretchModeGroups();
+            this->BuildMDAtomGroups();
+            if(cacheFile!="")
+            {// Write to a unique temporary file, then move it in place, so that
+             // other threads or processes never read a partially written file
+               static std::atomic<unsigned long> nbTmpFile(0);
+               const string tmpFile=cacheFile+(boost::format(".%d-%d.tmp")%getpid()%nbTmpFile++).str();
+               bool ok=false;
+               {
+                  ofstream fout(tmpFile.c_str());
+                  if(fout.good())
+                  {
+                     this->SaveTopology(fout);
+                     fout.close();
+                     ok=!fout.fail();
+                  }
+               }
+               if((!ok)||(rename(tmpFile.c_str(),cacheFile.c_str())!=0)) remove(tmpFile.c_str());
+            }
+         }
       }
    }
    if(mOptimizeOrientation.GetChoice()==1)
@@ -2914,21 +3376,21 @@ void Molecule::GlobalOptRandomMove(const REAL mutationAmplitude,
                const unsigned int n=rand()%mvMDAtomGroup.size();
                list<MDAtomGroup>::iterator pos=mvMDAtomGroup.begin();
                for(unsigned int i=0;i<n;++i)++pos;
-               map<MolAtom*,XYZ> v0;
-               for(set<MolAtom*>::iterator at=pos->mvpAtom.begin();at!=pos->mvpAtom.end();++at)
-                  v0[*at]=XYZ(rand()/(REAL)RAND_MAX+0.5,rand()/(REAL)RAND_MAX+0.5,rand()/(REAL)RAND_MAX+0.5);
+               // Random initial speed, using the compiled atoms & restraints of the group
+               MDTopology *pTopology=&(pos->mTopology);
+               for(unsigned long i=0;i<pTopology->mNbMovedAtom;++i)
+               {
+                  pTopology->mVX[i]=rand()/(REAL)RAND_MAX+0.5;
+                  pTopology->mVY[i]=rand()/(REAL)RAND_MAX+0.5;
+                  pTopology->mVZ[i]=rand()/(REAL)RAND_MAX+0.5;
+               }
 
                const REAL nrj0=mMDMoveEnergy*( pos->mvpBond.size()
                                     +pos->mvpBondAngle.size()
                                     +pos->mvpDihedralAngle.size());
-               map<RigidGroup*,std::pair<XYZ,XYZ> > vr;
                float nrjMult=1.0+mutationAmplitude*0.2;
                if((rand()%20)==0) nrjMult=4.0;
-               this->MolecularDynamicsEvolve(v0, int(100*sqrt(mutationAmplitude)),0.004,
-                                             pos->mvpBond,
-                                             pos->mvpBondAngle,
-                                             pos->mvpDihedralAngle,
-                                             vr,nrj0*nrjMult);
+               pTopology->Evolve(int(100*sqrt(mutationAmplitude)),0.004,nrj0*nrjMult);
             }
             #endif
             else
@@ -3131,7 +3593,16 @@ REAL Molecule::GetLogLikelihood()const
       &&(mClockLogLikelihood>mClockAtomPosition)
       &&(mClockLogLikelihood>mClockScatterer)) return mLogLikelihood*mLogLikelihoodScale;
    TAU_PROFILE("Molecule::GetLogLikelihood()","REAL ()",TAU_DEFAULT);
-   mLogLikelihood=this->RefinableObj::GetLogLikelihood();
+   if(  (mClockRestraintTable<mClockAtomList)
+      ||(mClockRestraintTable<mClockBondList)
+      ||(mClockRestraintTable<mClockBondAngleList)
+      ||(mClockRestraintTable<mClockDihedralAngleList)
+      ||(mRestraintTable.GetNbRestraint()!=mvpRestraint.size()))
+   {
+      mRestraintTable.Build(mvpAtom,mvpRestraint);
+      mClockRestraintTable.Click();
+   }
+   mLogLikelihood=mRestraintTable.GetLogLikelihood();
    mClockLogLikelihood.Click();
    return mLogLikelihood*mLogLikelihoodScale;
 }
@@ -4357,85 +4828,22 @@ void Molecule::MolecularDynamicsEvolve(map<MolAtom*,XYZ> &v0,const unsigned nbSt
       for(vector<RigidGroup *>::iterator pos=this->GetRigidGroupList().begin();pos!=this->GetRigidGroupList().end();++pos)
          (*pvr)[*pos]=make_pair(XYZ(0,0,0),XYZ(0,0,0));
    }
-   const REAL m=500;// mass
-   const REAL im=1./m;
-
-   // Try to keep total energy constant
-   REAL e_v,e_k,v_r=1.0;
-   for(unsigned i = 0; i < nbStep; ++i)
+   // :TODO: handle rigid groups ?
+   vector<MolAtom*> vpAtom;
+   for(map<MolAtom*,XYZ>::const_iterator pos=v0.begin();pos!=v0.end();++pos) vpAtom.push_back(pos->first);
+   MDTopology topology;
+   topology.Build(vpAtom,*pvb,*pva,*pvd);
+   unsigned long i=0;
+   for(map<MolAtom*,XYZ>::const_iterator pos=v0.begin();pos!=v0.end();++pos,++i)
    {
-      // Calc full gradient
-      map<MolAtom*,XYZ> grad;
-      for(map<MolAtom*,XYZ>::iterator pos=v0.begin();pos!=v0.end();++pos) grad[pos->first]=XYZ(0,0,0);
-
-      // :TODO: handle rigid groups ?
-      e_v=0;
-      for(vector<MolBond*>::const_iterator pos=pvb->begin();pos!=pvb->end();++pos)
-      {
-         (*pos)->CalcGradient(grad);
-         e_v+=(*pos)->GetLogLikelihood(false,false);
-      }
-
-      for(vector<MolBondAngle*>::const_iterator pos=pva->begin();pos!=pva->end();++pos)
-      {
-         (*pos)->CalcGradient(grad);
-         e_v+=(*pos)->GetLogLikelihood(false,false);
-      }
-
-      for(vector<MolDihedralAngle*>::const_iterator pos=pvd->begin();pos!=pvd->end();++pos)
-      {
-         (*pos)->CalcGradient(grad);
-         e_v+=(*pos)->GetLogLikelihood(false,false);
-      }
-
-      //kinetic energy
-      e_k=0;
-      for(map<MolAtom*,XYZ>::const_iterator pos=v0.begin();pos!=v0.end();++pos)
-         e_k += 0.5*m*(pos->second.x*pos->second.x + pos->second.y*pos->second.y + pos->second.z*pos->second.z);
-
-      if(nrj0==0) nrj0=e_k+e_v;
-      else
-      {
-         // Apply a coefficient to the speed to keep the overall energy constant
-         const REAL de=e_k+e_v-nrj0;
-         if(de<e_k) v_r=sqrt((e_k-de)/e_k);
-         else v_r=0.0;
-      }
-
-      #if 0
-      char buf[100];
-      sprintf(buf,"(i) LLK + Ek = %10.3f + %10.3f =%10.3f (nrj0=%10.3f)",e_v,e_k,e_v+e_k,nrj0);
-      cout<<buf<<endl;
-
-      // Display gradient & speed - for tests
-      for(map<MolAtom*,XYZ>::iterator pos=v0.begin();pos!=v0.end();++pos)
-      {
-         sprintf(buf,"%10s xyz= (%8.3f %8.3f %8.3f) v= (%8.3f %8.3f %8.3f) m*a= (%8.3f %8.3f %8.3f)",
-               pos->first->GetName().c_str(),
-               pos->first->GetX(),pos->first->GetY(),pos->first->GetZ(),
-                v0[*pos].x    ,v0[*pos].y     ,v0[*pos].z,
-               -grad[*pos].x*im,-grad[*pos].y*im,-grad[*pos].z*im);
-         //cout<<buf<<endl;
-      }
-      //cout<<endl<<endl;
-      #endif
-      // Move according to max step to minimize LLK
-      for(map<MolAtom*,XYZ>::const_iterator pos=v0.begin();pos!=v0.end();++pos)
-      {
-         const XYZ *pa=&(grad[pos->first]);
-         pos->first->SetX(pos->first->GetX()+pos->second.x*dt*v_r-0.5*im*dt*dt*pa->x);
-         pos->first->SetY(pos->first->GetY()+pos->second.y*dt*v_r-0.5*im*dt*dt*pa->y);
-         pos->first->SetZ(pos->first->GetZ()+pos->second.z*dt*v_r-0.5*im*dt*dt*pa->z);
-      }
-      // Compute new speed
-      for(map<MolAtom*,XYZ>::iterator pos=v0.begin();pos!=v0.end();++pos)
-      {
-         const XYZ *pa=&(grad[pos->first]);
-         pos->second.x = v_r*pos->second.x - pa->x*dt*im;
-         pos->second.y = v_r*pos->second.y - pa->y*dt*im;
-         pos->second.z = v_r*pos->second.z - pa->z*dt*im;
-      }
+      topology.mVX[i]=pos->second.x;
+      topology.mVY[i]=pos->second.y;
+      topology.mVZ[i]=pos->second.z;
    }
+   topology.Evolve(nbStep,dt,nrj0);
+   i=0;
+   for(map<MolAtom*,XYZ>::iterator pos=v0.begin();pos!=v0.end();++pos,++i)
+      pos->second=XYZ(topology.mVX[i],topology.mVY[i],topology.mVZ[i]);
 }
 
 const vector<MolAtom*>& Molecule::GetAtomList()const{return mvpAtom;}
@@ -5331,6 +5739,7 @@ void Molecule::BuildRingList()
    this->BuildConnectivityTable();
    if(mClockRingList>mClockConnectivityTable) return;
    VFN_DEBUG_ENTRY("Molecule::BuildRingList()",7)
+   TAU_PROFILE("Molecule::BuildRingList()","void ()",TAU_DEFAULT);
    for(vector<MolAtom*>::const_iterator pos=mvpAtom.begin();pos!=mvpAtom.end();++pos)
       (*pos)->SetIsInRing(false);
    list<MolAtom *> atomlist;
@@ -5639,6 +6048,42 @@ void Molecule::BuildRotorGroup()
    VFN_DEBUG_EXIT("Molecule::BuildRotorGroup()",5)
 }
 
+/** \internal Find the restraints which are really broken by a stretch mode, among a list
+* of candidates, using the derivative of each restraint versus the mode, for up to 5
+* random conformations.
+*
+* \param paramSetRandom: the 5 saved parameter sets with the random conformations
+* \param vBroken: the restraints found to be broken are added to this list
+*/
+template<class T> static void FindBrokenRestraints(Molecule &mol,const StretchMode &mode,
+                                                   const vector<T*> &vCandidate,
+                                                   const unsigned long *paramSetRandom,
+                                                   map<const T*,REAL> &vBroken)
+{
+   if(vCandidate.size()==0) return;
+   vector<T*> vr=vCandidate;
+   vector<REAL> vd(vr.size(),0);
+   for(unsigned long i=0;(i<5)&&(vr.size()>0);++i)
+   {
+      mol.RestoreParamSet(paramSetRandom[i]);
+      mode.CalcDeriv(false);
+      for(unsigned long j=0;j<vr.size();)
+      {
+         vr[j]->GetLogLikelihood(true,true);
+         vd[j] += abs(vr[j]->GetDeriv(mode.mDerivXYZ));
+         if(vd[j]>0.01)
+         {
+            vBroken.insert(make_pair(vr[j],0));
+            vr.erase(vr.begin()+j);
+            vd.erase(vd.begin()+j);
+         }
+         else ++j;
+      }
+   }
+   for(unsigned long j=0;j<vr.size();++j)
+      if(!(abs(vd[j])<=0.01)) vBroken.insert(make_pair(vr[j],0));
+}
+
 void Molecule::BuildStretchModeBondLength()
 {
    #if 0
@@ -5739,6 +6184,8 @@ void Molecule::BuildStretchModeBondLength()
       else pos=mvStretchModeBondLength.erase(pos);
       TAU_PROFILE_STOP(timer5);
    }
+   // Atom indices of all restraints, to find the restraints broken by each mode
+   RestraintAtomGroupFlags groupFlags(mvpAtom,mvpBond,mvpBondAngle,mvpDihedralAngle);
    // Generate 5 completely random atomic positions
       this->SaveParamSet(mLocalParamSet);
       unsigned long paramSetRandom[5];
@@ -5759,15 +6206,10 @@ void Molecule::BuildStretchModeBondLength()
       TAU_PROFILE_START(timer2);
       bool keep=true;
       pos->mvpBrokenBond.clear();
+      groupFlags.SetGroup(pos->mvTranslatedAtomList);
       for(vector<MolBond*>::const_iterator r=mvpBond.begin();r!=mvpBond.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvTranslatedAtomList.begin();
-             at!=pos->mvTranslatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-         }
+         const unsigned int ct=groupFlags.NbBondAtom(r-mvpBond.begin());
          // If we moved either both or non of the bond atom, the bond length is unchanged.
          if((ct!=0)&&(ct !=2)) pos->mvpBrokenBond.insert(make_pair(*r,0));
       }
@@ -5788,33 +6230,17 @@ void Molecule::BuildStretchModeBondLength()
       TAU_PROFILE_START(timer3);
       bool keep=true;
       pos->mvpBrokenBondAngle.clear();
+      groupFlags.SetGroup(pos->mvTranslatedAtomList);
+      vector<MolBondAngle*> vCandidate;
       for(vector<MolBondAngle*>::const_iterator r=mvpBondAngle.begin();r!=mvpBondAngle.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvTranslatedAtomList.begin();
-             at!=pos->mvTranslatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-            if(*at==&((*r)->GetAtom3())) ct++;
-         }
+         const unsigned int ct=groupFlags.NbBondAngleAtom(r-mvpBondAngle.begin());
          bool broken=true;
          if((ct==0)||(ct==3)) broken=false;
-         if(broken)
-         {// Make sure with derivatives
-            REAL d=0;
-            for(unsigned long i=0;i<5;++i)
-            {
-               this->RestoreParamSet(paramSetRandom[i]);
-               pos->CalcDeriv(false);
-               (*r)->GetLogLikelihood(true,true);
-               d += abs((*r)->GetDeriv(pos->mDerivXYZ));
-               if(d>0.01) break;
-            }
-            if(abs(d)<=0.01) broken=false;
-         }
-         if(broken) pos->mvpBrokenBondAngle.insert(make_pair(*r,0));
+         if(broken) vCandidate.push_back(*r);
       }
+      // Make sure with derivatives
+      FindBrokenRestraints(*this,*pos,vCandidate,paramSetRandom,pos->mvpBrokenBondAngle);
       if(mFlexModel.GetChoice()==2)
       {
          if(pos->mvpBrokenBondAngle.size()>0) keep=false;
@@ -5830,34 +6256,17 @@ void Molecule::BuildStretchModeBondLength()
       TAU_PROFILE_START(timer4);
       bool keep=true;
       pos->mvpBrokenDihedralAngle.clear();
+      groupFlags.SetGroup(pos->mvTranslatedAtomList);
+      vector<MolDihedralAngle*> vCandidate;
       for(vector<MolDihedralAngle*>::const_iterator r=mvpDihedralAngle.begin();r!=mvpDihedralAngle.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvTranslatedAtomList.begin();
-             at!=pos->mvTranslatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-            if(*at==&((*r)->GetAtom3())) ct++;
-            if(*at==&((*r)->GetAtom4())) ct++;
-         }
+         const unsigned int ct=groupFlags.NbDihedralAngleAtom(r-mvpDihedralAngle.begin());
          bool broken=true;
          if((ct==0)||(ct==4)) broken=false;
-         if(broken)
-         {// Make sure with derivatives
-            REAL d=0;
-            for(unsigned long i=0;i<5;++i)
-            {
-               this->RestoreParamSet(paramSetRandom[i]);
-               pos->CalcDeriv(false);
-               (*r)->GetLogLikelihood(true,true);
-               d += abs((*r)->GetDeriv(pos->mDerivXYZ));
-               if(d>0.01) break;
-            }
-            if(abs(d)<=0.01) broken=false;
-         }
-         if(broken) pos->mvpBrokenDihedralAngle.insert(make_pair(*r,0));
+         if(broken) vCandidate.push_back(*r);
       }
+      // Make sure with derivatives
+      FindBrokenRestraints(*this,*pos,vCandidate,paramSetRandom,pos->mvpBrokenDihedralAngle);
       if(mFlexModel.GetChoice()==2)
       {
          if(pos->mvpBrokenDihedralAngle.size()>0) keep=false;
@@ -6057,6 +6466,8 @@ void Molecule::BuildStretchModeBondAngle()
       else pos=mvStretchModeBondAngle.erase(pos);
       TAU_PROFILE_STOP(timer5);
    }
+   // Atom indices of all restraints, to find the restraints broken by each mode
+   RestraintAtomGroupFlags groupFlags(mvpAtom,mvpBond,mvpBondAngle,mvpDihedralAngle);
    // Generate 5 completely random atomic positions
       this->SaveParamSet(mLocalParamSet);
       unsigned long paramSetRandom[5];
@@ -6077,33 +6488,18 @@ void Molecule::BuildStretchModeBondAngle()
       TAU_PROFILE_START(timer2);
       bool keep=true;
       pos->mvpBrokenBond.clear();
+      groupFlags.SetGroup(pos->mvRotatedAtomList);
+      vector<MolBond*> vCandidate;
       for(vector<MolBond*>::const_iterator r=mvpBond.begin();r!=mvpBond.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvRotatedAtomList.begin();
-             at!=pos->mvRotatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-         }
+         const unsigned int ct=groupFlags.NbBondAtom(r-mvpBond.begin());
          bool broken=true;
          // If we moved either both or non of the bond atom, the bond length is unchanged.
          if((ct==0)||(ct==2)) broken=false;
-         if(broken)
-         {// Make sure with derivatives
-            REAL d=0;
-            for(unsigned long i=0;i<5;++i)
-            {
-               this->RestoreParamSet(paramSetRandom[i]);
-               pos->CalcDeriv(false);
-               (*r)->GetLogLikelihood(true,true);
-               d += abs((*r)->GetDeriv(pos->mDerivXYZ));
-               if(d>0.01) break;
-            }
-            if(abs(d)<=0.01) broken=false;
-         }
-         if(broken) pos->mvpBrokenBond.insert(make_pair(*r,0));
+         if(broken) vCandidate.push_back(*r);
       }
+      // Make sure with derivatives
+      FindBrokenRestraints(*this,*pos,vCandidate,paramSetRandom,pos->mvpBrokenBond);
       if(mFlexModel.GetChoice()==2)
       {
          if(pos->mvpBrokenBond.size()>0) keep=false;
@@ -6119,34 +6515,18 @@ void Molecule::BuildStretchModeBondAngle()
       TAU_PROFILE_START(timer3);
       bool keep=true;
       pos->mvpBrokenBondAngle.clear();
+      groupFlags.SetGroup(pos->mvRotatedAtomList);
+      vector<MolBondAngle*> vCandidate;
       for(vector<MolBondAngle*>::const_iterator r=mvpBondAngle.begin();r!=mvpBondAngle.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvRotatedAtomList.begin();
-             at!=pos->mvRotatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-            if(*at==&((*r)->GetAtom3())) ct++;
-         }
+         const unsigned int ct=groupFlags.NbBondAngleAtom(r-mvpBondAngle.begin());
          bool broken=true;
          if(ct==0) broken=false;
          if(ct==3) broken=false;
-         if(broken)
-         {// Make sure with derivatives
-            REAL d=0;
-            for(unsigned long i=0;i<5;++i)
-            {
-               this->RestoreParamSet(paramSetRandom[i]);
-               pos->CalcDeriv(false);
-               (*r)->GetLogLikelihood(true,true);
-               d += abs((*r)->GetDeriv(pos->mDerivXYZ));
-               if(d>0.01) break;
-            }
-            if(abs(d)<=0.01) broken=false;
-         }
-         if(broken) pos->mvpBrokenBondAngle.insert(make_pair(*r,0));
+         if(broken) vCandidate.push_back(*r);
       }
+      // Make sure with derivatives
+      FindBrokenRestraints(*this,*pos,vCandidate,paramSetRandom,pos->mvpBrokenBondAngle);
       if(mFlexModel.GetChoice()==2)
       {
          int nb=pos->mvpBrokenBond.size();
@@ -6164,35 +6544,18 @@ void Molecule::BuildStretchModeBondAngle()
       TAU_PROFILE_START(timer4);
       bool keep=true;
       pos->mvpBrokenDihedralAngle.clear();
+      groupFlags.SetGroup(pos->mvRotatedAtomList);
+      vector<MolDihedralAngle*> vCandidate;
       for(vector<MolDihedralAngle*>::const_iterator r=mvpDihedralAngle.begin();r!=mvpDihedralAngle.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvRotatedAtomList.begin();
-             at!=pos->mvRotatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-            if(*at==&((*r)->GetAtom3())) ct++;
-            if(*at==&((*r)->GetAtom4())) ct++;
-         }
+         const unsigned int ct=groupFlags.NbDihedralAngleAtom(r-mvpDihedralAngle.begin());
          bool broken=true;
          if(ct==0) broken=false;
          if(ct==4) broken=false;
-         if(broken)
-         {// Make sure with derivatives
-            REAL d=0;
-            for(unsigned long i=0;i<5;++i)
-            {
-               this->RestoreParamSet(paramSetRandom[i]);
-               pos->CalcDeriv(false);
-               (*r)->GetLogLikelihood(true,true);
-               d += abs((*r)->GetDeriv(pos->mDerivXYZ));
-               if(d>0.01) break;
-            }
-            if(abs(d)<=0.01) broken=false;
-         }
-         if(broken) pos->mvpBrokenDihedralAngle.insert(make_pair(*r,0));
+         if(broken) vCandidate.push_back(*r);
       }
+      // Make sure with derivatives
+      FindBrokenRestraints(*this,*pos,vCandidate,paramSetRandom,pos->mvpBrokenDihedralAngle);
       if(mFlexModel.GetChoice()==2)
       {
          if(pos->mvpBrokenDihedralAngle.size()>0) keep=false;
@@ -6469,6 +6832,8 @@ void Molecule::BuildStretchModeTorsion()
       else pos=mvStretchModeTorsion.erase(pos);
       TAU_PROFILE_STOP(timer5);
    }
+   // Atom indices of all restraints, to find the restraints broken by each mode
+   RestraintAtomGroupFlags groupFlags(mvpAtom,mvpBond,mvpBondAngle,mvpDihedralAngle);
    // Generate 5 completely random atomic positions
       this->SaveParamSet(mLocalParamSet);
       unsigned long paramSetRandom[5];
@@ -6489,33 +6854,18 @@ void Molecule::BuildStretchModeTorsion()
       TAU_PROFILE_START(timer2);
       bool keep=true;
       pos->mvpBrokenBond.clear();
+      groupFlags.SetGroup(pos->mvRotatedAtomList);
+      vector<MolBond*> vCandidate;
       for(vector<MolBond*>::const_iterator r=mvpBond.begin();r!=mvpBond.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvRotatedAtomList.begin();
-             at!=pos->mvRotatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-         }
+         const unsigned int ct=groupFlags.NbBondAtom(r-mvpBond.begin());
          bool broken=true;
          // If we moved either both or non of the bond atom, the bond length is unchanged.
          if((ct==0)||(ct==2)) broken=false;
-         if(broken)
-         {// Make sure with derivatives
-            REAL d=0;
-            for(unsigned long i=0;i<5;++i)
-            {
-               this->RestoreParamSet(paramSetRandom[i]);
-               pos->CalcDeriv(false);
-               (*r)->GetLogLikelihood(true,true);
-               d += abs((*r)->GetDeriv(pos->mDerivXYZ));
-               if(d>0.01) break;
-            }
-            if(abs(d)<=0.01) broken=false;
-         }
-         if(broken) pos->mvpBrokenBond.insert(make_pair(*r,0));
+         if(broken) vCandidate.push_back(*r);
       }
+      // Make sure with derivatives
+      FindBrokenRestraints(*this,*pos,vCandidate,paramSetRandom,pos->mvpBrokenBond);
       if(mFlexModel.GetChoice()==2)
       {
          if(pos->mvpBrokenBond.size()>0) keep=false;
@@ -6531,33 +6881,17 @@ void Molecule::BuildStretchModeTorsion()
       TAU_PROFILE_START(timer3);
       bool keep=true;
       pos->mvpBrokenBondAngle.clear();
+      groupFlags.SetGroup(pos->mvRotatedAtomList);
+      vector<MolBondAngle*> vCandidate;
       for(vector<MolBondAngle*>::const_iterator r=mvpBondAngle.begin();r!=mvpBondAngle.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvRotatedAtomList.begin();
-             at!=pos->mvRotatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-            if(*at==&((*r)->GetAtom3())) ct++;
-         }
+         const unsigned int ct=groupFlags.NbBondAngleAtom(r-mvpBondAngle.begin());
          bool broken=true;
          if((ct==0)||(ct==3)) broken=false;
-         if(broken)
-         {// Make sure with derivatives
-            REAL d=0;
-            for(unsigned long i=0;i<5;++i)
-            {
-               this->RestoreParamSet(paramSetRandom[i]);
-               pos->CalcDeriv(false);
-               (*r)->GetLogLikelihood(true,true);
-               d += abs((*r)->GetDeriv(pos->mDerivXYZ));
-               if(d>0.01) break;
-            }
-            if(abs(d)<=0.01) broken=false;
-         }
-         if(broken) pos->mvpBrokenBondAngle.insert(make_pair(*r,0));
+         if(broken) vCandidate.push_back(*r);
       }
+      // Make sure with derivatives
+      FindBrokenRestraints(*this,*pos,vCandidate,paramSetRandom,pos->mvpBrokenBondAngle);
       if(mFlexModel.GetChoice()==2)
       {
          if(pos->mvpBrokenBond.size()>0) keep=false;
@@ -6573,34 +6907,17 @@ void Molecule::BuildStretchModeTorsion()
       TAU_PROFILE_START(timer4);
       bool keep=true;
       pos->mvpBrokenDihedralAngle.clear();
+      groupFlags.SetGroup(pos->mvRotatedAtomList);
+      vector<MolDihedralAngle*> vCandidate;
       for(vector<MolDihedralAngle*>::const_iterator r=mvpDihedralAngle.begin();r!=mvpDihedralAngle.end();++r)
       {
-         unsigned int ct=0;
-         for(set<MolAtom *>::const_iterator at=pos->mvRotatedAtomList.begin();
-             at!=pos->mvRotatedAtomList.end();++at)
-         {
-            if(*at==&((*r)->GetAtom1())) ct++;
-            if(*at==&((*r)->GetAtom2())) ct++;
-            if(*at==&((*r)->GetAtom3())) ct++;
-            if(*at==&((*r)->GetAtom4())) ct++;
-         }
+         const unsigned int ct=groupFlags.NbDihedralAngleAtom(r-mvpDihedralAngle.begin());
          bool broken=true;
          if((ct==0)||(ct==4)) broken=false;
-         if(broken)
-         {// Make sure with derivatives
-            REAL d=0;
-            for(unsigned long i=0;i<5;++i)
-            {
-               this->RestoreParamSet(paramSetRandom[i]);
-               pos->CalcDeriv(false);
-               (*r)->GetLogLikelihood(true,true);
-               d += abs((*r)->GetDeriv(pos->mDerivXYZ));
-               if(d>0.01) break;
-            }
-            if(abs(d)<=0.01) broken=false;
-         }
-         if(broken) pos->mvpBrokenDihedralAngle.insert(make_pair(*r,0));
+         if(broken) vCandidate.push_back(*r);
       }
+      // Make sure with derivatives
+      FindBrokenRestraints(*this,*pos,vCandidate,paramSetRandom,pos->mvpBrokenDihedralAngle);
       if(mFlexModel.GetChoice()==2)
       {
          int nb=pos->mvpBrokenDihedralAngle.size();
@@ -6928,9 +7245,42 @@ void Molecule::BuildStretchModeTwist()
    VFN_DEBUG_EXIT("Molecule::BuildStretchModeTwist()",7)
 }
 
+/** \internal Sum of the displacements of a group of atoms, for a rotation around an axis
+* defined by one atom and a vector. The atoms are not moved. This uses the same
+* computations as Molecule::RotateAtomGroup().
+*
+* \param vIdx: index of the rotated atoms in vpAtom
+*/
+static REAL RotationDisplacement(const MolAtom &at,const REAL vx,const REAL vy,const REAL vz,
+                                 const vector<MolAtom*> &vpAtom,const vector<unsigned long> &vIdx,
+                                 const REAL angle)
+{
+   if(vIdx.size()==0) return 0;
+   // Same as Molecule::RotateAtomGroup(), which does nothing for an ill-defined vector
+   if((fabs(vx)+fabs(vy)+fabs(vz))<1e-6) return 0;
+   const REAL x0=at.X();
+   const REAL y0=at.Y();
+   const REAL z0=at.Z();
+   const Quaternion quat=Quaternion::RotationQuaternion(angle,vx,vy,vz);
+   REAL d=0;
+   for(vector<unsigned long>::const_iterator pos=vIdx.begin();pos!=vIdx.end();++pos)
+   {
+      const MolAtom *pAtom=vpAtom[*pos];
+      REAL x=pAtom->X()-x0,y=pAtom->Y()-y0,z=pAtom->Z()-z0;
+      quat.RotateVector(x,y,z);
+      x+=x0;
+      y+=y0;
+      z+=z0;
+      const REAL dx=pAtom->X()-x,dy=pAtom->Y()-y,dz=pAtom->Z()-z;
+      d+=sqrt(abs(dx*dx+dy*dy+dz*dz));
+   }
+   return d;
+}
+
 void Molecule::TuneGlobalOptimRotationAmplitude()
 {
    VFN_DEBUG_ENTRY("Molecule::TuneGlobalOptimRotationAmplitude()",5)
+   TAU_PROFILE("Molecule::TuneGlobalOptimRotationAmplitude()","void ()",TAU_DEFAULT);
    unsigned long initialConfig=this->CreateParamSet("Initial Configuration");
    const unsigned int nbTest=100;
 
@@ -6943,6 +7293,27 @@ void Molecule::TuneGlobalOptimRotationAmplitude()
 
    REAL displacement=0;//For the global Molecule rotation
 
+   // Index of the rotated atoms for each mode, in the order of the Molecule's atom list
+   map<const MolAtom*,unsigned long> vIndex;
+   for(unsigned long i=0;i<mvpAtom.size();++i) vIndex[mvpAtom[i]]=i;
+   vector<vector<unsigned long> > vBondAngleAtom,vTorsionAtom;
+   for(list<StretchModeBondAngle>::const_iterator pos=mvStretchModeBondAngle.begin();
+       pos!=mvStretchModeBondAngle.end();++pos)
+   {
+      vBondAngleAtom.push_back(vector<unsigned long>());
+      for(set<MolAtom*>::const_iterator at=pos->mvRotatedAtomList.begin();at!=pos->mvRotatedAtomList.end();++at)
+         vBondAngleAtom.back().push_back(vIndex[*at]);
+      sort(vBondAngleAtom.back().begin(),vBondAngleAtom.back().end());
+   }
+   for(list<StretchModeTorsion>::const_iterator pos=mvStretchModeTorsion.begin();
+       pos!=mvStretchModeTorsion.end();++pos)
+   {
+      vTorsionAtom.push_back(vector<unsigned long>());
+      for(set<MolAtom*>::const_iterator at=pos->mvRotatedAtomList.begin();at!=pos->mvRotatedAtomList.end();++at)
+         vTorsionAtom.back().push_back(vIndex[*at]);
+      sort(vTorsionAtom.back().begin(),vTorsionAtom.back().end());
+   }
+
    for(unsigned int j=0;j<nbTest;j++)
    {
       this->RandomizeConfiguration();
@@ -6961,10 +7332,12 @@ void Molecule::TuneGlobalOptimRotationAmplitude()
       xc /= (REAL)(this->GetNbComponent());
       yc /= (REAL)(this->GetNbComponent());
       zc /= (REAL)(this->GetNbComponent());
-      // Record displacement amplitude for torsion angles
+      // Record displacement amplitude for torsion angles. The rotation is computed
+      // for the rotated atoms only (the other atoms do not move), without moving them.
       REAL dx,dy,dz;
+      vector<vector<unsigned long> >::const_iterator vat=vBondAngleAtom.begin();
       for(list<StretchModeBondAngle>::iterator pos=mvStretchModeBondAngle.begin();
-          pos!=mvStretchModeBondAngle.end();++pos)
+          pos!=mvStretchModeBondAngle.end();++pos,++vat)
       {
          const REAL dx10=pos->mpAtom0->GetX()-pos->mpAtom1->GetX();
          const REAL dy10=pos->mpAtom0->GetY()-pos->mpAtom1->GetY();
@@ -6976,28 +7349,16 @@ void Molecule::TuneGlobalOptimRotationAmplitude()
          const REAL vx=dy10*dz12-dz10*dy12;
          const REAL vy=dz10*dx12-dx10*dz12;
          const REAL vz=dx10*dy12-dy10*dx12;
-         this->RotateAtomGroup(*(pos->mpAtom1),vx,vy,vz,pos->mvRotatedAtomList,0.01,false);
-         for(long i=0;i<this->GetNbComponent();++i)
-         {
-            dx=x0[i]-mvpAtom[i]->GetX();
-            dy=y0[i]-mvpAtom[i]->GetY();
-            dz=z0[i]-mvpAtom[i]->GetZ();
-            pos->mBaseAmplitude+=sqrt(abs(dx*dx+dy*dy+dz*dz));
-         }
-         this->RotateAtomGroup(*(pos->mpAtom1),vx,vy,vz,pos->mvRotatedAtomList,-0.01,false);
+         pos->mBaseAmplitude+=RotationDisplacement(*(pos->mpAtom1),vx,vy,vz,mvpAtom,*vat,0.01);
       }
+      vat=vTorsionAtom.begin();
       for(list<StretchModeTorsion>::iterator pos=mvStretchModeTorsion.begin();
-          pos!=mvStretchModeTorsion.end();++pos)
+          pos!=mvStretchModeTorsion.end();++pos,++vat)
       {
-         this->RotateAtomGroup(*(pos->mpAtom1),*(pos->mpAtom2),pos->mvRotatedAtomList,0.01,false);
-         for(long i=0;i<this->GetNbComponent();++i)
-         {
-            dx=x0[i]-mvpAtom[i]->GetX();
-            dy=y0[i]-mvpAtom[i]->GetY();
-            dz=z0[i]-mvpAtom[i]->GetZ();
-            pos->mBaseAmplitude+=sqrt(abs(dx*dx+dy*dy+dz*dz));
-         }
-         this->RotateAtomGroup(*(pos->mpAtom1),*(pos->mpAtom2),pos->mvRotatedAtomList,-0.01,false);
+         const REAL vx=pos->mpAtom2->X()-pos->mpAtom1->X();
+         const REAL vy=pos->mpAtom2->Y()-pos->mpAtom1->Y();
+         const REAL vz=pos->mpAtom2->Z()-pos->mpAtom1->Z();
+         pos->mBaseAmplitude+=RotationDisplacement(*(pos->mpAtom1),vx,vy,vz,mvpAtom,*vat,0.01);
       }
       // Record displacement amplitude for global rotation, for 10 random rot axis
       for(unsigned int k=0;k<10;++k)
@@ -7107,6 +7468,410 @@ void Molecule::TuneGlobalOptimRotationAmplitude()
    VFN_DEBUG_EXIT("Molecule::TuneGlobalOptimRotationAmplitude()",5)
 }
 
+static std::string gMoleculeTopologyCacheDir;
+
+static mutex& GetMoleculeTopologyCacheDirMutex()
+{
+   static mutex m;
+   return m;
+}
+
+void SetMoleculeTopologyCacheDir(const std::string &dir)
+{
+   lock_guard<mutex> lock(GetMoleculeTopologyCacheDirMutex());
+   gMoleculeTopologyCacheDir=dir;
+}
+
+std::string GetMoleculeTopologyCacheDir()
+{
+   lock_guard<mutex> lock(GetMoleculeTopologyCacheDirMutex());
+   return gMoleculeTopologyCacheDir;
+}
+
+/// \internal Add a value to a 64-bit FNV-1a hash
+template<class T> static void TopologyHash(unsigned long long &h,const T v)
+{
+   const unsigned char *p=reinterpret_cast<const unsigned char*>(&v);
+   for(unsigned int i=0;i<sizeof(T);++i)
+   {
+      h^=p[i];
+      h*=1099511628211ULL;
+   }
+}
+
+/// \internal Index of an object in a list, or -1 if it is not found or null
+template<class T> static long TopologyIndex(const map<const T*,unsigned long> &vIndex,const T *p)
+{
+   typename map<const T*,unsigned long>::const_iterator pos=vIndex.find(p);
+   if(pos==vIndex.end()) return -1;
+   return (long)(pos->second);
+}
+
+/// \internal Write a set of atoms, as the number of atoms followed by their index
+static void WriteTopologyAtomSet(ostream &os,const set<MolAtom*> &vAtom,
+                                 const map<const MolAtom*,unsigned long> &vIndex)
+{
+   os<<" "<<vAtom.size();
+   for(set<MolAtom*>::const_iterator pos=vAtom.begin();pos!=vAtom.end();++pos)
+      os<<" "<<TopologyIndex<MolAtom>(vIndex,*pos);
+}
+
+/// \internal Write the keys of a list of restraints, as their number followed by their index
+template<class T> static void WriteTopologyRestraints(ostream &os,const map<const T*,REAL> &vRestraint,
+                                                      const map<const T*,unsigned long> &vIndex)
+{
+   os<<" "<<vRestraint.size();
+   for(typename map<const T*,REAL>::const_iterator pos=vRestraint.begin();pos!=vRestraint.end();++pos)
+      os<<" "<<TopologyIndex<T>(vIndex,pos->first);
+}
+
+/// \internal Read an index in a list. Returns 0 if the index is not valid.
+template<class T> static T* ReadTopologyObject(istream &is,const vector<T*> &vp)
+{
+   long i=-1;
+   is>>i;
+   if(is.fail() || (i<0) || (i>=(long)vp.size())) return 0;
+   return vp[i];
+}
+
+/// \internal Read a set of atoms written by WriteTopologyAtomSet()
+static bool ReadTopologyAtomSet(istream &is,const vector<MolAtom*> &vpAtom,set<MolAtom*> &vAtom)
+{
+   unsigned long nb=0;
+   is>>nb;
+   if(is.fail() || (nb>vpAtom.size())) return false;
+   for(unsigned long i=0;i<nb;++i)
+   {
+      MolAtom *p=ReadTopologyObject(is,vpAtom);
+      if(p==0) return false;
+      vAtom.insert(p);
+   }
+   return true;
+}
+
+/// \internal Read a list of restraints written by WriteTopologyRestraints()
+template<class T> static bool ReadTopologyRestraints(istream &is,const vector<T*> &vp,
+                                                     map<const T*,REAL> &vRestraint)
+{
+   unsigned long nb=0;
+   is>>nb;
+   if(is.fail() || (nb>vp.size())) return false;
+   for(unsigned long i=0;i<nb;++i)
+   {
+      const T *p=ReadTopologyObject(is,vp);
+      if(p==0) return false;
+      vRestraint.insert(make_pair(p,0));
+   }
+   return true;
+}
+
+/// \internal Read the (optional) restraint associated to a stretch mode, written as -1 if none
+template<class T> static bool ReadTopologyModeRestraint(istream &is,const vector<T*> &vp,const T* &p)
+{
+   long i=-1;
+   is>>i;
+   if(is.fail() || (i>=(long)vp.size())) return false;
+   p= i<0 ? 0 : vp[i];
+   return true;
+}
+
+unsigned long long Molecule::GetTopologyHash()const
+{
+   map<const MolAtom*,unsigned long> vIndex;
+   for(unsigned long i=0;i<mvpAtom.size();++i) vIndex[mvpAtom[i]]=i;
+   unsigned long long h=14695981039346656037ULL;
+   TopologyHash(h,(long)mFlexModel.GetChoice());
+   TopologyHash(h,(unsigned long)mvpAtom.size());
+   for(vector<MolAtom*>::const_iterator pos=mvpAtom.begin();pos!=mvpAtom.end();++pos)
+      TopologyHash(h,(*pos)->IsDummy());
+   TopologyHash(h,(unsigned long)mvpBond.size());
+   for(vector<MolBond*>::const_iterator pos=mvpBond.begin();pos!=mvpBond.end();++pos)
+   {
+      TopologyHash(h,TopologyIndex<MolAtom>(vIndex,&((*pos)->GetAtom1())));
+      TopologyHash(h,TopologyIndex<MolAtom>(vIndex,&((*pos)->GetAtom2())));
+      TopologyHash(h,(*pos)->GetLength0());
+      TopologyHash(h,(*pos)->GetLengthDelta());
+      TopologyHash(h,(*pos)->GetLengthSigma());
+   }
+   TopologyHash(h,(unsigned long)mvpBondAngle.size());
+   for(vector<MolBondAngle*>::const_iterator pos=mvpBondAngle.begin();pos!=mvpBondAngle.end();++pos)
+   {
+      TopologyHash(h,TopologyIndex<MolAtom>(vIndex,&((*pos)->GetAtom1())));
+      TopologyHash(h,TopologyIndex<MolAtom>(vIndex,&((*pos)->GetAtom2())));
+      TopologyHash(h,TopologyIndex<MolAtom>(vIndex,&((*pos)->GetAtom3())));
+      TopologyHash(h,(*pos)->GetAngle0());
+      TopologyHash(h,(*pos)->GetAngleDelta());
+      TopologyHash(h,(*pos)->GetAngleSigma());
+   }
+   TopologyHash(h,(unsigned long)mvpDihedralAngle.size());
+   for(vector<MolDihedralAngle*>::const_iterator pos=mvpDihedralAngle.begin();pos!=mvpDihedralAngle.end();++pos)
+   {
+      TopologyHash(h,TopologyIndex<MolAtom>(vIndex,&((*pos)->GetAtom1())));
+      TopologyHash(h,TopologyIndex<MolAtom>(vIndex,&((*pos)->GetAtom2())));
+      TopologyHash(h,TopologyIndex<MolAtom>(vIndex,&((*pos)->GetAtom3())));
+      TopologyHash(h,TopologyIndex<MolAtom>(vIndex,&((*pos)->GetAtom4())));
+      TopologyHash(h,(*pos)->GetAngle0());
+      TopologyHash(h,(*pos)->GetAngleDelta());
+      TopologyHash(h,(*pos)->GetAngleSigma());
+   }
+   TopologyHash(h,(unsigned long)mvRigidGroup.size());
+   for(vector<RigidGroup*>::const_iterator pos=mvRigidGroup.begin();pos!=mvRigidGroup.end();++pos)
+   {
+      TopologyHash(h,(unsigned long)(*pos)->size());
+      for(set<MolAtom*>::const_iterator at=(*pos)->begin();at!=(*pos)->end();++at)
+         TopologyHash(h,TopologyIndex<MolAtom>(vIndex,*at));
+   }
+   return h;
+}
+
+void Molecule::SaveTopology(ostream &os)const
+{
+   VFN_DEBUG_ENTRY("Molecule::SaveTopology()",5)
+   map<const MolAtom*,unsigned long> vAtomIndex;
+   for(unsigned long i=0;i<mvpAtom.size();++i) vAtomIndex[mvpAtom[i]]=i;
+   map<const MolBond*,unsigned long> vBondIndex;
+   for(unsigned long i=0;i<mvpBond.size();++i) vBondIndex[mvpBond[i]]=i;
+   map<const MolBondAngle*,unsigned long> vBondAngleIndex;
+   for(unsigned long i=0;i<mvpBondAngle.size();++i) vBondAngleIndex[mvpBondAngle[i]]=i;
+   map<const MolDihedralAngle*,unsigned long> vDihedralAngleIndex;
+   for(unsigned long i=0;i<mvpDihedralAngle.size();++i) vDihedralAngleIndex[mvpDihedralAngle[i]]=i;
+
+   const std::streamsize precision=os.precision(17);
+   os<<"ObjCryst::Molecule::Topology 1"<<endl
+     <<"Hash "<<this->GetTopologyHash()<<endl
+     <<"BaseRotationAmplitude "<<mBaseRotationAmplitude<<endl;
+   os<<"Rings "<<mvRing.size()<<endl;
+   for(list<MolRing>::const_iterator pos=mvRing.begin();pos!=mvRing.end();++pos)
+   {
+      os<<pos->GetAtomList().size();
+      for(list<MolAtom*>::const_iterator at=pos->GetAtomList().begin();at!=pos->GetAtomList().end();++at)
+         os<<" "<<TopologyIndex<MolAtom>(vAtomIndex,*at);
+      os<<endl;
+   }
+   os<<"FlipGroups "<<mvFlipGroup.size()<<endl;
+   for(list<FlipGroup>::const_iterator pos=mvFlipGroup.begin();pos!=mvFlipGroup.end();++pos)
+   {
+      os<<TopologyIndex<MolAtom>(vAtomIndex,pos->mpAtom0)<<" "
+        <<TopologyIndex<MolAtom>(vAtomIndex,pos->mpAtom1)<<" "
+        <<TopologyIndex<MolAtom>(vAtomIndex,pos->mpAtom2)<<" "
+        <<pos->mvRotatedChainList.size();
+      for(list<pair<const MolAtom *,set<MolAtom *> > >::const_iterator chain=pos->mvRotatedChainList.begin();
+          chain!=pos->mvRotatedChainList.end();++chain)
+      {
+         os<<" "<<TopologyIndex<MolAtom>(vAtomIndex,chain->first);
+         WriteTopologyAtomSet(os,chain->second,vAtomIndex);
+      }
+      os<<endl;
+   }
+   os<<"StretchModeBondLength "<<mvStretchModeBondLength.size()<<endl;
+   for(list<StretchModeBondLength>::const_iterator pos=mvStretchModeBondLength.begin();
+       pos!=mvStretchModeBondLength.end();++pos)
+   {
+      os<<TopologyIndex<MolAtom>(vAtomIndex,pos->mpAtom0)<<" "
+        <<TopologyIndex<MolAtom>(vAtomIndex,pos->mpAtom1)<<" "
+        <<TopologyIndex<MolBond>(vBondIndex,pos->mpBond)<<" "
+        <<pos->mBaseAmplitude;
+      WriteTopologyAtomSet(os,pos->mvTranslatedAtomList,vAtomIndex);
+      WriteTopologyRestraints(os,pos->mvpBrokenBond,vBondIndex);
+      WriteTopologyRestraints(os,pos->mvpBrokenBondAngle,vBondAngleIndex);
+      WriteTopologyRestraints(os,pos->mvpBrokenDihedralAngle,vDihedralAngleIndex);
+      os<<endl;
+   }
+   os<<"StretchModeBondAngle "<<mvStretchModeBondAngle.size()<<endl;
+   for(list<StretchModeBondAngle>::const_iterator pos=mvStretchModeBondAngle.begin();
+       pos!=mvStretchModeBondAngle.end();++pos)
+   {
+      os<<TopologyIndex<MolAtom>(vAtomIndex,pos->mpAtom0)<<" "
+        <<TopologyIndex<MolAtom>(vAtomIndex,pos->mpAtom1)<<" "
+        <<TopologyIndex<MolAtom>(vAtomIndex,pos->mpAtom2)<<" "
+        <<TopologyIndex<MolBondAngle>(vBondAngleIndex,pos->mpBondAngle)<<" "
+        <<pos->mBaseAmplitude;
+      WriteTopologyAtomSet(os,pos->mvRotatedAtomList,vAtomIndex);
+      WriteTopologyRestraints(os,pos->mvpBrokenBond,vBondIndex);
+      WriteTopologyRestraints(os,pos->mvpBrokenBondAngle,vBondAngleIndex);
+      WriteTopologyRestraints(os,pos->mvpBrokenDihedralAngle,vDihedralAngleIndex);
+      os<<endl;
+   }
+   os<<"StretchModeTorsion "<<mvStretchModeTorsion.size()<<endl;
+   for(list<StretchModeTorsion>::const_iterator pos=mvStretchModeTorsion.begin();
+       pos!=mvStretchModeTorsion.end();++pos)
+   {
+      os<<TopologyIndex<MolAtom>(vAtomIndex,pos->mpAtom1)<<" "
+        <<TopologyIndex<MolAtom>(vAtomIndex,pos->mpAtom2)<<" "
+        <<TopologyIndex<MolDihedralAngle>(vDihedralAngleIndex,pos->mpDihedralAngle)<<" "
+        <<pos->mBaseAmplitude;
+      WriteTopologyAtomSet(os,pos->mvRotatedAtomList,vAtomIndex);
+      WriteTopologyRestraints(os,pos->mvpBrokenBond,vBondIndex);
+      WriteTopologyRestraints(os,pos->mvpBrokenBondAngle,vBondAngleIndex);
+      WriteTopologyRestraints(os,pos->mvpBrokenDihedralAngle,vDihedralAngleIndex);
+      os<<endl;
+   }
+   os<<"End"<<endl;
+   os.precision(precision);
+   VFN_DEBUG_EXIT("Molecule::SaveTopology()",5)
+}
+
+bool Molecule::LoadTopology(istream &is)
+{
+   VFN_DEBUG_ENTRY("Molecule::LoadTopology()",5)
+   TAU_PROFILE("Molecule::LoadTopology()","bool (istream&)",TAU_DEFAULT);
+   // Everything is read in temporary lists, so that nothing is changed in case of error
+   string tag;
+   unsigned long version=0,nb=0;
+   unsigned long long hash=0;
+   REAL baseRotationAmplitude=0;
+   list<MolRing> vRing;
+   list<FlipGroup> vFlipGroup;
+   list<StretchModeBondLength> vBondLength;
+   list<StretchModeBondAngle> vBondAngle;
+   list<StretchModeTorsion> vTorsion;
+   bool ok=true;
+   is>>tag>>version;
+   ok= !is.fail() && (tag=="ObjCryst::Molecule::Topology") && (version==1);
+   if(ok)
+   {
+      is>>tag>>hash;
+      ok= !is.fail() && (tag=="Hash") && (hash==this->GetTopologyHash());
+   }
+   if(ok)
+   {
+      is>>tag>>baseRotationAmplitude;
+      ok= !is.fail() && (tag=="BaseRotationAmplitude");
+   }
+   if(ok)
+   {
+      is>>tag>>nb;
+      ok= !is.fail() && (tag=="Rings");
+   }
+   for(unsigned long i=0;ok && (i<nb);++i)
+   {
+      unsigned long nbAtom=0;
+      is>>nbAtom;
+      ok= !is.fail() && (nbAtom<=mvpAtom.size());
+      vRing.resize(vRing.size()+1);
+      for(unsigned long j=0;ok && (j<nbAtom);++j)
+      {
+         MolAtom *p=ReadTopologyObject(is,mvpAtom);
+         ok= p!=0;
+         vRing.back().GetAtomList().push_back(p);
+      }
+   }
+   if(ok)
+   {
+      is>>tag>>nb;
+      ok= !is.fail() && (tag=="FlipGroups");
+   }
+   for(unsigned long i=0;ok && (i<nb);++i)
+   {
+      const MolAtom *p0=ReadTopologyObject(is,mvpAtom);
+      const MolAtom *p1=ReadTopologyObject(is,mvpAtom);
+      const MolAtom *p2=ReadTopologyObject(is,mvpAtom);
+      unsigned long nbChain=0;
+      is>>nbChain;
+      ok= (p0!=0) && (p1!=0) && (p2!=0) && !is.fail();
+      if(!ok) break;
+      vFlipGroup.push_back(FlipGroup(*p0,*p1,*p2));
+      for(unsigned long j=0;ok && (j<nbChain);++j)
+      {
+         const MolAtom *p=ReadTopologyObject(is,mvpAtom);
+         vFlipGroup.back().mvRotatedChainList.push_back(make_pair(p,set<MolAtom*>()));
+         ok= (p!=0) && ReadTopologyAtomSet(is,mvpAtom,vFlipGroup.back().mvRotatedChainList.back().second);
+      }
+   }
+   if(ok)
+   {
+      is>>tag>>nb;
+      ok= !is.fail() && (tag=="StretchModeBondLength");
+   }
+   for(unsigned long i=0;ok && (i<nb);++i)
+   {
+      MolAtom *p0=ReadTopologyObject(is,mvpAtom);
+      MolAtom *p1=ReadTopologyObject(is,mvpAtom);
+      const MolBond *pBond=0;
+      ok= (p0!=0) && (p1!=0) && ReadTopologyModeRestraint(is,mvpBond,pBond);
+      if(!ok) break;
+      vBondLength.push_back(StretchModeBondLength(*p0,*p1,pBond));
+      is>>vBondLength.back().mBaseAmplitude;
+      ok=    !is.fail()
+          && ReadTopologyAtomSet(is,mvpAtom,vBondLength.back().mvTranslatedAtomList)
+          && ReadTopologyRestraints(is,mvpBond,vBondLength.back().mvpBrokenBond)
+          && ReadTopologyRestraints(is,mvpBondAngle,vBondLength.back().mvpBrokenBondAngle)
+          && ReadTopologyRestraints(is,mvpDihedralAngle,vBondLength.back().mvpBrokenDihedralAngle);
+   }
+   if(ok)
+   {
+      is>>tag>>nb;
+      ok= !is.fail() && (tag=="StretchModeBondAngle");
+   }
+   for(unsigned long i=0;ok && (i<nb);++i)
+   {
+      MolAtom *p0=ReadTopologyObject(is,mvpAtom);
+      MolAtom *p1=ReadTopologyObject(is,mvpAtom);
+      MolAtom *p2=ReadTopologyObject(is,mvpAtom);
+      const MolBondAngle *pBondAngle=0;
+      ok= (p0!=0) && (p1!=0) && (p2!=0) && ReadTopologyModeRestraint(is,mvpBondAngle,pBondAngle);
+      if(!ok) break;
+      vBondAngle.push_back(StretchModeBondAngle(*p0,*p1,*p2,pBondAngle));
+      is>>vBondAngle.back().mBaseAmplitude;
+      ok=    !is.fail()
+          && ReadTopologyAtomSet(is,mvpAtom,vBondAngle.back().mvRotatedAtomList)
+          && ReadTopologyRestraints(is,mvpBond,vBondAngle.back().mvpBrokenBond)
+          && ReadTopologyRestraints(is,mvpBondAngle,vBondAngle.back().mvpBrokenBondAngle)
+          && ReadTopologyRestraints(is,mvpDihedralAngle,vBondAngle.back().mvpBrokenDihedralAngle);
+   }
+   if(ok)
+   {
+      is>>tag>>nb;
+      ok= !is.fail() && (tag=="StretchModeTorsion");
+   }
+   for(unsigned long i=0;ok && (i<nb);++i)
+   {
+      MolAtom *p1=ReadTopologyObject(is,mvpAtom);
+      MolAtom *p2=ReadTopologyObject(is,mvpAtom);
+      const MolDihedralAngle *pDihedralAngle=0;
+      ok= (p1!=0) && (p2!=0) && ReadTopologyModeRestraint(is,mvpDihedralAngle,pDihedralAngle);
+      if(!ok) break;
+      vTorsion.push_back(StretchModeTorsion(*p1,*p2,pDihedralAngle));
+      is>>vTorsion.back().mBaseAmplitude;
+      ok=    !is.fail()
+          && ReadTopologyAtomSet(is,mvpAtom,vTorsion.back().mvRotatedAtomList)
+          && ReadTopologyRestraints(is,mvpBond,vTorsion.back().mvpBrokenBond)
+          && ReadTopologyRestraints(is,mvpBondAngle,vTorsion.back().mvpBrokenBondAngle)
+          && ReadTopologyRestraints(is,mvpDihedralAngle,vTorsion.back().mvpBrokenDihedralAngle);
+   }
+   if(ok)
+   {// A truncated file is rejected
+      is>>tag;
+      ok= !is.fail() && (tag=="End");
+   }
+   if(!ok)
+   {
+      VFN_DEBUG_EXIT("Molecule::LoadTopology(): not a valid topology for this Molecule",5)
+      return false;
+   }
+   this->BuildConnectivityTable();
+   mBaseRotationAmplitude=baseRotationAmplitude;
+   for(vector<MolAtom*>::const_iterator pos=mvpAtom.begin();pos!=mvpAtom.end();++pos)
+      (*pos)->SetIsInRing(false);
+   mvRing.swap(vRing);
+   for(list<MolRing>::const_iterator pos=mvRing.begin();pos!=mvRing.end();++pos)
+      for(list<MolAtom*>::const_iterator at=pos->GetAtomList().begin();at!=pos->GetAtomList().end();++at)
+         (*at)->SetIsInRing(true);
+   mClockRingList.Click();
+   mvFlipGroup.swap(vFlipGroup);
+   mClockFlipGroup.Click();
+   mvStretchModeBondLength.swap(vBondLength);
+   mClockStretchModeBondLength.Click();
+   mvStretchModeBondAngle.swap(vBondAngle);
+   mClockStretchModeBondAngle.Click();
+   mvStretchModeTorsion.swap(vTorsion);
+   mClockStretchModeTorsion.Click();
+   this->BuildStretchModeGroups();
+   this->BuildMDAtomGroups();
+   VFN_DEBUG_EXIT("Molecule::LoadTopology()",5)
+   return true;
+}
+
 void Molecule::BuildFlipGroup()
 {
    this->BuildConnectivityTable();
@@ -7288,6 +8053,7 @@ void Molecule::BuildFlipGroup()
 
 void Molecule::BuildStretchModeGroups()
 {
+   TAU_PROFILE("Molecule::BuildStretchModeGroups()","void ()",TAU_DEFAULT);
    // Assume Stretch modes have already been built
    map<const MolBond*,         set<const StretchMode*> > vpBond;
    for(list<StretchModeBondLength>::const_iterator mode=mvStretchModeBondLength.begin();
@@ -7443,6 +8209,7 @@ void Molecule::BuildStretchModeGroups()
 
 void Molecule::BuildMDAtomGroups()
 {
+   TAU_PROFILE("Molecule::BuildMDAtomGroups()","void ()",TAU_DEFAULT);
    // For each atom, list all atoms that are never moved relatively to it.
    // (not moved == distance cannot change)
    map<MolAtom*,set<MolAtom*> > vBoundAtoms;
@@ -7628,6 +8395,8 @@ void Molecule::UpdateScattCompList()const
     for(vector<RigidGroup *>::const_iterator pos=this->GetRigidGroupList().begin();pos!=this->GetRigidGroupList().end();++pos)
     {
         (*pos)->mQuat.Normalize();
+        REAL m[9];
+        (*pos)->mQuat.GetRotationMatrix(m);
         // Center of the atom group
         REAL x0=0,y0=0,z0=0;
         for(set<unsigned int>::iterator at=(*pos)->mvIdx.begin();at!=(*pos)->mvIdx.end();++at)
@@ -7641,18 +8410,18 @@ void Molecule::UpdateScattCompList()const
         z0/=(*pos)->size();
 
         // Apply rotation & translation to all atoms
+        const REAL tx=x0+(*pos)->mX, ty=y0+(*pos)->mY, tz=z0+(*pos)->mZ;
         for(set<unsigned int>::iterator at=(*pos)->mvIdx.begin();at!=(*pos)->mvIdx.end();++at)
         {
-          REAL x=mvpAtom[*at]->GetX()-x0, y=mvpAtom[*at]->GetY()-y0, z=mvpAtom[*at]->GetZ()-z0;
-          (*pos)->mQuat.RotateVector(x,y,z);
-          mScattCompList(*at).mX=x+x0+(*pos)->mX;
-          mScattCompList(*at).mY=y+y0+(*pos)->mY;
-          mScattCompList(*at).mZ=z+z0+(*pos)->mZ;
+          const REAL x=mvpAtom[*at]->GetX()-x0, y=mvpAtom[*at]->GetY()-y0, z=mvpAtom[*at]->GetZ()-z0;
+          mScattCompList(*at).mX=m[0]*x+m[1]*y+m[2]*z+tx;
+          mScattCompList(*at).mY=m[3]*x+m[4]*y+m[5]*z+ty;
+          mScattCompList(*at).mZ=m[6]*x+m[7]*y+m[8]*z+tz;
         }
     }
   }
   #endif
-   // translate center to (0,0,0)
+   // Center of the Molecule
    REAL x0=0,y0=0,z0=0;
    if((mMoleculeCenter.GetChoice()==0) || (mpCenterAtom==0))
    {
@@ -7672,33 +8441,28 @@ void Molecule::UpdateScattCompList()const
       y0=mpCenterAtom->GetY();
       z0=mpCenterAtom->GetZ();
    }
-   for(long i=0;i<nb;++i)
-   {
-      mScattCompList(i).mX -= x0;
-      mScattCompList(i).mY -= y0;
-      mScattCompList(i).mZ -= z0;
-   }
-   //VFN_DEBUG_MESSAGE("Molecule::UpdateScattCompList()",10)
-   // rotate
+   // Translate the center to (0,0,0), rotate, convert to fractional coordinates
+   // and translate the center to its position in the unit cell, all with one
+   // affine transformation. The matrix is the product of the orthonormal to fractional
+   // matrix by the rotation matrix, obtained by converting the columns of the latter.
    mQuat.Normalize();
-   for(long i=0;i<nb;++i)
-   {
-      //#error the vector must not be normalized !
-      mQuat.RotateVector(mScattCompList(i).mX,mScattCompList(i).mY,mScattCompList(i).mZ);
-   }
-   // Convert to fractionnal coordinates
-   for(long i=0;i<nb;++i)
-   {
-      this->GetCrystal().OrthonormalToFractionalCoords(mScattCompList(i).mX,
-                                                       mScattCompList(i).mY,
-                                                       mScattCompList(i).mZ);
-   }
-   // translate center to position in unit cell
-   for(long i=0;i<nb;++i)
-   {
-      mScattCompList(i).mX += mXYZ(0);
-      mScattCompList(i).mY += mXYZ(1);
-      mScattCompList(i).mZ += mXYZ(2);
+   REAL m[9];
+   mQuat.GetRotationMatrix(m);
+   for(unsigned int j=0;j<3;++j)
+      this->GetCrystal().OrthonormalToFractionalCoords(m[j],m[j+3],m[j+6]);
+   const REAL tx=mXYZ(0)-(m[0]*x0+m[1]*y0+m[2]*z0);
+   const REAL ty=mXYZ(1)-(m[3]*x0+m[4]*y0+m[5]*z0);
+   const REAL tz=mXYZ(2)-(m[6]*x0+m[7]*y0+m[8]*z0);
+   if(nb>0)
+   {
+      ScatteringComponent *RESTRICT p=&(mScattCompList(0));
+      for(long i=0;i<nb;++i)
+      {
+         const REAL x=p[i].mX, y=p[i].mY, z=p[i].mZ;
+         p[i].mX=m[0]*x+m[1]*y+m[2]*z+tx;
+         p[i].mY=m[3]*x+m[4]*y+m[5]*z+ty;
+         p[i].mZ=m[6]*x+m[7]*y+m[8]*z+tz;
+      }
    }
    mClockScattCompList.Click();
    VFN_DEBUG_EXIT("Molecule::UpdateScattCompList()",5)
@@ -7743,6 +8507,8 @@ void Molecule::InitOptions()
    static string moleculeCenterChoices[2];
 
    static bool needInitNames=true;
+   static mutex needInitNamesMutex;
+   lock_guard<mutex> needInitNamesLock(needInitNamesMutex);
    if(true==needInitNames)
    {
       Flexname="Flexibility Model";
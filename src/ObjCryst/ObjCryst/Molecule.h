@@ -490,6 +490,10 @@ class Quaternion
       void XMLInput(istream &is,const XMLCrystTag &tag);
       /// Rotate vector v=(v1,v2,v3). The rotated components are directly written
       void RotateVector(REAL &v1,REAL &v2, REAL &v3)const;
+      /** Get the 3x3 matrix m (stored by rows) of the rotation, so that
+      * RotateVector(v) is equivalent to m*v. This is faster to rotate many vectors.
+      */
+      void GetRotationMatrix(REAL *m)const;
       /// Re-normalize the quaternion to unity. This should not be useful, except
       /// on individual component input, or after long calculations. And even
       /// if wrong, the rotation is independent of the norm of the quaternion.
@@ -705,6 +709,99 @@ struct StretchModeTwist:public StretchMode
    set<MolAtom *> mvRotatedAtomList;
 };
 
+/** Compiled description of a group of atoms and of the restraints between them,
+* used for molecular dynamics moves (see Molecule::MolecularDynamicsEvolve()).
+*
+* Atoms are referred to by their index in flat coordinate arrays, and each
+* restraint by the indices of its atoms. The first mNbMovedAtom atoms are moved,
+* the others are only used to compute the restraints. The coordinates are read
+* from the MolAtom objects at the beginning of Evolve(), and only written back at
+* the end.
+*/
+struct MDTopology
+{
+   MDTopology();
+   /** Build the topology.
+   * \param vpMovedAtom: the list of atoms to be moved
+   * \param vb,va,vd: bond, bond angle and dihedral angle restraints used as potential
+   */
+   void Build(const std::vector<MolAtom*> &vpMovedAtom,
+              const std::vector<MolBond*> &vb,const std::vector<MolBondAngle*> &va,
+              const std::vector<MolDihedralAngle*> &vd);
+   /** Perform molecular dynamics steps, starting from the speed in mVX,mVY,mVZ
+   * (which are updated). See Molecule::MolecularDynamicsEvolve() for the parameters.
+   */
+   void Evolve(const unsigned nbStep,const REAL dt,REAL nrj0);
+   /// All atoms, the moved ones first
+   std::vector<MolAtom*> mvpAtom;
+   /// Number of moved atoms
+   unsigned long mNbMovedAtom;
+   /// Indices of the atoms of each bond (2 per bond), bond angle (3) and dihedral angle (4)
+   std::vector<unsigned long> mvBondAtom,mvBondAngleAtom,mvDihedralAngleAtom;
+   /// The restraints, from which the ideal values, delta and sigma are read at each Evolve()
+   std::vector<const MolBond*> mvpBond;
+   std::vector<const MolBondAngle*> mvpBondAngle;
+   std::vector<const MolDihedralAngle*> mvpDihedralAngle;
+   /// Restraint parameters (ideal value, delta, sigma) for each restraint
+   std::vector<REAL> mvBondPar,mvBondAnglePar,mvDihedralAnglePar;
+   /// Coordinates and gradient of the log-likelihood for all atoms
+   std::vector<REAL> mX,mY,mZ,mGradX,mGradY,mGradZ;
+   /// Speed of the moved atoms
+   std::vector<REAL> mVX,mVY,mVZ;
+};
+
+/** Compiled table of the restraints of a Molecule, used to compute the
+* overall restraint log-likelihood (see Molecule::GetLogLikelihood()).
+*
+* Bonds, bond angles and dihedral angles are stored with the indices of their
+* atoms in flat coordinate arrays, with their ideal value, delta and sigma. The
+* log-likelihood of each restraint is kept between evaluations, and only the
+* restraints involving an atom which has moved (or for which a parameter
+* has changed) are re-computed. Other types of restraints are re-computed
+* at each evaluation.
+*
+* The sum is made in the order of the restraints, so that the result is
+* identical to the sum of the individual Restraint::GetLogLikelihood().
+*/
+struct MolRestraintTable
+{
+   MolRestraintTable();
+   /** Build the table.
+   * \param vpAtom: the list of atoms of the Molecule
+   * \param vpRestraint: the list of all restraints
+   */
+   void Build(const std::vector<MolAtom*> &vpAtom,const std::vector<Restraint*> &vpRestraint);
+   /// Compute the sum of the log-likelihood of all restraints
+   REAL GetLogLikelihood();
+   /// Number of restraints in the table
+   unsigned long GetNbRestraint()const;
+   /// All atoms
+   std::vector<const MolAtom*> mvpAtom;
+   /// Coordinates of the atoms, at the last evaluation
+   std::vector<REAL> mX,mY,mZ;
+   /// For each atom, the list of restraints (index in mvpRestraint) involving
+   /// this atom is mvAtomRestraint[mvAtomRestraintBegin[i]...mvAtomRestraintBegin[i+1]-1]
+   std::vector<unsigned long> mvAtomRestraintBegin,mvAtomRestraint;
+   /// All restraints
+   std::vector<const Restraint*> mvpRestraint;
+   /// Log-likelihood of each restraint, at the last evaluation
+   std::vector<REAL> mvLLK;
+   /// Restraints which need to be re-computed
+   std::vector<bool> mvNeedRecalc;
+   /// Bond, bond angle and dihedral angle restraints
+   std::vector<const MolBond*> mvpBond;
+   std::vector<const MolBondAngle*> mvpBondAngle;
+   std::vector<const MolDihedralAngle*> mvpDihedralAngle;
+   /// Index in mvpRestraint of each bond, bond angle and dihedral angle
+   std::vector<unsigned long> mvBondIndex,mvBondAngleIndex,mvDihedralAngleIndex;
+   /// Indices of the atoms of each bond (2 per bond), bond angle (3) and dihedral angle (4)
+   std::vector<unsigned long> mvBondAtom,mvBondAngleAtom,mvDihedralAngleAtom;
+   /// Restraint parameters (ideal value, delta, sigma) for each restraint, at the last evaluation
+   std::vector<REAL> mvBondPar,mvBondAnglePar,mvDihedralAnglePar;
+   /// Index in mvpRestraint of other types of restraints
+   std::vector<unsigned long> mvOtherIndex;
+};
+
 /** Groups of atoms that can be moved using molecular dynamics
 * principles, taking a list of restraints as ptential.
 * This is used to move group of atoms for which no adequate stretch mode
@@ -728,6 +825,8 @@ struct MDAtomGroup
    std::vector<MolBond*> mvpBond;
    std::vector<MolBondAngle*> mvpBondAngle;
    std::vector<MolDihedralAngle*> mvpDihedralAngle;
+   /// Compiled atoms & restraints, for MolecularDynamicsEvolve()
+   MDTopology mTopology;
 };
 
 /** Light-weight representation of an atom in the molecule, as a part of a Z-matrix.
@@ -742,6 +841,24 @@ struct MolZAtom
    REAL mBondLength,mBondAngle,mDihedralAngle;
 };
 
+/** Directory used to cache the topology of molecules (rings, flip groups, stretch modes
+* and their tuned amplitudes), see Molecule::SaveTopology() and Molecule::LoadTopology().
+*
+* If not empty, Molecule::BeginOptimization() looks in this directory for a file
+* matching the Molecule::GetTopologyHash() of the molecule before building the
+* stretch modes, and saves the topology there after building them. This is empty
+* (no cache) by default.
+*
+* The same directory can be shared by several threads or processes: an exclusive
+* lock (flock() on a "<cache file>.lock" file) is held while a cache file is
+* read or built, so that a given topology is only built once, and the cache files
+* are written to a temporary file and then renamed, so that a partially written
+* file is never read.
+*/
+void SetMoleculeTopologyCacheDir(const std::string &dir);
+/// Directory used to cache the topology of molecules, see SetMoleculeTopologyCacheDir()
+std::string GetMoleculeTopologyCacheDir();
+
 /** Molecule : class for complex scatterer descriptions using
 * cartesian coordinates with bond length/angle restraints, and
 * moves either of individual atoms or using torsion bonds.
@@ -1073,6 +1190,25 @@ class Molecule: public Scatterer
        * deleted.
       */
       void SetDeleteSubObjInDestructor(const bool b);
+      /** Hash of the Molecule topology: atoms, restraints (with their ideal values
+      * and sigmas), rigid groups and flexibility model. Two molecules with the same hash
+      * have the same stretch modes, so this is used as a key to cache them.
+      */
+      unsigned long long GetTopologyHash()const;
+      /** Save the topology derived from the restraints: rings, flip groups, bond length,
+      * bond angle and torsion stretch modes, with the restraints they break and their
+      * tuned amplitudes, and the global rotation amplitude.
+      *
+      * Atoms and restraints are saved as their index in the Molecule lists, so the
+      * topology can only be loaded in a Molecule with the same GetTopologyHash().
+      */
+      void SaveTopology(ostream &os)const;
+      /** Load the topology saved by SaveTopology(), instead of building it.
+      *
+      * \return false (and nothing is changed) if the stream is not a topology
+      * matching this Molecule's GetTopologyHash().
+      */
+      bool LoadTopology(istream &is);
    public:
       virtual void InitRefParList();
       /** Build the list of rings in the molecule.
@@ -1393,6 +1529,10 @@ class Molecule: public Scatterer
 
    /// The current log(likelihood)
    mutable REAL mLogLikelihood;
+   /// Compiled restraints, used to compute the log(likelihood)
+   mutable MolRestraintTable mRestraintTable;
+   /// Last time the restraint table was built
+   mutable RefinableObjClock mClockRestraintTable;
    /** Scale (multiplier) for the log(likelihood)
    *
    * Changing this scale is equivalent to changing the sigma values of all bonds,
@@ -22,6 +22,7 @@
 */
 
 #include <cstdlib>
+#include <algorithm>
 
 #include <typeinfo>
 #include <stdio.h> //for sprintf()
@@ -44,6 +45,16 @@
 #include <fstream>
 #include <iomanip>
 #include <sstream>
+#include <thread>
+#include <cstring>
+#include <mutex>
+#include <cerrno>
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#endif
 
 #ifdef _MSC_VER // MS VC++ predefined macros....
 #undef min
@@ -126,7 +137,7 @@ void CylinderAbsCorr::CalcCorr() const
 //
 ////////////////////////////////////////////////////////////////////////
 ObjRegistry<PowderPatternComponent>
-   gPowderPatternComponentRegistry("List of all PowderPattern Components");
+   gPowderPatternComponentRegistry("List of all PowderPattern Components",true);
 
 PowderPatternComponent::PowderPatternComponent():
 mIsScalable(false),mpParentPowderPattern(0)
@@ -257,6 +268,7 @@ mMaxSinThetaOvLambda(10),mModelVariance(0)
 }
 
 PowderPatternBackground::PowderPatternBackground(const  PowderPatternBackground &old):
+PowderPatternComponent(old),
 mBackgroundNbPoint(old.mBackgroundNbPoint),
 mBackgroundInterpPointX(old.mBackgroundInterpPointX),
 mBackgroundInterpPointIntensity(old.mBackgroundInterpPointIntensity),
@@ -265,6 +277,11 @@ mMaxSinThetaOvLambda(10),mModelVariance(0)
    mClockMaster.AddChild(mClockBackgroundPoint);
    this->InitOptions();
    mInterpolationModel.SetChoice(old.mInterpolationModel.GetChoice());
+   if(mBackgroundNbPoint>0)
+   {
+      this->InitRefParList();
+      for(long i=0;i<this->GetNbPar();i++) this->GetPar(i).CopyAttributes(old.GetPar(i));
+   }
 }
 
 PowderPatternBackground::~PowderPatternBackground(){}
@@ -427,14 +444,13 @@ void PowderPatternBackground::TagNewBestConfig()const
 {
 }
 
-void PowderPatternBackground::OptimizeBayesianBackground()
+void PowderPatternBackground::OptimizeBayesianBackground(const unsigned int nbThread)
 {
    VFN_DEBUG_ENTRY("PowderPatternBackground::OptimizeBayesianBackground()",5);
    TAU_PROFILE("PowderPatternBackground::OptimizeBayesianBackground()","void ()",TAU_DEFAULT);
    PowderPatternBackgroundBayesianMinimiser min(*this);
    SimplexObj simplex("Simplex Test");
    simplex.AddRefinableObj(min);
-
    long nbcycle;
    REAL llk=simplex.GetLogLikelihood();
    long ct=0;
@@ -448,8 +464,28 @@ void PowderPatternBackground::OptimizeBayesianBackground()
               (int)ct,(float)llk);
       (*fpObjCrystInformUser)((string)buf);
    }
+   // Workers for the parallel simplex, each with a copy of this background
+   // (created after the global optimization step has been changed)
+   unsigned int nbWorker= nbThread==0 ? thread::hardware_concurrency() : nbThread;
+   nbWorker= nbWorker>1 ? nbWorker-1 : 0;
+   vector<PowderPatternBackgroundBayesianMinimiser*> vpWorkerMin;
+   vector<SimplexObj*> vpWorker;
+   for(unsigned int i=0;i<nbWorker;i++)
+   {
+      vpWorkerMin.push_back(new PowderPatternBackgroundBayesianMinimiser(min));
+      vpWorker.push_back(new SimplexObj("Simplex Test worker"));
+      vpWorker.back()->AddRefinableObj(*(vpWorkerMin.back()));
+      simplex.AddWorker(*(vpWorker.back()));
+   }
    nbcycle=500*mBackgroundNbPoint;
-   simplex.Optimize(nbcycle,false);
+   try {simplex.Optimize(nbcycle,false);}
+   catch(...)
+   {
+      for(unsigned int i=0;i<nbWorker;i++) {delete vpWorker[i];delete vpWorkerMin[i];}
+      throw;
+   }
+   simplex.ClearWorkers();
+   for(unsigned int i=0;i<nbWorker;i++) {delete vpWorker[i];delete vpWorkerMin[i];}
    llk=simplex.GetLogLikelihood();
    cout<<ct<<", Chi^2(BayesianBackground)="<<llk<<endl;
 
@@ -728,6 +764,8 @@ void PowderPatternBackground::InitOptions()
    static string InterpolationModelChoices[2];
 
    static bool needInitNames=true;
+   static mutex needInitNamesMutex;
+   lock_guard<mutex> needInitNamesLock(needInitNamesMutex);
    if(true==needInitNames)
    {
       InterpolationModelName="Interpolation Model";
@@ -791,7 +829,7 @@ WXCrystObjBasic* PowderPatternBackground::WXCreate(wxWindow* parent)
 //
 ////////////////////////////////////////////////////////////////////////
 PowderPatternDiffraction::PowderPatternDiffraction():
-mpReflectionProfile(0),
+mNbPointUsedProfileCalc(0),mpReflectionProfile(0),
 mCorrLorentz(*this),mCorrPolar(*this),mCorrSlitAperture(*this),
 mCorrTextureMarchDollase(*this),mCorrTextureEllipsoid(*this),mCorrTOF(*this),mCorrCylAbs(*this),mExtractionMode(false),
 mpLeBailData(0),mFrozenLatticePar(6),mFreezeLatticePar(false),mFrozenBMatrix(3,3),mGenHKLBMatrix(3,3)
@@ -812,7 +850,7 @@ mpLeBailData(0),mFrozenLatticePar(6),mFreezeLatticePar(false),mFrozenBMatrix(3,3
 }
 
 PowderPatternDiffraction::PowderPatternDiffraction(const PowderPatternDiffraction &old):
-mpReflectionProfile(0),
+mNbPointUsedProfileCalc(0),mpReflectionProfile(0),
 mCorrLorentz(*this),mCorrPolar(*this),mCorrSlitAperture(*this),
 mCorrTextureMarchDollase(*this),mCorrTextureEllipsoid(*this),mCorrTOF(*this),mCorrCylAbs(*this),mExtractionMode(false),
 mpLeBailData(0),mFrozenLatticePar(6),mFreezeLatticePar(old.FreezeLatticePar()),mFrozenBMatrix(3,3),mGenHKLBMatrix(3,3)
@@ -1122,7 +1160,8 @@ void PowderPatternDiffraction::SetExtractionMode(const bool extract,const bool i
 
 bool PowderPatternDiffraction::GetExtractionMode()const{return mExtractionMode;}
 
-void PowderPatternDiffraction::ExtractLeBail(unsigned int nbcycle)
+void PowderPatternDiffraction::ExtractLeBail(unsigned int nbcycle,const REAL convergence,
+                                             unsigned int nbthread)
 {
    VFN_DEBUG_ENTRY("PowderPatternDiffraction::ExtractLeBail()",7)
    TAU_PROFILE("PowderPatternDiffraction::ExtractLeBail()","void (int)",TAU_DEFAULT);
@@ -1148,39 +1187,42 @@ void PowderPatternDiffraction::ExtractLeBail(unsigned int nbcycle)
    // actually more reflections are calculated, but the pattern is only calculated up to
    // max(sin(theta)/lambda).
    const unsigned long nbrefl=this->ScatteringData::GetNbReflBelowMaxSinThetaOvLambda();
+   if(nbthread==0) nbthread=thread::hardware_concurrency();
+   if(nbthread>nbrefl/256+1) nbthread=nbrefl/256+1;// Not worth it for small blocks
+   if(nbthread==0) nbthread=1;
    iextract=0;
+   // Only read once, not from the worker threads
+   const long nbPointUsed=mpParentPowderPattern->GetNbPointUsed();
+   // Ratio of the observed and calculated pattern for each point, allocated once for all cycles
+   CrystVector_REAL ratio(obs.numElements()),previous;
    for(;nbcycle>0;nbcycle--)
    {
       //cout<<"PowderPatternDiffraction::ExtractLeBail(): cycle #"<<nbcycle<<endl;
+      // The reflection profiles are only computed once, only the pattern is re-computed
       calc=this->GetPowderPatternCalc();
-      for(unsigned int k0=0;k0<nbrefl;++k0)
-      {
-         if(mvReflProfile[k0].profile.numElements()==0) continue; // May happen for reflections near limits ?
-         REAL s1=0;
-         //cout<<mH(k0)<<" "<<mK(k0)<<" "<<mL(k0)<<" , Iobs=??"<<endl;
-         long last=mvReflProfile[k0].last,first;
-         if(last>=(long)(mpParentPowderPattern->GetNbPointUsed())) last=mpParentPowderPattern->GetNbPointUsed();
-         if(mvReflProfile[k0].first<0)first=0;
-         else first=(mvReflProfile[k0].first);
-         const REAL *p1=mvReflProfile[k0].profile.data()+(first-mvReflProfile[k0].first);
-         const REAL *p2=calc.data()+first;
-         const REAL *pobs=obs.data()+first;
-         for(long i=first;i<=last;++i)
+      {
+         const REAL *pobs=obs.data();
+         const REAL *pcalc=calc.data();
+         REAL *pr=ratio.data();
+         for(long i=ratio.numElements();i>0;i--)
          {
-            const REAL s2=*p2++;
-            const REAL tmp=*pobs++ * *p1++;
-            if( (s2<1e-8) ) // || (tmp<=0)
-            {// Avoid <0 intensities (should not happen, it means profile is <0)
-               //cout<<"S2? "<< int(mH(k0))<<" "<<int(mK(k0))<<" "<<int(mL(k0)) <<" calc(i="<<i<<")"<<calc(i)<<" obs(i="<<i<<")="<<obs(i)<<", tmp="<<tmp<<" profile(i)="<<mvReflProfile[k0].profile(i-mvReflProfile[k0].first)<<" "<<mFhklObsSq(k0)<<endl;
-               continue ;
-            }
-            s1 += tmp /s2;
-            //cout<<"   "<<s2<<" "<<obs(i)<<" "<<mvReflProfile[k0].profile(i-mvReflProfile[k0].first)<<" "<<mFhklObsSq(k0)<<endl;
+            // Avoid <0 intensities (should not happen, it means profile is <0)
+            *pr++ = (*pcalc<1e-8) ? 0 : *pobs / *pcalc;
+            pobs++;pcalc++;
          }
-         if((s1>1e-8)&&(!ISNAN_OR_INF(s1))) iextract(k0)=s1*mFhklObsSq(k0);
-         else iextract(k0)=1e-8;//:KLUDGE: should <0 intensities be allowed ?
-         //if(nbcycle==1) cout<<" Le Bail "<<int(mH(k0))<<" "<<int(mK(k0))<<" "<<int(mL(k0))<<" , Iobs="<<iextract(k0)<<endl;
       }
+      if(nbthread>1)
+      {
+         vector<thread> vThread;
+         const unsigned long nbBlock=(nbrefl+nbthread-1)/nbthread;
+         for(unsigned long k0=0;k0<nbrefl;k0+=nbBlock)
+            vThread.push_back(ObjRegistryIsolation::StartThread(&PowderPatternDiffraction::CalcLeBailPartition,
+                                                                this,cref(ratio),ref(iextract),nbPointUsed,
+                                                                k0,min(k0+nbBlock,nbrefl)));
+         for(vector<thread>::iterator pos=vThread.begin();pos!=vThread.end();++pos) pos->join();
+      }
+      else this->CalcLeBailPartition(ratio,iextract,nbPointUsed,0,nbrefl);
+      if(convergence>0) previous=mFhklObsSq;
       mFhklObsSq=iextract;
       if(this->GetCrystal().GetScatteringComponentList().GetNbComponent()>0)
       {// Change scale factor if we have some atoms in the structure
@@ -1199,6 +1241,19 @@ void PowderPatternDiffraction::ExtractLeBail(unsigned int nbcycle)
       mClockFhklObsSq.Click();
       //cout<<"PowderPatternDiffraction::ExtractLeBail():results (scale factor="<<mpParentPowderPattern->GetScaleFactor(*this)*1e6<<")" <<endl<< FormatVertVectorHKLFloats<REAL>(mH,mK,mL,this->GetFhklCalcSq(),mFhklObsSq,10,4,nbrefl)<<endl;
       mClockIhklCalc.Reset(); // During Le Bail
+      if(convergence>0)
+      {// Relative change of the extracted intensities
+         REAL diff=0,sum=0;
+         const REAL* p1=mFhklObsSq.data();
+         const REAL* p2=previous.data();
+         for(long i=nbrefl;i>0;i--)
+         {
+            diff+=abs(*p1 - *p2++);
+            sum +=abs(*p1++);
+         }
+         VFN_DEBUG_MESSAGE("PowderPatternDiffraction::ExtractLeBail(): relative change="<<diff/sum,7)
+         if(diff<=convergence*sum) break;
+      }
    }
    // Store extracted data in a single crystal data object
    if(mpLeBailData==0) mpLeBailData=new DiffractionDataSingleCrystal(*mpCrystal,false);
@@ -1218,20 +1273,42 @@ void PowderPatternDiffraction::ExtractLeBail(unsigned int nbcycle)
    }
    VFN_DEBUG_EXIT("PowderPatternDiffraction::ExtractLeBail()mFhklObsSq.size()=="<<mFhklObsSq.numElements(),7)
 }
-long PowderPatternDiffraction::GetNbReflBelowMaxSinThetaOvLambda()const
+void PowderPatternDiffraction::CalcLeBailPartition(const CrystVector_REAL &ratio,
+                                                   CrystVector_REAL &iextract,
+                                                   const long nbPointUsed,
+                                                   const unsigned long k0begin,
+                                                   const unsigned long k0end)const
 {
-   if(this->IsBeingRefined()) return mNbReflUsed;
-   VFN_DEBUG_MESSAGE("PowderPatternDiffraction::GetNbReflBelowMaxSinThetaOvLambda(): "<<mNbReflUsed<<"/"<<mNbRefl<<" [max sin(theta)/lambda="<<mMaxSinThetaOvLambda<<"]",4)
+   for(unsigned long k0=k0begin;k0<k0end;++k0)
+   {
+      if(mvReflProfile[k0].profile.numElements()==0) continue; // May happen for reflections near limits ?
+      long last=mvReflProfile[k0].last,first;
+      if(last>=nbPointUsed) last=nbPointUsed;
+      if(mvReflProfile[k0].first<0)first=0;
+      else first=(mvReflProfile[k0].first);
+      REAL s1=0;
+      if(last>=first)
+         s1=SumProduct(mvReflProfile[k0].profile.data()+(first-mvReflProfile[k0].first),
+                       ratio.data()+first,last-first+1);
+      if((s1>1e-8)&&(!ISNAN_OR_INF(s1))) iextract(k0)=s1*mFhklObsSq(k0);
+      else iextract(k0)=1e-8;//:KLUDGE: should <0 intensities be allowed ?
+      //cout<<" Le Bail "<<int(mH(k0))<<" "<<int(mK(k0))<<" "<<int(mL(k0))<<" , Iobs="<<iextract(k0)<<endl;
+   }
+}
+
+void PowderPatternDiffraction::CalcNbReflBelowMaxSinThetaOvLambda()const
+{
+   VFN_DEBUG_MESSAGE("PowderPatternDiffraction::CalcNbReflBelowMaxSinThetaOvLambda(): "<<mNbReflUsed<<"/"<<mNbRefl<<" [max sin(theta)/lambda="<<mMaxSinThetaOvLambda<<"]",4)
    this->CalcPowderReflProfile();
    const long nbpoint=mpParentPowderPattern->GetNbPointUsed();
    if((mNbReflUsed>0)&&(mNbReflUsed<mNbRefl))
    {
       if(  (mvReflProfile[mNbReflUsed  ].first>nbpoint)
-         &&(mvReflProfile[mNbReflUsed-1].first<=nbpoint)) return mNbReflUsed;
+         &&(mvReflProfile[mNbReflUsed-1].first<=nbpoint)) return;
    }
 
    if((mNbReflUsed==mNbRefl) && (mvReflProfile[mNbReflUsed-1].profile.numElements()>0))
-      if(mvReflProfile[mNbReflUsed-1].first<=nbpoint)return mNbReflUsed;
+      if(mvReflProfile[mNbReflUsed-1].first<=nbpoint)return;
 
 
    long i;
@@ -1246,7 +1323,6 @@ long PowderPatternDiffraction::GetNbReflBelowMaxSinThetaOvLambda()const
       VFN_DEBUG_MESSAGE("->Changed Max sin(theta)/lambda="<<mMaxSinThetaOvLambda\
                         <<" nb refl="<<mNbReflUsed,4)
    }
-   return mNbReflUsed;
 }
 
 void PowderPatternDiffraction::SetFrozenLatticePar(const unsigned int i, REAL v)
@@ -1758,7 +1834,8 @@ void PowderPatternDiffraction::CalcPowderReflProfile()const
       &&(mClockProfileCalc>this->GetRadiation().GetClockWavelength())
       &&(mClockProfileCalc>mpParentPowderPattern->GetClockPowderPatternXCorr())
       &&(mClockProfileCalc>mClockHKL)
-      &&(mClockProfileCalc>mpParentPowderPattern->GetClockNbPointUsed())) return;
+      &&(  (mClockProfileCalc>mpParentPowderPattern->GetClockNbPointUsed())
+         ||(mpParentPowderPattern->GetNbPointUsed()<=mNbPointUsedProfileCalc))) return;
 
    TAU_PROFILE("PowderPatternDiffraction::CalcPowderReflProfile()","void (bool)",TAU_DEFAULT);
    VFN_DEBUG_ENTRY("PowderPatternDiffraction::CalcPowderReflProfile()",5)
@@ -1811,10 +1888,10 @@ Radiation must be either monochromatic, from an X-Ray Tube, or neutron TOF !!");
 
    VFN_DEBUG_MESSAGE("PowderPatternDiffraction::CalcPowderReflProfile():\
 Computing all Profiles",5)
-   REAL center,// center of current reflection (depends on line if several)
-        x0;    // theoretical (uncorrected for zero's, etc..) position of center of line
+   REAL x0;    // theoretical (uncorrected for zero's, etc..) position of center of line
    long first,last;// first & last point of the stored profile
-   CrystVector_REAL vx,reflProfile,tmpV;
+   CrystVector_REAL vx;
+   CrystVector_REAL vCenter(nbLine);// center of each line for the current reflection
    mvReflProfile.resize(this->GetNbRefl());
    for(unsigned int i=0;i<this->GetNbRefl();i++)
    {
@@ -1824,101 +1901,82 @@ Computing all Profiles",5)
    }
    VFN_DEBUG_MESSAGE("PowderPatternDiffraction::CalcPowderReflProfile()",5)
 
-   for(unsigned int line=0;line<nbLine;line++)
-   {
-      for(long i=0;i<this->GetNbRefl();i++)
-      {// Only the reflections contributing below the max(sin(theta)/lambda) will be computed
-         VFN_DEBUG_ENTRY("PowderPatternDiffraction::CalcPowderReflProfile()#"<<i,5)
-         x0=mpParentPowderPattern->STOL2X(mSinThetaLambda(i));
-
-         VFN_DEBUG_MESSAGE("PowderPatternDiffraction::CalcPowderReflProfile()#"<<i,5)
-         if(nbLine>1)
-         {// we have several lines, not centered on the profile range
-            center = mpParentPowderPattern->X2XCorr(
-                        x0+2*tan(x0/2.0)*spectrumDeltaLambdaOvLambda(line));
-         }
-         else center=mpParentPowderPattern->X2XCorr(x0);
-         REAL fact=1.0;
-         if(!mUseFastLessPreciseFunc) fact=5.0;
-         const REAL halfwidth=mpReflectionProfile->GetFullProfileWidth(0.04,center,mH(i),mK(i),mL(i))*fact;
-         if(line==0)
-         {
-            // For an X-Ray tube, label on first (strongest) of reflections lines (Kalpha1)
-            label.str("");
-            label<<mIntH(i)<<" "<<mIntK(i)<<" "<<mIntL(i);
-            mvLabel.push_back(make_pair(center,label.str()));
-            REAL spectrumwidth=0.0;
-            if(this->GetRadiation().GetWavelengthType()==WAVELENGTH_ALPHA12)
-            {// We need to shift the last point to include 2 lines in the profile
-               spectrumwidth=2*this->GetRadiation().GetXRayTubeDeltaLambda()
-                              /this->GetRadiation().GetWavelength()(0)*tan(x0/2.0);
-            }
-            first=(long)(mpParentPowderPattern->X2Pixel(center-halfwidth));
-            last =(long)(mpParentPowderPattern->X2Pixel(center+halfwidth+spectrumwidth));
-            if(this->GetRadiation().GetWavelengthType()==WAVELENGTH_TOF)
-            {
-               const long f=first;
-               first=last;
-               last=f;
-            }
-            if(first>last)
-            { // Whoops - should not happen !! Unless there is a strange (dis)order for the x coordinates...
-               cout<<"PowderPatternDiffraction::CalcPowderReflProfile(), line"<<__LINE__<<"first>last !! :"<<first<<","<<last<<endl;
-               first=(first+last)/2;
-               last=first;
-            }
-            first -=1;
-            last+=1;
-            VFN_DEBUG_MESSAGE("PowderPatternDiffraction::CalcPowderReflProfile():"<<first<<","<<last<<","<<center,3)
-            if(first>last)
-            {
-               cout<<__FILE__<<__LINE__<<endl;
-               exit(0);
-            }
-            if((last>=0)&&(first<(long)(mpParentPowderPattern->GetNbPoint())))
-            {
-               if(first<0) first=0;
-               if(last>=(long)(mpParentPowderPattern->GetNbPoint()))
-                  last=mpParentPowderPattern->GetNbPoint()-1;
-               vx.resize(last-first+1);
-            }
-            else vx.resize(0); // store no profile if reflection out of pattern
-            mvReflProfile[i].first=first;
-            mvReflProfile[i].last=last;
-         }
-         else
-         {
-            first=mvReflProfile[i].first;
-            last=mvReflProfile[i].last;
-            if((last>=0)&&(first<(long)(mpParentPowderPattern->GetNbPoint())))
-               vx.resize(last-first+1);
-            else vx.resize(0);
-            vx.resize(last-first+1);
-         }
-         if((last>=0)&&(first<(long)(mpParentPowderPattern->GetNbPoint())))
+   // All lines of the spectrum are computed in one pass for each reflection,
+   // sharing the profile window and the profile parameters (width, mixing, asymmetry)
+   // of the first (strongest) line (Kalpha1 for an X-Ray tube).
+   for(long i=0;i<this->GetNbRefl();i++)
+   {// Only the reflections contributing below the max(sin(theta)/lambda) will be computed
+      VFN_DEBUG_ENTRY("PowderPatternDiffraction::CalcPowderReflProfile()#"<<i,5)
+      x0=mpParentPowderPattern->STOL2X(mSinThetaLambda(i));
+      if(nbLine>1)
+      {// we have several lines, not centered on the profile range
+         for(unsigned int line=0;line<nbLine;line++)
+            vCenter(line) = mpParentPowderPattern->X2XCorr(
+                              x0+2*tan(x0/2.0)*spectrumDeltaLambdaOvLambda(line));
+      }
+      else vCenter(0)=mpParentPowderPattern->X2XCorr(x0);
+      const REAL center=vCenter(0);
+      REAL fact=1.0;
+      if(!mUseFastLessPreciseFunc) fact=5.0;
+      const REAL halfwidth=mpReflectionProfile->GetFullProfileWidth(0.04,center,mH(i),mK(i),mL(i))*fact;
+      // For an X-Ray tube, label on first (strongest) of reflections lines (Kalpha1)
+      label.str("");
+      label<<mIntH(i)<<" "<<mIntK(i)<<" "<<mIntL(i);
+      mvLabel.push_back(make_pair(center,label.str()));
+      REAL spectrumwidth=0.0;
+      if(this->GetRadiation().GetWavelengthType()==WAVELENGTH_ALPHA12)
+      {// We need to shift the last point to include 2 lines in the profile
+         spectrumwidth=2*this->GetRadiation().GetXRayTubeDeltaLambda()
+                        /this->GetRadiation().GetWavelength()(0)*tan(x0/2.0);
+      }
+      first=(long)(mpParentPowderPattern->X2Pixel(center-halfwidth));
+      last =(long)(mpParentPowderPattern->X2Pixel(center+halfwidth+spectrumwidth));
+      if(this->GetRadiation().GetWavelengthType()==WAVELENGTH_TOF)
+      {
+         const long f=first;
+         first=last;
+         last=f;
+      }
+      if(first>last)
+      { // Whoops - should not happen !! Unless there is a strange (dis)order for the x coordinates...
+         cout<<"PowderPatternDiffraction::CalcPowderReflProfile(), line"<<__LINE__<<"first>last !! :"<<first<<","<<last<<endl;
+         first=(first+last)/2;
+         last=first;
+      }
+      first -=1;
+      last+=1;
+      VFN_DEBUG_MESSAGE("PowderPatternDiffraction::CalcPowderReflProfile():"<<first<<","<<last<<","<<center,3)
+      if((last>=0)&&(first<(long)(mpParentPowderPattern->GetNbPoint())))
+      {
+         if(first<0) first=0;
+         if(last>=(long)(mpParentPowderPattern->GetNbPoint()))
+            last=mpParentPowderPattern->GetNbPoint()-1;
+         mvReflProfile[i].first=first;
+         mvReflProfile[i].last=last;
+         vx.resize(last-first+1);
          {
-            {
-               const REAL *p0=mpParentPowderPattern->GetPowderPatternX().data()+first;
-               REAL *p1=vx.data();
-               for(long i=first;i<=last;i++) *p1++ = *p0++;
-            }
-
-            VFN_DEBUG_MESSAGE("PowderPatternDiffraction::CalcPowderReflProfile():"<<first<<","<<last<<","<<center,3)
-            reflProfile=mpReflectionProfile->GetProfile(vx,center,mH(i),mK(i),mL(i));
-            VFN_DEBUG_MESSAGE("PowderPatternDiffraction::CalcPowderReflProfile()",2)
-            if(nbLine>1) reflProfile *=spectrumFactor(line);
-            if(line==0) mvReflProfile[i].profile = reflProfile;
-            else mvReflProfile[i].profile += reflProfile;
+            const REAL *p0=mpParentPowderPattern->GetPowderPatternX().data()+first;
+            REAL *p1=vx.data();
+            for(long j=first;j<=last;j++) *p1++ = *p0++;
          }
+         if(nbLine>1)
+            mvReflProfile[i].profile=mpReflectionProfile->GetMultiLineProfile(vx,vCenter,spectrumFactor,
+                                                                              mH(i),mK(i),mL(i));
          else
-         { // reflection is out of pattern, so store no profile
-            mvReflProfile[i].profile.resize(0);
-         }
-         VFN_DEBUG_EXIT("PowderPatternDiffraction::CalcPowderReflProfile():\
-Computing all Profiles: Reflection #"<<i,5)
-         if(first>(long)(mpParentPowderPattern->GetNbPointUsed())) break;
+            mvReflProfile[i].profile=mpReflectionProfile->GetProfile(vx,center,mH(i),mK(i),mL(i));
+         VFN_DEBUG_MESSAGE("PowderPatternDiffraction::CalcPowderReflProfile()",2)
+      }
+      else
+      { // reflection is out of pattern, so store no profile
+         mvReflProfile[i].first=first;
+         mvReflProfile[i].last=last;
+         mvReflProfile[i].profile.resize(0);
       }
+      VFN_DEBUG_EXIT("PowderPatternDiffraction::CalcPowderReflProfile():\
+Computing all Profiles: Reflection #"<<i,5)
+      if(first>(long)(mpParentPowderPattern->GetNbPointUsed())) break;
    }
+   mNbPointUsedProfileCalc=mpParentPowderPattern->GetNbPointUsed();
    mClockProfileCalc.Click();
    VFN_DEBUG_EXIT("PowderPatternDiffraction::CalcPowderReflProfile()",5)
 }
@@ -2250,7 +2308,7 @@ void PowderPatternDiffraction::CalcIhkl() const
                                                    mExpectedIntensityFactor,
                                                    mIntensityCorr,
                                                    mMultiplicity,
-                                                   mvLuzzatiFactor[&(mpCrystal->GetScatteringPowerRegistry().GetObj(0))],
+                                                   this->GetScattPowRow(mLuzzatiFactor,0),
                                                    mFhklCalcVariance,
                                                    mIhklCalcVariance),2);
       VFN_DEBUG_MESSAGE(mNbRefl<<" "<<mNbReflUsed,2)
@@ -2369,7 +2427,9 @@ void PowderPatternDiffraction::InitOptions()
 const CrystVector_long& PowderPatternDiffraction::GetBraggLimits()const
 {
    this->CalcPowderReflProfile();
-   if((mClockProfileCalc>mClockBraggLimits)&&(this->GetNbReflBelowMaxSinThetaOvLambda()>0))
+   const long nbRefl=this->GetNbReflBelowMaxSinThetaOvLambda();
+   if(  ((mClockProfileCalc>mClockBraggLimits)||(mClockNbReflUsed>mClockBraggLimits))
+      &&(nbRefl>0))
    {
       VFN_DEBUG_ENTRY("PowderPatternDiffraction::GetBraggLimits(*min,*max)",3)
       TAU_PROFILE("PowderPatternDiffraction::GetBraggLimits()","void ()",TAU_DEFAULT);
@@ -2440,40 +2500,31 @@ void PowderPatternDiffraction::PrepareIntegratedProfile()const
 
    const long numInterval=pMin->numElements();
 
-   vector< map<long, REAL> > vIntegratedProfileFactor;
-   vIntegratedProfileFactor.resize(mNbReflUsed);
-   vector< map<long, REAL> >::iterator pos1;
-   pos1=vIntegratedProfileFactor.begin();
-
    mIntegratedProfileFactor.resize(mNbReflUsed);
    vector< pair<unsigned long, CrystVector_REAL> >::iterator pos2;
    pos2=mIntegratedProfileFactor.begin();
    for(long i=0;i<mNbReflUsed;i++)
    {
-      pos1->clear();
-      long firstInterval=numInterval;
-      for(long j=0;j<numInterval;j++)
+      const long first0 = mvReflProfile[i].first;
+      const long last0  = mvReflProfile[i].last ;
+      // Intervals are sorted and do not overlap, so the profile covers
+      // all intervals between the first and the last point of the profile
+      const long j0=lower_bound(pMax->data(),pMax->data()+numInterval,first0)-pMax->data();
+      long j1=j0;
+      if(mvReflProfile[i].profile.size()>0)
+         while((j1<numInterval)&&((*pMin)(j1)<=last0)) j1++;
+      pos2->first= j1>j0 ? j0 : numInterval;
+      pos2->second.resize(j1-j0);
+      REAL *pFact=pos2->second.data();
+      for(long j=j0;j<j1;j++)
       {
-         const long first0 = mvReflProfile[i].first;
-         const long last0  = mvReflProfile[i].last ;
          const long first= first0>(*pMin)(j) ? first0:(*pMin)(j);
          const long last = last0 <(*pMax)(j) ? last0 :(*pMax)(j);
-         if((first<=last) && (mvReflProfile[i].profile.size()>0))
-         {
-            if(firstInterval>j) firstInterval=j;
-            if(pos1->find(j) == pos1->end()) (*pos1)[j]=0.;
-            REAL *fact = &((*pos1)[j]);//this creates the 'j' entry if necessary
-            const REAL *p2 = mvReflProfile[i].profile.data()+(first-first0);
-            //cout << i<<","<<j<<","<<first<<","<<last<<":"<<*fact<<"/"<<mNbReflUsed<<","<<mNbRefl<<endl;
-            for(long k=first;k<=last;k++) *fact += *p2++;
-         }
+         const REAL *p2 = mvReflProfile[i].profile.data()+(first-first0);
+         REAL fact=0;
+         for(long k=first;k<=last;k++) fact += *p2++;
+         *pFact++ = fact;
       }
-      pos2->first=firstInterval;
-      pos2->second.resize(pos1->size());
-      REAL *pFact=pos2->second.data();
-      for(map<long, REAL>::const_iterator pos=pos1->begin();pos!=pos1->end();++pos)
-         *pFact++ = pos->second;
-      pos1++;
       pos2++;
    }
    mClockIntegratedProfileFactor.Click();
@@ -2511,14 +2562,14 @@ WXCrystObjBasic* PowderPatternDiffraction::WXCreate(wxWindow* parent)
 //
 ////////////////////////////////////////////////////////////////////////
 ObjRegistry<PowderPattern>
-   gPowderPatternRegistry("List of all PowderPattern objects");
+   gPowderPatternRegistry("List of all PowderPattern objects",true);
 
 PowderPattern::PowderPattern():
 mIsXAscending(true),mNbPoint(0),
 mXZero(0.),m2ThetaDisplacement(0.),m2ThetaTransparency(0.),
 mDIFC(48277.14),mDIFA(-6.7),
 mScaleFactor(20),mMuR(0), mUseFastLessPreciseFunc(false),
-mStatisticsExcludeBackground(false),mMaxSinThetaOvLambda(10),mNbPointUsed(0)
+mStatisticsExcludeBackground(false),mMaxSinThetaOvLambda(10),mResolutionFactor(1),mNbPointUsed(0)
 {
    mScaleFactor=1;
    mSubObjRegistry.SetName("SubObjRegistry for a PowderPattern object");
@@ -2545,7 +2596,7 @@ mPowderPatternComponentRegistry(old.mPowderPatternComponentRegistry),
 mScaleFactor(old.mScaleFactor),mMuR(old.mMuR),
 mUseFastLessPreciseFunc(old.mUseFastLessPreciseFunc),
 mStatisticsExcludeBackground(old.mStatisticsExcludeBackground),
-mMaxSinThetaOvLambda(old.mMaxSinThetaOvLambda),mNbPointUsed(old.mNbPointUsed)
+mMaxSinThetaOvLambda(old.mMaxSinThetaOvLambda),mResolutionFactor(1),mNbPointUsed(old.mNbPointUsed)
 {
    mX=old.mX;
    this->Init();
@@ -3008,351 +3059,568 @@ REAL PowderPattern::X2Pixel(const REAL x)const
    return pixx;
 }
 
-void PowderPattern::ImportPowderPatternFullprof(const string &filename)
+namespace
 {
-   //15.000   0.030  70.000 LANI4FE#1 REC 800 4JRS
-   //2447.   2418.   2384.   2457.   2398.   2374.   2378.   2383.
-   //...
-   VFN_DEBUG_MESSAGE("PowderPattern::ImportPowderPatternFullprof() : \
-from file : "+filename,5)
-   ifstream fin(filename.c_str());
-   if(!fin)
+/** Parse a number at p the same way as istream::operator>>(double), without
+* skipping white spaces first. p is moved after the number, unless there is none.
+*
+* Most numbers found in powder pattern files have few significant digits and
+* are converted exactly with a single (correctly rounded) multiplication or
+* division. Other numbers are converted by the standard library.
+*/
+bool ParsePowderPatternReal(const char *&p,const char *end,REAL &v)
+{
+   static const double pow10[23]={1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,
+                                  1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+   const char *pos=p;
+   bool negative=false;
+   if((pos<end)&&((*pos=='-')||(*pos=='+'))) negative=(*pos++=='-');
+   unsigned long long mantissa=0;
+   int nbDigit=0;// Number of significant digits in the mantissa
+   int exponent=0;
+   bool digits=false,exact=true;
+   for(;(pos<end)&&(*pos>='0')&&(*pos<='9');++pos)
    {
-      throw ObjCrystException("PowderPattern::ImportPowderPatternFullprof() : \
-Error opening file for input:"+filename);
+      digits=true;
+      if(nbDigit<19)
+      {
+         mantissa=mantissa*10+(*pos-'0');
+         if(mantissa>0) nbDigit++;
+      }
+      else exact=false;
    }
-   REAL min,max,step;
-   fin >> min >> step >> max;
-   min  *= DEG2RAD;
-   max  *= DEG2RAD;
-   step *= DEG2RAD;
-   this->SetPowderPatternPar(min,step,(long)((max-min)/step+1.001));
-   VFN_DEBUG_MESSAGE("PowderPattern::ImportPowderPatternFullprof() :"\
-      << " 2Theta min=" << min*RAD2DEG << " 2Theta max=" << max*RAD2DEG \
-      << " NbPoints=" << mNbPoint,5)
-   mPowderPatternObs.resize (mNbPoint);
-   mPowderPatternObsSigma.resize (mNbPoint);
-   mPowderPatternWeight.resize(mNbPoint);
-
-   char tmpComment[200];
-   fin.getline(tmpComment,100);
-   //if(""==mName) mName.append(tmpComment);
-
-   for(unsigned long i=0;i<mNbPoint;i++) fin >> mPowderPatternObs(i);
-   fin.close();
-   this->SetSigmaToSqrtIobs();
-   this->SetWeightToInvSigmaSq();
-   mClockPowderPatternPar.Click();
-   this->UpdateDisplay();
+   if((pos<end)&&(*pos=='.'))
    {
-      char buf [200];
-      sprintf(buf,"Imported powder pattern: %d points, 2theta=%7.3f -> %7.3f, step=%6.3f",
-              (int)mNbPoint,min*RAD2DEG,max*RAD2DEG,step*RAD2DEG);
-      (*fpObjCrystInformUser)((string)buf);
+      ++pos;
+      for(;(pos<end)&&(*pos>='0')&&(*pos<='9');++pos)
+      {
+         digits=true;
+         if(nbDigit<19)
+         {
+            mantissa=mantissa*10+(*pos-'0');
+            if(mantissa>0) nbDigit++;
+            exponent--;
+         }
+         else exact=false;
+      }
    }
-   VFN_DEBUG_MESSAGE("PowderPattern::ImportFullProfPattern():finished:"<<mNbPoint<<" points",5)
+   if(!digits) return false;
+   if((pos<end)&&((*pos=='e')||(*pos=='E')))
+   {
+      const char *pexp=pos+1;
+      bool negativeExp=false;
+      if((pexp<end)&&((*pexp=='-')||(*pexp=='+'))) negativeExp=(*pexp++=='-');
+      if((pexp<end)&&(*pexp>='0')&&(*pexp<='9'))
+      {
+         int e=0;
+         for(;(pexp<end)&&(*pexp>='0')&&(*pexp<='9');++pexp) if(e<10000) e=e*10+(*pexp-'0');
+         exponent+= negativeExp ? -e : e;
+         pos=pexp;
+      }
+   }
+   if(exact&&(mantissa<=(1ULL<<53))&&(exponent>=-22)&&(exponent<=22))
+   {
+      double d=(double)mantissa;
+      if(exponent<0) d/=pow10[-exponent];
+      else d*=pow10[exponent];
+      v=(REAL)(negative ? -d : d);
+   }
+   else
+   {
+      istringstream is(string(p,pos));
+      is.imbue(locale::classic());
+      double d=0;
+      is>>d;
+      v=(REAL)d;
+   }
+   p=pos;
+   return true;
 }
 
-void PowderPattern::ImportPowderPatternPSI_DMC(const string &filename)
+/// Read a number from a fixed-width field (e.g. in GSAS records), or 0 if there is none
+REAL ReadFixedWidthReal(const char *line,const size_t lineLength,const size_t start,const size_t width)
 {
-   VFN_DEBUG_MESSAGE("PowderPattern::ImportPowderPatternPSI_DMC() : \
-from file : "+filename,5)
-   ifstream fin(filename.c_str());
-   if(!fin)
-   {
-      throw ObjCrystException("PowderPattern::ImportPowderPatternPSI_DMC() : \
-Error opening file for input:"+filename);
-   }
-   //Skip the first two lines
-      char tmpComment[200];
-      fin.getline(tmpComment,190);
-      fin.getline(tmpComment,190);
-   REAL min,max,step;
-   fin >> min >> step >> max;
-   min  *= DEG2RAD;
-   max  *= DEG2RAD;
-   step *= DEG2RAD;
-   this->SetPowderPatternPar(min,step,(unsigned long)((max-min)/step+1.001));
-   VFN_DEBUG_MESSAGE("PowderPattern::ImportPowderPatternPSI_DMC() :"\
-      << " 2Theta min=" << min*RAD2DEG << " 2Theta max=" << max*RAD2DEG \
-      << " NbPoints=" << mNbPoint,5)
-   mPowderPatternObs.resize (mNbPoint);
-   mPowderPatternObsSigma.resize (mNbPoint);
-   mPowderPatternWeight.resize(mNbPoint);
+   if(start>=lineLength) return 0;
+   const char *p=line+start;
+   const char *end=line+(start+width<lineLength ? start+width : lineLength);
+   while((p<end)&&isspace((unsigned char)*p)) p++;
+   REAL v=0;
+   if(!ParsePowderPatternReal(p,end,v)) return 0;
+   return v;
+}
 
-   fin.getline(tmpComment,100);
-   //if(""==mName) mName.append(tmpComment);
+/** Read-only access to a whole text file, read at once into memory, with
+* a few functions to read it like an istream.
+*
+* The file is not memory-mapped, so that a file which is truncated or rewritten
+* while it is read (e.g. during an in-situ acquisition) does not crash the program.
+*/
+class PowderPatternFileBuffer
+{
+   public:
+      PowderPatternFileBuffer(const string &filename);
+      /// Was the file opened ?
+      bool IsOpen()const;
+      /// Skip white spaces and read a number. Returns false (and does not move) if there is none.
+      bool ReadReal(REAL &v);
+      /// Skip white spaces and read a word
+      bool ReadWord(string &word);
+      /// Go to the beginning of the next line
+      void SkipLine();
+      /// Number of words (separated by white spaces) from the current position to the end
+      unsigned long GetNbWord()const;
+   private:
+      void SkipSpace();
+      const char *mpBegin,*mpEnd,*mpPos;
+      /// The file contents
+      string mData;
+      bool mIsOpen;
+};
 
-   for(unsigned long i=0;i<mNbPoint;i++) fin >> mPowderPatternObs(i);
-   for(unsigned long i=0;i<mNbPoint;i++) fin >> mPowderPatternObsSigma(i);
-   fin.close();
-   this->SetWeightToInvSigmaSq();
-   mClockPowderPatternPar.Click();
-   this->UpdateDisplay();
+PowderPatternFileBuffer::PowderPatternFileBuffer(const string &filename):
+mpBegin(0),mpEnd(0),mpPos(0),mIsOpen(false)
+{
+   bool ok=false;
+   #ifndef _WIN32
+   // Regular file: a single read() of the size given by fstat()
+   const int fd=open(filename.c_str(),O_RDONLY);
+   if(fd<0) return;
+   struct stat st;
+   if((fstat(fd,&st)==0)&&S_ISREG(st.st_mode))
    {
-      char buf [200];
-      sprintf(buf,"Imported powder pattern: %d points, 2theta=%7.3f -> %7.3f, step=%6.3f",
-              (int)mNbPoint,min*RAD2DEG,max*RAD2DEG,step*RAD2DEG);
-      (*fpObjCrystInformUser)((string)buf);
+      mData.resize(st.st_size);
+      size_t nb=0;
+      while(nb<mData.size())
+      {
+         const ssize_t n=read(fd,&mData[nb],mData.size()-nb);
+         if((n<0)&&(errno==EINTR)) continue;
+         if(n<=0) break;// The file was truncated since fstat(): keep what was read
+         nb+=n;
+      }
+      mData.resize(nb);
+      ok=true;
    }
-   VFN_DEBUG_MESSAGE("PowderPattern::ImportPowderPatternPSI_DMC():finished",5)
+   close(fd);
+   #endif
+   if(!ok)
+   {// Special file, or no POSIX read(): use a stream
+      ifstream fin(filename.c_str(),ios::in|ios::binary);
+      if(!fin) return;
+      mData.assign(istreambuf_iterator<char>(fin),istreambuf_iterator<char>());
+   }
+   mpBegin=mData.data();
+   mpEnd=mpBegin+mData.size();
+   mpPos=mpBegin;
+   mIsOpen=true;
 }
 
-void PowderPattern::ImportPowderPatternILL_D1A5(const string &filename)
+bool PowderPatternFileBuffer::IsOpen()const{return mIsOpen;}
+
+void PowderPatternFileBuffer::SkipSpace()
 {
-   VFN_DEBUG_MESSAGE("PowderPattern::ImportPowderPatternILL_D1AD2B() : \
-from file : "+filename,5)
-   ifstream fin(filename.c_str());
-   if(!fin)
-   {
-      throw ObjCrystException("PowderPattern::ImportPowderPatternILL_D1AD2B() : \
-Error opening file for input:"+filename);
-   }
-   //Skip the first three lines
-      char tmpComment[200];
-      fin.getline(tmpComment,190);
-      fin.getline(tmpComment,190);
-      fin.getline(tmpComment,190);
+   while((mpPos<mpEnd)&&isspace((unsigned char)*mpPos)) mpPos++;
+}
 
-   fin >> mNbPoint;
-   fin.getline(tmpComment,190);
-   REAL min,step;
-   fin >> min >> step;
-   min  *= DEG2RAD;
-   step *= DEG2RAD;
-   this->SetPowderPatternPar(min,step,mNbPoint);
-   VFN_DEBUG_MESSAGE("PowderPattern::ImportPowderPatternILL_D1AD2B() :"\
-      << " 2Theta min=" << min*RAD2DEG << " 2Theta max=" << min*RAD2DEG+mNbPoint*step*RAD2DEG \
-      << " NbPoints=" << mNbPoint,5)
-   mPowderPatternObs.resize (mNbPoint);
-   mPowderPatternObsSigma.resize (mNbPoint);
-   mPowderPatternWeight.resize(mNbPoint);
+bool PowderPatternFileBuffer::ReadReal(REAL &v)
+{
+   this->SkipSpace();
+   return ParsePowderPatternReal(mpPos,mpEnd,v);
+}
 
-   //if(""==mName) mName.append(tmpComment);
+bool PowderPatternFileBuffer::ReadWord(string &word)
+{
+   this->SkipSpace();
+   const char *p=mpPos;
+   while((mpPos<mpEnd)&&!isspace((unsigned char)*mpPos)) mpPos++;
+   word.assign(p,mpPos);
+   return mpPos>p;
+}
 
-   for(unsigned long i=0;i<mNbPoint;i++) fin >> mPowderPatternObs(i);
-   for(unsigned long i=0;i<mNbPoint;i++) fin >> mPowderPatternObsSigma(i);
-   fin.close();
-   this->SetWeightToInvSigmaSq();
-   mClockPowderPatternPar.Click();
-   this->UpdateDisplay();
-   {
-      char buf [200];
-      sprintf(buf,"Imported powder pattern: %d points, 2theta=%7.3f -> %7.3f, step=%6.3f",
-              (int)mNbPoint,min*RAD2DEG,(min+step*(mNbPoint-1))*RAD2DEG,
-              step*RAD2DEG);
-      (*fpObjCrystInformUser)((string)buf);
-   }
-   VFN_DEBUG_MESSAGE("PowderPattern::ImportPowderPatternILL_D1AD2B():finished",5)
+void PowderPatternFileBuffer::SkipLine()
+{
+   while((mpPos<mpEnd)&&(*mpPos!='\n')) mpPos++;
+   if(mpPos<mpEnd) mpPos++;
 }
 
-void PowderPattern::ImportPowderPatternXdd(const string &filename)
+unsigned long PowderPatternFileBuffer::GetNbWord()const
 {
-   VFN_DEBUG_MESSAGE("PowderPattern::ImportPowderPatternXdd():from file :" \
-                           +filename,5)
-   ifstream fin (filename.c_str());
-   if(!fin)
+   unsigned long nb=0;
+   bool inWord=false;
+   for(const char *p=mpPos;p<mpEnd;p++)
    {
-      throw ObjCrystException("PowderPattern::ImportPowderPatternXdd() : \
-Error opening file for input:"+filename);
+      const bool space=isspace((unsigned char)*p);
+      if((!space)&&(!inWord)) nb++;
+      inWord=!space;
    }
-   char tmpComment[200];
-   fin.getline(tmpComment,100);
-   //if(""==mName) mName.append(tmpComment);
-   REAL min,max,step,tmp;
-   fin >> min >> step >> max;
-   min  *= DEG2RAD;
-   max *= DEG2RAD;
-   step *= DEG2RAD;
-   this->SetPowderPatternPar(min,step,(long)((max-min)/step+1.001));
-   mPowderPatternObs.resize (mNbPoint);
-   mPowderPatternObsSigma.resize(mNbPoint);
-   mPowderPatternCalc.resize(mNbPoint);
-   mPowderPatternWeight.resize(mNbPoint);
-   mPowderPatternWeight=1.;
+   return nb;
+}
+}//namespace
+
+string PowderPattern::ParseImportFile(const string &filename,const PowderPatternFileFormat format,
+                                      const int nbSkip,ImportData &data)
+{
+   static const char *functionName[]={"PowderPattern::ImportPowderPatternFullprof()",
+                                      "PowderPattern::ImportPowderPatternPSI_DMC()",
+                                      "PowderPattern::ImportPowderPatternILL_D1A5()",
+                                      "PowderPattern::ImportPowderPatternXdd()",
+                                      "PowderPattern::ImportPowderPatternSietronicsCPI()",
+                                      "PowderPattern::ImportPowderPattern2ThetaObsSigma()",
+                                      "PowderPattern::ImportPowderPattern2ThetaObs()",
+                                      "PowderPattern::ImportPowderPatternTOF_ISIS_XYSigma()"};
+   const string function=functionName[format];
+   PowderPatternFileBuffer fin(filename);
+   if(!fin.IsOpen()) return function+" : Error opening file for input:"+filename;
+   data=ImportData();
+   switch(format)
+   {
+      case POWDER_FILE_FULLPROF:
+      case POWDER_FILE_PSI_DMC:
+      case POWDER_FILE_ILL_D1A5:
+      case POWDER_FILE_XDD:
+      case POWDER_FILE_SIETRONICS_CPI:
+      {// Constant step, the observed intensities follow a short header
+         //Fullprof:
+         //15.000   0.030  70.000 LANI4FE#1 REC 800 4JRS
+         //2447.   2418.   2384.   2457.   2398.   2374.   2378.   2383.
+         //...
+         //PSI DMC: two comment lines, min step max, then Iobs and sigma(Iobs)
+         //ILL D1A/D2B: three comment lines, nb points, min step, then Iobs and sigma(Iobs)
+         //Xdd: one comment line, min step max, three unused numbers, then Iobs
+         //Sietronics CPI: one comment line, min max step, unused lines up to SCANDATA, then Iobs
+         REAL min=0,max=0,step=0;
+         switch(format)
+         {
+            case POWDER_FILE_PSI_DMC: fin.SkipLine();fin.SkipLine();break;
+            case POWDER_FILE_ILL_D1A5:
+            {
+               fin.SkipLine();fin.SkipLine();fin.SkipLine();
+               REAL nb=0;
+               fin.ReadReal(nb);
+               fin.SkipLine();
+               data.mNbPoint=(unsigned long)nb;
+               break;
+            }
+            case POWDER_FILE_XDD:
+            case POWDER_FILE_SIETRONICS_CPI: fin.SkipLine();break;
+            default: break;
+         }
+         fin.ReadReal(min);
+         if(format==POWDER_FILE_SIETRONICS_CPI)
+         {
+            fin.ReadReal(max);
+            fin.ReadReal(step);
+         }
+         else
+         {
+            fin.ReadReal(step);
+            if(format!=POWDER_FILE_ILL_D1A5) fin.ReadReal(max);
+         }
+         min  *= DEG2RAD;
+         max  *= DEG2RAD;
+         step *= DEG2RAD;
+         if(format!=POWDER_FILE_ILL_D1A5)
+         {
+            if((step==0)||((max-min)/step<0))
+               return function+" : invalid 2theta range or step in file:"+filename;
+            data.mNbPoint=(unsigned long)((max-min)/step+1.001);
+         }
+         data.mMin=min;
+         data.mStep=step;
+         switch(format)
+         {
+            case POWDER_FILE_FULLPROF:
+            case POWDER_FILE_PSI_DMC: fin.SkipLine();break;
+            case POWDER_FILE_XDD:
+            {
+               REAL tmp;
+               fin.ReadReal(tmp); //Count time
+               fin.ReadReal(tmp); //unused
+               fin.ReadReal(tmp); //unused (wavelength?)
+               break;
+            }
+            case POWDER_FILE_SIETRONICS_CPI:
+            {//Following lines are ignored (no fixed format ?)
+               string str;
+               do
+               {
+                  if(!fin.ReadWord(str)) return function+" : could not find SCANDATA in file:"+filename;
+               } while ("SCANDATA"!=str);
+               break;
+            }
+            default: break;
+         }
+         const unsigned long nb=data.mNbPoint;
+         // Missing values are set to 0
+         data.mObs.resize(nb);
+         data.mObs=0;
+         for(unsigned long i=0;i<nb;i++) if(!fin.ReadReal(data.mObs(i))) break;
+         if((format==POWDER_FILE_PSI_DMC)||(format==POWDER_FILE_ILL_D1A5))
+         {
+            data.mSigma.resize(nb);
+            data.mSigma=0;
+            for(unsigned long i=0;i<nb;i++) if(!fin.ReadReal(data.mSigma(i))) break;
+         }
+         else data.mSigmaFromObs=true;
+         break;
+      }
+      case POWDER_FILE_2THETA_OBS_SIGMA:
+      case POWDER_FILE_2THETA_OBS:
+      case POWDER_FILE_TOF_ISIS_XYSIGMA:
+      {// Columns x, Iobs and (except for 2THETA_OBS) sigma(Iobs)
+         if(format==POWDER_FILE_TOF_ISIS_XYSIGMA) fin.SkipLine();
+         else for(int i=0;i<nbSkip;i++) fin.SkipLine();
+         const unsigned int nbColumn= format==POWDER_FILE_2THETA_OBS ? 2 : 3;
+         // The arrays are allocated once, from the number of words left in the file
+         unsigned long nb=fin.GetNbWord()/nbColumn;
+         data.mX.resize(nb);
+         data.mObs.resize(nb);
+         data.mSigma.resize(nb);
+         unsigned long i=0;
+         for(;i<nb;i++)
+         {
+            if(!fin.ReadReal(data.mX(i))) break;
+            if(!fin.ReadReal(data.mObs(i))) break;
+            if(nbColumn==3)
+            {
+               if(!fin.ReadReal(data.mSigma(i))) break;
+            }
+         }
+         nb=i;
+         data.mX.resizeAndPreserve(nb);
+         data.mObs.resizeAndPreserve(nb);
+         data.mSigma.resizeAndPreserve(nb);
+         data.mNbPoint=nb;
+         if(nbColumn==2) data.mSigmaFromObs=true;
+         if(format==POWDER_FILE_TOF_ISIS_XYSIGMA)
+         {
+            data.mTOF=true;
+            // Reverse order of arrays, so that we are in ascending order of sin(theta)/lambda
+            REAL tmp;
+            for(unsigned long i=0;i<(nb/2);i++)
+            {
+               tmp=data.mX(i);
+               data.mX(i)=data.mX(nb-1-i);
+               data.mX(nb-1-i)=tmp;
 
-   fin >> tmp; //Count time
-   fin >> tmp; //unused
-   fin >> tmp; //unused (wavelength?)
+               tmp=data.mObs(i);
+               data.mObs(i)=data.mObs(nb-1-i);
+               data.mObs(nb-1-i)=tmp;
 
-   for(unsigned long i=0;i<mNbPoint;i++) fin >> mPowderPatternObs(i);
-   fin.close();
-   this->SetSigmaToSqrtIobs();
-   this->SetWeightToInvSigmaSq();
-   this->UpdateDisplay();
-   {
-      char buf [200];
-      sprintf(buf,"Imported powder pattern: %d points, 2theta=%7.3f -> %7.3f, step=%6.3f",
-              (int)mNbPoint,min*RAD2DEG,max*RAD2DEG,step*RAD2DEG);
-      (*fpObjCrystInformUser)((string)buf);
+               tmp=data.mSigma(i);
+               data.mSigma(i)=data.mSigma(nb-1-i);
+               data.mSigma(nb-1-i)=tmp;
+            }
+         }
+         else data.mX *= DEG2RAD;
+         break;
+      }
    }
-   VFN_DEBUG_MESSAGE("DiffractionDataPowder::ImportXddPattern() :finished",5)
+   return "";
 }
 
-void PowderPattern::ImportPowderPatternSietronicsCPI(const string &filename)
+void PowderPattern::ParseImportFiles(const vector<string> &filenames,
+                                     const PowderPatternFileFormat format,const int nbSkip,
+                                     vector<ImportData> &vData,vector<string> &vError,
+                                     const unsigned int first,const unsigned int step)
 {
-   VFN_DEBUG_ENTRY("PowderPattern::ImportPowderPatternSietronicsCPI():from file :" \
-                           +filename,5)
-   ifstream fin (filename.c_str());
-   if(!fin)
-   {
-      throw ObjCrystException("PowderPattern::ImportPowderPatternSietronicsCPI() : \
-Error opening file for input:"+filename);
-   }
-   char tmpComment[300];
-   fin.getline(tmpComment,100);
-   VFN_DEBUG_MESSAGE(" ->Discarded comment :"<<tmpComment,1)
-   REAL min,max,step;
-   fin >> min >> max >> step;
-   min  *= DEG2RAD;
-   max *= DEG2RAD;
-   step *= DEG2RAD;
-   this->SetPowderPatternPar(min,step,(long)((max-min)/step+1.001));
-   mPowderPatternObs.resize (mNbPoint);
-   mPowderPatternObsSigma.resize(mNbPoint);
-   mPowderPatternCalc.resize(mNbPoint);
-   mPowderPatternWeight.resize(mNbPoint);
-   mPowderPatternWeight=1.;
-
-   //Following lines are ignored (no fixed format ?)
-   string str;
-   do
+   for(unsigned long i=first;i<filenames.size();i+=step)
    {
-      fin>>str;
-      VFN_DEBUG_MESSAGE(" ->Read :"<<str,1)
-   } while ("SCANDATA"!=str);
-
-   for(unsigned long i=0;i<mNbPoint;i++) fin >> mPowderPatternObs(i);
-   fin.close();
-   this->SetSigmaToSqrtIobs();
-   this->SetWeightToInvSigmaSq();
-   mClockPowderPatternPar.Click();
-   this->UpdateDisplay();
-   {
-      char buf [200];
-      sprintf(buf,"Imported powder pattern: %d points, 2theta=%7.3f -> %7.3f, step=%6.3f",
-              (int)mNbPoint,min*RAD2DEG,max*RAD2DEG,step*RAD2DEG);
-      (*fpObjCrystInformUser)((string)buf);
+      try
+      {
+         vError[i]=ParseImportFile(filenames[i],format,nbSkip,vData[i]);
+      }
+      catch(const std::exception &except)
+      {
+         vError[i]="PowderPattern::ImportPowderPatternFiles(): error importing "
+                   +filenames[i]+": "+except.what();
+      }
    }
-   VFN_DEBUG_EXIT("DiffractionDataPowder::ImportPowderPatternSietronicsCPI()",5)
 }
 
-void PowderPattern::ImportPowderPattern2ThetaObsSigma(const string &filename,const int nbSkip)
+void PowderPattern::SetImportData(const ImportData &data)
 {
-   VFN_DEBUG_MESSAGE("DiffractionDataPowder::ImportPowderPattern2ThetaObsSigma():from:" \
-                           +filename,5)
-   ifstream fin (filename.c_str());
-   if(!fin)
+   // If the x coordinates are unchanged (e.g. a new pattern from the same series),
+   // keep them so that profiles and reflection lists need not be recomputed.
+   bool sameX=false;
+   if(data.mX.numElements()>0)
    {
-      throw ObjCrystException("PowderPattern::ImportPowderPattern2ThetaObsSigma():\
-Error opening file for input:"+filename);
-   }
-   {//Get rid of first lines
-      char tmpComment[200];
-      for(int i=0;i<nbSkip;i++) fin.getline(tmpComment,150);
+      if((unsigned long)data.mX.numElements()==mNbPoint)
+      {
+         sameX=true;
+         for(unsigned long i=0;i<mNbPoint;i++) if(data.mX(i)!=mX(i)) {sameX=false;break;}
+      }
    }
-   mPowderPatternObs.resize (500);
-   mPowderPatternObsSigma.resize(500);
-   mX.resize(500);
-   mNbPoint=0;
-
-   do
+   else
    {
-      fin >> mX              (mNbPoint);
-      fin >> mPowderPatternObs     (mNbPoint);
-      fin >> mPowderPatternObsSigma(mNbPoint);
-      //cout << mX              (mNbPoint)<<" "
-      //     << mPowderPatternObs     (mNbPoint)<<" "
-      //    << mPowderPatternObsSigma(mNbPoint)<<endl;
-      if(!fin) break;
-      mNbPoint++;
-      if( (mNbPoint%500)==0)
+      if(data.mNbPoint==mNbPoint)
       {
-         mX.resizeAndPreserve(mNbPoint+500);
-         mPowderPatternObs.resizeAndPreserve(mNbPoint+500);
-         mPowderPatternObsSigma.resizeAndPreserve(mNbPoint+500);
+         sameX=true;
+         for(unsigned long i=0;i<mNbPoint;i++)
+            if((data.mMin+data.mStep*i)!=mX(i)) {sameX=false;break;}
       }
-   } while(fin.eof() == false);
-   fin.close();
-
-   mX.resizeAndPreserve                    (mNbPoint);
-   mPowderPatternObs.resizeAndPreserve     (mNbPoint);
-   mPowderPatternObsSigma.resizeAndPreserve(mNbPoint);
-   mPowderPatternWeight.resize(mNbPoint);
-
-   mX *= DEG2RAD;
-
+   }
+   if(!sameX)
+   {
+      if(data.mX.numElements()>0) this->SetPowderPatternX(data.mX);
+      else this->SetPowderPatternPar(data.mMin,data.mStep,data.mNbPoint);
+   }
+   mPowderPatternObs=data.mObs;
+   if(data.mSigmaFromObs) this->SetSigmaToSqrtIobs();
+   else mPowderPatternObsSigma=data.mSigma;
    this->SetWeightToInvSigmaSq();
-   mClockPowderPatternPar.Click();
-   this->UpdateDisplay();
+   if(data.mTOF)
    {
-      char buf [200];
+      if(this->GetRadiationType()!=RAD_NEUTRON) this->SetRadiationType(RAD_NEUTRON);
+      if(this->GetRadiation().GetWavelengthType()!=WAVELENGTH_TOF)
+         this->GetRadiation().SetWavelengthType(WAVELENGTH_TOF);
+   }
+   if(sameX)
+   {// Only the observed data changed: the scale factor and Chi^2 must be re-computed
+      mClockScaleFactor.Click();
+      mClockIntegratedFactorsPrep.Reset();
+   }
+   else mClockPowderPatternPar.Click();
+   this->UpdateDisplay();
+   char buf [200];
+   if(data.mTOF)
+      sprintf(buf,"Imported TOF powder pattern: %d points, TOF=%7.3f -> %7.3f",
+              (int)mNbPoint,this->GetPowderPatternXMin(),
+              this->GetPowderPatternXMax());
+   else
       sprintf(buf,"Imported powder pattern: %d points, 2theta=%7.3f -> %7.3f, step=%6.3f",
               (int)mNbPoint,this->GetPowderPatternXMin()*RAD2DEG,
               this->GetPowderPatternXMax()*RAD2DEG,
               this->GetPowderPatternXStep()*RAD2DEG);
-      (*fpObjCrystInformUser)((string)buf);
+   (*fpObjCrystInformUser)((string)buf);
+}
+
+vector<PowderPattern*> PowderPattern::ImportPowderPatternFiles(const vector<string> &filenames,
+                                                               const PowderPatternFileFormat format,
+                                                               const int nbSkip,
+                                                               const unsigned int nbThread)
+{
+   TAU_PROFILE("PowderPattern::ImportPowderPatternFiles()","void ()",TAU_DEFAULT);
+   VFN_DEBUG_ENTRY("PowderPattern::ImportPowderPatternFiles():"<<filenames.size()<<" files",5)
+   const unsigned long nb=filenames.size();
+   vector<ImportData> vData(nb);
+   vector<string> vError(nb);
+   // Parse the files in parallel. ObjCryst objects are only created afterwards,
+   // as they (and their clocks) must not be modified from several threads.
+   unsigned int nbt=nbThread;
+   if(nbt==0) nbt=thread::hardware_concurrency();
+   if(nbt>nb) nbt=nb;
+   if(nbt<=1) ParseImportFiles(filenames,format,nbSkip,vData,vError,0,1);
+   else
+   {
+      vector<thread> vThread;
+      for(unsigned int i=0;i<nbt;i++)
+         vThread.push_back(ObjRegistryIsolation::StartThread(&PowderPattern::ParseImportFiles,
+                                  cref(filenames),format,nbSkip,ref(vData),ref(vError),i,nbt));
+      for(unsigned int i=0;i<nbt;i++) vThread[i].join();
+   }
+   for(unsigned long i=0;i<nb;i++)
+      if(vError[i]!="") throw ObjCrystException(vError[i]);
+   vector<PowderPattern*> vPattern(nb);
+   for(unsigned long i=0;i<nb;i++)
+   {
+      vPattern[i]=new PowderPattern;
+      vPattern[i]->SetName(filenames[i]);
+      vPattern[i]->SetImportData(vData[i]);
+      vData[i]=ImportData();
    }
-   VFN_DEBUG_MESSAGE("PowderPattern::ImportPowderPattern2ThetaObsSigma()\
-:finished: "<<mNbPoint<<" points",5)
+   VFN_DEBUG_EXIT("PowderPattern::ImportPowderPatternFiles()",5)
+   return vPattern;
 }
 
-void PowderPattern::ImportPowderPattern2ThetaObs(const string &filename,const int nbSkip)
+vector<PowderPattern*> PowderPattern::ImportPowderPatternGlob(const string &pattern,
+                                                              const PowderPatternFileFormat format,
+                                                              const int nbSkip,
+                                                              const unsigned int nbThread)
 {
-   VFN_DEBUG_MESSAGE("PowderPattern::ImportPowderPattern2ThetaObs():from:" \
-                           +filename,5)
-   ifstream fin (filename.c_str());
-   if(!fin)
-   {
-      throw ObjCrystException("PowderPattern::ImportPowderPattern2ThetaObs():\
-Error opening file for input:"+filename);
-   }
-   {//Get rid of first lines
-      char tmpComment[200];
-      for(int i=0;i<nbSkip;i++) fin.getline(tmpComment,150);
-   }
-   mPowderPatternObs.resize (500);
-   mPowderPatternObsSigma.resize(500);
-   mX.resize(500);
-   mNbPoint=0;
+   #ifdef _WIN32
+   throw ObjCrystException("PowderPattern::ImportPowderPatternGlob(): not available on this platform");
+   #else
+   vector<string> filenames;
+   glob_t g;
+   const int status=glob(pattern.c_str(),0,NULL,&g);
+   if(status==0)
+      for(size_t i=0;i<g.gl_pathc;i++) filenames.push_back(g.gl_pathv[i]);
+   globfree(&g);
+   if((status!=0)&&(status!=GLOB_NOMATCH))
+      throw ObjCrystException("PowderPattern::ImportPowderPatternGlob(): error listing files:"+pattern);
+   // glob() already sorts the list
+   return ImportPowderPatternFiles(filenames,format,nbSkip,nbThread);
+   #endif
+}
 
-   do
-   {
-      fin >> mX(mNbPoint);
-      fin >> mPowderPatternObs     (mNbPoint);
-      mPowderPatternObsSigma(mNbPoint)
-         =sqrt(mPowderPatternObs(mNbPoint));
-      if(!fin) break;
-      mNbPoint++;
-      if( (mNbPoint%500)==0)
-      {
-         mX.resizeAndPreserve(mNbPoint+500);
-         mPowderPatternObs.resizeAndPreserve(mNbPoint+500);
-         mPowderPatternObsSigma.resizeAndPreserve(mNbPoint+500);
-      }
-   } while(fin.eof() == false);
-   fin.close();
+void PowderPattern::ImportPowderPatternFullprof(const string &filename)
+{
+   VFN_DEBUG_ENTRY("PowderPattern::ImportPowderPatternFullprof():from file:"+filename,5)
+   ImportData data;
+   const string error=ParseImportFile(filename,POWDER_FILE_FULLPROF,0,data);
+   if(error!="") throw ObjCrystException(error);
+   this->SetImportData(data);
+   VFN_DEBUG_EXIT("PowderPattern::ImportPowderPatternFullprof():finished:"<<mNbPoint<<" points",5)
+}
 
-   mX.resizeAndPreserve              (mNbPoint);
-   mPowderPatternObs.resizeAndPreserve     (mNbPoint);
-   mPowderPatternObsSigma.resizeAndPreserve(mNbPoint);
-   mPowderPatternWeight.resize(mNbPoint);
+void PowderPattern::ImportPowderPatternPSI_DMC(const string &filename)
+{
+   VFN_DEBUG_ENTRY("PowderPattern::ImportPowderPatternPSI_DMC():from file:"+filename,5)
+   ImportData data;
+   const string error=ParseImportFile(filename,POWDER_FILE_PSI_DMC,0,data);
+   if(error!="") throw ObjCrystException(error);
+   this->SetImportData(data);
+   VFN_DEBUG_EXIT("PowderPattern::ImportPowderPatternPSI_DMC():finished:"<<mNbPoint<<" points",5)
+}
 
-   mX *= DEG2RAD;
+void PowderPattern::ImportPowderPatternILL_D1A5(const string &filename)
+{
+   VFN_DEBUG_ENTRY("PowderPattern::ImportPowderPatternILL_D1A5():from file:"+filename,5)
+   ImportData data;
+   const string error=ParseImportFile(filename,POWDER_FILE_ILL_D1A5,0,data);
+   if(error!="") throw ObjCrystException(error);
+   this->SetImportData(data);
+   VFN_DEBUG_EXIT("PowderPattern::ImportPowderPatternILL_D1A5():finished:"<<mNbPoint<<" points",5)
+}
 
-   this->SetSigmaToSqrtIobs();
-   this->SetWeightToInvSigmaSq();
-   mClockPowderPatternPar.Click();
-   this->UpdateDisplay();
-   {
-      char buf [200];
-      sprintf(buf,"Imported powder pattern: %d points, 2theta=%7.3f -> %7.3f, step=%6.3f",
-              (int)mNbPoint,this->GetPowderPatternXMin()*RAD2DEG,
-              this->GetPowderPatternXMax()*RAD2DEG,
-              this->GetPowderPatternXStep()*RAD2DEG);
-      (*fpObjCrystInformUser)((string)buf);
-   }
-   VFN_DEBUG_MESSAGE("PowderPattern::ImportPowderPattern2ThetaObs():finished",5)
+void PowderPattern::ImportPowderPatternXdd(const string &filename)
+{
+   VFN_DEBUG_ENTRY("PowderPattern::ImportPowderPatternXdd():from file:"+filename,5)
+   ImportData data;
+   const string error=ParseImportFile(filename,POWDER_FILE_XDD,0,data);
+   if(error!="") throw ObjCrystException(error);
+   this->SetImportData(data);
+   VFN_DEBUG_EXIT("PowderPattern::ImportPowderPatternXdd():finished:"<<mNbPoint<<" points",5)
+}
+
+void PowderPattern::ImportPowderPatternSietronicsCPI(const string &filename)
+{
+   VFN_DEBUG_ENTRY("PowderPattern::ImportPowderPatternSietronicsCPI():from file:"+filename,5)
+   ImportData data;
+   const string error=ParseImportFile(filename,POWDER_FILE_SIETRONICS_CPI,0,data);
+   if(error!="") throw ObjCrystException(error);
+   this->SetImportData(data);
+   VFN_DEBUG_EXIT("PowderPattern::ImportPowderPatternSietronicsCPI():finished:"<<mNbPoint<<" points",5)
+}
+
+void PowderPattern::ImportPowderPattern2ThetaObsSigma(const string &filename,const int nbSkip)
+{
+   VFN_DEBUG_ENTRY("PowderPattern::ImportPowderPattern2ThetaObsSigma():from file:"+filename,5)
+   ImportData data;
+   const string error=ParseImportFile(filename,POWDER_FILE_2THETA_OBS_SIGMA,nbSkip,data);
+   if(error!="") throw ObjCrystException(error);
+   this->SetImportData(data);
+   VFN_DEBUG_EXIT("PowderPattern::ImportPowderPattern2ThetaObsSigma():finished:"<<mNbPoint<<" points",5)
+}
+
+void PowderPattern::ImportPowderPattern2ThetaObs(const string &filename,const int nbSkip)
+{
+   VFN_DEBUG_ENTRY("PowderPattern::ImportPowderPattern2ThetaObs():from file:"+filename,5)
+   ImportData data;
+   const string error=ParseImportFile(filename,POWDER_FILE_2THETA_OBS,nbSkip,data);
+   if(error!="") throw ObjCrystException(error);
+   this->SetImportData(data);
+   VFN_DEBUG_EXIT("PowderPattern::ImportPowderPattern2ThetaObs():finished:"<<mNbPoint<<" points",5)
 }
 
 void PowderPattern::ImportPowderPatternMultiDetectorLLBG42(const string &filename)
@@ -3502,79 +3770,12 @@ Error opening file for input:"+filename);
 
 void PowderPattern::ImportPowderPatternTOF_ISIS_XYSigma(const string &filename)
 {
-   VFN_DEBUG_MESSAGE("DiffractionDataPowder::ImportPowderPatternTOF_ISIS_XYSigma():from:" \
-                           +filename,5)
-   ifstream fin (filename.c_str());
-   if(!fin)
-   {
-      throw ObjCrystException("PowderPattern::ImportPowderPatternTOF_ISIS_XYSigma():\
-Error opening file for input:"+filename);
-   }
-   {//Get rid of first line
-      char junk[400];
-      fin.getline(junk,150);
-   }
-   mPowderPatternObs.resize (500);
-   mPowderPatternObsSigma.resize(500);
-   mX.resize(500);
-   mNbPoint=0;
-
-   do
-   {
-      fin >> mX              (mNbPoint);
-      fin >> mPowderPatternObs     (mNbPoint);
-      fin >> mPowderPatternObsSigma(mNbPoint);
-      //cout << mX              (mNbPoint)<<" "
-      //     << mPowderPatternObs     (mNbPoint)<<" "
-      //    << mPowderPatternObsSigma(mNbPoint)<<endl;
-      if(!fin) break;
-      mNbPoint++;
-      if( (mNbPoint%500)==0)
-      {
-         mX.resizeAndPreserve(mNbPoint+500);
-         mPowderPatternObs.resizeAndPreserve(mNbPoint+500);
-         mPowderPatternObsSigma.resizeAndPreserve(mNbPoint+500);
-      }
-   } while(fin.eof() == false);
-   fin.close();
-
-   mX.resizeAndPreserve                    (mNbPoint);
-   mPowderPatternObs.resizeAndPreserve     (mNbPoint);
-   mPowderPatternObsSigma.resizeAndPreserve(mNbPoint);
-   mPowderPatternWeight.resize(mNbPoint);
-
-   // Reverse order of arrays, so that we are in ascending order of sin(theta)/lambda
-   REAL tmp;
-   for(unsigned long i=0;i<(mNbPoint/2);i++)
-   {
-      tmp=mX(i);
-      mX(i)=mX(mNbPoint-1-i);
-      mX(mNbPoint-1-i)=tmp;
-
-      tmp=mPowderPatternObs(i);
-      mPowderPatternObs(i)=mPowderPatternObs(mNbPoint-1-i);
-      mPowderPatternObs(mNbPoint-1-i)=tmp;
-
-      tmp=mPowderPatternObsSigma(i);
-      mPowderPatternObsSigma(i)=mPowderPatternObsSigma(mNbPoint-1-i);
-      mPowderPatternObsSigma(mNbPoint-1-i)=tmp;
-   }
-   this->SetPowderPatternX(mX);
-
-   this->SetWeightToInvSigmaSq();
-   this->SetRadiationType(RAD_NEUTRON);
-   this->GetRadiation().SetWavelengthType(WAVELENGTH_TOF);
-   mClockPowderPatternPar.Click();
-   this->UpdateDisplay();
-   {
-      char buf [200];
-      sprintf(buf,"Imported TOF powder pattern: %d points, TOF=%7.3f -> %7.3f",
-              (int)mNbPoint,this->GetPowderPatternXMin(),
-              this->GetPowderPatternXMax());
-      (*fpObjCrystInformUser)((string)buf);
-   }
-   VFN_DEBUG_MESSAGE("PowderPattern::ImportPowderPatternTOF_ISIS_XYSigma()\
-:finished: "<<mNbPoint<<" points",5)
+   VFN_DEBUG_ENTRY("PowderPattern::ImportPowderPatternTOF_ISIS_XYSigma():from file:"+filename,5)
+   ImportData data;
+   const string error=ParseImportFile(filename,POWDER_FILE_TOF_ISIS_XYSIGMA,0,data);
+   if(error!="") throw ObjCrystException(error);
+   this->SetImportData(data);
+   VFN_DEBUG_EXIT("PowderPattern::ImportPowderPatternTOF_ISIS_XYSigma():finished:"<<mNbPoint<<" points",5)
 }
 
 void PowderPattern::ImportPowderPatternGSAS(const string &filename)
@@ -3648,7 +3849,6 @@ Could not find BANK statement !! In file: "+filename);
       string sub;
       unsigned long point=0;
       REAL iobs,isig;
-      string substr;
       for(long i=0;i<nbRecords;i++)
       {
          fin.read(line,80);
@@ -3664,10 +3864,8 @@ Could not find BANK statement !! In file: "+filename);
             substr=string(line).substr(j*16,16);
             sscanf(substr.c_str(),"%8f%8f",&iobs,&isig);
             */
-            substr=string(line).substr(j*16+0 ,8);
-            istringstream(substr) >> iobs;
-            substr=string(line).substr(j*16+8 ,8);
-            istringstream(substr) >> isig;
+            iobs=ReadFixedWidthReal(line,strlen(line),j*16+0,8);
+            isig=ReadFixedWidthReal(line,strlen(line),j*16+8,8);
 
             mPowderPatternObs(point)=iobs;
             mPowderPatternObsSigma(point++)=isig;
@@ -3707,8 +3905,7 @@ Could not find BANK statement !! In file: "+filename);
             substr=string(line).substr(j*8+0 ,2);
             if(substr=="  ") nc=1;
             else sscanf(substr.c_str(),"%d",&nc);
-            substr=string(line).substr(j*8+2 ,6);
-            istringstream(substr) >> iobs;
+            iobs=ReadFixedWidthReal(line,strlen(line),j*8+2,6);
             mPowderPatternObs(point)=iobs;
             mPowderPatternObsSigma(point++)=sqrt(iobs)/sqrt((REAL)nc);
             if(point==mNbPoint) break;
@@ -3725,7 +3922,6 @@ Could not find BANK statement !! In file: "+filename);
 
       unsigned long point=0;
       REAL x,iobs,iobssigma;
-      string substr;
       for(long i=0;i<nbRecords;i++)
       {
          fin.read(line,80);
@@ -3741,12 +3937,9 @@ Could not find BANK statement !! In file: "+filename);
             substr=string(line).substr(j*20,20);
             sscanf(substr.c_str(),"%8f%7f%5f",&x,&iobs,&iobssigma);
             */
-            substr=string(line).substr(j*20+0 ,8);
-            istringstream(substr) >> x;
-            substr=string(line).substr(j*20+8 ,7);
-            istringstream(substr) >> iobs;
-            substr=string(line).substr(j*20+15,5);
-            istringstream(substr) >> iobssigma;
+            x        =ReadFixedWidthReal(line,strlen(line),j*20+0 ,8);
+            iobs     =ReadFixedWidthReal(line,strlen(line),j*20+8 ,7);
+            iobssigma=ReadFixedWidthReal(line,strlen(line),j*20+15,5);
             mPowderPatternObs(point)=iobs;
             mPowderPatternObsSigma(point)=iobssigma;
             mX(point)=x/32;
@@ -4320,50 +4513,30 @@ REAL PowderPattern::GetChi2()const
    mChi2=0.;
    mChi2LikeNorm=0.;
    VFN_DEBUG_MESSAGE("PowderPattern::GetChi2()Integrated profiles",3);
-   const REAL * RESTRICT p1, * RESTRICT p2, * RESTRICT p3;
-   p1=mPowderPatternCalc.data();
-   p2=mPowderPatternObs.data();
-   p3=mPowderPatternWeight.data();
+   const REAL *p1=mPowderPatternCalc.data();
+   const REAL *p2=mPowderPatternObs.data();
+   const REAL *p3=mPowderPatternWeight.data();
+   // Chi^2 and normalization term, for each segment of the pattern between excluded regions
    const long nbExclude=mExcludedRegionMinX.numElements();
-   if(0==nbExclude)
+   unsigned long i=0;
+   for(int j=0;j<=nbExclude;j++)
    {
-      for(unsigned long i=0;i<maxPoints;i++)
-      {
-         mChi2 += *p3 * ((*p1)-(*p2))*((*p1)-(*p2));
-         if(*p3<=0) p3++;
-         else mChi2LikeNorm -= log(*p3++);
-         p1++;p2++;
-      }
-   }
-   else
-   {
-      unsigned long min,max;
-      unsigned long i=0;
-      for(int j=0;j<nbExclude;j++)
+      unsigned long min=maxPoints,max=maxPoints;
+      if(j<nbExclude)
       {
          min=(unsigned long)floor(this->X2Pixel(mExcludedRegionMinX(j)));
          max=(unsigned long)ceil (this->X2Pixel(mExcludedRegionMaxX(j)));
-         if(min>maxPoints) break;
-         if(max>maxPoints)max=maxPoints;
-         for(;i<min;i++)//! min is the *beginning* of the excluded region !
-         {
-            mChi2 += *p3 * ((*p1)-(*p2))*((*p1)-(*p2));
-            if(*p3<=0) p3++;
-            else mChi2LikeNorm -= log(*p3++);
-            p1++;p2++;
-         }
-         p1 += max-i;
-         p2 += max-i;
-         p3 += max-i;
-         i  += max-i;
+         if(min>maxPoints) min=maxPoints;
+         if(max>maxPoints) max=maxPoints;
       }
-      for(;i<maxPoints;i++)
+      //! min is the *beginning* of the excluded region !
+      if(min>i)
       {
-         mChi2 += *p3 * ((*p1)-(*p2))*((*p1)-(*p2));
-         if(*p3<=0) p3++;
-         else mChi2LikeNorm -= log(*p3++);
-         p1++;p2++;
+         mChi2 += SumWeightedSquaredDiff(p3+i,p1+i,p2+i,min-i);
+         for(;i<min;i++) if(p3[i]>0) mChi2LikeNorm -= log(p3[i]);
       }
+      if(max>i) i=max;
+      if(i>=maxPoints) break;
    }
    mChi2LikeNorm/=2;
    VFN_DEBUG_MESSAGE("Chi^2="<<mChi2<<", log(norm)="<<mChi2LikeNorm,3)
@@ -4461,117 +4634,53 @@ void PowderPattern::FitScaleFactorForR()const
       mFitScaleFactorM.resize(nbScale,nbScale);
       mFitScaleFactorB.resize(nbScale,1);
       mFitScaleFactorX.resize(nbScale,1);
-   // Build Matrix & Vector for LSQ
-   const long nbExclude=mExcludedRegionMinX.numElements();
-   if(0==nbExclude)
+   // Segments [begin;end[ of the pattern which are not excluded
+   vector<pair<unsigned long,unsigned long> > vSegment;
    {
-      for(int i=0;i<nbScale;i++)
-      {
-         for(int j=i;j<nbScale;j++)
-         {
-            // Here use a direct access to the powder spectrum, since
-            // we know it has just been recomputed
-            const REAL *p1=mPowderPatternComponentRegistry.GetObj(mScalableComponentIndex(i))
-                              .mPowderPatternCalc.data();
-            const REAL *p2=mPowderPatternComponentRegistry.GetObj(mScalableComponentIndex(j))
-                              .mPowderPatternCalc.data();
-            REAL m=0.;
-            for(unsigned long k=0;k<mNbPointUsed;k++) m += *p1++ * *p2++;
-            mFitScaleFactorM(i,j)=m;
-            mFitScaleFactorM(j,i)=m;
-         }
-      }
-      for(int i=0;i<nbScale;i++)
+      const long nbExclude=mExcludedRegionMinX.numElements();
+      unsigned long l=0;
+      for(int k=0;k<nbExclude;k++)
       {
-         const REAL *p1=mPowderPatternObs.data();
-         const REAL *p2=mPowderPatternComponentRegistry.GetObj(mScalableComponentIndex(i))
-                           .mPowderPatternCalc.data();
-         REAL b=0.;
-         if(mPowderPatternBackgroundCalc.numElements()<=1)
-            for(unsigned long k=0;k<mNbPointUsed;k++) b += *p1++ * *p2++;
-         else
-         {
-            const REAL *p3=mPowderPatternBackgroundCalc.data();
-            for(unsigned long k=0;k<mNbPointUsed;k++) b += (*p1++ - *p3++) * *p2++;
-         }
-         mFitScaleFactorB(i,0) =b;
+         unsigned long min=(unsigned long)floor(this->X2Pixel(mExcludedRegionMinX(k)));
+         unsigned long max=(unsigned long)ceil (this->X2Pixel(mExcludedRegionMaxX(k)));
+         if(min>mNbPointUsed) break;
+         if(max>mNbPointUsed)max=mNbPointUsed;
+         //! min is the *beginning* of the excluded region
+         if(min>l) vSegment.push_back(make_pair(l,min));
+         if(max>l) l=max;
       }
+      if(l<mNbPointUsed) vSegment.push_back(make_pair(l,(unsigned long)mNbPointUsed));
    }
-   else
+   // Build Matrix & Vector for LSQ
+   const REAL *pobs=mPowderPatternObs.data();
+   for(int i=0;i<nbScale;i++)
    {
-      unsigned long min,max;
-      for(int i=0;i<nbScale;i++)
-      {
-         for(int j=i;j<nbScale;j++)
-         {
-            // Here use a direct access to the powder spectrum, since
-            // we know it has just been recomputed
-            const REAL *p1=mPowderPatternComponentRegistry.GetObj(mScalableComponentIndex(i))
-                              .mPowderPatternCalc.data();
-            const REAL *p2=mPowderPatternComponentRegistry.GetObj(mScalableComponentIndex(j))
-                              .mPowderPatternCalc.data();
-            REAL m=0.;
-            unsigned long l=0;
-            for(int k=0;k<nbExclude;k++)
-            {
-               min=(unsigned long)floor(this->X2Pixel(mExcludedRegionMinX(j)));
-               max=(unsigned long)ceil (this->X2Pixel(mExcludedRegionMaxX(j)));
-               if(min>mNbPointUsed) break;
-               if(max>mNbPointUsed)max=mNbPointUsed;
-               //! min is the *beginning* of the excluded region
-               for(;l<min;l++) m += *p1++ * *p2++;
-               p1 += max-l;
-               p2 += max-l;
-               l  = max;
-            }
-            for(;l<mNbPointUsed;l++) m += *p1++ * *p2++;
-            mFitScaleFactorM(i,j)=m;
-            mFitScaleFactorM(j,i)=m;
-         }
-      }
-      for(int i=0;i<nbScale;i++)
+      // Here use a direct access to the powder spectrum, since
+      // we know it has just been recomputed
+      const REAL *p1=mPowderPatternComponentRegistry.GetObj(mScalableComponentIndex(i))
+                        .mPowderPatternCalc.data();
+      for(int j=i;j<nbScale;j++)
       {
-         const REAL *p1=mPowderPatternObs.data();
-         const REAL *p2=mPowderPatternComponentRegistry
-                           .GetObj(mScalableComponentIndex(i))
-                              .mPowderPatternCalc.data();
-         REAL b=0.;
-         unsigned long l=0;
+         const REAL *p2=mPowderPatternComponentRegistry.GetObj(mScalableComponentIndex(j))
+                           .mPowderPatternCalc.data();
+         REAL m=0.;
+         for(vector<pair<unsigned long,unsigned long> >::const_iterator pos=vSegment.begin();
+             pos!=vSegment.end();++pos)
+            m += SumProduct(p1+pos->first,p2+pos->first,pos->second-pos->first);
+         mFitScaleFactorM(i,j)=m;
+         mFitScaleFactorM(j,i)=m;
+      }
+      REAL b=0.;
+      for(vector<pair<unsigned long,unsigned long> >::const_iterator pos=vSegment.begin();
+          pos!=vSegment.end();++pos)
+      {
+         const unsigned long k=pos->first,nb=pos->second-pos->first;
          if(mPowderPatternBackgroundCalc.numElements()<=1)
-         {
-            for(int k=0;k<nbExclude;k++)
-            {
-               min=(unsigned long)floor(this->X2Pixel(mExcludedRegionMinX(k)));
-               max=(unsigned long)ceil (this->X2Pixel(mExcludedRegionMaxX(k)));
-               if(min>mNbPointUsed) break;
-               if(max>mNbPointUsed)max=mNbPointUsed;
-               //! min is the *beginning* of the excluded region
-               for(;l<min;l++) b += *p1++ * *p2++;
-               p1 += max-l;
-               p2 += max-l;
-               l  = max;
-            }
-            for(;l<mNbPointUsed;l++) b += *p1++ * *p2++;
-         }
+            b += SumProduct(pobs+k,p1+k,nb);
          else
-         {
-            const REAL *p3=mPowderPatternBackgroundCalc.data();
-            for(int k=0;k<nbExclude;k++)
-            {
-               min=(unsigned long)floor(this->X2Pixel(mExcludedRegionMinX(k)));
-               max=(unsigned long)ceil (this->X2Pixel(mExcludedRegionMaxX(k)));
-               if(min>mNbPointUsed) break;
-               if(max>mNbPointUsed)max=mNbPointUsed;
-               //! min is the *beginning* of the excluded region
-               for(;l<min;l++) b += (*p1++ - *p3++) * *p2++;
-               p1 += max-l;
-               p2 += max-l;
-               l  = max;
-            }
-            for(;l<mNbPointUsed;l++) b += (*p1++ - *p3++) * *p2++;
-         }
-         mFitScaleFactorB(i,0) =b;
+            b += SumDiffProduct(pobs+k,mPowderPatternBackgroundCalc.data()+k,p1+k,nb);
       }
+      mFitScaleFactorB(i,0) =b;
    }
    if(1==nbScale) mFitScaleFactorX=mFitScaleFactorB(0)/mFitScaleFactorM(0);
    else
@@ -4589,7 +4698,7 @@ void PowderPattern::FitScaleFactorForR()const
          (*fpObjCrystInformUser)("Warning:FitScaleFactorForR: working around NaN scale factor...");
          continue;
       }
-      for(unsigned long j=0;j<mNbPointUsed;j++) *p0++ += s * *p1++;
+      AddScaled(p0,s,p1,mNbPointUsed);
       VFN_DEBUG_MESSAGE("-> Old:"<<mScaleFactor(mScalableComponentIndex(i)) <<" Change:"<<mFitScaleFactorX(i),2);
       mScaleFactor(mScalableComponentIndex(i)) = mFitScaleFactorX(i);
       mClockScaleFactor.Click();
@@ -4738,7 +4847,7 @@ void PowderPattern::FitScaleFactorForIntegratedR()const
          (*fpObjCrystInformUser)("Warning:FitScaleFactorForIntegratedR: working around NaN scale factor...");
          continue;
       }
-      for(unsigned long j=0;j<mNbPointUsed;j++) *p0++ += s * *p1++;
+      AddScaled(p0,s,p1,mNbPointUsed);
       VFN_DEBUG_MESSAGE("-> Old:"<<mScaleFactor(mScalableComponentIndex(i)) <<" New:"<<mFitScaleFactorX(i),3);
       mScaleFactor(mScalableComponentIndex(i)) = mFitScaleFactorX(i);
       mClockScaleFactor.Click();
@@ -4758,7 +4867,6 @@ void PowderPattern::FitScaleFactorForRw()const
    TAU_PROFILE("PowderPattern::FitScaleFactorForRw()","void ()",TAU_DEFAULT);
    VFN_DEBUG_ENTRY("PowderPattern::FitScaleFactorForRw()",3);
    this->CalcPowderPattern();
-   //:TODO: take into account excluded regions...
    // Which components are scalable ?
       mScalableComponentIndex.resize(mPowderPatternComponentRegistry.GetNb());
       int nbScale=0;
@@ -4778,125 +4886,54 @@ void PowderPattern::FitScaleFactorForRw()const
       mFitScaleFactorM.resize(nbScale,nbScale);
       mFitScaleFactorB.resize(nbScale,1);
       mFitScaleFactorX.resize(nbScale,1);
-   // Build Matrix & Vector for LSQ
-   const long nbExclude=mExcludedRegionMinX.numElements();
-   if(0==nbExclude)
+   // Segments [begin;end[ of the pattern which are not excluded
+   vector<pair<unsigned long,unsigned long> > vSegment;
    {
-      for(int i=0;i<nbScale;i++)
-      {
-         for(int j=i;j<nbScale;j++)
-         {
-            // Here use a direct access to the powder spectrum, since
-            // we know it has just been recomputed
-            const REAL *p1=mPowderPatternComponentRegistry.GetObj(mScalableComponentIndex(i))
-                              .mPowderPatternCalc.data();
-            const REAL *p2=mPowderPatternComponentRegistry.GetObj(mScalableComponentIndex(j))
-                              .mPowderPatternCalc.data();
-            const REAL *p3=mPowderPatternWeight.data();
-            REAL m=0.;
-            for(unsigned long k=0;k<mNbPointUsed;k++) m += *p1++ * *p2++ * *p3++;
-            mFitScaleFactorM(i,j)=m;
-            mFitScaleFactorM(j,i)=m;
-         }
-      }
-      for(int i=0;i<nbScale;i++)
+      const long nbExclude=mExcludedRegionMinX.numElements();
+      unsigned long l=0;
+      for(int k=0;k<nbExclude;k++)
       {
-         const REAL *p1=mPowderPatternObs.data();
-         const REAL *p2=mPowderPatternComponentRegistry.GetObj(mScalableComponentIndex(i))
-                           .mPowderPatternCalc.data();
-         const REAL *p3=mPowderPatternWeight.data();
-         REAL b=0.;
-         if(mPowderPatternBackgroundCalc.numElements()<=1)
-            for(unsigned long k=0;k<mNbPointUsed;k++) b += *p1++ * *p2++ * *p3++;
-         else
-         {
-            const REAL *p4=mPowderPatternBackgroundCalc.data();
-            for(unsigned long k=0;k<mNbPointUsed;k++)
-               b += (*p1++ - *p4++) * *p2++ * *p3++;
-         }
-         mFitScaleFactorB(i,0) =b;
+         unsigned long min=(unsigned long)floor(this->X2Pixel(mExcludedRegionMinX(k)));
+         unsigned long max=(unsigned long)ceil (this->X2Pixel(mExcludedRegionMaxX(k)));
+         if(min>mNbPointUsed) break;
+         if(max>mNbPointUsed)max=mNbPointUsed;
+         //! min is the *beginning* of the excluded region
+         if(min>l) vSegment.push_back(make_pair(l,min));
+         if(max>l) l=max;
       }
+      if(l<mNbPointUsed) vSegment.push_back(make_pair(l,(unsigned long)mNbPointUsed));
    }
-   else
+   // Build Matrix & Vector for LSQ
+   const REAL *pw=mPowderPatternWeight.data();
+   const REAL *pobs=mPowderPatternObs.data();
+   for(int i=0;i<nbScale;i++)
    {
-      unsigned long min,max;
-      for(int i=0;i<nbScale;i++)
-      {
-         for(int j=i;j<nbScale;j++)
-         {
-            // Here use a direct access to the powder spectrum, since
-            // we know it has just been recomputed
-            const REAL *p1=mPowderPatternComponentRegistry.GetObj(mScalableComponentIndex(i))
-                              .mPowderPatternCalc.data();
-            const REAL *p2=mPowderPatternComponentRegistry.GetObj(mScalableComponentIndex(j))
-                              .mPowderPatternCalc.data();
-            const REAL *p3=mPowderPatternWeight.data();
-            REAL m=0.;
-            unsigned long l=0;
-            for(int k=0;k<nbExclude;k++)
-            {
-               min=(unsigned long)floor(this->X2Pixel(mExcludedRegionMinX(j)));
-               max=(unsigned long)ceil (this->X2Pixel(mExcludedRegionMaxX(j)));
-               if(min>mNbPointUsed) break;
-               if(max>mNbPointUsed)max=mNbPointUsed;
-               //! min is the *beginning* of the excluded region
-               for(;l<min;l++) m += *p1++ * *p2++ * *p3++;
-               p1 += max-l;
-               p2 += max-l;
-               p3 += max-l;
-               l  = max;
-            }
-            for(;l<mNbPointUsed;l++) m += *p1++ * *p2++ * *p3++;
-            mFitScaleFactorM(i,j)=m;
-            mFitScaleFactorM(j,i)=m;
-         }
-      }
-      for(int i=0;i<nbScale;i++)
+      // Here use a direct access to the powder spectrum, since
+      // we know it has just been recomputed
+      const REAL *p1=mPowderPatternComponentRegistry.GetObj(mScalableComponentIndex(i))
+                        .mPowderPatternCalc.data();
+      for(int j=i;j<nbScale;j++)
       {
-         const REAL *p1=mPowderPatternObs.data();
-         const REAL *p2=mPowderPatternComponentRegistry
-                           .GetObj(mScalableComponentIndex(i))
-                              .mPowderPatternCalc.data();
-         const REAL *p3=mPowderPatternWeight.data();
-         REAL b=0.;
-         unsigned long l=0;
+         const REAL *p2=mPowderPatternComponentRegistry.GetObj(mScalableComponentIndex(j))
+                           .mPowderPatternCalc.data();
+         REAL m=0.;
+         for(vector<pair<unsigned long,unsigned long> >::const_iterator pos=vSegment.begin();
+             pos!=vSegment.end();++pos)
+            m += SumProduct(p1+pos->first,p2+pos->first,pw+pos->first,pos->second-pos->first);
+         mFitScaleFactorM(i,j)=m;
+         mFitScaleFactorM(j,i)=m;
+      }
+      REAL b=0.;
+      for(vector<pair<unsigned long,unsigned long> >::const_iterator pos=vSegment.begin();
+          pos!=vSegment.end();++pos)
+      {
+         const unsigned long k=pos->first,nb=pos->second-pos->first;
          if(mPowderPatternBackgroundCalc.numElements()<=1)
-         {
-            for(int k=0;k<nbExclude;k++)
-            {
-               min=(unsigned long)floor(this->X2Pixel(mExcludedRegionMinX(k)));
-               max=(unsigned long)ceil (this->X2Pixel(mExcludedRegionMaxX(k)));
-               if(min>mNbPointUsed) break;
-               if(max>mNbPointUsed)max=mNbPointUsed;
-               //! min is the *beginning* of the excluded region
-               for(;l<min;l++) b += *p1++ * *p2++ * *p3++;
-               p1 += max-l;
-               p2 += max-l;
-               p3 += max-l;
-               l  = max;
-            }
-            for(;l<mNbPointUsed;l++) b += *p1++ * *p2++ * *p3++;
-         }
+            b += SumProduct(pobs+k,p1+k,pw+k,nb);
          else
-         {
-            const REAL *p4=mPowderPatternBackgroundCalc.data();
-            for(int k=0;k<nbExclude;k++)
-            {
-               min=(unsigned long)floor(this->X2Pixel(mExcludedRegionMinX(k)));
-               max=(unsigned long)ceil (this->X2Pixel(mExcludedRegionMaxX(k)));
-               if(min>mNbPointUsed) break;
-               if(max>mNbPointUsed)max=mNbPointUsed;
-               //! min is the *beginning* of the excluded region
-               for(;l<min;l++) b += (*p1++ - *p4++) * *p2++ * *p3++;
-               p1 += max-l;
-               p2 += max-l;
-               p3 += max-l;
-               l  = max;
-            }
-            for(;l<mNbPointUsed;l++) b += (*p1++ - *p4++) * *p2++ * *p3++;
-         }
-         mFitScaleFactorB(i,0) =b;
+            b += SumDiffProduct(pobs+k,mPowderPatternBackgroundCalc.data()+k,p1+k,pw+k,nb);
       }
+      mFitScaleFactorB(i,0) =b;
    }
    if(1==nbScale) mFitScaleFactorX=mFitScaleFactorB(0)/mFitScaleFactorM(0);
    else
@@ -4914,7 +4951,7 @@ void PowderPattern::FitScaleFactorForRw()const
          (*fpObjCrystInformUser)("Warning:FitScaleFactorForRw working around NaN scale factor...");
          continue;
       }
-      for(unsigned long j=0;j<mNbPointUsed;j++) *p0++ += s * *p1++;
+      AddScaled(p0,s,p1,mNbPointUsed);
       VFN_DEBUG_MESSAGE("-> Old:"<<mScaleFactor(mScalableComponentIndex(i)) <<" Change:"<<mFitScaleFactorX(i),3);
       mScaleFactor(mScalableComponentIndex(i)) = mFitScaleFactorX(i);
       mClockScaleFactor.Click();
@@ -5289,6 +5326,8 @@ REAL PowderPattern::GetLogLikelihood()const
    return tmp;
 }
 
+unsigned int PowderPattern::GetLogLikelihoodTier()const{return 1;}
+
 unsigned int PowderPattern::GetNbLSQFunction()const{return 2;}
 
 const CrystVector_REAL&
@@ -5436,6 +5475,15 @@ void PowderPattern::SetMaxSinThetaOvLambda(const REAL max)
 
 REAL PowderPattern::GetMaxSinThetaOvLambda()const{return mMaxSinThetaOvLambda;}
 
+void PowderPattern::SetResolutionFactor(const REAL factor)
+{
+   mResolutionFactor=factor;
+   this->CalcNbPointUsed(true);
+   // Update the number of reflections used by the components, which depends
+   // on the number of points used.
+   this->RefinableObj::SetResolutionFactor(factor);
+}
+
 const CrystVector_long& PowderPattern::GetIntegratedProfileMin()const
 {
    this->PrepareIntegratedRfactor();
@@ -6796,18 +6844,25 @@ void PowderPattern::PrepareIntegratedRfactor()const
    mClockIntegratedFactorsPrep.Click();
    VFN_DEBUG_EXIT("PowderPattern::PrepareIntegratedRfactor()",3);
 }
-void PowderPattern::CalcNbPointUsed()const
+void PowderPattern::CalcNbPointUsed(const bool force)const
 {
-   if(this->IsBeingRefined())return;
+   if(this->IsBeingRefined()&&(!force))return;
+   REAL maxSTOL=mMaxSinThetaOvLambda;
+   if((mResolutionFactor<1)&&(mNbPoint>0))
+   {// Fraction of the resolution actually reached by the pattern
+      const REAL stol=max(this->X2STOL(this->GetPowderPatternXMin()),
+                          this->X2STOL(this->GetPowderPatternXMax()));
+      maxSTOL=min(mMaxSinThetaOvLambda,stol)*mResolutionFactor;
+   }
    unsigned long tmp;
    // Use the first point of the profile of the first reflection not calculated
    if(this->GetRadiation().GetWavelengthType()==WAVELENGTH_TOF)
    {
-      tmp=(unsigned long)(this->X2PixelCorr(this->STOL2X(mMaxSinThetaOvLambda)));
+      tmp=(unsigned long)(this->X2PixelCorr(this->STOL2X(maxSTOL)));
    }
    else
    {
-      REAL sinth=mMaxSinThetaOvLambda*this->GetWavelength();
+      REAL sinth=maxSTOL*this->GetWavelength();
       if(1>fabs(sinth)) tmp=(unsigned long)(this->X2PixelCorr(2*asin(sinth))); else tmp=mNbPoint;
    }
    if(tmp>mNbPoint) tmp= mNbPoint;
@@ -6815,7 +6870,7 @@ void PowderPattern::CalcNbPointUsed()const
    {
       mNbPointUsed=tmp;
       mClockNbPointUsed.Click();
-      VFN_DEBUG_MESSAGE("PowderPattern::CalcNbPointUsed():"<<mNbPointUsed<<" max(sin(theta)/lambda)="<<mMaxSinThetaOvLambda, 3)
+      VFN_DEBUG_MESSAGE("PowderPattern::CalcNbPointUsed():"<<mNbPointUsed<<" max(sin(theta)/lambda)="<<maxSTOL, 3)
    }
 
 }
@@ -6827,6 +6882,8 @@ void PowderPattern::InitOptions()
    static string OptProfileIntegrationChoices[2];
 
    static bool needInitNames=true;
+   static mutex needInitNamesMutex;
+   lock_guard<mutex> needInitNamesLock(needInitNamesMutex);
    if(true==needInitNames)
    {
       OptProfileIntegrationName="Use Integrated Profiles";
@@ -255,8 +255,12 @@ class PowderPatternBackground : public PowderPatternComponent
       * each with 200 cycles.
       *
       * See the class documentation for PowderPatternBackgroundBayesianMinimiser.
+      *
+      * \param nbThread: number of threads used by the simplex (see SimplexObj::AddWorker()),
+      * each working on a copy of this background. The default is 1, 0 means all cores.
+      * The result does not depend on the number of threads.
       */
-      void OptimizeBayesianBackground();
+      void OptimizeBayesianBackground(const unsigned int nbThread=1);
       /** Fix parameters corresponding to points of the pattern that are not actually calculated.
       * This is necessary for modelling using splines, to avoid divergence of interpolation
       * points during least squares optimization.
@@ -395,12 +399,15 @@ class PowderPatternDiffraction : virtual public PowderPatternComponent,public Sc
       bool GetExtractionMode()const;
       /** Extract intensities using Le Bail method
       *
-      *\param nbcycle: number of cycles
+      * Reflection profiles are computed once and re-used for all cycles.
+      *\param nbcycle: maximum number of cycles
+      *\param convergence: if >0, stop when the relative change of the extracted
+      * intensities, sum(abs(I_new-I_old))/sum(abs(I_new)), is below this value.
+      *\param nbthread: number of threads used to partition the observed intensity
+      * between reflections (0: use all available cores). Only patterns with
+      * many reflections are split between threads.
       */
-      void ExtractLeBail(unsigned int nbcycle=1);
-      /// Recalc, and get the number of reflections which should be actually used,
-      /// due to the maximuml sin(theta)/lambda value set.
-      virtual long GetNbReflBelowMaxSinThetaOvLambda()const;
+      void ExtractLeBail(unsigned int nbcycle=1,const REAL convergence=0,unsigned int nbthread=1);
       /// Change one parameter in mFrozenLatticePar. This triggers a call to CalcLocalBMatrix() if the parameter has changed
       void SetFrozenLatticePar(const unsigned int i, REAL v);
       /// Access to one parameter in mFrozenLatticePar
@@ -441,6 +448,19 @@ class PowderPatternDiffraction : virtual public PowderPatternComponent,public Sc
       /// \internal Calc derivatives of reflection profiles for all used reflections,
       /// for a given list of refinable parameters
       void CalcPowderReflProfile_FullDeriv(std::set<RefinablePar *> &vPar);
+      /// \internal Update the number of reflections used, from the number of points
+      /// used in the parent PowderPattern.
+      virtual void CalcNbReflBelowMaxSinThetaOvLambda()const;
+      /** \internal Le Bail partition of the observed intensity for reflections [k0begin;k0end[
+      *
+      *\param ratio: ratio of the observed and calculated patterns (excluding other phases)
+      *\param iextract: the extracted intensities, only the [k0begin;k0end[ range is written
+      *\param nbPointUsed: the parent PowderPattern's GetNbPointUsed(), computed before
+      * the worker threads are started
+      */
+      void CalcLeBailPartition(const CrystVector_REAL &ratio,CrystVector_REAL &iextract,
+                               const long nbPointUsed,
+                               const unsigned long k0begin,const unsigned long k0end)const;
       /// \internal Calc Lorentz-Polarisation-Aperture correction
       void CalcIntensityCorr()const;
       /// \internal Compute the intensity for all reflections (taking into account
@@ -467,6 +487,10 @@ class PowderPatternDiffraction : virtual public PowderPatternComponent,public Sc
          mutable RefinableObjClock mClockIntensityCorr;
          /// Last time the reflection profiles were computed
          mutable RefinableObjClock mClockProfileCalc;
+         /// Number of points used in the parent pattern when the profiles were computed.
+         /// They need not be re-computed if fewer points are used (e.g. with a lower
+         /// resolution factor during a global optimization).
+         mutable unsigned long mNbPointUsedProfileCalc;
          /// Last time intensities were computed
          mutable RefinableObjClock mClockIhklCalc;
       /// Profile
@@ -568,6 +592,13 @@ class PowderPatternDiffraction : virtual public PowderPatternComponent,public Sc
       void GenHKLFullSpace(const REAL, const bool) const;
 };
 
+/// File formats which can be imported by PowderPattern::ImportPowderPatternFiles(),
+/// each corresponding to one of the PowderPattern::ImportPowderPattern*() functions.
+enum PowderPatternFileFormat { POWDER_FILE_FULLPROF, POWDER_FILE_PSI_DMC, POWDER_FILE_ILL_D1A5,
+                               POWDER_FILE_XDD, POWDER_FILE_SIETRONICS_CPI,
+                               POWDER_FILE_2THETA_OBS_SIGMA, POWDER_FILE_2THETA_OBS,
+                               POWDER_FILE_TOF_ISIS_XYSIGMA};
+
 //######################################################################
 /** \brief Powder pattern class, with an observed pattern and several
 * calculated components to modelize the pattern.
@@ -810,6 +841,29 @@ class PowderPattern : public RefinableObj
          /** Import CIF powder pattern data.
          */
          void ImportPowderPatternCIF(const CIF &cif);
+         /** \brief Import a list of powder pattern files, in parallel.
+         *
+         * The files are read and parsed by several threads, and a new PowderPattern
+         * is then created for each file (in the same order), named after the file.
+         * The caller is responsible for deleting these objects. If any file cannot
+         * be imported, an exception is thrown and no object is created.
+         *\param filenames: the list of files
+         *\param format: the format of all files
+         *\param nbSkip: the number of lines to skip at the beginning of each file,
+         * only for the POWDER_FILE_2THETA_OBS_SIGMA and POWDER_FILE_2THETA_OBS formats.
+         *\param nbThread: the number of threads, or 0 to use all available cores
+         */
+         static vector<PowderPattern*> ImportPowderPatternFiles(const vector<string> &filenames,
+                                                                const PowderPatternFileFormat format,
+                                                                const int nbSkip=0,
+                                                                const unsigned int nbThread=0);
+         /** \brief Import all powder pattern files matching a shell wildcard pattern,
+         * e.g. "insitu/scan_*.xye", sorted by name. See ImportPowderPatternFiles().
+         */
+         static vector<PowderPattern*> ImportPowderPatternGlob(const string &pattern,
+                                                               const PowderPatternFileFormat format,
+                                                               const int nbSkip=0,
+                                                               const unsigned int nbThread=0);
          /** \brief Set observed powder pattern from vector array.
          *
          * Note: powder pattern parameters must have been set before calling this function,
@@ -893,6 +947,8 @@ class PowderPattern : public RefinableObj
       virtual void GlobalOptRandomMove(const REAL mutationAmplitude,
                                        const RefParType *type=gpRefParTypeObjCryst);
       virtual REAL GetLogLikelihood()const;
+      /// Returns 1: the powder pattern cost is computed after cheap (tier 0) terms.
+      virtual unsigned int GetLogLikelihoodTier()const;
       //LSQ functions
          virtual unsigned int GetNbLSQFunction()const;
          virtual const CrystVector_REAL& GetLSQCalc(const unsigned int) const;
@@ -912,6 +968,12 @@ class PowderPattern : public RefinableObj
       virtual void SetMaxSinThetaOvLambda(const REAL max);
       /// Get the maximum value for sin(theta)/lambda.
       REAL GetMaxSinThetaOvLambda()const;
+      /** Only use the pattern points below factor*max(sin(theta)/lambda), for faster
+      * calculations during global optimizations. The max is the lowest of the
+      * one set by SetMaxSinThetaOvLambda() and the one reached by the pattern. The change is applied immediately
+      * (even when the pattern is being refined) to the pattern and its components.
+      */
+      virtual void SetResolutionFactor(const REAL factor);
 
       // For integrated pattern calculations
          /// Get the list of first pixels for the integration intervals
@@ -996,10 +1058,41 @@ class PowderPattern : public RefinableObj
       /// Prepare  the calculation of the integrated R-factors
       void PrepareIntegratedRfactor()const;
       /// Calculate the number of points of the pattern actually used, from the maximum
-      /// value of sin(theta)/lambda
-      void CalcNbPointUsed()const;
+      /// value of sin(theta)/lambda and the resolution factor. Unless force=true, this
+      /// does nothing while the pattern is being refined.
+      void CalcNbPointUsed(const bool force=false)const;
       /// Initialize options
       virtual void InitOptions();
+      /// \internal Observed data read from a file, see ParseImportFile()
+      struct ImportData
+      {
+         ImportData():mMin(0),mStep(0),mNbPoint(0),mSigmaFromObs(false),mTOF(false){}
+         /// The x coordinates (2theta in radians, or TOF). If empty, they are
+         /// given by mMin, mStep and mNbPoint.
+         CrystVector_REAL mX;
+         REAL mMin,mStep;
+         unsigned long mNbPoint;
+         /// Observed intensities and their uncertainty
+         CrystVector_REAL mObs,mSigma;
+         /// If true, the uncertainties are not in the file and will be set to sqrt(Iobs)
+         bool mSigmaFromObs;
+         /// Is this a TOF pattern ?
+         bool mTOF;
+      };
+      /// \internal Read and parse a powder pattern file. This does not use any
+      /// ObjCryst object (nor throw an ObjCrystException), so it can be called from
+      /// several threads.
+      /// \return an error message, or an empty string if the file was imported.
+      static string ParseImportFile(const string &filename,const PowderPatternFileFormat format,
+                                    const int nbSkip,ImportData &data);
+      /// \internal Parse the files first, first+step,... for ImportPowderPatternFiles().
+      /// The error message is stored for the files which could not be imported.
+      static void ParseImportFiles(const vector<string> &filenames,
+                                   const PowderPatternFileFormat format,const int nbSkip,
+                                   vector<ImportData> &vData,vector<string> &vError,
+                                   const unsigned int first,const unsigned int step);
+      /// \internal Use data read from a file as the observed pattern
+      void SetImportData(const ImportData &data);
 
       /// The calculated powder pattern. It is mutable since it is
       /// completely defined by other parameters (eg it is not an 'independent parameter')
@@ -1140,6 +1233,8 @@ class PowderPattern : public RefinableObj
       * the max is calculated.
       */
       REAL mMaxSinThetaOvLambda;
+      /// Fraction of the maximum sin(theta)/lambda actually used, see SetResolutionFactor()
+      REAL mResolutionFactor;
       /// Number of points actually used, due to the maximum value of
       /// sin(theta)/lambda.
       mutable unsigned long mNbPointUsed;
@@ -1149,6 +1244,7 @@ class PowderPattern : public RefinableObj
       /// Clock recording the last time the number of points used (PowderPattern::mNbPointUsed)
       /// was changed.
       mutable RefinableObjClock mClockNbPointUsed;
+   friend class PowderPatternSequentialRefinement;
    #ifdef __WX__CRYST__
    public:
       virtual WXCrystObjBasic* WXCreate(wxWindow*);
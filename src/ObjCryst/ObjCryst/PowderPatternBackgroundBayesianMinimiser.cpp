@@ -26,7 +26,14 @@ namespace ObjCryst
 {
 PowderPatternBackgroundBayesianMinimiser::
    PowderPatternBackgroundBayesianMinimiser(PowderPatternBackground &backgd):
-mpBackground(&backgd)
+mpBackground(&backgd),mOwnBackground(false)
+{
+   this->AddSubRefObj(*mpBackground);
+}
+
+PowderPatternBackgroundBayesianMinimiser::
+   PowderPatternBackgroundBayesianMinimiser(const PowderPatternBackgroundBayesianMinimiser &old):
+mpBackground(new PowderPatternBackground(*(old.mpBackground))),mOwnBackground(true)
 {
    this->AddSubRefObj(*mpBackground);
 }
@@ -34,6 +41,7 @@ mpBackground(&backgd)
 PowderPatternBackgroundBayesianMinimiser::~PowderPatternBackgroundBayesianMinimiser()
 {
    this->RemoveSubRefObj(*mpBackground);
+   if(mOwnBackground) delete mpBackground;
 }
 
 const string& PowderPatternBackgroundBayesianMinimiser::GetClassName()const
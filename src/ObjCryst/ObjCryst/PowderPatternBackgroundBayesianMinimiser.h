@@ -37,6 +37,11 @@ class PowderPatternBackgroundBayesianMinimiser:public RefinableObj
 {
    public:
       PowderPatternBackgroundBayesianMinimiser(PowderPatternBackground &backgd);
+      /** Copy constructor: the new object works on its own copy of the background
+      * (with the same parent PowderPattern, which is only read), and can be used
+      * concurrently with the original one, e.g. as a SimplexObj worker.
+      */
+      PowderPatternBackgroundBayesianMinimiser(const PowderPatternBackgroundBayesianMinimiser &old);
       ~PowderPatternBackgroundBayesianMinimiser();
       virtual const string& GetClassName()const;
       virtual REAL GetLogLikelihood()const;
@@ -72,6 +77,8 @@ class PowderPatternBackgroundBayesianMinimiser:public RefinableObj
    */
    static REAL BayesianBackgroundLogLikelihood(const REAL t);
    PowderPatternBackground *mpBackground;
+   /// Is mpBackground owned by this object (copy) ?
+   bool mOwnBackground;
    /// Bayesian cost (-log(likelihood)) for each point
    mutable CrystVector_REAL mBayesianCalc;
    /// Obs==0 (desired -log(likelihood))
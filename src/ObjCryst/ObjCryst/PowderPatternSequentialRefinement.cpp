@@ -0,0 +1,220 @@
+/*  ObjCryst++ Object-Oriented Crystallographic Library
+    (c) 2000-2002 Vincent Favre-Nicolin vincefn@users.sourceforge.net
+        2000-2001 University of Geneva (Switzerland)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+/*
+*  source file for sequential refinement against a series of powder patterns
+*
+*/
+#include <sstream>
+#include <iomanip>
+#include <thread>
+
+#include "ObjCryst/ObjCryst/PowderPatternSequentialRefinement.h"
+#include "ObjCryst/Quirks/VFNDebug.h"
+
+namespace ObjCryst
+{
+
+PowderPatternSequentialRefinement::PowderPatternSequentialRefinement(PowderPattern &pattern):
+mpPattern(&pattern),mLSQ("Sequential refinement: "+pattern.GetName()),
+mFormat(POWDER_FILE_2THETA_OBS_SIGMA),mNbSkip(0),
+mSeedFromPrevious(true),mPipelineLoading(true),mpOutputStream(0)
+{
+   mLSQ.SetRefinedObj(pattern,0,true,true);
+}
+
+PowderPatternSequentialRefinement::~PowderPatternSequentialRefinement()
+{}
+
+void PowderPatternSequentialRefinement::SetFiles(const vector<string> &filenames,
+                                                 const PowderPatternFileFormat format,
+                                                 const int nbSkip)
+{
+   mvFilename=filenames;
+   mFormat=format;
+   mNbSkip=nbSkip;
+}
+
+unsigned long PowderPatternSequentialRefinement::GetNbFile()const{return mvFilename.size();}
+
+LSQNumObj& PowderPatternSequentialRefinement::GetLSQNumObj(){return mLSQ;}
+
+void PowderPatternSequentialRefinement::SetSeedFromPrevious(const bool b){mSeedFromPrevious=b;}
+
+void PowderPatternSequentialRefinement::SetPipelineLoading(const bool b){mPipelineLoading=b;}
+
+void PowderPatternSequentialRefinement::SetOutputStream(ostream *os){mpOutputStream=os;}
+
+void PowderPatternSequentialRefinement::Run(const int nbCycle,const bool useLevenbergMarquardt,
+                                            const float minChi2var)
+{
+   TAU_PROFILE("PowderPatternSequentialRefinement::Run()","void ()",TAU_DEFAULT);
+   VFN_DEBUG_ENTRY("PowderPatternSequentialRefinement::Run():"<<mvFilename.size()<<" files",5)
+   const unsigned long nb=mvFilename.size();
+   if(nb==0) throw ObjCrystException("PowderPatternSequentialRefinement::Run(): no file to refine !");
+   RefinableObj *pObj=&(mLSQ.GetCompiledRefinedObj());
+   if(pObj->GetNbPar()==0) mLSQ.PrepareRefParList();
+   pObj=&(mLSQ.GetCompiledRefinedObj());
+   // The reported parameters are those which are refined
+   vector<long> vParIndex;
+   mvParName.clear();
+   for(long i=0;i<pObj->GetNbPar();i++)
+      if((!pObj->GetPar(i).IsFixed())&&pObj->GetPar(i).IsUsed())
+      {
+         vParIndex.push_back(i);
+         mvParName.push_back(pObj->GetPar(i).GetName());
+      }
+   const unsigned long nbPar=vParIndex.size();
+   mParValues.resize(nb,nbPar);
+   mParSigmas.resize(nb,nbPar);
+   mParValues=0;
+   mParSigmas=0;
+   mRw.resize(nb);
+   mChi2.resize(nb);
+   mRw=0;
+   mChi2=0;
+   mvSuccess.assign(nb,false);
+   if(mpOutputStream!=0)
+   {
+      *mpOutputStream<<"# File Rwp Chi2";
+      for(unsigned long j=0;j<nbPar;j++)
+         *mpOutputStream<<" "<<mvParName[j]<<" sigma("<<mvParName[j]<<")";
+      *mpOutputStream<<endl;
+   }
+   const unsigned long initialSet=pObj->CreateParamSet("Sequential refinement: initial values");
+   const unsigned long previousSet=pObj->CreateParamSet("Sequential refinement: previous values");
+
+   // The object graph is only prepared once for the whole series
+   mLSQ.BeginOptimization(false);
+   PowderPattern::ImportData data,nextData;
+   string error,nextError;
+   ParseFile(mvFilename[0],mFormat,mNbSkip,data,error);
+   for(unsigned long i=0;i<nb;i++)
+   {
+      thread loader;
+      if(i<(nb-1))
+      {
+         if(mPipelineLoading)
+            loader=ObjRegistryIsolation::StartThread(&PowderPatternSequentialRefinement::ParseFile,
+                          cref(mvFilename[i+1]),mFormat,mNbSkip,ref(nextData),ref(nextError));
+      }
+      try
+      {
+         if(error=="")
+         {
+            if(!mSeedFromPrevious) pObj->RestoreParamSet(initialSet);
+            pObj->SaveParamSet(previousSet);
+            try
+            {
+               mpPattern->SetImportData(data);
+               mLSQ.Refine(nbCycle,useLevenbergMarquardt,true,false,minChi2var);
+               mvSuccess[i]=true;
+            }
+            catch(const ObjCrystException &except)
+            {
+               pObj->RestoreParamSet(previousSet);
+               error="refinement failed: "+except.message;
+            }
+            catch(const std::exception &except)
+            {
+               pObj->RestoreParamSet(previousSet);
+               error=string("refinement failed: ")+except.what();
+            }
+         }
+         if(mvSuccess[i])
+         {
+            for(unsigned long j=0;j<nbPar;j++)
+            {
+               mParValues(i,j)=pObj->GetPar(vParIndex[j]).GetHumanValue();
+               mParSigmas(i,j)=pObj->GetPar(vParIndex[j]).GetHumanSigma();
+            }
+            mRw(i)=mpPattern->GetRw();
+            mChi2(i)=mpPattern->GetChi2();
+         }
+         this->WriteResult(i,error);
+      }
+      catch(...)
+      {// The loader thread must be joined before it is destroyed
+         if(loader.joinable()) loader.join();
+         throw;
+      }
+      if(i<(nb-1))
+      {
+         if(loader.joinable()) loader.join();
+         else ParseFile(mvFilename[i+1],mFormat,mNbSkip,nextData,nextError);
+         swap(data,nextData);
+         error=nextError;
+         nextData=PowderPattern::ImportData();
+      }
+   }
+   mLSQ.EndOptimization();
+   pObj->ClearParamSet(previousSet);
+   pObj->ClearParamSet(initialSet);
+   VFN_DEBUG_EXIT("PowderPatternSequentialRefinement::Run()",5)
+}
+
+const vector<string>& PowderPatternSequentialRefinement::GetParNames()const{return mvParName;}
+
+const CrystMatrix_REAL& PowderPatternSequentialRefinement::GetParValues()const{return mParValues;}
+
+const CrystMatrix_REAL& PowderPatternSequentialRefinement::GetParSigmas()const{return mParSigmas;}
+
+const CrystVector_REAL& PowderPatternSequentialRefinement::GetRw()const{return mRw;}
+
+const CrystVector_REAL& PowderPatternSequentialRefinement::GetChi2()const{return mChi2;}
+
+const vector<bool>& PowderPatternSequentialRefinement::GetSuccess()const{return mvSuccess;}
+
+void PowderPatternSequentialRefinement::ParseFile(const string &filename,
+                                                  const PowderPatternFileFormat format,
+                                                  const int nbSkip,
+                                                  PowderPattern::ImportData &data,string &error)
+{
+   try
+   {
+      error=PowderPattern::ParseImportFile(filename,format,nbSkip,data);
+   }
+   catch(const std::exception &except)
+   {
+      error=string("error reading file: ")+except.what();
+   }
+}
+
+void PowderPatternSequentialRefinement::WriteResult(const unsigned long i,const string &error)const
+{
+   VFN_DEBUG_MESSAGE("PowderPatternSequentialRefinement::WriteResult():"<<mvFilename[i]<<":"<<error,5)
+   if(error!="")
+   {
+      char buf[200];
+      sprintf(buf,"Sequential refinement: pattern #%lu, ",i);
+      (*fpObjCrystInformUser)(string(buf)+mvFilename[i]+": "+error);
+   }
+   if(mpOutputStream==0) return;
+   // Format the line separately, so that the output stream flags are unchanged
+   stringstream s;
+   s<<setprecision(8)<<mvFilename[i];
+   if(mvSuccess[i])
+   {
+      s<<" "<<mRw(i)<<" "<<mChi2(i);
+      for(long j=0;j<mParValues.cols();j++) s<<" "<<mParValues(i,j)<<" "<<mParSigmas(i,j);
+   }
+   else s<<" # "<<error;
+   *mpOutputStream<<s.str()<<endl;
+}
+
+}//namespace
@@ -0,0 +1,152 @@
+/*  ObjCryst++ Object-Oriented Crystallographic Library
+    (c) 2000-2002 Vincent Favre-Nicolin vincefn@users.sourceforge.net
+        2000-2001 University of Geneva (Switzerland)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+/*   PowderPatternSequentialRefinement.h
+*  Sequential (parametric) refinement against a series of powder patterns
+*
+*/
+#ifndef __POWDERPATTERNSEQUENTIALREFINEMENT_H
+#define __POWDERPATTERNSEQUENTIALREFINEMENT_H
+
+#include "ObjCryst/CrystVector/CrystVector.h"
+#include "ObjCryst/RefinableObj/LSQNumObj.h"
+#include "ObjCryst/ObjCryst/PowderPattern.h"
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+namespace ObjCryst
+{
+/** \brief Sequential refinement of one model against a series of powder patterns
+* (e.g. a temperature or time series).
+*
+* The same PowderPattern object (with its components, crystal structures, etc...)
+* is used for all the patterns of the series: only the observed intensities are
+* replaced before each refinement. If all patterns share the same x coordinates,
+* the reflection list, the profiles and the scattering factors are
+* therefore only computed once.
+*
+* Each refinement starts from the result of the previous one. The next file can be
+* read while the current pattern is being refined, and the results (refined values and
+* their uncertainties, R-factors) are written to a stream as soon as each pattern
+* has been refined.
+*
+* \code
+* PowderPatternSequentialRefinement seq(pattern);
+* seq.SetFiles(filenames,POWDER_FILE_2THETA_OBS_SIGMA,1);
+* seq.GetLSQNumObj().PrepareRefParList();
+* seq.GetLSQNumObj().SetParIsFixed(gpRefParTypeUnitCell,false);
+* ofstream out("results.txt");
+* seq.SetOutputStream(&out);
+* seq.Run();
+* \endcode
+*/
+class PowderPatternSequentialRefinement
+{
+   public:
+      /** Constructor
+      *
+      * \param pattern: the powder pattern which will be refined. Its sub-objects
+      * (crystal structures, radiation...) are also refined.
+      */
+      PowderPatternSequentialRefinement(PowderPattern &pattern);
+      ~PowderPatternSequentialRefinement();
+      /** Set the list of files to be refined, in the order of the refinement.
+      *
+      * \param format, nbSkip: see PowderPattern::ImportPowderPatternFiles().
+      */
+      void SetFiles(const vector<string> &filenames,const PowderPatternFileFormat format,
+                    const int nbSkip=0);
+      /// Number of files in the series
+      unsigned long GetNbFile()const;
+      /** Access to the least-squares object used for all refinements.
+      *
+      * This can be used to choose which parameters are refined (after calling
+      * LSQNumObj::PrepareRefParList()). If the parameter list has not been prepared,
+      * this is done at the beginning of Run().
+      */
+      LSQNumObj& GetLSQNumObj();
+      /// If true (the default), each refinement starts from the result of the previous one.
+      /// Otherwise all refinements start from the parameter values at the beginning of Run().
+      void SetSeedFromPrevious(const bool b);
+      /// If true (the default), the next file is read (in another thread) while
+      /// the current pattern is refined.
+      void SetPipelineLoading(const bool b);
+      /// Results are written to this stream (one line per pattern) as soon as each
+      /// pattern has been refined. Use 0 (the default) to disable.
+      void SetOutputStream(ostream *os);
+      /** Refine the model against all the patterns of the series.
+      *
+      * The parameters are those of LSQNumObj::Refine(). If a file cannot be read or its
+      * refinement fails, the parameters are reverted to their values before this
+      * refinement, and the result is marked as failed (see GetSuccess()) before
+      * going on with the next pattern.
+      *
+      * The powder pattern is left with the observed data and refined parameters of the
+      * last pattern.
+      */
+      void Run(const int nbCycle=-20,const bool useLevenbergMarquardt=true,
+               const float minChi2var=0.001);
+      /// Names of the refined parameters reported in the results
+      const vector<string>& GetParNames()const;
+      /// Refined values (human units) of all reported parameters, for each pattern
+      /// (one row per pattern).
+      const CrystMatrix_REAL& GetParValues()const;
+      /// Uncertainty of the refined values, for each pattern (one row per pattern).
+      const CrystMatrix_REAL& GetParSigmas()const;
+      /// Rwp for each pattern
+      const CrystVector_REAL& GetRw()const;
+      /// Chi^2 for each pattern
+      const CrystVector_REAL& GetChi2()const;
+      /// Were the file successfully read and the refinement done, for each pattern ?
+      const vector<bool>& GetSuccess()const;
+   protected:
+      /// Parse one file. This is used to read the next file while the current one is refined.
+      static void ParseFile(const string &filename,const PowderPatternFileFormat format,
+                            const int nbSkip,PowderPattern::ImportData &data,string &error);
+      /// Write the results for one pattern to the output stream
+      void WriteResult(const unsigned long i,const string &error)const;
+      /// The refined powder pattern
+      PowderPattern *mpPattern;
+      /// The least-squares object used for all refinements
+      LSQNumObj mLSQ;
+      /// The files to be refined
+      vector<string> mvFilename;
+      /// Format of the files
+      PowderPatternFileFormat mFormat;
+      /// Number of lines to skip at the beginning of each file
+      int mNbSkip;
+      /// Start each refinement from the result of the previous one ?
+      bool mSeedFromPrevious;
+      /// Read the next file while refining the current one ?
+      bool mPipelineLoading;
+      /// Stream where the results are written, or 0
+      ostream *mpOutputStream;
+      /// Names of the reported parameters
+      vector<string> mvParName;
+      /// Results: refined values and uncertainties (one row per pattern)
+      CrystMatrix_REAL mParValues,mParSigmas;
+      /// Results: R-factor and Chi^2
+      CrystVector_REAL mRw,mChi2;
+      /// Results: was the refinement successful ?
+      vector<bool> mvSuccess;
+};
+
+}//namespace
+#endif //__POWDERPATTERNSEQUENTIALREFINEMENT_H
@@ -68,7 +68,7 @@ extern const RefParType *gpRefParTypeScattDataProfileWidth;
 extern const RefParType *gpRefParTypeScattDataProfileAsym;
 
 ObjRegistry<ReflectionProfile>
-   gReflectionProfileRegistry("List of all ReflectionProfile types");;
+   gReflectionProfileRegistry("List of all ReflectionProfile types",true);;
 ////////////////////////////////////////////////////////////////////////
 //
 //    ReflectionProfile
@@ -83,6 +83,21 @@ ReflectionProfile::~ReflectionProfile()
 {}
 bool ReflectionProfile::IsAnisotropic()const
 {return false;}
+CrystVector_REAL ReflectionProfile::GetMultiLineProfile(const CrystVector_REAL &x,
+                                                       const CrystVector_REAL &vcenter,
+                                                       const CrystVector_REAL &vfactor,
+                                                       const REAL h, const REAL k, const REAL l)const
+{
+   CrystVector_REAL profile,tmpV;
+   for(long line=0;line<vcenter.numElements();line++)
+   {
+      tmpV=this->GetProfile(x,vcenter(line),h,k,l);
+      tmpV*=vfactor(line);
+      if(line==0) profile=tmpV;
+      else profile+=tmpV;
+   }
+   return profile;
+}
 ////////////////////////////////////////////////////////////////////////
 //
 //    ReflectionProfilePseudoVoigt
@@ -168,6 +183,25 @@ CrystVector_REAL ReflectionProfilePseudoVoigt::GetProfile(const CrystVector_REAL
    return profile;
 }
 
+CrystVector_REAL ReflectionProfilePseudoVoigt::GetMultiLineProfile(const CrystVector_REAL &x,
+                                                                  const CrystVector_REAL &vcenter,
+                                                                  const CrystVector_REAL &vfactor,
+                                                                  const REAL h, const REAL k, const REAL l)const
+{
+   // Width, mixing and asymmetry are computed for the first (strongest) line
+   const REAL center=vcenter(0);
+   REAL fwhm= mCagliotiW
+             +mCagliotiV*tan(center/2.0)
+             +mCagliotiU*pow(tan(center/2.0),2);
+   if(fwhm<=0) fwhm=1e-6;
+   else fwhm=sqrt(fwhm);
+   const REAL asym=mAsym0+mAsym1/sin(center)+mAsym2/pow((REAL)sin(center),(REAL)2.0);
+   REAL eta=mPseudoVoigtEta0+center*mPseudoVoigtEta1;
+   if(eta>1) eta=1;
+   if(eta<0) eta=0;
+   return PowderProfilePseudoVoigtMultiLine(x,vcenter,vfactor,fwhm,fwhm,eta,asym);
+}
+
 void ReflectionProfilePseudoVoigt::SetProfilePar(const REAL fwhmCagliotiW,
                    const REAL fwhmCagliotiU,
                    const REAL fwhmCagliotiV,
@@ -555,6 +589,26 @@ CrystVector_REAL ReflectionProfilePseudoVoigtAnisotropic::GetProfile(const Cryst
    return profile;
 }
 
+CrystVector_REAL ReflectionProfilePseudoVoigtAnisotropic::GetMultiLineProfile(const CrystVector_REAL &x,
+                                                                             const CrystVector_REAL &vcenter,
+                                                                             const CrystVector_REAL &vfactor,
+                                                                             const REAL h, const REAL k, const REAL l)const
+{
+   // Widths, mixing and asymmetry are computed for the first (strongest) line
+   const REAL center=vcenter(0);
+   const REAL tantheta=tan(center/2.0);
+   const REAL costheta=cos(center/2.0);
+   const REAL sintheta=sin(center/2.0);
+   const REAL fwhmG=sqrt(abs( mCagliotiW+mCagliotiV*tantheta+mCagliotiU*tantheta*tantheta+mScherrerP/(costheta*costheta)));
+   const REAL gam=mLorentzGammaHH*h*h+mLorentzGammaKK*k*k+mLorentzGammaLL*l*l+2*mLorentzGammaHK*h*k+2*mLorentzGammaHL*h*l+2*mLorentzGammaKL*k*l;
+   const REAL fwhmL= mLorentzX/costheta+(mLorentzY+gam/(sintheta*sintheta))*tantheta;
+   REAL eta=mPseudoVoigtEta0+center*mPseudoVoigtEta1;
+   if(eta>1) eta=1;
+   if(eta<0) eta=0;
+   const REAL asym=mAsym0+mAsym1/sin(center)+mAsym2/pow((REAL)sin(center),(REAL)2.0);
+   return PowderProfilePseudoVoigtMultiLine(x,vcenter,vfactor,fwhmG,fwhmL,eta,asym);
+}
+
 void ReflectionProfilePseudoVoigtAnisotropic::SetProfilePar(const REAL fwhmCagliotiW,
                    const REAL fwhmCagliotiU,
                    const REAL fwhmCagliotiV,
@@ -1534,6 +1588,56 @@ CrystVector_REAL PowderProfileLorentz(const CrystVector_REAL ttheta,const REAL f
    return result;
 }
 
+CrystVector_REAL PowderProfilePseudoVoigtMultiLine(const CrystVector_REAL &x,
+                                                   const CrystVector_REAL &vcenter,
+                                                   const CrystVector_REAL &vfactor,
+                                                   const REAL fwhmG, const REAL fwhmL,
+                                                   const REAL eta, const REAL asym)
+{
+   TAU_PROFILE("PowderProfilePseudoVoigtMultiLine()","Vector (Vector,Vector,Vector,REAL)",TAU_DEFAULT);
+   const long nbPoints=x.numElements();
+   CrystVector_REAL result(nbPoints);
+   if(nbPoints==0) return result;
+   result=0;
+   // Gaussian & Lorentzian coefficients, adapted from Toraya J. Appl. Cryst 23(1990),485-491
+   // (index 1: below the center, 2: above), including the normalization & mixing factors.
+   REAL g1=0,g2=0,gnorm=0,l1=0,l2=0,lnorm=0;
+   if((fwhmG>0)&&(eta<1))
+   {
+      g1= -(1.+asym)/asym*(1.+asym)/asym*log(2.)/fwhmG/fwhmG;
+      g2= -(1.+asym)     *(1.+asym)     *log(2.)/fwhmG/fwhmG;
+      gnorm=(1-eta)*2./fwhmG*sqrt(log(2.)/M_PI);
+   }
+   if((fwhmL>0)&&(eta>0))
+   {
+      l1= (1+asym)/asym*(1+asym)/asym/fwhmL/fwhmL;
+      l2= (1+asym)     *(1+asym)     /fwhmL/fwhmL;
+      lnorm=eta*2./M_PI/fwhmL;
+   }
+   const REAL *px=x.data();
+   REAL *p=result.data();
+   for(long line=0;line<vcenter.numElements();line++)
+   {
+      const REAL center=vcenter(line);
+      const REAL gn=gnorm*vfactor(line),ln=lnorm*vfactor(line);
+      // Same split as PowderProfileGauss(): the first point after the center still
+      // uses the low-angle coefficient.
+      long split=0;
+      while((split<nbPoints-1)&&(px[split]<=center)) split++;
+      for(long i=0;i<=split;i++)
+      {
+         const REAL d2=(px[i]-center)*(px[i]-center);
+         p[i]+=gn*exp(g1*d2)+ln/(1+l1*d2);
+      }
+      for(long i=split+1;i<nbPoints;i++)
+      {
+         const REAL d2=(px[i]-center)*(px[i]-center);
+         p[i]+=gn*exp(g2*d2)+ln/(1+l2*d2);
+      }
+   }
+   return result;
+}
+
 CrystVector_REAL AsymmetryBerarBaldinozzi(const CrystVector_REAL x,
                                           const REAL fw, const REAL center,
                                           const REAL a0, const REAL a1,
@@ -41,6 +41,19 @@ CrystVector_REAL PowderProfileGauss  (const CrystVector_REAL theta,
 ///function is in theta=center. If asymmetry is used, negative tth values must be first.
 CrystVector_REAL PowderProfileLorentz(const CrystVector_REAL theta,
                                       const REAL fwhm, const REAL center, const REAL asym=1.0);
+/** Pseudo-Voigt profile summed over several lines (e.g. Kalpha1 and Kalpha2 from an
+* X-Ray tube), all lines sharing the same widths, mixing parameter and asymmetry.
+*
+* The result is sum_i vfactor(i)*[(1-eta)*Gauss(fwhmG,vcenter(i))+eta*Lorentz(fwhmL,vcenter(i))],
+* with the same conventions (normalization, Toraya asymmetry) as PowderProfileGauss() and
+* PowderProfileLorentz(), but computed in one pass without temporary arrays.
+* A width <=0 removes the corresponding (Gaussian or Lorentzian) component.
+*/
+CrystVector_REAL PowderProfilePseudoVoigtMultiLine(const CrystVector_REAL &x,
+                                                   const CrystVector_REAL &vcenter,
+                                                   const CrystVector_REAL &vfactor,
+                                                   const REAL fwhmG, const REAL fwhmL,
+                                                   const REAL eta, const REAL asym=1.0);
 /// Asymmetry function [Ref J. Appl. Cryst 26 (1993), 128-129
 CrystVector_REAL AsymmetryBerarBaldinozzi(const CrystVector_REAL theta,
                                           const REAL fwhm, const REAL center,
@@ -79,6 +92,22 @@ class ReflectionProfile:public RefinableObj
       */
       virtual CrystVector_REAL GetProfile(const CrystVector_REAL &x, const REAL xcenter,
                                   const REAL h, const REAL k, const REAL l)const=0;
+      /** Get the reflection profile for a spectrum with several lines, e.g. Kalpha1
+      * and Kalpha2 from an X-Ray tube.
+      *
+      * This returns the sum of the profiles centered on vxcenter(i), weighted by vfactor(i).
+      * Derived classes can compute the profile parameters (width, mixing, asymmetry)
+      * only once, for the first (strongest) line, and synthesize all lines in a
+      * single pass. The default implementation calls GetProfile() for each line.
+      *\param x: the vector of x  coordinates (i.e. either 2theta or time-of-flight)
+      *\param vxcenter: coordinates (2theta, tof) of the center of each line
+      *\param vfactor: relative weight of each line
+      *\param h,k,l: reflection Miller indices
+      */
+      virtual CrystVector_REAL GetMultiLineProfile(const CrystVector_REAL &x,
+                                                   const CrystVector_REAL &vxcenter,
+                                                   const CrystVector_REAL &vfactor,
+                                                   const REAL h, const REAL k, const REAL l)const;
       /// Get the (approximate) full profile width at a given percentage
       /// of the profile maximum (e.g. FWHM=GetFullProfileWidth(0.5)).
       virtual REAL GetFullProfileWidth(const REAL relativeIntensity, const REAL xcenter,
@@ -107,6 +136,10 @@ class ReflectionProfilePseudoVoigt:public ReflectionProfile
       virtual const string& GetClassName()const;
       CrystVector_REAL GetProfile(const CrystVector_REAL &x, const REAL xcenter,
                                   const REAL h, const REAL k, const REAL l)const;
+      CrystVector_REAL GetMultiLineProfile(const CrystVector_REAL &x,
+                                           const CrystVector_REAL &vxcenter,
+                                           const CrystVector_REAL &vfactor,
+                                           const REAL h, const REAL k, const REAL l)const;
       /** Set reflection profile parameters
       *
       * \param fwhmCagliotiW,fwhmCagliotiU,fwhmCagliotiV : these are the U,V and W
@@ -170,6 +203,10 @@ class ReflectionProfilePseudoVoigtAnisotropic:public ReflectionProfile
       virtual const string& GetClassName()const;
       CrystVector_REAL GetProfile(const CrystVector_REAL &x, const REAL xcenter,
                                   const REAL h, const REAL k, const REAL l)const;
+      CrystVector_REAL GetMultiLineProfile(const CrystVector_REAL &x,
+                                           const CrystVector_REAL &vxcenter,
+                                           const CrystVector_REAL &vfactor,
+                                           const REAL h, const REAL k, const REAL l)const;
       /** Set reflection profile parameters
        *
        * if only W is given, the width is constant
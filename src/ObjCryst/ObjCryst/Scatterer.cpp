@@ -64,7 +64,7 @@ long NiftyStaticGlobalObjectsInitializer_Scatterer::mCount=0;
 //
 //
 ////////////////////////////////////////////////////////////////////////
-ObjRegistry<Scatterer> gScattererRegistry("Global Scatterer Registry");
+ObjRegistry<Scatterer> gScattererRegistry("Global Scatterer Registry",true);
 
 Scatterer::Scatterer():mXYZ(3),mOccupancy(1.0),mColourName("White"),mpCryst(0)
 {
@@ -82,7 +82,7 @@ mOccupancy(old.mOccupancy),
 mColourName(old.mColourName),mpCryst(old.mpCryst)
 {
    VFN_DEBUG_MESSAGE("Scatterer::Scatterer(&old)",5)
-   mName=old.GetName();
+   this->RefinableObj::SetName(old.GetName());
    this->InitRGBColour();
    gScattererRegistry.Register(*this);
    mClockMaster.AddChild(mClockScatterer);
@@ -636,9 +636,11 @@ void TextureMarchDollase::CalcCorr() const
    }
    const long nbReflUsed=mpData->GetNbReflBelowMaxSinThetaOvLambda();
    if(  (mClockTexturePar<mClockCorrCalc)
-      &&(mpData->GetClockTheta()<mClockCorrCalc)) return;
+      &&(mpData->GetClockTheta()<mClockCorrCalc)
+      &&((long)mNbReflUsed==nbReflUsed)) return;
    VFN_DEBUG_ENTRY("TextureMarchDollase::CalcCorr()",3)
    TAU_PROFILE("TextureMarchDollase::CalcCorr()","void ()",TAU_DEFAULT);
+   this->CalcGeom();
    // normalizer for the sum of fractions, and non-texture fraction
    // (the sum of fractions must be equal to 1, but we cannot
    // modify fractions here since this is a const function)
@@ -654,59 +656,24 @@ void TextureMarchDollase::CalcCorr() const
       const long nbRefl=mpData->GetNbRefl();
       mCorr.resize(nbRefl);
       mCorr=nonTexturedFraction;
-      CrystVector_REAL reflNorm(nbRefl);
-      {
-         const REAL *xx=mpData->GetReflX().data();
-         const REAL *yy=mpData->GetReflY().data();
-         const REAL *zz=mpData->GetReflZ().data();
-         for(long i=0;i<nbReflUsed;i++)
-         {
-            reflNorm(i)= sqrt(*xx * *xx + *yy * *yy + *zz * *zz);
-            xx++;yy++;zz++;
-         }
-      }
-      CrystMatrix_REAL hkl;
       for(unsigned int i=0; i<this->GetNbPhase();i++)
       {
-         // We are using multiplicity for powder diffraction, therefore with only
-         // unique reflections. But Equivalent reflections do not have the same
-         // texture correction ! So we must use the symmetry oprators, and it is simpler
-         // to apply the symmetries to the texture vector than to all reflections
-         hkl=mpData->GetCrystal().GetSpaceGroup()
-               .GetAllEquivRefl(this->GetPhaseH(i),this->GetPhaseK(i),this->GetPhaseL(i),true);
+         const CrystMatrix_REAL *pCosSq=&(mvCosSq[i]);
          //coefficients
             const REAL march=1./(this->GetMarchCoeff(i)+1e-6);
             const REAL march2=this->GetMarchCoeff(i)*this->GetMarchCoeff(i)-march;
             // Normalized by the number of symmetrical reflections
-            const REAL frac=this->GetFraction(i)/(fractionNorm+1e-6)/hkl.rows();
-
-         for(long j=0;j<hkl.rows();j++)
+            const REAL frac=this->GetFraction(i)/(fractionNorm+1e-6)/pCosSq->rows();
+         const REAL *pcos2=pCosSq->data();
+         for(long j=0;j<pCosSq->rows();j++)
          {
-            //orthonormal coordinates for T (texture) vector
-               REAL tx=hkl(j,0),
-                    ty=hkl(j,1),
-                    tz=hkl(j,2);
-            // reflection coordinates
-               const REAL *xx=mpData->GetReflX().data();
-               const REAL *yy=mpData->GetReflY().data();
-               const REAL *zz=mpData->GetReflZ().data();
-               const REAL *xyznorm=reflNorm.data();
-               {
-                  mpData->GetCrystal().MillerToOrthonormalCoords(tx,ty,tz);
-                  const REAL norm=sqrt(tx*tx+ty*ty+tz*tz);
-                  tx/=(norm+1e-6);
-                  ty/=(norm+1e-6);
-                  tz/=(norm+1e-6);
-               }
-            // Calculation
-               REAL tmp;
-               for(long k=0;k<nbReflUsed;k++)
-               {
-                  tmp=(tx * (*xx++) + ty * (*yy++) + tz * (*zz++))/ (*xyznorm++);
-                  tmp=march+march2*tmp*tmp;
-                  if(tmp<0) tmp=0;// rounding errors ?
-                  mCorr(k)+=frac*pow((float)tmp,(float)-1.5);
-               }
+            REAL *pCorr=mCorr.data();
+            for(long k=0;k<nbReflUsed;k++)
+            {
+               REAL tmp=march+march2* *pcos2++;
+               if(tmp<0) tmp=0;// rounding errors ?
+               *pCorr++ += frac/(tmp*sqrt(tmp));
+            }
          }
       }
    //if(this->IsbeingRefined()==false)
@@ -721,6 +688,77 @@ void TextureMarchDollase::CalcCorr() const
    mClockCorrCalc.Click();
    VFN_DEBUG_EXIT("TextureMarchDollase::CalcCorr()",3)
 }
+
+void TextureMarchDollase::CalcGeom() const
+{
+   const long nbReflUsed=mpData->GetNbReflBelowMaxSinThetaOvLambda();
+   bool needCalc=(mpData->GetClockTheta()>mClockGeomCalc)
+                ||((long)mNbReflUsed!=nbReflUsed)
+                ||(mvGeomHKL.size()!=3*this->GetNbPhase());
+   for(unsigned int i=0;(i<this->GetNbPhase())&&(!needCalc);i++)
+      needCalc=  (mvGeomHKL[3*i  ]!=this->GetPhaseH(i))
+               ||(mvGeomHKL[3*i+1]!=this->GetPhaseK(i))
+               ||(mvGeomHKL[3*i+2]!=this->GetPhaseL(i));
+   if(!needCalc) return;
+   VFN_DEBUG_ENTRY("TextureMarchDollase::CalcGeom()",3)
+   TAU_PROFILE("TextureMarchDollase::CalcGeom()","void ()",TAU_DEFAULT);
+   mNbReflUsed=nbReflUsed;
+   CrystVector_REAL reflNorm(nbReflUsed);
+   {
+      const REAL *xx=mpData->GetReflX().data();
+      const REAL *yy=mpData->GetReflY().data();
+      const REAL *zz=mpData->GetReflZ().data();
+      for(long i=0;i<nbReflUsed;i++)
+      {
+         reflNorm(i)= sqrt(*xx * *xx + *yy * *yy + *zz * *zz);
+         xx++;yy++;zz++;
+      }
+   }
+   mvCosSq.resize(this->GetNbPhase());
+   mvGeomHKL.resize(3*this->GetNbPhase());
+   CrystMatrix_REAL hkl;
+   for(unsigned int i=0; i<this->GetNbPhase();i++)
+   {
+      mvGeomHKL[3*i  ]=this->GetPhaseH(i);
+      mvGeomHKL[3*i+1]=this->GetPhaseK(i);
+      mvGeomHKL[3*i+2]=this->GetPhaseL(i);
+      // We are using multiplicity for powder diffraction, therefore with only
+      // unique reflections. But Equivalent reflections do not have the same
+      // texture correction ! So we must use the symmetry oprators, and it is simpler
+      // to apply the symmetries to the texture vector than to all reflections
+      hkl=mpData->GetCrystal().GetSpaceGroup()
+            .GetAllEquivRefl(this->GetPhaseH(i),this->GetPhaseK(i),this->GetPhaseL(i),true);
+      mvCosSq[i].resize(hkl.rows(),nbReflUsed);
+      REAL *pcos2=mvCosSq[i].data();
+      for(long j=0;j<hkl.rows();j++)
+      {
+         //orthonormal coordinates for T (texture) vector
+            REAL tx=hkl(j,0),
+                 ty=hkl(j,1),
+                 tz=hkl(j,2);
+            {
+               mpData->GetCrystal().MillerToOrthonormalCoords(tx,ty,tz);
+               const REAL norm=sqrt(tx*tx+ty*ty+tz*tz);
+               tx/=(norm+1e-6);
+               ty/=(norm+1e-6);
+               tz/=(norm+1e-6);
+            }
+         // reflection coordinates
+            const REAL *xx=mpData->GetReflX().data();
+            const REAL *yy=mpData->GetReflY().data();
+            const REAL *zz=mpData->GetReflZ().data();
+            const REAL *xyznorm=reflNorm.data();
+            for(long k=0;k<nbReflUsed;k++)
+            {
+               const REAL tmp=(tx * (*xx++) + ty * (*yy++) + tz * (*zz++))/ (*xyznorm++);
+               *pcos2++ = tmp*tmp;
+            }
+      }
+   }
+   mClockGeomCalc.Click();
+   VFN_DEBUG_EXIT("TextureMarchDollase::CalcGeom()",3)
+}
+
 void TextureMarchDollase::DeleteAllPhase()
 {
 }
@@ -923,36 +961,27 @@ void TextureEllipsoid::CalcCorr() const
       &&(mpData->GetClockTheta()<mClockCorrCalc)
       &&(mpData->GetClockNbReflBelowMaxSinThetaOvLambda()<mClockCorrCalc)) return;
    VFN_DEBUG_ENTRY("TextureEllipsoid::CalcCorr()",3)
-   TAU_PROFILE("TextureEllipsoid::CalcCorr()","void ()",TAU_DEFAULT)
+   TAU_PROFILE("TextureEllipsoid::CalcCorr()","void ()",TAU_DEFAULT);
+   this->CalcGeom();
 
    //compute correction
    const long nbRefl=mpData->GetNbRefl();
    mCorr.resize(nbRefl);
    ///mCorr=1.0;
    /// Icorr = Iobs[1 + (EPR1*h^2 + EPR2*k^2 + EPR3*l^2 + EPR4*2hk + EPR5*2hl + EPR6*2kl) * 0.001d^2]^-1.5
-   REAL tmp, dhkl;
+   REAL tmp;
    REAL sum=0;
    REAL *pCorr=mCorr.data();
-   const REAL *pH=mpData->GetH().data();
-   const REAL *pK=mpData->GetH().data();
-   const REAL *pL=mpData->GetH().data();
-   const REAL *pstol=mpData->GetSinThetaOverLambda().data();
+   const REAL *p0=mGeom.data();
+   const REAL *p1=p0+nbReflUsed,*p2=p1+nbReflUsed,*p3=p2+nbReflUsed,*p4=p3+nbReflUsed,*p5=p4+nbReflUsed;
    for(long i=0;i<nbReflUsed;i++)
    {
-      dhkl=1.0/(2* (*pstol++));
-      dhkl=0.001*dhkl*dhkl;
-      tmp=(mEPR[0]* (*pH) * (*pH) +
-           mEPR[1]* (*pK) * (*pK) +
-           mEPR[2]* (*pL) * (*pL) +
-           mEPR[3]*2* (*pH) * (*pK) +
-           mEPR[4]*2* (*pH) * (*pL) +
-           mEPR[5]*2* (*pK) * (*pL)) *
-           dhkl;
+      tmp=mEPR[0]*p0[i]+mEPR[1]*p1[i]+mEPR[2]*p2[i]+mEPR[3]*p3[i]+mEPR[4]*p4[i]+mEPR[5]*p5[i];
       if(tmp<0) tmp=0;// rounding errors ?
-      tmp=pow((float)(1.0+tmp),(float)-1.5);
-      *pCorr++=tmp;
+      tmp+=1.0;
+      tmp=1/(tmp*sqrt(tmp));
+      pCorr[i]=tmp;
       sum+=tmp;
-      pH++;pK++;pL++;
    }
    // Normalize correction to 1
    tmp=nbReflUsed/sum;
@@ -965,6 +994,34 @@ void TextureEllipsoid::CalcCorr() const
    VFN_DEBUG_EXIT("TextureEllipsoid::CalcCorr()",3)
 }
 
+void TextureEllipsoid::CalcGeom() const
+{
+   const long nbReflUsed=mpData->GetNbReflBelowMaxSinThetaOvLambda();
+   if(  (mpData->GetClockTheta()<mClockGeomCalc)
+      &&((long)mNbReflUsed==nbReflUsed)) return;
+   VFN_DEBUG_ENTRY("TextureEllipsoid::CalcGeom()",3)
+   TAU_PROFILE("TextureEllipsoid::CalcGeom()","void ()",TAU_DEFAULT);
+   mNbReflUsed=nbReflUsed;
+   mGeom.resize(6,nbReflUsed);
+   const REAL *pH=mpData->GetH().data();
+   const REAL *pK=mpData->GetK().data();
+   const REAL *pL=mpData->GetL().data();
+   const REAL *pstol=mpData->GetSinThetaOverLambda().data();
+   for(long i=0;i<nbReflUsed;i++)
+   {
+      REAL dhkl=1.0/(2* pstol[i]);
+      dhkl=0.001*dhkl*dhkl;
+      mGeom(0,i)=  pH[i]*pH[i]*dhkl;
+      mGeom(1,i)=  pK[i]*pK[i]*dhkl;
+      mGeom(2,i)=  pL[i]*pL[i]*dhkl;
+      mGeom(3,i)=2*pH[i]*pK[i]*dhkl;
+      mGeom(4,i)=2*pH[i]*pL[i]*dhkl;
+      mGeom(5,i)=2*pK[i]*pL[i]*dhkl;
+   }
+   mClockGeomCalc.Click();
+   VFN_DEBUG_EXIT("TextureEllipsoid::CalcGeom()",3)
+}
+
 void TextureEllipsoid::UpdateEllipsoidPar()
 {
    VFN_DEBUG_ENTRY("TextureEllipsoid::UpdateEllipsoidPar().",3)
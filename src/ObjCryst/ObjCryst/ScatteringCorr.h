@@ -193,6 +193,20 @@ class TextureMarchDollase:public ScatteringCorr,public RefinableObj
       /// This is automaticaly updated during CalcCorr, from the parent
       /// ScatteringData::GetMaxSinThetaOvLambda()
       mutable unsigned long mNbReflUsed;
+      /// \internal Compute the texture geometry (mvCosSq), if the reflections, the
+      /// unit cell or the texture directions have changed.
+      void CalcGeom() const;
+      /** For each phase, squared cosine of the angle between each equivalent texture
+      * direction (rows) and each used reflection (columns).
+      *
+      * This only depends on the reflections and texture directions, so that changing
+      * the March coefficients or fractions only requires a fast pass over these values.
+      */
+      mutable vector<CrystMatrix_REAL> mvCosSq;
+      /// (H,K,L) texture direction of each phase for which mvCosSq was computed
+      mutable vector<REAL> mvGeomHKL;
+      /// Last time mvCosSq was computed
+      mutable RefinableObjClock mClockGeomCalc;
    #ifdef __WX__CRYST__
    public:
       virtual WXCrystObjBasic* WXCreate(wxWindow*);
@@ -232,6 +246,13 @@ class TextureEllipsoid:public ScatteringCorr,public RefinableObj
       /// This is automaticaly updated during CalcCorr, from the parent
       /// ScatteringData::GetMaxSinThetaOvLambda()
       mutable unsigned long mNbReflUsed;
+      /// \internal Compute mGeom, if the reflections or the unit cell have changed.
+      void CalcGeom() const;
+      /// For each used reflection (columns), the 6 terms multiplying EPR1..EPR6 (rows):
+      /// (h^2, k^2, l^2, 2hk, 2hl, 2kl)*0.001*d^2
+      mutable CrystMatrix_REAL mGeom;
+      /// Last time mGeom was computed
+      mutable RefinableObjClock mClockGeomCalc;
 
    #ifdef __WX__CRYST__
     public:
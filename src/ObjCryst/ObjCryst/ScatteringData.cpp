@@ -24,6 +24,8 @@
 #include <cmath>
 
 #include <typeinfo>
+#include <algorithm>
+#include <thread>
 
 #include "cctbx/sgtbx/space_group.h"
 #include "cctbx/miller/index_generator.h"
@@ -42,6 +44,7 @@
 
 #include <fstream>
 #include <iomanip>
+#include <mutex>
 #include <stdio.h> //for sprintf()
 
 #ifdef HAVE_SSE_MATHFUN
@@ -392,6 +395,8 @@ void Radiation::InitOptions()
    static string WavelengthTypeChoices[3];
 
    static bool needInitNames=true;
+   static mutex needInitNamesMutex;
+   lock_guard<mutex> needInitNamesLock(needInitNamesMutex);
    if(true==needInitNames)
    {
       RadiationTypeName="Radiation";
@@ -457,8 +462,10 @@ WXCrystObjBasic* Radiation::WXCreate(wxWindow* parent)
 
 ScatteringData::ScatteringData():
 mNbRefl(0),
-mpCrystal(0),mGlobalBiso(0),mUseFastLessPreciseFunc(false),
-mIgnoreImagScattFact(false),mMaxSinThetaOvLambda(10)
+mpCrystal(0),mGlobalBiso(0),mUseFastLessPreciseFunc(false),mScattPowStride(0),
+mIgnoreImagScattFact(false),mMaxSinThetaOvLambda(10),
+mResolutionFactor(1),
+mGenHKLCacheMaxSTOL(0),mGenHKLCacheUnique(false),mGenHKLCacheAnomalous(false)
 {
    VFN_DEBUG_MESSAGE("ScatteringData::ScatteringData()",10)
    {//This should be done elsewhere...
@@ -479,9 +486,12 @@ ScatteringData::ScatteringData(const ScatteringData &old):
 mNbRefl(old.mNbRefl),
 mpCrystal(old.mpCrystal),mUseFastLessPreciseFunc(old.mUseFastLessPreciseFunc),
 //Do not copy temporary arrays
+mScattPowStride(0),
 mClockHKL(old.mClockHKL),
 mIgnoreImagScattFact(old.mIgnoreImagScattFact),
-mMaxSinThetaOvLambda(old.mMaxSinThetaOvLambda)
+mMaxSinThetaOvLambda(old.mMaxSinThetaOvLambda),
+mResolutionFactor(1),
+mGenHKLCacheMaxSTOL(0),mGenHKLCacheUnique(false),mGenHKLCacheAnomalous(false)
 {
    VFN_DEBUG_MESSAGE("ScatteringData::ScatteringData(&old)",10)
    mClockStructFactor.Reset();
@@ -536,6 +546,10 @@ void ScatteringData::GenHKLFullSpace2(const REAL maxSTOL,const bool unique)
   const_cast<const ScatteringData*>(this)->ScatteringData::GenHKLFullSpace2(maxSTOL, unique);
 }
 
+/// Relative margin on max(sin(theta)/lambda) for the reflections generated by
+/// GenHKLFullSpace2, so that the list can be re-used after small changes of the unit cell.
+static const REAL sGenHKLCacheMargin=0.02;
+
 void ScatteringData::GenHKLFullSpace2(const REAL maxSTOL,const bool unique) const
 {
    //(*fpObjCrystInformUser)("Generating Full HKL list...");
@@ -546,6 +560,31 @@ void ScatteringData::GenHKLFullSpace2(const REAL maxSTOL,const bool unique) cons
       throw ObjCrystException("ScatteringData::GenHKLFullSpace2() \
       no crystal assigned yet to this ScatteringData object.");
    }
+   const bool anomalous=!(this->IsIgnoringImagScattFact());
+   const CrystMatrix_REAL bMatrix=mpCrystal->GetBMatrix();
+   if(  (mGenHKLCacheMaxSTOL>0)&&(mGenHKLCacheUnique==unique)&&(mGenHKLCacheAnomalous==anomalous)
+      &&(mGenHKLCacheClock>mpCrystal->GetSpaceGroup().GetClockSpaceGroup()))
+   {// Can we re-use the list generated previously ? It includes all reflections
+    // with |B_old*hkl|<=2*maxSTOL_cache, and |B_old*hkl|<=||B_old*B_new^-1||*|B_new*hkl|,
+    // with ||B_old*B_new^-1|| <= 1+||B_old*B_new^-1 - I||_F
+      CrystMatrix_REAL m=product(mGenHKLCacheBMatrix,InvertMatrix(bMatrix));
+      REAL dev=0;
+      for(unsigned int i=0;i<3;i++)
+         for(unsigned int j=0;j<3;j++)
+         {
+            const REAL d=m(i,j)-(REAL)(i==j);
+            dev+=d*d;
+         }
+      if(maxSTOL*(1+sqrt(dev))<=mGenHKLCacheMaxSTOL)
+      {
+         VFN_DEBUG_MESSAGE("ScatteringData::GenHKLFullSpace2(): re-using cached list, "<<mGenHKLCacheH.numElements()<<" reflections",5)
+         this->SetHKLFromGenHKLCache(maxSTOL);
+         VFN_DEBUG_EXIT("ScatteringData::GenHKLFullSpace2():End",5)
+         return;
+      }
+   }
+   // Generate slightly beyond maxSTOL, so that the list can be re-used after small cell changes
+   const REAL maxSTOLgen=maxSTOL*(1+sGenHKLCacheMargin);
    cctbx::uctbx::unit_cell uc=cctbx::uctbx::unit_cell(scitbx::af::double6(mpCrystal->GetLatticePar(0),
                                                                           mpCrystal->GetLatticePar(1),
 						                          mpCrystal->GetLatticePar(2),
@@ -554,76 +593,69 @@ void ScatteringData::GenHKLFullSpace2(const REAL maxSTOL,const bool unique) cons
 									  mpCrystal->GetLatticePar(5)*RAD2DEG));
    cctbx::miller::index_generator igen(uc,
                                 this->GetCrystal().GetSpaceGroup().GetCCTbxSpg().type(),
-                                !(this->IsIgnoringImagScattFact()),
-                                1/(2*maxSTOL));
-   if(unique)
+                                anomalous,
+                                1/(2*maxSTOLgen));
+   // The unique indices are generated sequentially (amortised growth of the vector)...
+   vector<long> vhkl;
+   for(;;)
    {
-      mNbRefl=0;
-      CrystVector_long H(mNbRefl);
-      CrystVector_long K(mNbRefl);
-      CrystVector_long L(mNbRefl);
-      mMultiplicity.resize(mNbRefl);
-      for(;;)
-      {
-         if(mNbRefl==H.numElements())
-         {
-            H.resizeAndPreserve(mNbRefl+100);
-            K.resizeAndPreserve(mNbRefl+100);
-            L.resizeAndPreserve(mNbRefl+100);
-            mMultiplicity.resizeAndPreserve(mNbRefl+100);
-         }
-         cctbx::miller::index<> h = igen.next();
-         if (h.is_zero()) break;
-         H(mNbRefl)=h[0];
-         K(mNbRefl)=h[1];
-         L(mNbRefl)=h[2];
-         cctbx::miller::sym_equiv_indices sei(this->GetCrystal().GetSpaceGroup().GetCCTbxSpg(),h);
-         mMultiplicity(mNbRefl)=sei.multiplicity(!(this->IsIgnoringImagScattFact()));
-         mNbRefl++;
-      }
-      H.resizeAndPreserve(mNbRefl);
-      K.resizeAndPreserve(mNbRefl);
-      L.resizeAndPreserve(mNbRefl);
-      mMultiplicity.resizeAndPreserve(mNbRefl);
-      this->SetHKL(H,K,L);
-      this->SortReflectionBySinThetaOverLambda(maxSTOL);
-   }
-   else
+      cctbx::miller::index<> h = igen.next();
+      if (h.is_zero()) break;
+      vhkl.push_back(h[0]);
+      vhkl.push_back(h[1]);
+      vhkl.push_back(h[2]);
+   }
+   // ...while the multiplicity and the symmetry expansion are done in parallel over
+   // contiguous blocks, which are concatenated in order.
+   const unsigned long nbUnique=vhkl.size()/3;
+   unsigned long nbThread=thread::hardware_concurrency();
+   if(nbThread>nbUnique/4096+1) nbThread=nbUnique/4096+1;// Not worth it for small lists
+   if(nbThread==0) nbThread=1;
+   const unsigned long nbBlock=(nbUnique+nbThread-1)/nbThread;
+   vector<vector<long> > vhklBlock(nbThread);
+   vector<vector<int> > vmultBlock(nbThread);
+   if(nbThread>1)
+   {
+      vector<thread> vThread;
+      for(unsigned long i=0;i<nbThread;i++)
+         vThread.push_back(ObjRegistryIsolation::StartThread(&ScatteringData::GenHKLFullSpacePartition,
+                                  this,cref(vhkl),
+                                  unique,anomalous,i*nbBlock,min((i+1)*nbBlock,nbUnique),
+                                  ref(vhklBlock[i]),ref(vmultBlock[i])));
+      for(vector<thread>::iterator pos=vThread.begin();pos!=vThread.end();++pos) pos->join();
+   }
+   else this->GenHKLFullSpacePartition(vhkl,unique,anomalous,0,nbUnique,vhklBlock[0],vmultBlock[0]);
+
+   mNbRefl=0;
+   for(unsigned long i=0;i<nbThread;i++) mNbRefl+=vmultBlock[i].size();
+   mGenHKLCacheH.resize(mNbRefl);
+   mGenHKLCacheK.resize(mNbRefl);
+   mGenHKLCacheL.resize(mNbRefl);
+   mGenHKLCacheMultiplicity.resize(mNbRefl);
    {
-      mNbRefl=0;
-      CrystVector_long H(mNbRefl);
-      CrystVector_long K(mNbRefl);
-      CrystVector_long L(mNbRefl);
-      mMultiplicity.resize(mNbRefl);
-      for(;;)
+      REAL *ph=mGenHKLCacheH.data();
+      REAL *pk=mGenHKLCacheK.data();
+      REAL *pl=mGenHKLCacheL.data();
+      int *pmult=mGenHKLCacheMultiplicity.data();
+      for(unsigned long i=0;i<nbThread;i++)
       {
-         cctbx::miller::index<> h = igen.next();
-         if (h.is_zero()) break;
-         cctbx::miller::sym_equiv_indices sei(this->GetCrystal().GetSpaceGroup().GetCCTbxSpg(),h);
-         for(int i=0;i<sei.multiplicity(true);i++)
+         const long *p=vhklBlock[i].data();
+         for(vector<int>::const_iterator pos=vmultBlock[i].begin();pos!=vmultBlock[i].end();++pos)
          {
-            cctbx::miller::index<> k = sei(i).h();
-            if(mNbRefl==H.numElements())
-            {
-               H.resizeAndPreserve(mNbRefl+100);
-               K.resizeAndPreserve(mNbRefl+100);
-               L.resizeAndPreserve(mNbRefl+100);
-               mMultiplicity.resizeAndPreserve(mNbRefl+100);
-            }
-            mMultiplicity(mNbRefl)=sei.multiplicity(!(this->IsIgnoringImagScattFact()));
-            H(mNbRefl)=k[0];
-            K(mNbRefl)=k[1];
-            L(mNbRefl++)=k[2];
+            *ph++ = *p++;
+            *pk++ = *p++;
+            *pl++ = *p++;
+            *pmult++ = *pos;
          }
       }
-      H.resizeAndPreserve(mNbRefl);
-      K.resizeAndPreserve(mNbRefl);
-      L.resizeAndPreserve(mNbRefl);
-      mMultiplicity.resizeAndPreserve(mNbRefl);
-      this->SetHKL(H,K,L);
-      this->SortReflectionBySinThetaOverLambda(maxSTOL);
    }
-   mClockHKL.Click();
+   mGenHKLCacheBMatrix=bMatrix;
+   mGenHKLCacheMaxSTOL=maxSTOLgen;
+   mGenHKLCacheUnique=unique;
+   mGenHKLCacheAnomalous=anomalous;
+   mGenHKLCacheClock.Click();
+
+   this->SetHKLFromGenHKLCache(maxSTOL);
    /*{
       char buf [200];
       sprintf(buf,"Generating Full HKL list...Done (kept %d reflections)",(int)mNbRefl);
@@ -632,6 +664,54 @@ void ScatteringData::GenHKLFullSpace2(const REAL maxSTOL,const bool unique) cons
    VFN_DEBUG_EXIT("ScatteringData::GenHKLFullSpace2():End",5)
 }
 
+void ScatteringData::SetHKLFromGenHKLCache(const REAL maxSTOL)const
+{
+   // Bypass SetHKL(), as the arrays only need to be prepared once the list has been
+   // sorted and truncated to maxSTOL.
+   mNbRefl=mGenHKLCacheH.numElements();
+   mH=mGenHKLCacheH;
+   mK=mGenHKLCacheK;
+   mL=mGenHKLCacheL;
+   mMultiplicity=mGenHKLCacheMultiplicity;
+   mClockHKL.Click();
+   this->SortReflectionBySinThetaOverLambda(maxSTOL);
+   mClockHKL.Click();
+}
+
+void ScatteringData::GenHKLFullSpacePartition(const vector<long> &hkl,const bool unique,
+                                              const bool anomalous,
+                                              const unsigned long i0,const unsigned long i1,
+                                              vector<long> &hklOut,vector<int> &multOut)const
+{
+   const cctbx::sgtbx::space_group *pSpg=&(this->GetCrystal().GetSpaceGroup().GetCCTbxSpg());
+   hklOut.reserve(3*(i1-i0));
+   multOut.reserve(i1-i0);
+   for(unsigned long i=i0;i<i1;i++)
+   {
+      const cctbx::miller::index<> h(hkl[3*i],hkl[3*i+1],hkl[3*i+2]);
+      cctbx::miller::sym_equiv_indices sei(*pSpg,h);
+      const int mult=sei.multiplicity(anomalous);
+      if(unique)
+      {
+         hklOut.push_back(h[0]);
+         hklOut.push_back(h[1]);
+         hklOut.push_back(h[2]);
+         multOut.push_back(mult);
+      }
+      else
+      {
+         for(int j=0;j<sei.multiplicity(true);j++)
+         {
+            const cctbx::miller::index<> k = sei(j).h();
+            hklOut.push_back(k[0]);
+            hklOut.push_back(k[1]);
+            hklOut.push_back(k[2]);
+            multOut.push_back(mult);
+         }
+      }
+   }
+}
+
 void ScatteringData::GenHKLFullSpace(const REAL maxTheta,const bool useMultiplicity)
 {
   const_cast<const ScatteringData*>(this)->ScatteringData::GenHKLFullSpace(maxTheta, useMultiplicity);
@@ -662,6 +742,7 @@ void ScatteringData::SetCrystal(Crystal &crystal)
    mClockMaster.AddChild(mpCrystal->GetSpaceGroup().GetClockSpaceGroup());
    mClockGeomStructFact.Reset();
    mClockStructFactor.Reset();
+   mGenHKLCacheMaxSTOL=0;
 }
 const Crystal& ScatteringData::GetCrystal()const {return *mpCrystal;}
 
@@ -811,6 +892,9 @@ void ScatteringData::SetFhklObsSq(const CrystVector_REAL &obs)
 const map<const ScatteringPower*,CrystVector_REAL>& ScatteringData::GetScatteringFactor() const
 {
    this->CalcScattFactor();
+   mvScatteringFactor.clear();
+   for(unsigned long i=0;i<mvpScattPow.size();i++)
+      mvScatteringFactor[mvpScattPow[i]]=this->GetScattPowRow(mScatteringFactor,i);
    return mvScatteringFactor;
 }
 
@@ -867,25 +951,23 @@ void ScatteringData::PrintFhklCalcDetail(ostream &os)const
    os <<"       H        K        L       1/2d        Theta       F(hkl)^2";
    os <<"     Re(F)         Im(F)       ";
    vector<CrystVector_REAL> sf;
-   sf.resize(mvRealGeomSF.size()*2);
+   sf.resize(mvpScattPow.size()*2);
    long i=0;
-   for(map<const ScatteringPower*,CrystVector_REAL>::const_iterator
-         pos=mvRealGeomSF.begin();pos!=mvRealGeomSF.end();++pos)
+   for(unsigned long slot=0;slot<mvpScattPow.size();slot++)
    {
-      os << FormatString("Re(F)_"+pos->first->GetName(),14)
-         << FormatString("Im(F)_"+pos->first->GetName(),14);
-      cout<<pos->first->GetName()<<":"<<pos->first->GetForwardScatteringFactor(RAD_XRAY)<<endl;
-      sf[2*i]  = mvRealGeomSF[pos->first];
-      sf[2*i] *= mvScatteringFactor[pos->first];
-      sf[2*i] *= mvTemperatureFactor[pos->first];
-      sf[2*i+1]  = mvImagGeomSF[pos->first];
-      sf[2*i+1] *= mvScatteringFactor[pos->first];
-      sf[2*i+1] *= mvTemperatureFactor[pos->first];
+      if(!mvGeomSFIsUsed[slot]) continue;
+      const ScatteringPower *pScattPow=mvpScattPow[slot];
+      os << FormatString("Re(F)_"+pScattPow->GetName(),14)
+         << FormatString("Im(F)_"+pScattPow->GetName(),14);
+      cout<<pScattPow->GetName()<<":"<<pScattPow->GetForwardScatteringFactor(RAD_XRAY)<<endl;
+      sf[2*i]  = this->GetScattPowRow(mRealGeomSF,slot);
+      sf[2*i] *= this->GetScattPowRow(mScatteringFactor,slot);
+      sf[2*i] *= this->GetScattPowRow(mTemperatureFactor,slot);
+      sf[2*i+1]  = this->GetScattPowRow(mImagGeomSF,slot);
+      sf[2*i+1] *= this->GetScattPowRow(mScatteringFactor,slot);
+      sf[2*i+1] *= this->GetScattPowRow(mTemperatureFactor,slot);
       v.push_back(&(sf[2*i]));
       v.push_back(&(sf[2*i+1]));
-      //v.push_back(mvRealGeomSF[pos->first]);
-      //v.push_back(mvImagGeomSF[pos->first]);
-      //v.push_back(mvScatteringFactor[pos->first]);
       i++;
    }
    os<<endl;
@@ -932,6 +1014,13 @@ void ScatteringData::SetApproximationFlag(const bool allow)
    this->RefinableObj::SetApproximationFlag(allow);
 }
 
+void ScatteringData::SetResolutionFactor(const REAL factor)
+{
+   mResolutionFactor=factor;
+   if(mNbRefl>0) this->CalcNbReflBelowMaxSinThetaOvLambda();
+   this->RefinableObj::SetResolutionFactor(factor);
+}
+
 void ScatteringData::PrepareHKLarrays() const
 {
    VFN_DEBUG_ENTRY("ScatteringData::PrepareHKLarrays()"<<mNbRefl<<" reflections",5)
@@ -989,27 +1078,33 @@ void ScatteringData::SetMaxSinThetaOvLambda(const REAL max){mMaxSinThetaOvLambda
 REAL ScatteringData::GetMaxSinThetaOvLambda()const{return mMaxSinThetaOvLambda;}
 long ScatteringData::GetNbReflBelowMaxSinThetaOvLambda()const
 {
-   if(this->IsBeingRefined()) return mNbReflUsed;
-   VFN_DEBUG_MESSAGE("ScatteringData::GetNbReflBelowMaxSinThetaOvLambda()",4)
+   if(!(this->IsBeingRefined())) this->CalcNbReflBelowMaxSinThetaOvLambda();
+   return mNbReflUsed;
+}
+void ScatteringData::CalcNbReflBelowMaxSinThetaOvLambda()const
+{
+   VFN_DEBUG_MESSAGE("ScatteringData::CalcNbReflBelowMaxSinThetaOvLambda()",4)
    this->CalcSinThetaLambda();
+   REAL maxSTOL=mMaxSinThetaOvLambda;
+   if((mResolutionFactor<1)&&(mNbRefl>0))
+      maxSTOL=min(mMaxSinThetaOvLambda,mSinThetaLambda(mNbRefl-1))*mResolutionFactor;
    if((mNbReflUsed>0)&&(mNbReflUsed<mNbRefl))
    {
-      if(  (mSinThetaLambda(mNbReflUsed  )>mMaxSinThetaOvLambda)
-         &&(mSinThetaLambda(mNbReflUsed-1)<=mMaxSinThetaOvLambda)) return mNbReflUsed;
+      if(  (mSinThetaLambda(mNbReflUsed  )>maxSTOL)
+         &&(mSinThetaLambda(mNbReflUsed-1)<=maxSTOL)) return;
    }
 
-   if((mNbReflUsed==mNbRefl)&&(mSinThetaLambda(mNbRefl-1)<=mMaxSinThetaOvLambda))
-      return mNbReflUsed;
+   if((mNbReflUsed==mNbRefl)&&(mSinThetaLambda(mNbRefl-1)<=maxSTOL))
+      return;
    long i;
-   for(i=0;i<mNbRefl;i++) if(mSinThetaLambda(i)>mMaxSinThetaOvLambda) break;
+   for(i=0;i<mNbRefl;i++) if(mSinThetaLambda(i)>maxSTOL) break;
    if(i!=mNbReflUsed)
    {
       mNbReflUsed=i;
       mClockNbReflUsed.Click();
-      VFN_DEBUG_MESSAGE("->Changed Max sin(theta)/lambda="<<mMaxSinThetaOvLambda\
+      VFN_DEBUG_MESSAGE("->Changed Max sin(theta)/lambda="<<maxSTOL\
                         <<" nb refl="<<mNbReflUsed,4)
    }
-   return mNbReflUsed;
 }
 const RefinableObjClock& ScatteringData::GetClockNbReflBelowMaxSinThetaOvLambda()const
 {return mClockNbReflUsed;}
@@ -1021,68 +1116,55 @@ CrystVector_long ScatteringData::SortReflectionBySinThetaOverLambda(const REAL m
    this->CalcSinThetaLambda();
    CrystVector_long sortedSubs;
    sortedSubs=SortSubs(mSinThetaLambda);
-   CrystVector_long oldH,oldK,oldL,oldMult;
+   CrystVector_REAL oldH,oldK,oldL;
+   CrystVector_int oldMult;
    oldH=mH;
    oldK=mK;
    oldL=mL;
    oldMult=mMultiplicity;
-   long subs;
-   long shift=0;
 
    //get rid of [0,0,0] reflection
    VFN_DEBUG_MESSAGE("ScatteringData::SortReflectionBySinThetaOverLambda() 1",2)
-   if(0==mSinThetaLambda(sortedSubs(0)))
+   long shift=0;
+   if(0==mSinThetaLambda(sortedSubs(0))) shift=1;
+   // Number of reflections kept: the list is truncated to maxSTOL (if >0) before
+   // being copied, so that the hkl arrays only need to be prepared once.
+   long nb=mNbRefl-shift;
+   if(0<maxSTOL)
    {
-      shift=1;
-      mNbRefl -= 1;
-      mH.resize(mNbRefl);
-      mK.resize(mNbRefl);
-      mL.resize(mNbRefl);
-      mMultiplicity.resize(mNbRefl);
-   }
-   VFN_DEBUG_MESSAGE("ScatteringData::SortReflectionBySinThetaOverLambda() 2",2)
+      VFN_DEBUG_MESSAGE("ScatteringData::SortReflectionBySinThetaOverLambda() 2"<<maxSTOL,2)
+      long maxSubs;
+      for(maxSubs=0;maxSubs<nb;maxSubs++)
+      {
+         VFN_DEBUG_MESSAGE("  "<< oldH(sortedSubs(maxSubs+shift))<<" "<< oldK(sortedSubs(maxSubs+shift))<<" "<< oldL(sortedSubs(maxSubs+shift))<<" "<<mSinThetaLambda(sortedSubs(maxSubs+shift)),1)
+         if(mSinThetaLambda(sortedSubs(maxSubs+shift))>=maxSTOL) break;
+      }
+      if(maxSubs<nb) nb=maxSubs;
+   }
+   // Only keep the subscripts of the kept reflections, without [0,0,0]
+   if(nb<sortedSubs.numElements())
+   {
+      for(long i=0;i<nb;i++) sortedSubs(i)=sortedSubs(i+shift);
+      sortedSubs.resizeAndPreserve(nb);
+   }
+   VFN_DEBUG_MESSAGE("ScatteringData::SortReflectionBySinThetaOverLambda() 3",2)
+   mNbRefl=nb;
+   mH.resize(mNbRefl);
+   mK.resize(mNbRefl);
+   mL.resize(mNbRefl);
+   mMultiplicity.resize(mNbRefl);
    for(long i=0;i<mNbRefl;i++)
    {
-      subs=sortedSubs(i+shift);
+      const long subs=sortedSubs(i);
       mH(i)=oldH(subs);
       mK(i)=oldK(subs);
       mL(i)=oldL(subs);
       mMultiplicity(i)=oldMult(subs);
    }
    mClockHKL.Click();
-   VFN_DEBUG_MESSAGE("ScatteringData::SortReflectionBySinThetaOverLambda() 3",2)
+   VFN_DEBUG_MESSAGE("ScatteringData::SortReflectionBySinThetaOverLambda() 4",2)
    this->PrepareHKLarrays();
    this->CalcSinThetaLambda();
-
-   VFN_DEBUG_MESSAGE("ScatteringData::SortReflectionBySinThetaOverLambda() 4",2)
-   if(0<maxSTOL)
-   {
-      VFN_DEBUG_MESSAGE("ScatteringData::SortReflectionBySinThetaOverLambda() 5"<<maxSTOL,2)
-      long maxSubs=0;
-      VFN_DEBUG_MESSAGE("  "<< mIntH(maxSubs)<<" "<< mIntK(maxSubs)<<" "<< mIntL(maxSubs)<<" "<<mSinThetaLambda(maxSubs),1)
-      for(maxSubs=0;mSinThetaLambda(maxSubs)<maxSTOL;maxSubs++)
-      {
-         VFN_DEBUG_MESSAGE("  "<< mIntH(maxSubs)<<" "<< mIntK(maxSubs)<<" "<< mIntL(maxSubs)<<" "<<mSinThetaLambda(maxSubs),1)
-         if(maxSubs==(mNbRefl-1))
-         {
-            maxSubs=mNbRefl;
-            break;
-         }
-      }
-      if(maxSubs==mNbRefl)
-      {
-         VFN_DEBUG_EXIT("ScatteringData::SortReflectionBySinThetaOverLambda():"<<mNbRefl<<" reflections",5)
-         return sortedSubs;
-      }
-      mNbRefl=maxSubs;
-      mH.resizeAndPreserve(mNbRefl);
-      mK.resizeAndPreserve(mNbRefl);
-      mL.resizeAndPreserve(mNbRefl);
-      mMultiplicity.resizeAndPreserve(mNbRefl);
-      sortedSubs.resizeAndPreserve(mNbRefl);
-      mClockHKL.Click();
-      this->PrepareHKLarrays();
-   }
    VFN_DEBUG_EXIT("ScatteringData::SortReflectionBySinThetaOverLambda():"<<mNbRefl<<" reflections",5)
    return sortedSubs;
 }
@@ -1239,8 +1321,84 @@ const CrystMatrix_REAL& ScatteringData::GetBMatrix() const
    return this->GetCrystal().GetBMatrix();
 }
 
+void ScatteringData::PrepareScattPowIndex()const
+{
+   const ObjRegistry<ScatteringPower> *pReg=&(mpCrystal->GetScatteringPowerRegistry());
+   const long nbReg=pReg->GetNb();
+   // This also updates the ScattCompList if necessary.
+   const ScatteringComponentList *pScattCompList=&(mpCrystal->GetScatteringComponentList());
+   if(mClockScattPowExtra<mpCrystal->GetClockScattCompList())
+   {
+      mvpScattPowExtra.clear();
+      for(long i=0;i<pScattCompList->GetNbComponent();i++)
+      {
+         const ScatteringPower *pScattPow=(*pScattCompList)(i).mpScattPow;
+         if(pReg->Find(pScattPow)>=0) continue;
+         if(find(mvpScattPowExtra.begin(),mvpScattPowExtra.end(),pScattPow)
+            ==mvpScattPowExtra.end()) mvpScattPowExtra.push_back(pScattPow);
+      }
+      mClockScattPowExtra.Click();
+   }
+   const long nbSlot=nbReg+mvpScattPowExtra.size();
+   // Round up the number of reflections, so that all rows are aligned in memory
+   const long stride=((mNbRefl+7)/8)*8;
+   bool needUpdate=(nbSlot!=(long)mvpScattPow.size())||(stride!=mScattPowStride);
+   for(long i=0;(i<nbReg)&&(!needUpdate);i++)
+      if(mvpScattPow[i]!=&(pReg->GetObj(i))) needUpdate=true;
+   for(unsigned long i=0;(i<mvpScattPowExtra.size())&&(!needUpdate);i++)
+      if(mvpScattPow[nbReg+i]!=mvpScattPowExtra[i]) needUpdate=true;
+   if(!needUpdate) return;
+   VFN_DEBUG_MESSAGE("ScatteringData::PrepareScattPowIndex():"<<nbSlot<<" slots, "<<stride<<" refl",3)
+   mvpScattPow.resize(nbSlot);
+   for(long i=0;i<nbReg;i++) mvpScattPow[i]=&(pReg->GetObj(i));
+   for(unsigned long i=0;i<mvpScattPowExtra.size();i++) mvpScattPow[nbReg+i]=mvpScattPowExtra[i];
+   mScattPowStride=stride;
+   mFprime.resize(nbSlot);
+   mFsecond.resize(nbSlot);
+   mFprime=0;
+   mFsecond=0;
+   mScatteringFactor.resize(nbSlot,stride);
+   mTemperatureFactor.resize(nbSlot,stride);
+   mRealGeomSF.resize(nbSlot,stride);
+   mImagGeomSF.resize(nbSlot,stride);
+   mLuzzatiFactor.resize(nbSlot,stride);
+   mScatteringFactor=0;
+   mTemperatureFactor=0;
+   mRealGeomSF=0;
+   mImagGeomSF=0;
+   mLuzzatiFactor=0;
+   mvGeomSFIsUsed.assign(nbSlot,false);
+   mvHasLuzzatiFactor.assign(nbSlot,false);
+   // Everything must be recomputed
+   mClockScattFactor.Reset();
+   mClockScattFactorResonant.Reset();
+   mClockThermicFact.Reset();
+   mClockGeomStructFact.Reset();
+   mClockLuzzatiFactor.Reset();
+   mClockFhklCalcVariance.Reset();
+   mClockStructFactor.Reset();
+}
+
+long ScatteringData::GetScattPowIndex(const ScatteringPower *pScattPow)const
+{
+   const long i=mpCrystal->GetScatteringPowerRegistry().Find(pScattPow);
+   if(i>=0) return i;
+   for(unsigned long j=mpCrystal->GetScatteringPowerRegistry().GetNb();j<mvpScattPow.size();j++)
+      if(mvpScattPow[j]==pScattPow) return j;
+   return -1;
+}
+
+CrystVector_REAL ScatteringData::GetScattPowRow(const CrystMatrix_REAL &m,const long slot)const
+{
+   CrystVector_REAL v(mNbRefl);
+   const REAL *p=m.data()+slot*mScattPowStride;
+   for(long i=0;i<mNbRefl;i++) v(i)=*p++;
+   return v;
+}
+
 void ScatteringData::CalcScattFactor()const
 {
+   this->PrepareScattPowIndex();
    //if(mClockScattFactor>mClockMaster) return;
    if(  (mClockScattFactor>this->GetRadiation().GetClockWavelength())
       &&(mClockScattFactor>mClockHKL)
@@ -1250,16 +1408,19 @@ void ScatteringData::CalcScattFactor()const
    TAU_PROFILE("ScatteringData::CalcScattFactor()","void (bool)",TAU_DEFAULT);
    VFN_DEBUG_ENTRY("ScatteringData::CalcScattFactor()",4)
    this->CalcResonantScattFactor();
-   mvScatteringFactor.clear();
-   for(int i=mpCrystal->GetScatteringPowerRegistry().GetNb()-1;i>=0;i--)
+   for(int i=mvpScattPow.size()-1;i>=0;i--)
    {
-      const ScatteringPower *pScattPow=&(mpCrystal->GetScatteringPowerRegistry().GetObj(i));
-      mvScatteringFactor[pScattPow]=pScattPow->GetScatteringFactor(*this);
+      const ScatteringPower *pScattPow=mvpScattPow[i];
+      const CrystVector_REAL sf=pScattPow->GetScatteringFactor(*this);
       //Directly add Fprime
-      mvScatteringFactor[pScattPow]+= this->mvFprime[pScattPow];
+      const REAL fprime=mFprime(i);
+      const REAL * RESTRICT p0=sf.data();
+      REAL * RESTRICT p1=mScatteringFactor.data()+i*mScattPowStride;
+      const long nb= sf.numElements()<mNbRefl ? sf.numElements() : mNbRefl;
+      for(long j=nb;j>0;j--) *p1++ = *p0++ + fprime;
       VFN_DEBUG_MESSAGE("->   H      K      L   sin(t/l)     f0+f'"
                         <<FormatVertVectorHKLFloats<REAL>(mH,mK,mL,mSinThetaLambda,
-                                                          mvScatteringFactor[pScattPow],10,4,mNbReflUsed),1);
+                                                          this->GetScattPowRow(mScatteringFactor,i),10,4,mNbReflUsed),1);
    }
    mClockScattFactor.Click();
    VFN_DEBUG_EXIT("ScatteringData::CalcScattFactor()",4)
@@ -1267,6 +1428,7 @@ void ScatteringData::CalcScattFactor()const
 
 void ScatteringData::CalcTemperatureFactor()const
 {
+   this->PrepareScattPowIndex();
    //if(mClockThermicFact>mClockMaster) return;
    if(  (mClockThermicFact>this->GetRadiation().GetClockWavelength())
       &&(mClockThermicFact>mClockHKL)
@@ -1275,14 +1437,17 @@ void ScatteringData::CalcTemperatureFactor()const
       &&(mClockThermicFact>mpCrystal->GetMasterClockScatteringPower())) return;
    TAU_PROFILE("ScatteringData::CalcTemperatureFactor()","void (bool)",TAU_DEFAULT);
    VFN_DEBUG_ENTRY("ScatteringData::CalcTemperatureFactor()",4)
-   mvTemperatureFactor.clear();
-   for(int i=mpCrystal->GetScatteringPowerRegistry().GetNb()-1;i>=0;i--)
+   for(int i=mvpScattPow.size()-1;i>=0;i--)
    {
-      const ScatteringPower *pScattPow=&(mpCrystal->GetScatteringPowerRegistry().GetObj(i));
-      mvTemperatureFactor[pScattPow]=pScattPow->GetTemperatureFactor(*this);
+      const ScatteringPower *pScattPow=mvpScattPow[i];
+      const CrystVector_REAL dw=pScattPow->GetTemperatureFactor(*this);
+      const REAL * RESTRICT p0=dw.data();
+      REAL * RESTRICT p1=mTemperatureFactor.data()+i*mScattPowStride;
+      const long nb= dw.numElements()<mNbRefl ? dw.numElements() : mNbRefl;
+      for(long j=nb;j>0;j--) *p1++ = *p0++;
       VFN_DEBUG_MESSAGE("->   H      K      L   sin(t/l)     DebyeWaller"<<endl
                         <<FormatVertVectorHKLFloats<REAL>(mH,mK,mL,mSinThetaLambda,
-                                                          mvTemperatureFactor[pScattPow],10,4,mNbReflUsed),1);
+                                                          this->GetScattPowRow(mTemperatureFactor,i),10,4,mNbReflUsed),1);
    }
    mClockThermicFact.Click();
    VFN_DEBUG_EXIT("ScatteringData::CalcTemperatureFactor()",4)
@@ -1290,13 +1455,14 @@ void ScatteringData::CalcTemperatureFactor()const
 
 void ScatteringData::CalcResonantScattFactor()const
 {
+   this->PrepareScattPowIndex();
    if(  (mClockScattFactorResonant>mpCrystal->GetMasterClockScatteringPower())
       &&(mClockScattFactorResonant>this->GetRadiation().GetClockWavelength())) return;
    VFN_DEBUG_ENTRY("ScatteringData::CalcResonantScattFactor()",4)
    TAU_PROFILE("ScatteringData::CalcResonantScattFactor()","void (bool)",TAU_DEFAULT);
 
-   mvFprime.clear();
-   mvFsecond.clear();
+   mFprime=0;
+   mFsecond=0;
    if(this->GetRadiation().GetWavelength()(0) == 0)
    {
       VFN_DEBUG_EXIT("ScatteringData::CalcResonantScattFactor()->Lambda=0. fprime=fsecond=0",4)
@@ -1304,11 +1470,11 @@ void ScatteringData::CalcResonantScattFactor()const
    }
    else
    {
-      for(int i=mpCrystal->GetScatteringPowerRegistry().GetNb()-1;i>=0;i--)
+      for(int i=mvpScattPow.size()-1;i>=0;i--)
       {
-         const ScatteringPower *pScattPow=&(mpCrystal->GetScatteringPowerRegistry().GetObj(i));
-         mvFprime [pScattPow]=pScattPow->GetResonantScattFactReal(*this)(0);
-         mvFsecond[pScattPow]=pScattPow->GetResonantScattFactImag(*this)(0);
+         const ScatteringPower *pScattPow=mvpScattPow[i];
+         mFprime (i)=pScattPow->GetResonantScattFactReal(*this)(0);
+         mFsecond(i)=pScattPow->GetResonantScattFactImag(*this)(0);
       }
    }
    mClockScattFactorResonant.Click();
@@ -1390,67 +1556,59 @@ void ScatteringData::CalcStructFactor() const
       mFhklCalcReal=0;
       mFhklCalcImag=0;
    //Add all contributions
-   for(map<const ScatteringPower*,CrystVector_REAL>::const_iterator pos=mvRealGeomSF.begin();
-       pos!=mvRealGeomSF.end();++pos)
+   for(unsigned long i=0;i<mvpScattPow.size();i++)
    {
-      const ScatteringPower* pScattPow=pos->first;
-      VFN_DEBUG_MESSAGE("ScatteringData::CalcStructFactor():Fhkl Recalc, "<<pScattPow->GetName(),2)
-      const REAL * RESTRICT pGeomR=mvRealGeomSF[pScattPow].data();
-      const REAL * RESTRICT pGeomI=mvImagGeomSF[pScattPow].data();
-      const REAL * RESTRICT pScatt=mvScatteringFactor[pScattPow].data();
-      const REAL * RESTRICT pTemp=mvTemperatureFactor[pScattPow].data();
+      if(!mvGeomSFIsUsed[i]) continue;
+      VFN_DEBUG_MESSAGE("ScatteringData::CalcStructFactor():Fhkl Recalc, "<<mvpScattPow[i]->GetName(),2)
+      const REAL * RESTRICT pGeomR=mRealGeomSF.data()+i*mScattPowStride;
+      const REAL * RESTRICT pGeomI=mImagGeomSF.data()+i*mScattPowStride;
+      const REAL * RESTRICT pScatt=mScatteringFactor.data()+i*mScattPowStride;
+      const REAL * RESTRICT pTemp=mTemperatureFactor.data()+i*mScattPowStride;
 
       REAL * RESTRICT pReal=mFhklCalcReal.data();
       REAL * RESTRICT pImag=mFhklCalcImag.data();
 
-      VFN_DEBUG_MESSAGE("->mvRealGeomSF[i] "
-         <<mvRealGeomSF[pScattPow].numElements()<<"elements",2)
-      VFN_DEBUG_MESSAGE("->mvImagGeomSF[i] "
-         <<mvImagGeomSF[pScattPow].numElements()<<"elements",2)
-      VFN_DEBUG_MESSAGE("->mvScatteringFactor[i]"
-         <<mvScatteringFactor[pScattPow].numElements()<<"elements",1)
-      VFN_DEBUG_MESSAGE("->mvTemperatureFactor[i]"
-         <<mvTemperatureFactor[pScattPow].numElements()<<"elements",1)
       VFN_DEBUG_MESSAGE("->mFhklCalcReal "<<mFhklCalcReal.numElements()<<"elements",2)
       VFN_DEBUG_MESSAGE("->mFhklCalcImag "<<mFhklCalcImag.numElements()<<"elements",2)
-      VFN_DEBUG_MESSAGE("->   H      K      L   sin(t/l)     Re(F)      Im(F)      scatt      Temp->"<<pScattPow->GetName(),1)
+      VFN_DEBUG_MESSAGE("->   H      K      L   sin(t/l)     Re(F)      Im(F)      scatt      Temp->"<<mvpScattPow[i]->GetName(),1)
 
       VFN_DEBUG_MESSAGE(FormatVertVectorHKLFloats<REAL>(mH,mK,mL,mSinThetaLambda,
-                                                        mvRealGeomSF[pScattPow],
-                                                        mvImagGeomSF[pScattPow],
-                                                        mvScatteringFactor[pScattPow],
-                                                        mvTemperatureFactor[pScattPow],10,4,mNbReflUsed
+                                                        this->GetScattPowRow(mRealGeomSF,i),
+                                                        this->GetScattPowRow(mImagGeomSF,i),
+                                                        this->GetScattPowRow(mScatteringFactor,i),
+                                                        this->GetScattPowRow(mTemperatureFactor,i),10,4,mNbReflUsed
                                                         ),1);
-      if(mvLuzzatiFactor[pScattPow].numElements()>0)
+      if(mvHasLuzzatiFactor[i])
       {// using maximum likelihood
-         const REAL* RESTRICT pLuzzati=mvLuzzatiFactor[pScattPow].data();
+         const REAL* RESTRICT pLuzzati=mLuzzatiFactor.data()+i*mScattPowStride;
          if(false==mIgnoreImagScattFact)
          {
-            const REAL fsecond=mvFsecond[pScattPow];
+            const REAL fsecond=mFsecond(i);
             VFN_DEBUG_MESSAGE("->fsecond= "<<fsecond,10)
-            for(long j=mNbReflUsed;j>0;j--)
+            for(long j=0;j<mNbReflUsed;j++)
             {
-               VFN_DEBUG_MESSAGE("-->"<<j<<" "<<*pReal<<" "<<*pImag<<" "<<*pGeomR<<" "<<*pGeomI<<" "<<*pScatt<<" "<<*pTemp,1)
-               *pReal++ += (*pGeomR   * *pScatt   - *pGeomI   * fsecond)* *pTemp * *pLuzzati;
-               *pImag++ += (*pGeomI++ * *pScatt++ + *pGeomR++ * fsecond)* *pTemp++ * *pLuzzati++;
+               const REAL f=pTemp[j]*pLuzzati[j];
+               pReal[j] += (pGeomR[j] * pScatt[j] - pGeomI[j] * fsecond)*f;
+               pImag[j] += (pGeomI[j] * pScatt[j] + pGeomR[j] * fsecond)*f;
             }
          }
          else
          {
-            for(long j=mNbReflUsed;j>0;j--)
+            for(long j=0;j<mNbReflUsed;j++)
             {
-               *pReal++ += *pGeomR++  * *pTemp   * *pScatt   * *pLuzzati;
-               *pImag++ += *pGeomI++  * *pTemp++ * *pScatt++ * *pLuzzati++;
+               const REAL f=pTemp[j]*pScatt[j]*pLuzzati[j];
+               pReal[j] += pGeomR[j]*f;
+               pImag[j] += pGeomI[j]*f;
             }
          }
          VFN_DEBUG_MESSAGE("ScatteringData::CalcStructFactor():"<<mIgnoreImagScattFact
-                           <<",f\"="<<mvFsecond[pScattPow]<<endl<<
+                           <<",f\"="<<mFsecond(i)<<endl<<
                            FormatVertVectorHKLFloats<REAL>(mH,mK,mL,mSinThetaLambda,
-                                                           mvRealGeomSF[pScattPow],
-                                                           mvImagGeomSF[pScattPow],
-                                                           mvScatteringFactor[pScattPow],
-                                                           mvTemperatureFactor[pScattPow],
-                                                           mvLuzzatiFactor[pScattPow],
+                                                           this->GetScattPowRow(mRealGeomSF,i),
+                                                           this->GetScattPowRow(mImagGeomSF,i),
+                                                           this->GetScattPowRow(mScatteringFactor,i),
+                                                           this->GetScattPowRow(mTemperatureFactor,i),
+                                                           this->GetScattPowRow(mLuzzatiFactor,i),
                                                            mFhklCalcReal,
                                                            mFhklCalcImag,10,4,mNbReflUsed
                                                            ),2);
@@ -1459,29 +1617,28 @@ void ScatteringData::CalcStructFactor() const
       {
          if(false==mIgnoreImagScattFact)
          {
-            const REAL fsecond=mvFsecond[pScattPow];
+            const REAL fsecond=mFsecond(i);
             VFN_DEBUG_MESSAGE("->fsecond= "<<fsecond,2)
-            for(long j=mNbReflUsed;j>0;j--)
+            for(long j=0;j<mNbReflUsed;j++)
             {
-               *pReal += (*pGeomR   * *pScatt - *pGeomI * fsecond)* *pTemp;
-               *pImag += (*pGeomI   * *pScatt + *pGeomR * fsecond)* *pTemp;
-               VFN_DEBUG_MESSAGE("-->"<<j<<" "<<*pReal<<" "<<*pImag<<" "<<*pGeomR<<" "<<*pGeomI<<" "<<*pScatt<<" "<<*pTemp,1)
-               pGeomR++;pGeomI++;pTemp++;pScatt++;pReal++;pImag++;
+               pReal[j] += (pGeomR[j] * pScatt[j] - pGeomI[j] * fsecond)*pTemp[j];
+               pImag[j] += (pGeomI[j] * pScatt[j] + pGeomR[j] * fsecond)*pTemp[j];
             }
          }
          else
          {
-            for(long j=mNbReflUsed;j>0;j--)
+            for(long j=0;j<mNbReflUsed;j++)
             {
-               *pReal++ += *pGeomR++  * *pTemp * *pScatt;
-               *pImag++ += *pGeomI++  * *pTemp++ * *pScatt++;
+               const REAL f=pTemp[j]*pScatt[j];
+               pReal[j] += pGeomR[j]*f;
+               pImag[j] += pGeomI[j]*f;
             }
          }
          VFN_DEBUG_MESSAGE(FormatVertVectorHKLFloats<REAL>(mH,mK,mL,mSinThetaLambda,
-                                                            mvRealGeomSF[pScattPow],
-                                                            mvImagGeomSF[pScattPow],
-                                                            mvScatteringFactor[pScattPow],
-                                                            mvTemperatureFactor[pScattPow],
+                                                            this->GetScattPowRow(mRealGeomSF,i),
+                                                            this->GetScattPowRow(mImagGeomSF,i),
+                                                            this->GetScattPowRow(mScatteringFactor,i),
+                                                            this->GetScattPowRow(mTemperatureFactor,i),
                                                             mFhklCalcReal,
                                                             mFhklCalcImag,10,4,mNbReflUsed
                                                             ),2);
@@ -1529,10 +1686,10 @@ void ScatteringData::CalcStructFactor_FullDeriv(std::set<RefinablePar *> &vPar)
          mFhklCalcImag_FullDeriv[*par].resize(0);
          continue;
       }
-      for(map<const ScatteringPower*,CrystVector_REAL>::const_iterator pos=mvRealGeomSF.begin();
-         pos!=mvRealGeomSF.end();++pos)
+      for(unsigned long i=0;i<mvpScattPow.size();i++)
       {
-         const ScatteringPower* pScattPow=pos->first;
+         if(!mvGeomSFIsUsed[i]) continue;
+         const ScatteringPower* pScattPow=mvpScattPow[i];
          if(mvRealGeomSF_FullDeriv[*par][pScattPow].size()==0)
          {
             continue;//null derivative, so the array was empty
@@ -1546,17 +1703,17 @@ void ScatteringData::CalcStructFactor_FullDeriv(std::set<RefinablePar *> &vPar)
          }
          const REAL * RESTRICT pGeomRd=mvRealGeomSF_FullDeriv[*par][pScattPow].data();
          const REAL * RESTRICT pGeomId=mvImagGeomSF_FullDeriv[*par][pScattPow].data();
-         const REAL * RESTRICT pScatt=mvScatteringFactor[pScattPow].data();
-         const REAL * RESTRICT pTemp=mvTemperatureFactor[pScattPow].data();
+         const REAL * RESTRICT pScatt=mScatteringFactor.data()+i*mScattPowStride;
+         const REAL * RESTRICT pTemp=mTemperatureFactor.data()+i*mScattPowStride;
 
          REAL * RESTRICT pReal=mFhklCalcReal_FullDeriv[*par].data();
          REAL * RESTRICT pImag=mFhklCalcImag_FullDeriv[*par].data();
-         if(mvLuzzatiFactor[pScattPow].numElements()>0)
+         if(mvHasLuzzatiFactor[i])
          {// using maximum likelihood
-            const REAL* RESTRICT pLuzzati=mvLuzzatiFactor[pScattPow].data();
+            const REAL* RESTRICT pLuzzati=mLuzzatiFactor.data()+i*mScattPowStride;
             if(false==mIgnoreImagScattFact)
             {
-               const REAL fsecond=mvFsecond[pScattPow];
+               const REAL fsecond=mFsecond(i);
                for(long j=mNbReflUsed;j>0;j--)
                {
                   *pReal++ += (*pGeomRd   * *pScatt   - *pGeomId   * fsecond)* *pTemp * *pLuzzati;
@@ -1576,7 +1733,7 @@ void ScatteringData::CalcStructFactor_FullDeriv(std::set<RefinablePar *> &vPar)
          {
             if(false==mIgnoreImagScattFact)
             {
-               const REAL fsecond=mvFsecond[pScattPow];
+               const REAL fsecond=mFsecond(i);
                for(long j=mNbReflUsed;j>0;j--)
                {
                   *pReal += (*pGeomRd   * *pScatt - *pGeomId * fsecond)* *pTemp;
@@ -1651,6 +1808,7 @@ void ScatteringData::CalcGeomStructFactor() const
    // This also updates the ScattCompList if necessary.
    const ScatteringComponentList *pScattCompList
       =&(this->GetCrystal().GetScatteringComponentList());
+   this->PrepareScattPowIndex();
    if(  (mClockGeomStructFact>mpCrystal->GetClockScattCompList())
       &&(mClockGeomStructFact>mClockHKL)
       &&(mClockGeomStructFact>mClockNbReflUsed)
@@ -1670,7 +1828,7 @@ void ScatteringData::CalcGeomStructFactor() const
    VFN_DEBUG_MESSAGE("-->Number of reflections:"
       <<this->GetNbRefl()<<" (actually used:"<<mNbReflUsed<<")",2)
    #ifdef __DEBUG__
-   static long counter=0;
+   static thread_local long counter=0;
    VFN_DEBUG_MESSAGE("-->Number of GeomStructFactor calculations so far:"<<counter++,3)
    #endif
 
@@ -1700,39 +1858,23 @@ void ScatteringData::CalcGeomStructFactor() const
       const int nbRefl=this->GetNbRefl();
       CrystVector_long intVect(nbRefl);//not used if mUseFastLessPreciseFunc==false
       #endif
-      // which scattering powers are actually used ?
-      map<const ScatteringPower*,bool> vUsed;
-      // Add existing previously used scattering power to the test;
-      for(map<const ScatteringPower*,CrystVector_REAL>::const_iterator pos=mvRealGeomSF.begin();pos!=mvRealGeomSF.end();++pos)
-         vUsed[pos->first]=false;// this will be changed to true later if they are actually used
-
-      for(int i=mpCrystal->GetScatteringPowerRegistry().GetNb()-1;i>=0;i--)
-      {// Here we make sure scattering power that only contribute ghost atoms are taken into account
-         const ScatteringPower*pow=&(mpCrystal->GetScatteringPowerRegistry().GetObj(i));
-         if(pow->GetMaximumLikelihoodNbGhostAtom()>0) vUsed[pow]=true;
-         else vUsed[pow]=false;
-      }
+      // Slot of the scattering power of each component. ScatteringPower which
+      // are not in the Crystal's registry have an extra slot (see PrepareScattPowIndex())
+      vector<long> vSlot(nbComp);
       for(long i=0;i<nbComp;i++)
-         vUsed[(*pScattCompList)(i).mpScattPow]=true;
-      //Resize all arrays and set them to 0
-      for(map<const ScatteringPower*,bool>::const_iterator pos=vUsed.begin();pos!=vUsed.end();++pos)
+         vSlot[i]=this->GetScattPowIndex((*pScattCompList)(i).mpScattPow);
+      // which scattering powers are actually used ? Make sure scattering power
+      // that only contribute ghost atoms are taken into account
+      for(unsigned long i=0;i<mvpScattPow.size();i++)
+         mvGeomSFIsUsed[i]=(mvpScattPow[i]->GetMaximumLikelihoodNbGhostAtom()>0);
+      for(long i=0;i<nbComp;i++) mvGeomSFIsUsed[vSlot[i]]=true;
+      //Set all arrays to 0
+      for(unsigned long i=0;i<mvpScattPow.size();i++)
       {
-         if(pos->second)
-         {// this will create the entry if it does not already exist
-            mvRealGeomSF[pos->first].resize(mNbReflUsed);
-            mvImagGeomSF[pos->first].resize(mNbReflUsed);
-            mvRealGeomSF[pos->first]=0;
-            mvImagGeomSF[pos->first]=0;
-         }
-         else
-         {// erase entries that are not useful any more (e.g. ScatteringPower that were
-          // used but are not any more).
-            map<const ScatteringPower*,CrystVector_REAL>::iterator
-               poubelle=mvRealGeomSF.find(pos->first);
-            if(poubelle!=mvRealGeomSF.end()) mvRealGeomSF.erase(poubelle);
-            poubelle=mvImagGeomSF.find(pos->first);
-            if(poubelle!=mvImagGeomSF.end()) mvImagGeomSF.erase(poubelle);
-         }
+         if(!mvGeomSFIsUsed[i]) continue;
+         REAL *pr=mRealGeomSF.data()+i*mScattPowStride;
+         REAL *pi=mImagGeomSF.data()+i*mScattPowStride;
+         for(long j=0;j<mNbReflUsed;j++) {pr[j]=0;pi[j]=0;}
       }
 
       REAL centrMult=1.0;
@@ -1743,7 +1885,8 @@ void ScatteringData::CalcGeomStructFactor() const
          const REAL x=(*pScattCompList)(i).mX;
          const REAL y=(*pScattCompList)(i).mY;
          const REAL z=(*pScattCompList)(i).mZ;
-         const ScatteringPower *pScattPow=(*pScattCompList)(i).mpScattPow;
+         REAL *pRealGeomSF=mRealGeomSF.data()+vSlot[i]*mScattPowStride;
+         REAL *pImagGeomSF=mImagGeomSF.data()+vSlot[i]*mScattPowStride;
          const REAL popu= (*pScattCompList)(i).mOccupancy
                          *(*pScattCompList)(i).mDynPopCorr
                          *centrMult;
@@ -1768,8 +1911,8 @@ void ScatteringData::CalcGeomStructFactor() const
             #ifndef HAVE_SSE_MATHFUN
             if(mUseFastLessPreciseFunc==true)
             {
-               REAL * RESTRICT rrsf=mvRealGeomSF[pScattPow].data();
-               REAL * RESTRICT iisf=mvImagGeomSF[pScattPow].data();
+               REAL * RESTRICT rrsf=pRealGeomSF;
+               REAL * RESTRICT iisf=pImagGeomSF;
 
                const long intX=(long)(allCoords(j,0)*sLibCrystNbTabulSine);
                const long intY=(long)(allCoords(j,1)*sLibCrystNbTabulSine);
@@ -1842,8 +1985,8 @@ void ScatteringData::CalcGeomStructFactor() const
                // Actual structure factor calculations
                if(false==pSpg->HasInversionCenter())
                {// Slow ?
-                  REAL *rsf=mvRealGeomSF[pScattPow].data();
-                  REAL *isf=mvImagGeomSF[pScattPow].data();
+                  REAL *rsf=pRealGeomSF;
+                  REAL *isf=pImagGeomSF;
                   const long *h=mIntH.data();
                   const long *k=mIntK.data();
                   const long *l=mIntL.data();
@@ -1878,7 +2021,7 @@ void ScatteringData::CalcGeomStructFactor() const
                }
                else
                {
-                  REAL *rsf=mvRealGeomSF[pScattPow].data();
+                  REAL *rsf=pRealGeomSF;
                   const long *h=mIntH.data();
                   const long *k=mIntK.data();
                   const long *l=mIntL.data();
@@ -1917,8 +2060,8 @@ void ScatteringData::CalcGeomStructFactor() const
                const v4sf v4popu=_mm_load1_ps(&popu);// Can't multiply directly a vector by a scalar ?
                if(false==pSpg->HasInversionCenter())
                {
-                  REAL *rsf=mvRealGeomSF[pScattPow].data();
-                  REAL *isf=mvImagGeomSF[pScattPow].data();
+                  REAL *rsf=pRealGeomSF;
+                  REAL *isf=pImagGeomSF;
                   int jj=mNbReflUsed;
                   for(;jj>3;jj-=4)
                   {
@@ -1946,7 +2089,7 @@ void ScatteringData::CalcGeomStructFactor() const
                }
                else
                {
-                  REAL *rsf=mvRealGeomSF[pScattPow].data();
+                  REAL *rsf=pRealGeomSF;
                   int jj=mNbReflUsed;
                   for(;jj>3;jj-=4)
                   {
@@ -1972,14 +2115,14 @@ void ScatteringData::CalcGeomStructFactor() const
                REAL *tmp=tmpVect.data();
                for(int jj=0;jj<mNbReflUsed;jj++) *tmp++ = *hh++ * x + *kk++ * y + *ll++ *z;
 
-               REAL *sf=mvRealGeomSF[pScattPow].data();
+               REAL *sf=pRealGeomSF;
                tmp=tmpVect.data();
 
                for(int jj=0;jj<mNbReflUsed;jj++) *sf++ += popu * cos(*tmp++);
 
                if(false==pSpg->HasInversionCenter())
                {
-                  sf=mvImagGeomSF[pScattPow].data();
+                  sf=pImagGeomSF;
                   tmp=tmpVect.data();
                   for(int jj=0;jj<mNbReflUsed;jj++) *sf++ += popu * sin(*tmp++);
                }
@@ -2012,14 +2155,18 @@ void ScatteringData::CalcGeomStructFactor() const
                for(long j=mNbReflUsed;j>0;j--) *p1++ += cos(*hh++ *x + *kk++ *y + *ll++ *z );
             }
          }
-         for(map<const ScatteringPower*,CrystVector_REAL>::iterator
-               pos=mvRealGeomSF.begin();pos!=mvRealGeomSF.end();++pos)
-                  pos->second *= tmpVect;
-
-         if(false==pSpg->HasInversionCenter())
-            for(map<const ScatteringPower*,CrystVector_REAL>::iterator
-                  pos=mvImagGeomSF.begin();pos!=mvImagGeomSF.end();++pos)
-                     pos->second *= tmpVect;
+         for(unsigned long i=0;i<mvpScattPow.size();i++)
+         {
+            if(!mvGeomSFIsUsed[i]) continue;
+            const REAL * RESTRICT pt=tmpVect.data();
+            REAL * RESTRICT pr=mRealGeomSF.data()+i*mScattPowStride;
+            for(long j=0;j<mNbReflUsed;j++) pr[j] *= pt[j];
+            if(false==pSpg->HasInversionCenter())
+            {
+               REAL * RESTRICT pi=mImagGeomSF.data()+i*mScattPowStride;
+               for(long j=0;j<mNbReflUsed;j++) pi[j] *= pt[j];
+            }
+         }
       }
       if(true==pSpg->HasInversionCenter())
       {
@@ -2056,19 +2203,22 @@ void ScatteringData::CalcGeomStructFactor() const
             cosTmpVect=cos(tmpVect);
             sinTmpVect=sin(tmpVect);
 
-            map<const ScatteringPower*,CrystVector_REAL>::iterator posi=mvImagGeomSF.begin();
-            map<const ScatteringPower*,CrystVector_REAL>::iterator posr=mvRealGeomSF.begin();
-            for(;posi!=mvImagGeomSF.end();)
+            for(unsigned long i=0;i<mvpScattPow.size();i++)
             {
-               posi->second = posr->second;
-               posi->second *= sinTmpVect;
-               posr->second *= cosTmpVect;
-               posi++;posr++;
+               if(!mvGeomSFIsUsed[i]) continue;
+               const REAL * RESTRICT pc=cosTmpVect.data();
+               const REAL * RESTRICT ps=sinTmpVect.data();
+               REAL * RESTRICT pr=mRealGeomSF.data()+i*mScattPowStride;
+               REAL * RESTRICT pi=mImagGeomSF.data()+i*mScattPowStride;
+               for(long j=0;j<mNbReflUsed;j++)
+               {
+                  pi[j] = pr[j]*ps[j];
+                  pr[j] *= pc[j];
+               }
             }
          }
       }
    }
-   //cout << FormatVertVector<REAL>(*mvRealGeomSF,*mvImagGeomSF)<<endl;
    mClockGeomStructFact.Click();
    VFN_DEBUG_EXIT("ScatteringData::GeomStructFactor(Vx,Vy,Vz,...)",3)
 }
@@ -2309,9 +2459,10 @@ void ScatteringData::CalcGeomStructFactor_FullDeriv(std::set<RefinablePar*> &vPa
 
    for(std::set<RefinablePar*>::iterator par=vPar.begin();par!=vPar.end();++par)
    {
-      for(std::map<const ScatteringPower*,CrystVector_REAL>::iterator pos=mvRealGeomSF.begin();pos!=mvRealGeomSF.end();++pos)
+      for(unsigned long slot=0;slot<mvpScattPow.size();slot++)
       {
-         const ScatteringPower *pScattPow=pos->first;
+         if(!mvGeomSFIsUsed[slot]) continue;
+         const ScatteringPower *pScattPow=mvpScattPow[slot];
          cout<<(*par)->GetName()<<","<<pScattPow->GetName();
          if(mvRealGeomSF_FullDeriv[*par][pScattPow].size()==0)
          {
@@ -2322,13 +2473,13 @@ void ScatteringData::CalcGeomStructFactor_FullDeriv(std::set<RefinablePar*> &vPa
          const REAL step=(*par)->GetDerivStep();
          (*par)->Mutate(step);
          this->CalcGeomStructFactor();
-         mr[make_pair(pScattPow,*par)]=mvRealGeomSF[pScattPow];
-         mi[make_pair(pScattPow,*par)]=mvImagGeomSF[pScattPow];
+         mr[make_pair(pScattPow,*par)]=this->GetScattPowRow(mRealGeomSF,slot);
+         mi[make_pair(pScattPow,*par)]=this->GetScattPowRow(mImagGeomSF,slot);
          (*par)->Mutate(-2*step);
          this->CalcGeomStructFactor();
-         mr[make_pair(pScattPow,*par)]-=mvRealGeomSF[pScattPow];
+         mr[make_pair(pScattPow,*par)]-=this->GetScattPowRow(mRealGeomSF,slot);
          mr[make_pair(pScattPow,*par)]/=step*2;
-         mi[make_pair(pScattPow,*par)]-=mvImagGeomSF[pScattPow];
+         mi[make_pair(pScattPow,*par)]-=this->GetScattPowRow(mImagGeomSF,slot);
          mi[make_pair(pScattPow,*par)]/=step*2;
          (*par)->Mutate(step);
 
@@ -2361,11 +2512,11 @@ void ScatteringData::CalcLuzzatiFactor()const
    // Assume this is  called by ScatteringData::CalcStructFactor()
    // and that we already have computed geometrical structure factors
    VFN_DEBUG_ENTRY("ScatteringData::CalcLuzzatiFactor",3)
+   this->PrepareScattPowIndex();
    bool useLuzzati=false;
-   for(map<const ScatteringPower*,CrystVector_REAL>::const_iterator
-       pos=mvRealGeomSF.begin();pos!=mvRealGeomSF.end();++pos)
+   for(unsigned long i=0;i<mvpScattPow.size();i++)
    {
-      if(pos->first->GetMaximumLikelihoodPositionError()!=0)
+      if(mvGeomSFIsUsed[i] && (mvpScattPow[i]->GetMaximumLikelihoodPositionError()!=0))
       {
          useLuzzati=true;
          break;
@@ -2373,7 +2524,7 @@ void ScatteringData::CalcLuzzatiFactor()const
    }
    if(!useLuzzati)
    {
-      mvLuzzatiFactor.clear();
+      mvHasLuzzatiFactor.assign(mvpScattPow.size(),false);
       VFN_DEBUG_EXIT("ScatteringData::CalcLuzzatiFactor(): not needed, no positionnal errors",3)
       return;
    }
@@ -2407,25 +2558,25 @@ void ScatteringData::CalcLuzzatiFactor()const
    }
    TAU_PROFILE("ScatteringData::CalcLuzzatiFactor()","void ()",TAU_DEFAULT);
 
-   for(int i=mpCrystal->GetScatteringPowerRegistry().GetNb()-1;i>=0;i--)
+   for(int i=mvpScattPow.size()-1;i>=0;i--)
    {
-      const ScatteringPower* pScattPow=&(mpCrystal->GetScatteringPowerRegistry().GetObj(i));
+      const ScatteringPower* pScattPow=mvpScattPow[i];
       if(0 == pScattPow->GetMaximumLikelihoodPositionError())
       {
-         mvLuzzatiFactor[pScattPow].resize(0);
+         mvHasLuzzatiFactor[i]=false;
       }
       else
       {
-         mvLuzzatiFactor[pScattPow].resize(mNbRefl);
+         mvHasLuzzatiFactor[i]=true;
          const REAL b=-(8*M_PI*M_PI)* pScattPow->GetMaximumLikelihoodPositionError()
                                     * pScattPow->GetMaximumLikelihoodPositionError();
          const REAL *stol=this->GetSinThetaOverLambda().data();
-         REAL *fact=mvLuzzatiFactor[pScattPow].data();
+         REAL *fact=mLuzzatiFactor.data()+i*mScattPowStride;
          for(long j=0;j<mNbReflUsed;j++) {*fact++ = exp(b * *stol * *stol);stol++;}
          VFN_DEBUG_MESSAGE("ScatteringData::CalcLuzzatiFactor():"<<pScattPow->GetName()<<endl<<
                            FormatVertVectorHKLFloats<REAL>(mH,mK,mL,mSinThetaLambda,
-                           mvRealGeomSF[pScattPow],mvImagGeomSF[pScattPow],
-                           mvScatteringFactor[pScattPow],mvLuzzatiFactor[pScattPow],10,4,mNbReflUsed
+                           this->GetScattPowRow(mRealGeomSF,i),this->GetScattPowRow(mImagGeomSF,i),
+                           this->GetScattPowRow(mScatteringFactor,i),this->GetScattPowRow(mLuzzatiFactor,i),10,4,mNbReflUsed
                            ),2);
       }
    }
@@ -2446,18 +2597,15 @@ void ScatteringData::CalcStructFactVariance()const
       &&(mClockFhklCalcVariance>mClockStructFactor)
       &&(mClockFhklCalcVariance>mpCrystal->GetMasterClockScatteringPower())) return;
 
-   bool hasGhostAtoms=false;
-   for(map<const ScatteringPower*,CrystVector_REAL>::const_iterator
-       pos=mvRealGeomSF.begin();pos!=mvRealGeomSF.end();++pos)
+   this->PrepareScattPowIndex();
+   bool hasGhostAtoms=false,hasLuzzati=false;
+   for(unsigned long i=0;i<mvpScattPow.size();i++)
    {
-      if(pos->first->GetMaximumLikelihoodNbGhostAtom()!=0)
-      {
-         hasGhostAtoms=true;
-         break;
-      }
+      if(mvHasLuzzatiFactor[i]) hasLuzzati=true;
+      if(mvGeomSFIsUsed[i] && (mvpScattPow[i]->GetMaximumLikelihoodNbGhostAtom()!=0)) hasGhostAtoms=true;
    }
 
-   if( (0==mvLuzzatiFactor.size())&&(!hasGhostAtoms))
+   if( (!hasLuzzati)&&(!hasGhostAtoms))
    {
       mFhklCalcVariance.resize(0);
       return;
@@ -2506,8 +2654,8 @@ void ScatteringData::CalcStructFactVariance()const
 
    for(int i=mpCrystal->GetScatteringPowerRegistry().GetNb()-1;i>=0;i--)
    {
-      const ScatteringPower* pScattPow=&(mpCrystal->GetScatteringPowerRegistry().GetObj(i));
-      if(  (mvLuzzatiFactor[pScattPow].numElements()==0)
+      const ScatteringPower* pScattPow=mvpScattPow[i];
+      if(  (!mvHasLuzzatiFactor[i])
          &&(vGhost[pScattPow]==0)) continue;
       needVar=true;
       if(mFhklCalcVariance.numElements() != mNbRefl)
@@ -2517,10 +2665,10 @@ void ScatteringData::CalcStructFactVariance()const
          for(long j=0;j<mNbReflUsed;j++) *pVar++ = 0;
       }
       // variance on real & imag parts of the structure factor
-      const REAL *pScatt=mvScatteringFactor[pScattPow].data();
+      const REAL *pScatt=mScatteringFactor.data()+i*mScattPowStride;
       const int  *pExp=mExpectedIntensityFactor.data();
       REAL *pVar=mFhklCalcVariance.data();
-      if(mvLuzzatiFactor[pScattPow].numElements()==0)
+      if(!mvHasLuzzatiFactor[i])
       {
          const REAL nbghost=vGhost[pScattPow];
          for(long j=0;j<mNbReflUsed;j++)
@@ -2531,7 +2679,7 @@ void ScatteringData::CalcStructFactVariance()const
       }
       else
       {
-         const REAL *pLuz=mvLuzzatiFactor[pScattPow].data();
+         const REAL *pLuz=mLuzzatiFactor.data()+i*mScattPowStride;
          const REAL occ=vComp[pScattPow];
          const REAL nbghost=vGhost[pScattPow];
          for(long j=0;j<mNbReflUsed;j++)
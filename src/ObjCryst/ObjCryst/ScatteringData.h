@@ -466,6 +466,13 @@ class ScatteringData: virtual public RefinableObj
                                      const bool enableRestraints=false);
       virtual void EndOptimization();
       virtual void SetApproximationFlag(const bool allow);
+      /** Only use reflections below factor*max(sin(theta)/lambda), the max being the
+      * lowest of mMaxSinThetaOvLambda and the one of the last reflection. This is meant to
+      * be used during global optimizations, to switch cheaply between prefixes of the
+      * sorted list of reflections. The change is applied immediately, even when the
+      * object is being refined.
+      */
+      virtual void SetResolutionFactor(const REAL factor);
       /// Set the maximum value for sin(theta)/lambda. All data (reflections,..) still
       /// exist but are ignored for all calculations.
       virtual void SetMaxSinThetaOvLambda(const REAL max);
@@ -522,9 +529,25 @@ class ScatteringData: virtual public RefinableObj
       */
       virtual void GenHKLFullSpace(const REAL maxTheta,
                                    const bool unique=false) const;
+      /** \internal Compute the multiplicity (and the symmetry-equivalent reflections
+      * if !unique) for the unique reflections [i0;i1[ generated by GenHKLFullSpace2().
+      *
+      * \param hkl: the generated h,k,l indices, stored as consecutive triplets
+      * \param hklOut,multOut: the output reflections (triplets) and their multiplicity
+      */
+      void GenHKLFullSpacePartition(const vector<long> &hkl,const bool unique,
+                                    const bool anomalous,
+                                    const unsigned long i0,const unsigned long i1,
+                                    vector<long> &hklOut,vector<int> &multOut)const;
+      /// \internal Use the list of reflections cached by GenHKLFullSpace2(), sorting it and
+      /// keeping only reflections below maxSTOL.
+      void SetHKLFromGenHKLCache(const REAL maxSTOL)const;
       /// \internal This function is called after H,K and L arrays have
       /// been initialized or modified.
       virtual void PrepareHKLarrays() const;
+      /// \internal Update the number of reflections used (mNbReflUsed), from
+      /// max(sin(theta)/lambda) and the resolution factor.
+      virtual void CalcNbReflBelowMaxSinThetaOvLambda()const;
       /// \internal sort reflections by theta values (also get rid of [0,0,0] if present)
       /// If maxSTOL >0, then only reflections where sin(theta)/lambda<maxSTOL are kept
       /// \return an array with the subscript of the kept reflections (for inherited classes)
@@ -589,6 +612,16 @@ class ScatteringData: virtual public RefinableObj
       *
       */
       void CalcStructFactVariance()const;
+      /** \internal Update the list of ScatteringPower slots (mvpScattPow) used
+      * to index the per-ScatteringPower arrays, if the Crystal's ScatteringPower
+      * registry or the number of reflections has changed. All arrays are
+      * then resized and will be recomputed.
+      */
+      void PrepareScattPowIndex()const;
+      /// \internal Slot of a ScatteringPower in the per-ScatteringPower arrays, or -1.
+      long GetScattPowIndex(const ScatteringPower *pScattPow)const;
+      /// \internal Copy of one row (mNbRefl elements) of a per-ScatteringPower array
+      CrystVector_REAL GetScattPowRow(const CrystMatrix_REAL &m,const long slot)const;
 
       /// Number of H,K,L reflections
       mutable long mNbRefl;
@@ -650,20 +683,43 @@ class ScatteringData: virtual public RefinableObj
          /// theta for the crystal and the HKL in ReciprSpace (in radians)
          mutable CrystVector_REAL mTheta;
 
-         /// Anomalous X-Ray scattering term f' and f" are stored here for each ScatteringPower
+         /** The ScatteringPower corresponding to each slot of the per-ScatteringPower
+         * arrays below. The first slots are the ScatteringPower of the Crystal's registry
+         * (with the same index), followed by mvpScattPowExtra.
+         */
+         mutable vector<const ScatteringPower*> mvpScattPow;
+         /** ScatteringPower used by scattering components, but which are not
+         * in the Crystal's registry (e.g. the global ScatteringPower of a ZScatterer).
+         * These may be deleted at any time by their owner, so this list is rebuilt
+         * from the current ScatteringComponentList each time it changes.
+         */
+         mutable vector<const ScatteringPower*> mvpScattPowExtra;
+         /// Last time mvpScattPowExtra was rebuilt
+         mutable RefinableObjClock mClockScattPowExtra;
+         /// Number of elements in each row of the per-ScatteringPower arrays, i.e.
+         /// the number of reflections rounded up so that each row is aligned.
+         mutable long mScattPowStride;
+
+         /// Anomalous X-Ray scattering term f' and f" are stored here for each ScatteringPower slot
          /// We store here only a value. For multi-wavelength support this should be changed
          /// to a vector... or to a matrix to take into account anisotropy of anomalous
          /// scattering...
-         mutable map<const ScatteringPower*,REAL> mvFprime,mvFsecond;
+         mutable CrystVector_REAL mFprime,mFsecond;
 
-         /// Thermic factors for each ScatteringPower, as vectors with NbRefl elements
-         mutable map<const ScatteringPower*,CrystVector_REAL> mvTemperatureFactor;
+         /// Thermic factors for each ScatteringPower slot (rows) and each reflection (columns)
+         mutable CrystMatrix_REAL mTemperatureFactor;
 
-         /// Scattering factors for each ScatteringPower, as vectors with NbRefl elements
+         /// Scattering factors for each ScatteringPower slot (rows) and each reflection (columns)
+         mutable CrystMatrix_REAL mScatteringFactor;
+         /// Scattering factors, as returned by GetScatteringFactor()
          mutable map<const ScatteringPower*,CrystVector_REAL> mvScatteringFactor;
 
-         /// Geometrical Structure factor for each ScatteringPower, as vectors with NbRefl elements
-         mutable map<const ScatteringPower*,CrystVector_REAL> mvRealGeomSF,mvImagGeomSF;
+         /// Geometrical Structure factor for each ScatteringPower slot (rows) and
+         /// each reflection (columns)
+         mutable CrystMatrix_REAL mRealGeomSF,mImagGeomSF;
+         /// Is the geometrical structure factor computed for each ScatteringPower slot,
+         /// i.e. is the ScatteringPower used in the Crystal ?
+         mutable vector<bool> mvGeomSFIsUsed;
          mutable map<RefinablePar*,map<const ScatteringPower*,CrystVector_REAL> > mvRealGeomSF_FullDeriv,mvImagGeomSF_FullDeriv;
 
       //Public Clocks
@@ -717,15 +773,36 @@ class ScatteringData: virtual public RefinableObj
          * this to work correctly.
          */
          REAL mMaxSinThetaOvLambda;
+         /// Fraction of the maximum sin(theta)/lambda actually used, see SetResolutionFactor()
+         REAL mResolutionFactor;
          /// Number of reflections which are below the max. This is updated automatically
          /// from ScatteringData::mMaxSinThetaOvLambda
          mutable long mNbReflUsed;
          /// Clock recording the last time the number of reflections used has increased.
          mutable RefinableObjClock mClockNbReflUsed;
 
+      // Cache for GenHKLFullSpace2
+         /** Full list of reflections from the last GenHKLFullSpace2() call, generated
+         * slightly beyond the requested max(sin(theta)/lambda), so that it can be re-used
+         * (only re-sorted) after a small change of the unit cell.
+         */
+         mutable CrystVector_REAL mGenHKLCacheH,mGenHKLCacheK,mGenHKLCacheL;
+         /// Multiplicity of the cached reflections
+         mutable CrystVector_int mGenHKLCacheMultiplicity;
+         /// B matrix of the crystal used to generate the cached reflections
+         mutable CrystMatrix_REAL mGenHKLCacheBMatrix;
+         /// Max sin(theta)/lambda of the cached reflections (0 if there is no cached list)
+         mutable REAL mGenHKLCacheMaxSTOL;
+         /// Were the cached reflections generated with the unique and anomalous options ?
+         mutable bool mGenHKLCacheUnique,mGenHKLCacheAnomalous;
+         /// Time of the generation of the cached reflections, to compare with the spacegroup
+         mutable RefinableObjClock mGenHKLCacheClock;
+
       // Maximum Likelihood
-         /// The Luzzati 'D' factor for each scattering power and each reflection
-         mutable map<const ScatteringPower*,CrystVector_REAL> mvLuzzatiFactor;
+         /// The Luzzati 'D' factor for each scattering power slot and each reflection
+         mutable CrystMatrix_REAL mLuzzatiFactor;
+         /// Is there a Luzzati factor for each scattering power slot ?
+         mutable vector<bool> mvHasLuzzatiFactor;
          /** The variance on all calculated structure factors, taking into account
          * the positionnal errors and the expected intensity factor.
          *
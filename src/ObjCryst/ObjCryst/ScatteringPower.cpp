@@ -22,6 +22,10 @@
 #include <fstream>
 #include <cstring>
 #include <stdio.h> //for sprintf()
+#include <list>
+#include <map>
+#include <mutex>
+#include <atomic>
 
 
 #include "cctbx/eltbx/xray_scattering.h"
@@ -85,7 +89,7 @@ CrystMatrix_REAL Bij2Betaij(const CrystVector_REAL &Bij, const UnitCell &cell)
 //      SCATTERING POWER
 //
 //######################################################################
-ObjRegistry<ScatteringPower> gScatteringPowerRegistry("Global ScatteringPower Registry");
+ObjRegistry<ScatteringPower> gScatteringPowerRegistry("Global ScatteringPower Registry",true);
 
 ScatteringPower::ScatteringPower():mDynPopCorrIndex(0),mBiso(1.0),mIsIsotropic(true),
 mMaximumLikelihoodNbGhost(0),mFormalCharge(0.0)
@@ -298,7 +302,7 @@ void ScatteringPower::InitRGBColour()
 //
 //######################################################################
 ObjRegistry<ScatteringPowerAtom>
-   gScatteringPowerAtomRegistry("Global ScatteringPowerAtom Registry");
+   gScatteringPowerAtomRegistry("Global ScatteringPowerAtom Registry",true);
 
 ScatteringPowerAtom::ScatteringPowerAtom():
 ScatteringPower(),mSymbol(""),mAtomicNumber(0),mpGaussian(0)
@@ -488,11 +492,170 @@ void ScatteringPowerAtom::Init(const string &name,const string &symbol,const REA
    VFN_DEBUG_MESSAGE("ScatteringPowerAtom::Init(n,s,b):End",3)
 }
 
+//######################################################################
+//
+//      SCATTERING FACTOR CACHE
+//
+//######################################################################
+/// Cached scattering & temperature factors for one list of sin(theta)/lambda
+struct ScattFactorCacheGrid
+{
+   ScattFactorCacheGrid(const CrystVector_REAL &stol,const size_t hash):mStol(stol),mHash(hash){}
+   CrystVector_REAL mStol;
+   size_t mHash;
+   /// Scattering factors for each (radiation type, symbol)
+   map<pair<int,string>,CrystVector_REAL> mvScattFactor;
+   /// Isotropic temperature factors for each Biso
+   map<REAL,CrystVector_REAL> mvTemperatureFactor;
+};
+
+static std::atomic<bool> gScattFactorCacheEnabled(true);
+/// Maximum number of sin(theta)/lambda lists kept in the cache
+static const unsigned int gScattFactorCacheMaxGrid=16;
+/// Maximum number of vectors of each type stored for a given sin(theta)/lambda list
+static const unsigned int gScattFactorCacheMaxEntry=256;
+
+static mutex& GetScattFactorCacheMutex()
+{
+   static mutex m;
+   return m;
+}
+
+/// Most recently used first
+static list<ScattFactorCacheGrid>& GetScattFactorCacheGrids()
+{
+   static list<ScattFactorCacheGrid> v;
+   return v;
+}
+
+/// f' and f" for each (symbol, wavelength)
+static map<pair<string,REAL>,pair<REAL,REAL> >& GetScattFactorCacheResonant()
+{
+   static map<pair<string,REAL>,pair<REAL,REAL> > v;
+   return v;
+}
+
+void SetScatteringFactorCacheEnabled(const bool enable){gScattFactorCacheEnabled=enable;}
+bool IsScatteringFactorCacheEnabled(){return gScattFactorCacheEnabled;}
+
+void ClearScatteringFactorCache()
+{
+   lock_guard<mutex> lock(GetScattFactorCacheMutex());
+   GetScattFactorCacheGrids().clear();
+   GetScattFactorCacheResonant().clear();
+}
+
+static size_t ScattFactorCacheHash(const CrystVector_REAL &stol)
+{
+   // FNV-1a on the bit patterns
+   size_t h=(size_t)14695981039346656037ULL;
+   const REAL *p=stol.data();
+   for(long i=stol.numElements();i>0;i--)
+   {
+      unsigned long long v;
+      memcpy(&v,p++,sizeof(REAL));
+      h=(h^(size_t)v)*(size_t)1099511628211ULL;
+   }
+   return h;
+}
+
+/// Find the cached data for a list of sin(theta)/lambda, optionally creating it.
+/// The mutex must be locked.
+static ScattFactorCacheGrid* ScattFactorCacheFindGrid(const CrystVector_REAL &stol,
+                                                      const size_t hash,const bool create)
+{
+   list<ScattFactorCacheGrid> *pGrids=&GetScattFactorCacheGrids();
+   for(list<ScattFactorCacheGrid>::iterator pos=pGrids->begin();pos!=pGrids->end();++pos)
+   {
+      if((pos->mHash!=hash)||(pos->mStol.numElements()!=stol.numElements())) continue;
+      if(memcmp(pos->mStol.data(),stol.data(),stol.numElements()*sizeof(REAL))!=0) continue;
+      if(pos!=pGrids->begin()) pGrids->splice(pGrids->begin(),*pGrids,pos);
+      return &(pGrids->front());
+   }
+   if(!create) return 0;
+   if(pGrids->size()>=gScattFactorCacheMaxGrid) pGrids->pop_back();
+   pGrids->push_front(ScattFactorCacheGrid(stol,hash));
+   return &(pGrids->front());
+}
+
+template<class K> static bool ScattFactorCacheGet(map<K,CrystVector_REAL> ScattFactorCacheGrid::*pMap,
+                                                  const CrystVector_REAL &stol,const size_t hash,
+                                                  const K &key,CrystVector_REAL &v)
+{
+   lock_guard<mutex> lock(GetScattFactorCacheMutex());
+   ScattFactorCacheGrid *pGrid=ScattFactorCacheFindGrid(stol,hash,false);
+   if(pGrid==0) return false;
+   typename map<K,CrystVector_REAL>::const_iterator pos=(pGrid->*pMap).find(key);
+   if(pos==(pGrid->*pMap).end()) return false;
+   v=pos->second;
+   return true;
+}
+
+template<class K> static void ScattFactorCacheSet(map<K,CrystVector_REAL> ScattFactorCacheGrid::*pMap,
+                                                  const CrystVector_REAL &stol,const size_t hash,
+                                                  const K &key,const CrystVector_REAL &v)
+{
+   lock_guard<mutex> lock(GetScattFactorCacheMutex());
+   ScattFactorCacheGrid *pGrid=ScattFactorCacheFindGrid(stol,hash,true);
+   if((pGrid->*pMap).size()>=gScattFactorCacheMaxEntry) (pGrid->*pMap).clear();
+   (pGrid->*pMap)[key]=v;
+}
+
+/// Resonant terms for X-rays, from the Henke tables
+static void ScattFactorCacheGetResonant(const string &symbol,const REAL lambda,REAL &fprime,REAL &fsecond)
+{
+   const pair<string,REAL> key(symbol,lambda);
+   if(gScattFactorCacheEnabled)
+   {
+      lock_guard<mutex> lock(GetScattFactorCacheMutex());
+      map<pair<string,REAL>,pair<REAL,REAL> >::const_iterator pos=GetScattFactorCacheResonant().find(key);
+      if(pos!=GetScattFactorCacheResonant().end())
+      {
+         fprime=pos->second.first;
+         fsecond=pos->second.second;
+         return;
+      }
+   }
+   try
+   {
+      cctbx::eltbx::henke::table thenke(symbol);
+      cctbx::eltbx::fp_fdp f=thenke.at_angstrom(lambda);
+
+      if(f.is_valid_fp()) fprime=f.fp();
+      else fprime=0;
+      if(f.is_valid_fdp()) fsecond=f.fdp();
+      else fsecond=0;
+   }
+   catch(cctbx::error)
+   {
+      fprime=0;
+      fsecond=0;
+   }
+   if(gScattFactorCacheEnabled)
+   {
+      lock_guard<mutex> lock(GetScattFactorCacheMutex());
+      if(GetScattFactorCacheResonant().size()>=gScattFactorCacheMaxEntry) GetScattFactorCacheResonant().clear();
+      GetScattFactorCacheResonant()[key]=make_pair(fprime,fsecond);
+   }
+}
+
 CrystVector_REAL ScatteringPowerAtom::GetScatteringFactor(const ScatteringData &data,
                                                             const int spgSymPosIndex) const
 {
    VFN_DEBUG_MESSAGE("ScatteringPower::GetScatteringFactor(&data):"<<mName,3)
    CrystVector_REAL sf(data.GetNbRefl());
+   // Neutron scattering lengths are constant, so are not cached
+   const bool useCache=   gScattFactorCacheEnabled && (mpGaussian!=0)
+                       && (data.GetRadiationType()!=RAD_NEUTRON)
+                       && (data.GetSinThetaOverLambda().numElements()==data.GetNbRefl());
+   size_t hash=0;
+   const pair<int,string> key((int)(data.GetRadiationType()),mSymbol);
+   if(useCache)
+   {
+      hash=ScattFactorCacheHash(data.GetSinThetaOverLambda());
+      if(ScattFactorCacheGet(&ScattFactorCacheGrid::mvScattFactor,data.GetSinThetaOverLambda(),hash,key,sf))
+         return sf;
+   }
    switch(data.GetRadiationType())
    {
       case(RAD_NEUTRON):
@@ -532,6 +695,7 @@ CrystVector_REAL ScatteringPowerAtom::GetScatteringFactor(const ScatteringData &
          break;
       }
    }
+   if(useCache) ScattFactorCacheSet(&ScattFactorCacheGrid::mvScattFactor,data.GetSinThetaOverLambda(),hash,key,sf);
    VFN_DEBUG_MESSAGE("ScatteringPower::GetScatteringFactor(&data):End",3)
    return sf;
 }
@@ -579,6 +743,24 @@ CrystVector_REAL ScatteringPowerAtom::GetTemperatureFactor(const ScatteringData
       warnADP=false;
    }
 
+   // Do not cache the temperature factor while Biso is refined: each new value would
+   // just fill (and flush) the cache
+   bool useCache=   gScattFactorCacheEnabled
+                 && (data.GetSinThetaOverLambda().numElements()==data.GetNbRefl());
+   if(useCache)
+   {
+      const long i=this->FindPar(&mBiso);
+      if(i>=0) useCache=this->GetPar(i).IsFixed();
+   }
+   size_t hash=0;
+   if(useCache)
+   {
+      hash=ScattFactorCacheHash(data.GetSinThetaOverLambda());
+      if(ScattFactorCacheGet(&ScattFactorCacheGrid::mvTemperatureFactor,data.GetSinThetaOverLambda(),hash,
+                             mBiso,sf))
+         return sf;
+   }
+
    if(true)//(mIsIsotropic)
    {
       CrystVector_REAL stolsq(data.GetNbRefl());
@@ -612,6 +794,9 @@ CrystVector_REAL ScatteringPowerAtom::GetTemperatureFactor(const ScatteringData
 
       #undef SF
       #undef STOLSQ
+      if(useCache)
+         ScattFactorCacheSet(&ScattFactorCacheGrid::mvTemperatureFactor,data.GetSinThetaOverLambda(),hash,
+                             mBiso,sf);
    }
    else
    {// :TODO: handle ADP - requires taking into account symmetries...
@@ -683,21 +868,7 @@ CrystMatrix_REAL ScatteringPowerAtom::
       }
       case(RAD_XRAY):
       {
-         try
-         {
-            cctbx::eltbx::henke::table thenke(mSymbol);
-            cctbx::eltbx::fp_fdp f=thenke.at_angstrom(data.GetWavelength()(0));
-
-            if(f.is_valid_fp()) fprime(0)=f.fp();
-            else fprime(0)=0;
-            if(f.is_valid_fdp()) fsecond(0)=f.fdp();
-            else fsecond(0)=0;
-         }
-         catch(cctbx::error)
-         {
-            fprime(0)=0;
-            fsecond(0)=0;
-         }
+         ScattFactorCacheGetResonant(mSymbol,data.GetWavelength()(0),fprime(0),fsecond(0));
          break;
       }
       case(RAD_ELECTRON):
@@ -727,21 +898,7 @@ CrystMatrix_REAL ScatteringPowerAtom::
       }
       case(RAD_XRAY):
       {
-         try
-         {
-            cctbx::eltbx::henke::table thenke(mSymbol);
-            cctbx::eltbx::fp_fdp f=thenke.at_angstrom(data.GetWavelength()(0));
-
-            if(f.is_valid_fp()) fprime(0)=f.fp();
-            else fprime(0)=0;
-            if(f.is_valid_fdp()) fsecond(0)=f.fdp();
-            else fsecond(0)=0;
-         }
-         catch(cctbx::error)
-         {
-            fprime(0)=0;
-            fsecond(0)=0;
-         }
+         ScattFactorCacheGetResonant(mSymbol,data.GetWavelength()(0),fprime(0),fsecond(0));
          break;
       }
       case(RAD_ELECTRON):
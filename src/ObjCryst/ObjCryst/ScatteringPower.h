@@ -456,6 +456,30 @@ class ScatteringPowerAtom:virtual public ScatteringPower
 /// Global registry for all ScatteringPowerAtom objects
 extern ObjRegistry<ScatteringPowerAtom> gScatteringPowerAtomRegistry;
 
+//######################################################################
+//
+//      SCATTERING FACTOR CACHE
+//
+//######################################################################
+/** \brief Enable or disable the process-wide cache of scattering factors
+* (enabled by default).
+*
+* Atomic scattering factors f0(sin(theta)/lambda), isotropic Debye-Waller factors
+* and resonant terms f' and f" are stored in a cache which is shared (in a thread-safe
+* way) by all ScatteringData objects. Scattering and Debye-Waller factors are stored
+* for each list of sin(theta)/lambda values, so that several datasets with the same
+* reflections (e.g. a Crystal refined against patterns recorded at different
+* wavelengths) compute them only once. Cached values are found using the element
+* symbol, Biso, wavelength and the sin(theta)/lambda values, so they never become
+* obsolete - ScatteringData clocks still decide when they must be fetched again.
+* Debye-Waller factors are not cached while Biso is a refined (non-fixed) parameter.
+*/
+void SetScatteringFactorCacheEnabled(const bool enable=true);
+/// Is the process-wide cache of scattering factors enabled ?
+bool IsScatteringFactorCacheEnabled();
+/// Clear the process-wide cache of scattering factors.
+void ClearScatteringFactorCache();
+
 //######################################################################
 //
 //      SCATTERING COMPONENT
@@ -23,6 +23,8 @@
 #include "ObjCryst/ObjCryst/UnitCell.h"
 #include "ObjCryst/Quirks/VFNStreamFormat.h"
 
+#include <mutex>
+
 namespace ObjCryst
 {
 const RefParType *gpRefParTypeUnitCell=0;
@@ -171,66 +173,67 @@ REAL UnitCell::GetLatticePar(int whichPar)const
    {
       const int num = mSpaceGroup.GetSpaceGroupNumber();
 
-      static CrystVector_REAL cellDim;
-      cellDim=mCellDim;
+      // Local copy, so that this can be called from several threads
+      REAL cellDim[6];
+      for(int i=0;i<6;i++) cellDim[i]=mCellDim(i);
       if((num <=2)||(mConstrainLatticeToSpaceGroup.GetChoice()!=0))
-         return cellDim(whichPar);
+         return cellDim[whichPar];
       if((num <=15) && (0==mSpaceGroup.GetUniqueAxis()))
       {
-         cellDim(4)=M_PI/2.;
-         cellDim(5)=M_PI/2.;
-         return cellDim(whichPar);
+         cellDim[4]=M_PI/2.;
+         cellDim[5]=M_PI/2.;
+         return cellDim[whichPar];
       }
       if((num <=15) && (1==mSpaceGroup.GetUniqueAxis()))
       {
-         cellDim(3)=M_PI/2.;
-         cellDim(5)=M_PI/2.;
-         return cellDim(whichPar);
+         cellDim[3]=M_PI/2.;
+         cellDim[5]=M_PI/2.;
+         return cellDim[whichPar];
       }
       if((num <=15) && (2==mSpaceGroup.GetUniqueAxis()))
       {
-         cellDim(3)=M_PI/2.;
-         cellDim(4)=M_PI/2.;
-         return cellDim(whichPar);
+         cellDim[3]=M_PI/2.;
+         cellDim[4]=M_PI/2.;
+         return cellDim[whichPar];
       }
 
       if(num <=74)
       {
-         cellDim(3)=M_PI/2.;
-         cellDim(4)=M_PI/2.;
-         cellDim(5)=M_PI/2.;
-         return cellDim(whichPar);
+         cellDim[3]=M_PI/2.;
+         cellDim[4]=M_PI/2.;
+         cellDim[5]=M_PI/2.;
+         return cellDim[whichPar];
       }
       if(num <= 142)
       {
-         cellDim(3)=M_PI/2.;
-         cellDim(4)=M_PI/2.;
-         cellDim(5)=M_PI/2.;
-         cellDim(1) = mCellDim(0) ;
-         return cellDim(whichPar);
+         cellDim[3]=M_PI/2.;
+         cellDim[4]=M_PI/2.;
+         cellDim[5]=M_PI/2.;
+         cellDim[1] = mCellDim(0) ;
+         return cellDim[whichPar];
       }
       if(mSpaceGroup.GetExtension()=='R')
       {
-         cellDim(4) = mCellDim(3);
-         cellDim(5) = mCellDim(3);
-         cellDim(1) = mCellDim(0);
-         cellDim(2) = mCellDim(0);
-         return cellDim(whichPar);
+         cellDim[4] = mCellDim(3);
+         cellDim[5] = mCellDim(3);
+         cellDim[1] = mCellDim(0);
+         cellDim[2] = mCellDim(0);
+         return cellDim[whichPar];
       }
       if(num <= 194) // ||(mSpaceGroup.GetExtension()=='H')
       {//Hexagonal axes, for hexagonal and non-rhomboedral trigonal cells
-         cellDim(3) = M_PI/2.;
-         cellDim(4) = M_PI/2.;
-         cellDim(5) = M_PI*2./3.;
-         cellDim(1) = mCellDim(0) ;
-         return cellDim(whichPar);
+         cellDim[3] = M_PI/2.;
+         cellDim[4] = M_PI/2.;
+         cellDim[5] = M_PI*2./3.;
+         cellDim[1] = mCellDim(0) ;
+         return cellDim[whichPar];
       }
-      cellDim(3)=M_PI/2.;
-      cellDim(4)=M_PI/2.;
-      cellDim(5)=M_PI/2.;
-      cellDim(1) = mCellDim(0) ;
-      cellDim(2) = mCellDim(0) ;
-      return cellDim(whichPar);
+      cellDim[3]=M_PI/2.;
+      cellDim[4]=M_PI/2.;
+      cellDim[5]=M_PI/2.;
+      cellDim[1] = mCellDim(0) ;
+      cellDim[2] = mCellDim(0) ;
+      return cellDim[whichPar];
    }
 }
 
@@ -383,6 +386,8 @@ void UnitCell::InitOptions()
    static string ConstrainLatticeToSpaceGroupChoices[2];
 
    static bool needInitNames=true;
+   static mutex needInitNamesMutex;
+   lock_guard<mutex> needInitNamesLock(needInitNamesMutex);
    if(true==needInitNames)
    {
       ConstrainLatticeToSpaceGroupName="Constrain Lattice to SpaceGroup Symmetry";
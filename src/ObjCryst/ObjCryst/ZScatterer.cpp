@@ -91,7 +91,11 @@ const string& ZAtom::GetName()const {return mName;}
 ZScatterer& ZAtom::GetZScatterer(){return *mpScatt;}
 const ZScatterer& ZAtom::GetZScatterer()const{return *mpScatt;}
 
-void ZAtom::SetName(const string& name) {mName=name;}
+void ZAtom::SetName(const string& name)
+{
+   if(mName!=name) ++gObjNameChangeCounter;
+   mName=name;
+}
 long ZAtom::GetZBondAtom()const {return mAtomBond;}
 long ZAtom::GetZAngleAtom()const {return mAtomAngle;}
 long ZAtom::GetZDihedralAngleAtom()const {return mAtomDihed;}
@@ -223,7 +227,7 @@ mUseGlobalScattPow(false),mpGlobalScattPow(0),
 mpZMoveMinimizer(0)
 {
    VFN_DEBUG_MESSAGE("ZScatterer::ZScatterer():("<<mName<<")",5)
-   mName=name;
+   this->RefinableObj::SetName(name);
    mXYZ(0)=x;
    mXYZ(1)=y;
    mXYZ(2)=z;
@@ -246,7 +250,7 @@ mpZMoveMinimizer(0)
 {
    VFN_DEBUG_ENTRY("ZScatterer::ZScatterer(&old):("<<mName<<")",10)
 
-   mName=old.GetName();
+   this->RefinableObj::SetName(old.GetName());
    mXYZ(0)=old.GetX();
    mXYZ(1)=old.GetY();
    mXYZ(2)=old.GetZ();
@@ -2040,19 +2044,20 @@ void ZScatterer::UpdateScattCompList() const
    }
 
    long j=0;
-   REAL x,y,z;
    VFN_DEBUG_MESSAGE("ZScatterer::UpdateScattCompList(bool):Finishing"<<mNbAtom<<","<<mNbDummyAtom,3)
+   // Orthonormal to fractional matrix (by rows), from the conversion of the base vectors
+   REAL m[9]={1,0,0, 0,1,0, 0,0,1};
+   for(unsigned int k=0;k<3;++k) mpCryst->OrthonormalToFractionalCoords(m[k],m[k+3],m[k+6]);
+   const REAL *RESTRICT px=mXCoord.data();
+   const REAL *RESTRICT py=mYCoord.data();
+   const REAL *RESTRICT pz=mZCoord.data();
    for(long i=0;i<mNbAtom;i++)
    {
       if(0!=mZAtomRegistry.GetObj(i).GetScatteringPower())
       {
-         x=mXCoord(i);
-         y=mYCoord(i);
-         z=mZCoord(i);
-         mpCryst->OrthonormalToFractionalCoords(x,y,z);
-         mScattCompList(j  ).mX=x;
-         mScattCompList(j  ).mY=y;
-         mScattCompList(j  ).mZ=z;
+         mScattCompList(j  ).mX=m[0]*px[i]+m[1]*py[i]+m[2]*pz[i];
+         mScattCompList(j  ).mY=m[3]*px[i]+m[4]*py[i]+m[5]*pz[i];
+         mScattCompList(j  ).mZ=m[6]*px[i]+m[7]*py[i]+m[8]*pz[i];
          mScattCompList(j  ).mpScattPow=mZAtomRegistry.GetObj(i).GetScatteringPower();
          mScattCompList(j++).mOccupancy=mZAtomRegistry.GetObj(i).GetOccupancy()*mOccupancy;
       }
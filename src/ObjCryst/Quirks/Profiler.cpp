@@ -0,0 +1,355 @@
+/*  ObjCryst++ Object-Oriented Crystallographic Library
+    (c) 2000- Vincent Favre-Nicolin vincefn@users.sourceforge.net
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+/*
+*  source file for the built-in profiler
+*
+*/
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <boost/format.hpp>
+#include "ObjCryst/Quirks/Profiler.h"
+
+using namespace std;
+
+namespace ObjCryst
+{
+std::atomic<bool> gProfilerEnabled(false);
+
+/** A node in the tree of timers of one thread.
+*
+* Only the owning thread adds nodes and updates the counters. The counters are
+* atomic (relaxed), and nodes are added with the thread's mutex locked, so that
+* ProfilerReset() and the reports can walk the tree from another thread.
+*/
+struct ProfilerNode
+{
+   ProfilerNode(const char *name,ProfilerNode *parent):
+   mName(name),mpParent(parent),mNbCall(0),mTime(0),mNbAlloc(0),mAllocBytes(0)
+   {}
+   ~ProfilerNode()
+   {
+      for(vector<ProfilerNode*>::iterator pos=mvpChild.begin();pos!=mvpChild.end();++pos)
+         delete *pos;
+   }
+   /// Find a child node by name, or null
+   ProfilerNode* FindChild(const char *name)const
+   {
+      for(vector<ProfilerNode*>::const_iterator pos=mvpChild.begin();pos!=mvpChild.end();++pos)
+         if(((*pos)->mName==name) || (strcmp((*pos)->mName,name)==0)) return *pos;
+      return 0;
+   }
+   const char *mName;
+   ProfilerNode *mpParent;
+   vector<ProfilerNode*> mvpChild;
+   atomic<unsigned long long> mNbCall;
+   /// Total time, in nanoseconds
+   atomic<long long> mTime;
+   atomic<unsigned long long> mNbAlloc;
+   atomic<unsigned long long> mAllocBytes;
+};
+
+/// The tree of timers for one thread
+struct ProfilerThread
+{
+   ProfilerThread():mRoot("",0),mpCurrent(&mRoot){}
+   ProfilerNode mRoot;
+   ProfilerNode *mpCurrent;
+   /// Locked by the owning thread when adding a node, and by other threads
+   /// when walking the tree.
+   mutex mMutex;
+};
+
+/// Protects the list of thread trees and the retired tree
+static mutex& GetProfilerMutex()
+{
+   static mutex m;
+   return m;
+}
+
+/// The trees of the running threads
+static vector<ProfilerThread*>& GetProfilerThreads()
+{
+   static vector<ProfilerThread*> v;
+   return v;
+}
+
+/// The merged trees of the threads which have finished, so that they can still
+/// be reported.
+static ProfilerThread& GetProfilerRetired()
+{
+   static ProfilerThread t;
+   return t;
+}
+
+/// Number of threads merged in the retired tree
+static unsigned int sNbProfilerRetired=0;
+
+/// Add the counters of a tree to another one (the source must not change)
+static void ProfilerMergeTree(const ProfilerNode *src,ProfilerNode *dest)
+{
+   dest->mNbCall+=src->mNbCall.load(memory_order_relaxed);
+   dest->mTime+=src->mTime.load(memory_order_relaxed);
+   dest->mNbAlloc+=src->mNbAlloc.load(memory_order_relaxed);
+   dest->mAllocBytes+=src->mAllocBytes.load(memory_order_relaxed);
+   for(vector<ProfilerNode*>::const_iterator pos=src->mvpChild.begin();pos!=src->mvpChild.end();++pos)
+   {
+      ProfilerNode *child=dest->FindChild((*pos)->mName);
+      if(0==child)
+      {
+         child=new ProfilerNode((*pos)->mName,dest);
+         dest->mvpChild.push_back(child);
+      }
+      ProfilerMergeTree(*pos,child);
+   }
+}
+
+static thread_local ProfilerThread *spProfilerThread=0;
+
+/// Owns the tree of the current thread. When the thread finishes, its tree
+/// is merged into the retired tree and deleted.
+struct ProfilerThreadOwner
+{
+   ProfilerThreadOwner():mpThread(0){}
+   ~ProfilerThreadOwner()
+   {
+      if(0==mpThread) return;
+      {
+         lock_guard<mutex> lock(GetProfilerMutex());
+         vector<ProfilerThread*> &v=GetProfilerThreads();
+         v.erase(find(v.begin(),v.end(),mpThread));
+         ProfilerMergeTree(&(mpThread->mRoot),&(GetProfilerRetired().mRoot));
+         sNbProfilerRetired++;
+      }
+      spProfilerThread=0;
+      delete mpThread;
+   }
+   ProfilerThread *mpThread;
+};
+
+static ProfilerThread* GetProfilerThread()
+{
+   if(0==spProfilerThread)
+   {
+      static thread_local ProfilerThreadOwner owner;
+      spProfilerThread=new ProfilerThread;
+      owner.mpThread=spProfilerThread;
+      lock_guard<mutex> lock(GetProfilerMutex());
+      GetProfilerThreads().push_back(spProfilerThread);
+   }
+   return spProfilerThread;
+}
+
+static long long ProfilerNow()
+{
+   return chrono::duration_cast<chrono::nanoseconds>
+            (chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ProfilerTimer::StartNode()
+{
+   ProfilerThread *t=GetProfilerThread();
+   ProfilerNode *parent=t->mpCurrent;
+   ProfilerNode *node=parent->FindChild(mName);
+   if(0==node)
+   {
+      node=new ProfilerNode(mName,parent);
+      lock_guard<mutex> lock(t->mMutex);
+      parent->mvpChild.push_back(node);
+   }
+   node->mNbCall.fetch_add(1,memory_order_relaxed);
+   t->mpCurrent=node;
+   mpNode=node;
+   mStart=ProfilerNow();
+}
+
+void ProfilerTimer::StopNode()
+{
+   mpNode->mTime.fetch_add(ProfilerNow()-mStart,memory_order_relaxed);
+   spProfilerThread->mpCurrent=mpNode->mpParent;
+   mpNode=0;
+}
+
+void ProfilerEnable(const bool enable){gProfilerEnabled=enable;}
+
+static void ProfilerResetNode(ProfilerNode *node)
+{
+   node->mNbCall=0;
+   node->mTime=0;
+   node->mNbAlloc=0;
+   node->mAllocBytes=0;
+   for(vector<ProfilerNode*>::iterator pos=node->mvpChild.begin();pos!=node->mvpChild.end();++pos)
+      ProfilerResetNode(*pos);
+}
+
+void ProfilerReset()
+{
+   // Nodes are kept, since timers may be running
+   lock_guard<mutex> lock(GetProfilerMutex());
+   for(vector<ProfilerThread*>::iterator pos=GetProfilerThreads().begin();pos!=GetProfilerThreads().end();++pos)
+   {
+      lock_guard<mutex> threadLock((*pos)->mMutex);
+      ProfilerResetNode(&((*pos)->mRoot));
+   }
+   ProfilerResetNode(&(GetProfilerRetired().mRoot));
+   sNbProfilerRetired=0;
+}
+
+void ProfilerAddAllocation(const size_t bytes)
+{
+   ProfilerNode *node=GetProfilerThread()->mpCurrent;
+   node->mNbAlloc.fetch_add(1,memory_order_relaxed);
+   node->mAllocBytes.fetch_add(bytes,memory_order_relaxed);
+}
+
+/// Timer statistics merged for all threads
+struct ProfilerReportNode
+{
+   ProfilerReportNode():mNbCall(0),mTime(0),mNbAlloc(0),mAllocBytes(0){}
+   string mName;
+   unsigned long long mNbCall;
+   long long mTime;
+   unsigned long long mNbAlloc;
+   unsigned long long mAllocBytes;
+   vector<ProfilerReportNode> mvChild;
+   /// Time not spent in children timers
+   long long GetSelfTime()const
+   {
+      long long t=mTime;
+      for(vector<ProfilerReportNode>::const_iterator pos=mvChild.begin();pos!=mvChild.end();++pos)
+         t-=pos->mTime;
+      return t;
+   }
+};
+
+static bool ProfilerCompareTime(const ProfilerReportNode &a,const ProfilerReportNode &b)
+{
+   return a.mTime>b.mTime;
+}
+
+static void ProfilerMergeNode(const ProfilerNode *node,ProfilerReportNode &report)
+{
+   report.mNbCall+=node->mNbCall.load(memory_order_relaxed);
+   report.mTime+=node->mTime.load(memory_order_relaxed);
+   report.mNbAlloc+=node->mNbAlloc.load(memory_order_relaxed);
+   report.mAllocBytes+=node->mAllocBytes.load(memory_order_relaxed);
+   for(vector<ProfilerNode*>::const_iterator pos=node->mvpChild.begin();pos!=node->mvpChild.end();++pos)
+   {
+      vector<ProfilerReportNode>::iterator child=report.mvChild.begin();
+      for(;child!=report.mvChild.end();++child) if(child->mName==(*pos)->mName) break;
+      if(child==report.mvChild.end())
+      {
+         report.mvChild.push_back(ProfilerReportNode());
+         child=report.mvChild.end()-1;
+         child->mName=(*pos)->mName;
+      }
+      ProfilerMergeNode(*pos,*child);
+   }
+}
+
+static void ProfilerSortNode(ProfilerReportNode &report)
+{
+   sort(report.mvChild.begin(),report.mvChild.end(),ProfilerCompareTime);
+   for(vector<ProfilerReportNode>::iterator pos=report.mvChild.begin();pos!=report.mvChild.end();++pos)
+      ProfilerSortNode(*pos);
+}
+
+/// Build the report tree, with all threads merged. The root time is the sum
+/// of the top-level timers.
+static ProfilerReportNode ProfilerBuildReport(unsigned int &nbThread)
+{
+   ProfilerReportNode root;
+   lock_guard<mutex> lock(GetProfilerMutex());
+   nbThread=GetProfilerThreads().size()+sNbProfilerRetired;
+   for(vector<ProfilerThread*>::const_iterator pos=GetProfilerThreads().begin();pos!=GetProfilerThreads().end();++pos)
+   {
+      lock_guard<mutex> threadLock((*pos)->mMutex);
+      ProfilerMergeNode(&((*pos)->mRoot),root);
+   }
+   ProfilerMergeNode(&(GetProfilerRetired().mRoot),root);
+   root.mName="Total";
+   root.mTime=0;
+   for(vector<ProfilerReportNode>::const_iterator pos=root.mvChild.begin();pos!=root.mvChild.end();++pos)
+      root.mTime+=pos->mTime;
+   ProfilerSortNode(root);
+   return root;
+}
+
+static void ProfilerPrintNode(ostream &os,const ProfilerReportNode &node,const long long parentTime,
+                              const unsigned int depth)
+{
+   os<<boost::format("%12d %12.6f %12.6f %6.1f%% %10d  ")
+         %node.mNbCall %(node.mTime*1e-9) %(node.GetSelfTime()*1e-9)
+         %(parentTime>0 ? node.mTime*100.0/parentTime : 100.0) %node.mNbAlloc
+     <<string(2*depth,' ')<<node.mName<<endl;
+   for(vector<ProfilerReportNode>::const_iterator pos=node.mvChild.begin();pos!=node.mvChild.end();++pos)
+      ProfilerPrintNode(os,*pos,node.mTime,depth+1);
+}
+
+void ProfilerPrintReport(ostream &os)
+{
+   unsigned int nbThread;
+   const ProfilerReportNode root=ProfilerBuildReport(nbThread);
+   os<<"Profiling report ("<<nbThread<<" thread(s)):"<<endl
+     <<"       Calls      Time(s)      Self(s)  %Parent     Allocs  Name"<<endl;
+   ProfilerPrintNode(os,root,0,0);
+}
+
+static string ProfilerJSONString(const string &s)
+{
+   string r="\"";
+   for(string::const_iterator pos=s.begin();pos!=s.end();++pos)
+   {
+      if((*pos=='"') || (*pos=='\\')) r+='\\';
+      if((unsigned char)(*pos)<0x20) r+=' ';
+      else r+=*pos;
+   }
+   return r+"\"";
+}
+
+static void ProfilerPrintNodeJSON(ostream &os,const ProfilerReportNode &node,const unsigned int depth)
+{
+   const string indent(2*depth,' ');
+   os<<indent<<"{\"name\": "<<ProfilerJSONString(node.mName)
+     <<", \"calls\": "<<node.mNbCall
+     <<boost::format(", \"time\": %.9f, \"self\": %.9f") %(node.mTime*1e-9) %(node.GetSelfTime()*1e-9)
+     <<", \"alloc\": "<<node.mNbAlloc<<", \"alloc_bytes\": "<<node.mAllocBytes
+     <<", \"children\": [";
+   for(vector<ProfilerReportNode>::const_iterator pos=node.mvChild.begin();pos!=node.mvChild.end();++pos)
+   {
+      os<<(pos==node.mvChild.begin() ? "\n" : ",\n");
+      ProfilerPrintNodeJSON(os,*pos,depth+1);
+   }
+   if(node.mvChild.size()>0) os<<"\n"<<indent;
+   os<<"]}";
+}
+
+void ProfilerPrintReportJSON(ostream &os)
+{
+   unsigned int nbThread;
+   const ProfilerReportNode root=ProfilerBuildReport(nbThread);
+   os<<"{\"threads\": "<<nbThread<<", \"timers\":\n";
+   ProfilerPrintNodeJSON(os,root,1);
+   os<<"\n}"<<endl;
+}
+
+}//namespace
@@ -0,0 +1,108 @@
+/*  ObjCryst++ Object-Oriented Crystallographic Library
+    (c) 2000- Vincent Favre-Nicolin vincefn@users.sourceforge.net
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+/*
+*  header file for the built-in profiler, used by the TAU_PROFILE macros
+*  when the TAU toolkit is not used.
+*
+*/
+#ifndef _OBJCRYST_PROFILER_H_
+#define _OBJCRYST_PROFILER_H_
+
+#include <cstddef>
+#include <iostream>
+#include <atomic>
+
+namespace ObjCryst
+{
+/// Is the built-in profiler enabled ? This is false by default, use ProfilerEnable().
+extern std::atomic<bool> gProfilerEnabled;
+
+struct ProfilerNode;
+
+/** \brief Timer for the built-in profiler.
+*
+* Timers are organized as a tree for each thread: a timer started while another
+* is running is recorded as a child of the running timer. For each node of the tree,
+* the number of calls, the elapsed time and the number of memory allocations
+* (see ProfilerCountAllocation()) are recorded.
+*
+* This is used by the TAU_PROFILE_TIMER, TAU_PROFILE_START and TAU_PROFILE_STOP
+* macros. When the profiler is disabled, Start() and Stop() only test a global flag.
+*
+* A running timer is stopped when it is destroyed, so that the tree remains
+* consistent if its scope is left early (return, exception) before Stop().
+*
+* \param name: the name of the timer. This should be a string literal (the pointer
+* is stored).
+*/
+class ProfilerTimer
+{
+   public:
+      ProfilerTimer(const char *name):mName(name),mpNode(0),mStart(0){}
+      ~ProfilerTimer(){this->Stop();}
+      void Start()
+      {
+         if(0!=mpNode) this->StopNode();
+         if(gProfilerEnabled.load(std::memory_order_relaxed)) this->StartNode();
+      }
+      void Stop(){if(0!=mpNode) this->StopNode();}
+   private:
+      void StartNode();
+      void StopNode();
+      const char *mName;
+      /// The node for this timer in the current thread tree, if running
+      ProfilerNode *mpNode;
+      /// Start time, in nanoseconds
+      long long mStart;
+};
+
+/// Timer for the built-in profiler, running until the end of the scope
+/// (used by the TAU_PROFILE macro).
+class ProfilerScope:public ProfilerTimer
+{
+   public:
+      ProfilerScope(const char *name):ProfilerTimer(name){this->Start();}
+};
+
+/// Enable or disable the built-in profiler (for all threads).
+void ProfilerEnable(const bool enable=true);
+/// Reset all recorded timings and counters. This can be called while profiled code
+/// is running in other threads (running timers will only record the time after the reset).
+void ProfilerReset();
+/// \internal Record a memory allocation for the running timer
+void ProfilerAddAllocation(const std::size_t bytes);
+/// Record a memory allocation for the running timer (used by CrystVector & co)
+inline void ProfilerCountAllocation(const std::size_t bytes)
+{if(gProfilerEnabled.load(std::memory_order_relaxed)) ProfilerAddAllocation(bytes);}
+/** Print the profiling report, as an indented tree with the number of calls,
+* total and self time, and the number of allocations for each timer.
+*
+* The trees of all threads are merged (timers are identified by their name and
+* their parents' names), including the threads which have finished. This can be
+* called while profiled code is running, but the timers which are still running
+* are not included.
+*/
+void ProfilerPrintReport(std::ostream &os);
+/** Print the profiling report in JSON format, as a nested list of
+* {"name","calls","time","self","alloc","alloc_bytes","children"} objects,
+* with times in seconds. See ProfilerPrintReport().
+*/
+void ProfilerPrintReportJSON(std::ostream &os);
+}//namespace
+
+#endif
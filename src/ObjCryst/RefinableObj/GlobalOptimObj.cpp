@@ -21,6 +21,10 @@
 *
 */
 #include <iomanip>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <exception>
 
 #include "ObjCryst/RefinableObj/GlobalOptimObj.h"
 #include "ObjCryst/ObjCryst/Crystal.h"
@@ -31,6 +35,7 @@
 #include "ObjCryst/RefinableObj/LSQNumObj.h"
 
 #include "ObjCryst/ObjCryst/Molecule.h"
+#include "ObjCryst/ObjCryst/BatchRefinement.h"
 
 #ifdef __WX__CRYST__
    #include "ObjCryst/wxCryst/wxRefinableObj.h"
@@ -41,6 +46,16 @@
 #include <fstream>
 #include <sstream>
 #include <stdio.h>
+#include <limits>
+#include <signal.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
 #include <boost/format.hpp>
 
 namespace ObjCryst
@@ -63,29 +78,35 @@ void CompareWorlds(const CrystVector_long &idx,const CrystVector_long &swap, con
 //       OptimizationObj
 //
 //#################################################################################
-ObjRegistry<OptimizationObj> gOptimizationObjRegistry("List of all Optimization objects");
+ObjRegistry<OptimizationObj> gOptimizationObjRegistry("List of all Optimization objects",true);
+
+/// Seed rand() once, even if optimization objects are created from several threads
+static void InitRandomSeedOnce(){srand(time(NULL));}
+static void InitRandomSeed()
+{
+   static once_flag initRandomSeedFlag;
+   call_once(initRandomSeedFlag,InitRandomSeedOnce);
+}
 
 OptimizationObj::OptimizationObj():
 mName(""),mSaveFileName("GlobalOptim.save"),
 mNbTrialPerRun(10000000),mNbTrial(0),mRun(0),mBestCost(-1),
 mBestParSavedSetIndex(-1),
-mContext(0),
+mContext(0),mCostGraphIsValid(false),
 mIsOptimizing(false),mStopAfterCycle(false),
 mRefinedObjList("OptimizationObj: "+mName+" RefinableObj registry"),
 mRecursiveRefinedObjList("OptimizationObj: "+mName+" recursive RefinableObj registry"),
-mLastOptimTime(0)
+mNbThread(1),
+mAutoSaveParSavedSetIndex(-1),mAutoSaveCurrentParSavedSetIndex(-1),
+mAutoSaveTemplateSent(false),mAutoSaveWriteObjIndex(-1),
+mAutoSaveBusy(false),mAutoSaveStop(false),mAutoSaveCloneFailed(false),mLastOptimTime(0)
 {
    VFN_DEBUG_ENTRY("OptimizationObj::OptimizationObj()",5)
    // This must be done in a real class to avoid calling a pure virtual method
    // if a graphical representation is automatically called upon registration.
    //  gOptimizationObjRegistry.Register(*this);
 
-   static bool need_initRandomSeed=true;
-   if(need_initRandomSeed==true)
-   {
-      srand(time(NULL));
-      need_initRandomSeed=false;
-   }
+   InitRandomSeed();
    // We only copy parameters, so do not delete them !
    mRefParList.SetDeleteRefParInDestructor(false);
    VFN_DEBUG_EXIT("OptimizationObj::OptimizationObj()",5)
@@ -95,23 +116,21 @@ OptimizationObj::OptimizationObj(const string name):
 mName(name),mSaveFileName("GlobalOptim.save"),
 mNbTrialPerRun(10000000),mNbTrial(0),mRun(0),mBestCost(-1),
 mBestParSavedSetIndex(-1),
-mContext(0),
+mContext(0),mCostGraphIsValid(false),
 mIsOptimizing(false),mStopAfterCycle(false),
 mRefinedObjList("OptimizationObj: "+mName+" RefinableObj registry"),
 mRecursiveRefinedObjList("OptimizationObj: "+mName+" recursive RefinableObj registry"),
-mLastOptimTime(0)
+mNbThread(1),
+mAutoSaveParSavedSetIndex(-1),mAutoSaveCurrentParSavedSetIndex(-1),
+mAutoSaveTemplateSent(false),mAutoSaveWriteObjIndex(-1),
+mAutoSaveBusy(false),mAutoSaveStop(false),mAutoSaveCloneFailed(false),mLastOptimTime(0)
 {
    VFN_DEBUG_ENTRY("OptimizationObj::OptimizationObj()",5)
    // This must be done in a real class to avoid calling a pure virtual method
    // if a graphical representation is automatically called upon registration.
    //  gOptimizationObjRegistry.Register(*this);
 
-   static bool need_initRandomSeed=true;
-   if(need_initRandomSeed==true)
-   {
-      srand(time(NULL));
-      need_initRandomSeed=false;
-   }
+   InitRandomSeed();
    // We only copy parameters, so do not delete them !
    mRefParList.SetDeleteRefParInDestructor(false);
    VFN_DEBUG_EXIT("OptimizationObj::OptimizationObj()",5)
@@ -121,23 +140,21 @@ OptimizationObj::OptimizationObj(const OptimizationObj &old):
 mName(old.mName),mSaveFileName(old.mSaveFileName),
 mNbTrialPerRun(old.mNbTrialPerRun),mNbTrial(old.mNbTrial),mRun(old.mRun),mBestCost(old.mBestCost),
 mBestParSavedSetIndex(-1),
-mContext(0),
+mContext(0),mCostGraphIsValid(false),
 mIsOptimizing(false),mStopAfterCycle(false),
 mRefinedObjList("OptimizationObj: "+mName+" RefinableObj registry"),
 mRecursiveRefinedObjList("OptimizationObj: "+mName+" recursive RefinableObj registry"),
-mLastOptimTime(0)
+mNbThread(old.mNbThread),
+mAutoSaveParSavedSetIndex(-1),mAutoSaveCurrentParSavedSetIndex(-1),
+mAutoSaveTemplateSent(false),mAutoSaveWriteObjIndex(-1),
+mAutoSaveBusy(false),mAutoSaveStop(false),mAutoSaveCloneFailed(false),mLastOptimTime(0)
 {
    VFN_DEBUG_ENTRY("OptimizationObj::OptimizationObj(&old)",5)
    // This must be done in a real class to avoid calling a pure virtual method
    // if a graphical representation is automatically called upon registration.
    //  gOptimizationObjRegistry.Register(*this);
 
-   static bool need_initRandomSeed=true;
-   if(need_initRandomSeed==true)
-   {
-      srand(time(NULL));
-      need_initRandomSeed=false;
-   }
+   InitRandomSeed();
    // We only copy parameters, so do not delete them !
    mRefParList.SetDeleteRefParInDestructor(false);
 
@@ -150,6 +167,7 @@ mLastOptimTime(0)
 OptimizationObj::~OptimizationObj()
 {
    VFN_DEBUG_ENTRY("OptimizationObj::~OptimizationObj()",5)
+   this->StopXMLAutoSave();
    gOptimizationObjRegistry.DeRegister(*this);
    VFN_DEBUG_EXIT("OptimizationObj::~OptimizationObj()",5)
 }
@@ -243,26 +261,98 @@ void OptimizationObj::SetLimitsAbsolute(const RefParType *type,
       mRecursiveRefinedObjList.GetObj(i).SetLimitsAbsolute(type,min,max);
 }
 
+/// Computes the log(likelihood) of independent data objects, split between the
+/// threads of OptimizationObj::mLogLikelihoodPool.
+class OptimizationObjLogLikelihoodTask:public WorkerPoolTask
+{
+   public:
+      OptimizationObjLogLikelihoodTask(const vector<const RefinableObj*> &vpObj,
+                                       const vector<long> &vIndex,vector<REAL> &vLLK):
+      mvpObj(vpObj),mvIndex(vIndex),mvLLK(vLLK)
+      {}
+      virtual void Run(const unsigned int i,const unsigned int nb)
+      {
+         for(unsigned long j=i;j<mvIndex.size();j+=nb)
+            mvLLK[mvIndex[j]]=mvpObj[mvIndex[j]]->GetLogLikelihood();
+      }
+   private:
+      const vector<const RefinableObj*> &mvpObj;
+      /// Index of the objects to compute
+      const vector<long> &mvIndex;
+      vector<REAL> &mvLLK;
+};
+
 REAL OptimizationObj::GetLogLikelihood() const
+{
+   return this->GetTierLogLikelihood(-1);
+}
+
+REAL OptimizationObj::GetTierLogLikelihood(const int tier) const
 {
    TAU_PROFILE("OptimizationObj::GetLogLikelihood()","void ()",TAU_DEFAULT);
+   if(  (!mCostGraphIsValid)
+      ||(mCostGraphClock<mRecursiveRefinedObjList.GetRegistryClock())
+      ||(mCostGraphClock<mRefinedObjList.GetRegistryClock())) this->CompileCostGraph();
+   const long nb=mvpCostObj.size();
+   if(mvpCostObjStats.size()<=mContext) mvpCostObjStats.resize(mContext+1);
+   vector<LogLikelihoodStats*> *pvStats=&(mvpCostObjStats[mContext]);
+   // Statistics are only created for objects with a non-zero contribution
+   if((long)(pvStats->size())!=nb) pvStats->assign(nb,(LogLikelihoodStats*)0);
+   bool parallel=false;
+   if(mLogLikelihoodPool.GetNbWorker()>0)
+   {// Independent data objects
+      mvParallelIndex.clear();
+      for(long i=0;i<nb;i++)
+         if(mvCostObjIsData[i] && ((tier<0)||(mvCostObjTier[i]==(unsigned int)tier))) mvParallelIndex.push_back(i);
+      if(mvParallelIndex.size()>1)
+      {
+         TAU_PROFILE("OptimizationObj::GetLogLikelihood()-parallel","void ()",TAU_DEFAULT);
+         parallel=true;
+         mvParallelLLK.resize(nb);
+         // Shared update of the crystal structures, which are only read by data objects.
+         for(vector<const Crystal*>::const_iterator pos=mvpCostCrystal.begin();pos!=mvpCostCrystal.end();++pos)
+         {
+            (*pos)->GetScatteringComponentList();
+            (*pos)->GetBMatrix();
+         }
+         // All other objects are computed in this thread
+         for(long i=0;i<nb;i++)
+            if((!mvCostObjIsData[i])&&((tier<0)||(mvCostObjTier[i]==(unsigned int)tier)))
+               mvParallelLLK[i]=mvpCostObj[i]->GetLogLikelihood();
+         OptimizationObjLogLikelihoodTask task(mvpCostObj,mvParallelIndex,mvParallelLLK);
+         mLogLikelihoodPool.Run(task,mvParallelIndex.size());
+      }
+   }
    REAL cost =0.;
-   for(int i=0;i<mRecursiveRefinedObjList.GetNb();i++)
+   for(long i=0;i<nb;i++)
    {
-      const REAL tmp=mRecursiveRefinedObjList.GetObj(i).GetLogLikelihood();
+      if((tier>=0)&&(mvCostObjTier[i]!=(unsigned int)tier)) continue;
+      const REAL tmp= parallel ? mvParallelLLK[i] : mvpCostObj[i]->GetLogLikelihood();
       if(tmp!=0.)
       {
-         LogLikelihoodStats* st=&((mvContextObjStats[mContext])
-                                    [&(mRecursiveRefinedObjList.GetObj(i))]);
+         LogLikelihoodStats* st=(*pvStats)[i];
+         if(st==0) st=(*pvStats)[i]=&((mvContextObjStats[mContext])[mvpCostObj[i]]);
          st->mTotalLogLikelihood += tmp;
          st->mTotalLogLikelihoodDeltaSq +=
             (tmp-st->mLastLogLikelihood)*(tmp-st->mLastLogLikelihood);
          st->mLastLogLikelihood=tmp;
       }
-      cost += mvObjWeight[&(mRecursiveRefinedObjList.GetObj(i))].mWeight * tmp;
+      cost += mvpCostObjWeight[i]->mWeight * tmp;
    }
    return cost;
 }
+unsigned int OptimizationObj::GetNbLogLikelihoodTier() const
+{
+   if(  (!mCostGraphIsValid)
+      ||(mCostGraphClock<mRecursiveRefinedObjList.GetRegistryClock())
+      ||(mCostGraphClock<mRefinedObjList.GetRegistryClock())) this->CompileCostGraph();
+   unsigned int nb=1;
+   for(vector<unsigned int>::const_iterator pos=mvCostObjTier.begin();pos!=mvCostObjTier.end();++pos)
+      if(*pos>=nb) nb=*pos+1;
+   return nb;
+}
+void OptimizationObj::SetNbThread(const unsigned int nbThread){mNbThread=nbThread;}
+unsigned int OptimizationObj::GetNbThread()const{return mNbThread;}
 void OptimizationObj::StopAfterCycle()
 {
    VFN_DEBUG_MESSAGE("OptimizationObj::StopAfterCycle()",5)
@@ -300,7 +390,11 @@ RefinableObj& OptimizationObj::GetFullRefinableObj(const bool rebuild)
 }
 
 const string& OptimizationObj::GetName()const { return mName;}
-void OptimizationObj::SetName(const string& name) {mName=name;}
+void OptimizationObj::SetName(const string& name)
+{
+   if(mName!=name) ++gObjNameChangeCounter;
+   mName=name;
+}
 
 const string OptimizationObj::GetClassName()const { return "OptimizationObj";}
 
@@ -340,14 +434,26 @@ REAL& OptimizationObj::GetBestCost(){return mBestCost;}
 void OptimizationObj::BeginOptimization(const bool allowApproximations, const bool enableRestraints)
 {
    mvContextObjStats.clear();
+   mCostGraphIsValid=false;
    for(int i=0;i<mRefinedObjList.GetNb();i++)
    {
       mRefinedObjList.GetObj(i).BeginOptimization(allowApproximations,enableRestraints);
    }
+   this->BuildRecursiveRefObjList();
+   this->CompileCostGraph();
+   // Worker threads for the independent data objects
+   unsigned int nbThread=mNbThread;
+   if(nbThread==0) nbThread=thread::hardware_concurrency();
+   const unsigned int nbData=count(mvCostObjIsData.begin(),mvCostObjIsData.end(),true);
+   if(nbThread>nbData) nbThread=nbData;
+   mLogLikelihoodPool.Start(nbThread>1 ? nbThread-1 : 0);
 }
 
 void OptimizationObj::EndOptimization()
 {
+   mLogLikelihoodPool.Stop();
+   this->ProcessXMLAutoSave(true);
+   this->StopXMLAutoSave();
    for(int i=0;i<mRefinedObjList.GetNb();i++) mRefinedObjList.GetObj(i).EndOptimization();
 }
 
@@ -458,6 +564,11 @@ void OptimizationObj::PrepareRefParList()
       mvSavedParamSet.clear();
       mBestParSavedSetIndex=mRefParList.CreateParamSet("Best Configuration");
       mvSavedParamSet.push_back(make_pair(mBestParSavedSetIndex,mBestCost));
+      mAutoSaveParSavedSetIndex=mRefParList.CreateParamSet("XML AutoSave");
+      mAutoSaveCurrentParSavedSetIndex=mRefParList.CreateParamSet("XML AutoSave (current)");
+      mAutoSaveFileName="";
+      mAutoSaveSentFileName="";
+      mAutoSaveTemplateSent=false;
 
       mMainTracker.ClearTrackers();
 
@@ -501,6 +612,8 @@ void OptimizationObj::InitOptions()
    static string xmlAutoSaveChoices[6];
 
    static bool needInitNames=true;
+   static mutex needInitNamesMutex;
+   lock_guard<mutex> needInitNamesLock(needInitNamesMutex);
    if(true==needInitNames)
    {
       xmlAutoSaveName="Save Best Config Regularly";
@@ -526,6 +639,34 @@ void OptimizationObj::UpdateDisplay() const
    mMainTracker.UpdateDisplay();
 }
 
+void OptimizationObj::CompileCostGraph()const
+{
+   VFN_DEBUG_ENTRY("OptimizationObj::CompileCostGraph()",5)
+   const long nb=mRecursiveRefinedObjList.GetNb();
+   mvpCostObj.resize(nb);
+   mvCostObjTier.resize(nb);
+   mvCostObjIsData.resize(nb);
+   mvpCostObjWeight.resize(nb);
+   mvpCostCrystal.clear();
+   for(long i=0;i<nb;i++)
+   {
+      const RefinableObj *pObj=&(mRecursiveRefinedObjList.GetObj(i));
+      const string className=pObj->GetClassName();
+      mvpCostObj[i]=pObj;
+      mvCostObjTier[i]=pObj->GetLogLikelihoodTier();
+      mvCostObjIsData[i]=(className=="PowderPattern")||(className=="DiffractionDataSingleCrystal");
+      mvpCostObjWeight[i]=&(mvObjWeight[pObj]);
+      if(className=="Crystal") mvpCostCrystal.push_back(dynamic_cast<const Crystal*>(pObj));
+   }
+   // Pointers to the statistics are added for each context when needed
+   mvpCostObjStats.clear();
+   mvpMoveObj.resize(mRefinedObjList.GetNb());
+   for(int i=0;i<mRefinedObjList.GetNb();i++) mvpMoveObj[i]=&(mRefinedObjList.GetObj(i));
+   mCostGraphClock.Click();
+   mCostGraphIsValid=true;
+   VFN_DEBUG_EXIT("OptimizationObj::CompileCostGraph()",5)
+}
+
 void OptimizationObj::BuildRecursiveRefObjList()
 {
    // First check if anything has changed (ie if a sub-object has been
@@ -549,6 +690,267 @@ void OptimizationObj::AddOption(RefObjOpt *opt)
    VFN_DEBUG_EXIT("OptimizationObj::AddOption()",5)
 }
 
+void OptimizationObj::XMLAutoSaveSnapshot(const long setId,const string &tag)
+{
+   VFN_DEBUG_MESSAGE("OptimizationObj::XMLAutoSaveSnapshot():"<<tag,5)
+   if(mAutoSaveParSavedSetIndex<0)
+   {
+      mAutoSaveParSavedSetIndex=mRefParList.CreateParamSet("XML AutoSave");
+      mAutoSaveCurrentParSavedSetIndex=mRefParList.CreateParamSet("XML AutoSave (current)");
+   }
+   if(setId<0) mRefParList.SaveParamSet(mAutoSaveParSavedSetIndex);
+   else mRefParList.GetParamSet(mAutoSaveParSavedSetIndex)=mRefParList.GetParamSet(setId);
+   time_t date=time(0);
+   char strDate[40];
+   struct tm tmDate;// localtime() is not thread-safe (the autosave thread uses gmtime())
+   #ifdef _WIN32
+   localtime_s(&tmDate,&date);
+   #else
+   localtime_r(&date,&tmDate);
+   #endif
+   strftime(strDate,sizeof(strDate),"%Y-%m-%d_%H-%M-%S",&tmDate);//%Y-%m-%dT%H:%M:%S%Z
+   mAutoSaveFileName=this->GetName()+(string)strDate+tag+(string)".xml";
+}
+
+void OptimizationObj::XMLAutoSaveIfNeeded(const REAL seconds,unsigned long &secondsWhenAutoSave,
+                                          const bool newBest,const REAL cost)
+{
+   if(  ((mXMLAutoSave.GetChoice()==1)&&((seconds-secondsWhenAutoSave)>86400))
+      ||((mXMLAutoSave.GetChoice()==2)&&((seconds-secondsWhenAutoSave)>3600))
+      ||((mXMLAutoSave.GetChoice()==3)&&((seconds-secondsWhenAutoSave)> 600))
+      ||((mXMLAutoSave.GetChoice()==4)&&newBest) )
+   {
+      secondsWhenAutoSave=(unsigned long)seconds;
+      char costAsChar[30];
+      if(newBest)
+      {// New best configuration for this run: this is the current one
+         sprintf(costAsChar,"-Cost-%f",cost);
+         this->XMLAutoSaveSnapshot(-1,costAsChar);
+      }
+      else
+      {
+         sprintf(costAsChar,"-Cost-%f",mBestCost);
+         this->XMLAutoSaveSnapshot(mBestParSavedSetIndex,costAsChar);
+      }
+   }
+}
+
+void OptimizationObj::ProcessXMLAutoSave(const bool wait)
+{
+   if((mAutoSaveFileName=="")&&(mAutoSaveSentFileName==""))
+   {
+      if(wait)
+      {
+         std::unique_lock<std::mutex> lock(mAutoSaveMutex);
+         while(mAutoSaveBusy) mAutoSaveCond.wait(lock);
+      }
+      return;
+   }
+   bool cloneFailed;
+   {
+      std::unique_lock<std::mutex> lock(mAutoSaveMutex);
+      if(mAutoSaveBusy)
+      {
+         if(!wait) return;// The writer is late, keep only the last snapshot
+         while(mAutoSaveBusy) mAutoSaveCond.wait(lock);
+      }
+      cloneFailed=mAutoSaveCloneFailed;
+   }
+   // The writer could not use its copy of the objects for the last snapshot:
+   // unless there is a newer one, serialise it here (its values are still saved)
+   if(cloneFailed&&(mAutoSaveFileName=="")) mAutoSaveFileName=mAutoSaveSentFileName;
+   mAutoSaveSentFileName="";
+   if(mAutoSaveFileName=="") return;
+   TAU_PROFILE("OptimizationObj::ProcessXMLAutoSave()","void (bool)",TAU_DEFAULT);
+   VFN_DEBUG_ENTRY("OptimizationObj::ProcessXMLAutoSave():"<<mAutoSaveFileName,5)
+   string content,xmltemplate;
+   if(cloneFailed)
+   {
+      stringstream out;
+      mRefParList.SaveParamSet(mAutoSaveCurrentParSavedSetIndex);
+      mRefParList.RestoreParamSet(mAutoSaveParSavedSetIndex);
+      XMLCrystFileSaveGlobal(out);
+      mRefParList.RestoreParamSet(mAutoSaveCurrentParSavedSetIndex);
+      content=out.str();
+   }
+   else if(!mAutoSaveTemplateSent)
+   {// The writer builds its own copy of all objects from this, once per optimization
+      stringstream out;
+      XMLCrystFileSaveGlobal(out);
+      xmltemplate=out.str();
+   }
+   {
+      std::unique_lock<std::mutex> lock(mAutoSaveMutex);
+      mAutoSaveWriteFileName=mAutoSaveFileName;
+      mAutoSaveWriteContent=content;
+      if(!cloneFailed)
+      {
+         if(!mAutoSaveTemplateSent)
+         {
+            mAutoSaveWriteTemplate=xmltemplate;
+            mAutoSaveWriteObjIndex=gOptimizationObjRegistry.Find(*this);
+            mAutoSaveWriteObjName.resize(mRecursiveRefinedObjList.GetNb());
+            mAutoSaveWriteObjNbPar.resize(mRecursiveRefinedObjList.GetNb());
+            for(int i=0;i<mRecursiveRefinedObjList.GetNb();i++)
+            {
+               const RefinableObj *pObj=&(mRecursiveRefinedObjList.GetObj(i));
+               mAutoSaveWriteObjName[i]=pObj->GetClassName()+":"+pObj->GetName();
+               mAutoSaveWriteObjNbPar[i]=pObj->GetNbPar();
+            }
+            mAutoSaveTemplateSent=true;
+         }
+         mAutoSaveWriteValues=mRefParList.GetParamSet(mAutoSaveParSavedSetIndex);
+         mAutoSaveSentFileName=mAutoSaveFileName;
+      }
+      mAutoSaveBusy=true;
+      mAutoSaveStop=false;
+      mAutoSaveCond.notify_all();
+   }
+   mAutoSaveFileName="";
+   if(!mAutoSaveThread.joinable())
+      mAutoSaveThread=ObjRegistryIsolation::StartThread(&OptimizationObj::XMLAutoSaveLoop,this);
+   if(wait)
+   {
+      {
+         std::unique_lock<std::mutex> lock(mAutoSaveMutex);
+         while(mAutoSaveBusy) mAutoSaveCond.wait(lock);
+      }
+      // Serialise the snapshot here if the writer could not use its copy of the objects
+      if(mAutoSaveSentFileName!="") this->ProcessXMLAutoSave(true);
+   }
+   VFN_DEBUG_EXIT("OptimizationObj::ProcessXMLAutoSave()",5)
+}
+
+void OptimizationObj::StopXMLAutoSave()
+{
+   mAutoSaveTemplateSent=false;
+   if(!mAutoSaveThread.joinable()) return;
+   {
+      std::unique_lock<std::mutex> lock(mAutoSaveMutex);
+      mAutoSaveStop=true;
+      mAutoSaveCond.notify_all();
+   }
+   mAutoSaveThread.join();
+   mAutoSaveCloneFailed=false;
+}
+
+void OptimizationObj::XMLAutoSaveLoop()
+{
+   // The copy of the objects is private to this thread
+   ObjRegistryIsolation isolation;
+   // Parameters of the copy, in the same order as in mRefParList
+   vector<RefinablePar*> vpPar;
+   string filename,content,xmltemplate;
+   vector<string> vObjName;
+   vector<long> vObjNbPar;
+   long objIndex=-1;
+   CrystVector_REAL values;
+   std::unique_lock<std::mutex> lock(mAutoSaveMutex);
+   while(true)
+   {
+      if(!mAutoSaveBusy)
+      {
+         if(mAutoSaveStop) break;
+         mAutoSaveCond.wait(lock);
+         continue;
+      }
+      filename.swap(mAutoSaveWriteFileName);
+      content.swap(mAutoSaveWriteContent);
+      xmltemplate.swap(mAutoSaveWriteTemplate);
+      if(xmltemplate!="")
+      {
+         vObjName.swap(mAutoSaveWriteObjName);
+         vObjNbPar.swap(mAutoSaveWriteObjNbPar);
+         objIndex=mAutoSaveWriteObjIndex;
+      }
+      if(content=="") values=mAutoSaveWriteValues;
+      lock.unlock();
+      bool failed=false;
+      if(content=="")
+      {// Only the values were handed over: update the copy of the objects, and serialise it
+         if(xmltemplate!="")
+         {
+            vpPar.clear();
+            string error;
+            try
+            {
+               BatchRefinement::DeleteJobObjects();
+               stringstream in(xmltemplate);
+               XMLCrystFileLoadAllObject(in);
+               if((objIndex<0)||(objIndex>=gOptimizationObjRegistry.GetNb()))
+                  error="the optimization object is not registered";
+               else
+               {
+                  OptimizationObj *pCopy=&(gOptimizationObjRegistry.GetObj(objIndex));
+                  pCopy->BuildRecursiveRefObjList();
+                  // The sub-objects may not be listed in the same order as in the original:
+                  // they are matched by class and name, in the order in which they are listed.
+                  map<string,vector<RefinableObj*> > vpCopyObj;
+                  for(int i=0;i<pCopy->mRecursiveRefinedObjList.GetNb();i++)
+                  {
+                     RefinableObj *pObj=&(pCopy->mRecursiveRefinedObjList.GetObj(i));
+                     vpCopyObj[pObj->GetClassName()+":"+pObj->GetName()].push_back(pObj);
+                  }
+                  map<string,unsigned long> vNbMatched;
+                  for(unsigned long i=0;(i<vObjName.size())&&(error=="");i++)
+                  {
+                     const vector<RefinableObj*> *pv=&(vpCopyObj[vObjName[i]]);
+                     const unsigned long n=vNbMatched[vObjName[i]]++;
+                     if((n>=pv->size())||((*pv)[n]->GetNbPar()!=vObjNbPar[i]))
+                        error="cannot match "+vObjName[i];
+                     else
+                        for(long j=0;j<vObjNbPar[i];j++) vpPar.push_back(&((*pv)[n]->GetPar(j)));
+                  }
+               }
+            }
+            catch(const ObjCrystException &except) {error=except.message;}
+            catch(const std::exception &except) {error=except.what();}
+            if(error!="")
+            {
+               cout<<"OptimizationObj::XMLAutoSaveLoop(): cannot use a copy of the objects ("
+                   <<error<<"), the optimization thread will save the files"<<endl;
+               vpPar.clear();
+            }
+            xmltemplate.clear();
+         }
+         if((vpPar.size()==0)||((long)vpPar.size()!=values.numElements())) failed=true;
+         else
+         {
+            for(unsigned long i=0;i<vpPar.size();i++)
+               if(vpPar[i]->IsUsed()) vpPar[i]->SetValue(values(i));
+            stringstream out;
+            XMLCrystFileSaveGlobal(out);
+            content=out.str();
+         }
+      }
+      if(!failed)
+      {
+         FILE *fout=fopen(filename.c_str(),"wb");
+         if(fout==NULL) cout<<"OptimizationObj::XMLAutoSaveLoop(): cannot open "<<filename<<endl;
+         else
+         {
+            fwrite(content.data(),1,content.size(),fout);
+            fflush(fout);
+            #ifdef _WIN32
+            _commit(_fileno(fout));
+            #else
+            fsync(fileno(fout));
+            #endif
+            fclose(fout);
+         }
+      }
+      content.clear();
+      lock.lock();
+      if(failed) mAutoSaveCloneFailed=true;
+      mAutoSaveBusy=false;
+      mAutoSaveCond.notify_all();
+   }
+   lock.unlock();
+   // The copy must be deleted before the isolation scope
+   vpPar.clear();
+   BatchRefinement::DeleteJobObjects();
+}
+
 //#################################################################################
 //
 //       MonteCarloObj
@@ -559,7 +961,7 @@ OptimizationObj(""),
 mCurrentCost(-1),
 mTemperatureMax(1e6),mTemperatureMin(.001),mTemperatureGamma(1.0),
 mMutationAmplitudeMax(8.),mMutationAmplitudeMin(.125),mMutationAmplitudeGamma(1.0),
-mNbTrialRetry(0),mMinCostRetry(0)
+mNbTrialRetry(0),mMinCostRetry(0),mNbProcess(1),mResolutionFactor(1)
 #ifdef __WX__CRYST__
 ,mpWXCrystObj(0)
 #endif
@@ -580,7 +982,7 @@ OptimizationObj(name),
 mCurrentCost(-1),
 mTemperatureMax(1e6),mTemperatureMin(.001),mTemperatureGamma(1.0),
 mMutationAmplitudeMax(8.),mMutationAmplitudeMin(.125),mMutationAmplitudeGamma(1.0),
-mNbTrialRetry(0),mMinCostRetry(0)
+mNbTrialRetry(0),mMinCostRetry(0),mNbProcess(1),mResolutionFactor(1)
 #ifdef __WX__CRYST__
 ,mpWXCrystObj(0)
 #endif
@@ -603,7 +1005,8 @@ mTemperatureMax(old.mTemperatureMax),mTemperatureMin(old.mTemperatureMin),
 mTemperatureGamma(old.mTemperatureGamma),
 mMutationAmplitudeMax(old.mMutationAmplitudeMax),mMutationAmplitudeMin(old.mMutationAmplitudeMin),
 mMutationAmplitudeGamma(old.mMutationAmplitudeGamma),
-mNbTrialRetry(old.mNbTrialRetry),mMinCostRetry(old.mMinCostRetry)
+mNbTrialRetry(old.mNbTrialRetry),mMinCostRetry(old.mMinCostRetry),
+mNbProcess(old.mNbProcess),mResolutionFactor(1)
 #ifdef __WX__CRYST__
 ,mpWXCrystObj(0)
 #endif
@@ -622,7 +1025,7 @@ OptimizationObj(""),
 mCurrentCost(-1),
 mTemperatureMax(.03),mTemperatureMin(.003),mTemperatureGamma(1.0),
 mMutationAmplitudeMax(16.),mMutationAmplitudeMin(.125),mMutationAmplitudeGamma(1.0),
-mNbTrialRetry(0),mMinCostRetry(0)
+mNbTrialRetry(0),mMinCostRetry(0),mNbProcess(1),mResolutionFactor(1)
 #ifdef __WX__CRYST__
 ,mpWXCrystObj(0)
 #endif
@@ -704,6 +1107,7 @@ void MonteCarloObj::Optimize(long &nbStep,const bool silent,const REAL finalcost
    mCurrentCost=this->GetLogLikelihood();
    mBestCost=mCurrentCost;
    mvObjWeight.clear();
+   mCostGraphIsValid=false;
    mMainTracker.ClearValues();
    Chronometer chrono;
    chrono.start();
@@ -787,6 +1191,7 @@ void MonteCarloObj::MultiRunOptimize(long &nbCycle,long &nbStep,const bool silen
    mBestCost=mCurrentCost;
    this->TagNewBestConfig();
    mvObjWeight.clear();
+   mCostGraphIsValid=false;
    long nbTrialCumul=0;
    const long nbCycle0=nbCycle;
 	Chronometer chrono;
@@ -839,14 +1244,10 @@ void MonteCarloObj::MultiRunOptimize(long &nbCycle,long &nbStep,const bool silen
                        <<", Overall Best Cost:"<<mBestCost<<endl;
       if(mXMLAutoSave.GetChoice()==5)
       {
-         string saveFileName=this->GetName();
-         time_t date=time(0);
-         char strDate[40];
-         strftime(strDate,sizeof(strDate),"%Y-%m-%d_%H-%M-%S",localtime(&date));//%Y-%m-%dT%H:%M:%S%Z
          char costAsChar[30];
          sprintf(costAsChar,"-Run#%ld-Cost-%f",abs(nbCycle),this->GetLogLikelihood());
-         saveFileName=saveFileName+(string)strDate+(string)costAsChar+(string)".xml";
-         XMLCrystFileSaveGlobal(saveFileName);
+         this->XMLAutoSaveSnapshot(-1,costAsChar);
+         this->ProcessXMLAutoSave();
       }
       if(mSaveTrackedData.GetChoice()==1)
       {
@@ -908,6 +1309,94 @@ void MonteCarloObj::MultiRunOptimize(long &nbCycle,long &nbStep,const bool silen
    VFN_DEBUG_EXIT("MonteCarloObj::MultiRunOptimize()",5)
 }
 
+bool MonteCarloObj::DelayedAcceptance(const REAL currentCost,CrystVector_REAL &currentTierCost,
+                                      REAL &cost,const REAL temperature)
+{
+   TAU_PROFILE("MonteCarloObj::DelayedAcceptance()","bool (...)",TAU_DEFAULT);
+   const unsigned int nbTier=currentTierCost.numElements()+1;
+   CrystVector_REAL tierCost(nbTier-1);
+   for(unsigned int t=0;t<nbTier;t++)
+   {
+      REAL d;
+      if((t+1)<nbTier)
+      {
+         tierCost(t)=this->GetTierLogLikelihood(t);
+         d=tierCost(t)-currentTierCost(t);
+      }
+      else
+      {// Last tier: its current cost is given by the total
+         cost=this->GetTierLogLikelihood(t);
+         d=cost-(currentCost-currentTierCost.sum());
+         cost+=tierCost.sum();
+      }
+      if(d>0)
+         if(log((rand()+1)/(REAL)RAND_MAX)>=(-d/temperature)) return false;
+   }
+   currentTierCost=tierCost;
+   return true;
+}
+
+void MonteCarloObj::SetNbProcess(const unsigned int nb){mNbProcess=nb;}
+unsigned int MonteCarloObj::GetNbProcess()const{return mNbProcess;}
+
+/// Number of resolution levels used with the adaptive resolution option
+static const unsigned int sAdaptiveResolutionNbLevel=3;
+/// Resolution factor for the lowest level, i.e. 1/8 of the reflections in 3D
+static const REAL sAdaptiveResolutionMin=0.5;
+
+REAL MonteCarloObj::GetAdaptiveResolutionFactor(const REAL progress)const
+{
+   if(mAdaptiveResolution.GetChoice()==0) return 1;
+   unsigned int level=0;
+   if(progress>0) level=(unsigned int)(progress*sAdaptiveResolutionNbLevel);
+   if(level>=sAdaptiveResolutionNbLevel) return 1;
+   return sAdaptiveResolutionMin+(1-sAdaptiveResolutionMin)*level/(REAL)(sAdaptiveResolutionNbLevel-1);
+}
+
+void MonteCarloObj::SetDataResolutionFactor(const REAL factor)
+{
+   if(factor==mResolutionFactor) return;
+   VFN_DEBUG_MESSAGE("MonteCarloObj::SetDataResolutionFactor():"<<factor,3)
+   mResolutionFactor=factor;
+   for(int i=0;i<mRefinedObjList.GetNb();i++) mRefinedObjList.GetObj(i).SetResolutionFactor(factor);
+}
+
+REAL MonteCarloObj::GetLogLikelihoodAtResolution(const long parSetIndex,const REAL resolution)
+{
+   mRefParList.RestoreParamSet(parSetIndex);
+   this->SetDataResolutionFactor(resolution);
+   return this->GetLogLikelihood();
+}
+
+void MonteCarloObj::SimulatedAnnealingResolution(const REAL factor,const long runBestIndex,
+                                                 const long currentIndex,REAL &runBestCost)
+{
+   runBestCost=this->GetLogLikelihoodAtResolution(runBestIndex,factor);
+   if((factor==1)&&(runBestCost<mBestCost))
+   {
+      mBestCost=runBestCost;
+      mRefParList.SaveParamSet(mBestParSavedSetIndex);
+   }
+   mRefParList.RestoreParamSet(currentIndex);
+   mCurrentCost=this->GetLogLikelihood();
+}
+
+void MonteCarloObj::InitParallelTemperingResolution(const CrystVector_long &worldCurrentSetIndex,
+                                                    CrystVector_REAL &worldResolution,
+                                                    CrystVector_REAL &currentCost)
+{
+   const long nbWorld=worldCurrentSetIndex.numElements();
+   worldResolution.resize(nbWorld);
+   for(long i=0;i<nbWorld;i++)
+   {
+      worldResolution(i)=this->GetAdaptiveResolutionFactor(i/(REAL)nbWorld);
+      if(worldResolution(i)!=1)
+         currentCost(i)=this->GetLogLikelihoodAtResolution(worldCurrentSetIndex(i),worldResolution(i));
+   }
+   this->SetDataResolutionFactor(1);
+   mRefParList.RestoreParamSet(worldCurrentSetIndex(nbWorld-1));
+}
+
 void MonteCarloObj::RunSimulatedAnnealing(long &nbStep,const bool silent,
                                           const REAL finalcost,const REAL maxTime)
 {
@@ -921,8 +1410,14 @@ void MonteCarloObj::RunSimulatedAnnealing(long &nbStep,const bool silent,
    if(!silent) cout << "Starting Simulated Annealing Optimization for"<<nbSteps<<" trials"<<endl;
    if(!silent) this->DisplayReport();
    REAL runBestCost;
+   // Adaptive resolution: begin with coarse data
+   this->SetDataResolutionFactor(this->GetAdaptiveResolutionFactor(0));
    mCurrentCost=this->GetLogLikelihood();
    runBestCost=mCurrentCost;
+   // Delayed acceptance: costs of the lower tiers for the current configuration
+   const unsigned int nbTier= mDelayedAcceptance.GetChoice()==1 ? this->GetNbLogLikelihoodTier() : 1;
+   CrystVector_REAL currentTierCost(nbTier-1);
+   for(unsigned int t=0;(t+1)<nbTier;t++) currentTierCost(t)=this->GetTierLogLikelihood(t);
    const long lastParSavedSetIndex=mRefParList.CreateParamSet("MonteCarloObj:Last parameters (SA)");
    const long runBestIndex=mRefParList.CreateParamSet("Best parameters for current run (SA)");
    //Report each ... cycles
@@ -1003,12 +1498,29 @@ void MonteCarloObj::RunSimulatedAnnealing(long &nbStep,const bool silent,
                break;
             default: mMutationAmplitude=mMutationAmplitudeMin;break;
          }
+         const REAL resolution=this->GetAdaptiveResolutionFactor(mNbTrial/(REAL)nbSteps);
+         if(resolution!=mResolutionFactor)
+         {
+            this->SimulatedAnnealingResolution(resolution,runBestIndex,lastParSavedSetIndex,runBestCost);
+            if(!silent) cout << "Trial :" << mNbTrial
+                             << " Resolution factor="<< resolution
+                             << " Run Best Cost="<<runBestCost
+                             << " Current Cost="<<mCurrentCost<< endl;
+         }
       }
 
       this->NewConfiguration();
       accept=0;
-      REAL cost=this->GetLogLikelihood();
-      if(cost<mCurrentCost)
+      REAL cost;
+      bool accepted;
+      if(nbTier>1) accepted=this->DelayedAcceptance(mCurrentCost,currentTierCost,cost,mTemperature);
+      else
+      {
+         cost=this->GetLogLikelihood();
+         accepted=  (cost<mCurrentCost)
+                  ||(log((rand()+1)/(REAL)RAND_MAX) < (-(cost-mCurrentCost)/mTemperature));
+      }
+      if(accepted)
       {
          accept=1;
          mCurrentCost=cost;
@@ -1020,7 +1532,7 @@ void MonteCarloObj::RunSimulatedAnnealing(long &nbStep,const bool silent,
             this->TagNewBestConfig();
             needUpdateDisplay=true;
             mRefParList.SaveParamSet(runBestIndex);
-            if(runBestCost<mBestCost)
+            if((mResolutionFactor==1)&&(runBestCost<mBestCost))
             {
                mBestCost=mCurrentCost;
                mRefParList.SaveParamSet(mBestParSavedSetIndex);
@@ -1038,17 +1550,6 @@ void MonteCarloObj::RunSimulatedAnnealing(long &nbStep,const bool silent,
          nbAcceptedMoves++;
          nbAcceptedMovesTemp++;
       }
-      else
-      {
-         if( log((rand()+1)/(REAL)RAND_MAX) < (-(cost-mCurrentCost)/mTemperature) )
-         {
-            accept=1;
-            mCurrentCost=cost;
-            mRefParList.SaveParamSet(lastParSavedSetIndex);
-            nbAcceptedMoves++;
-            nbAcceptedMovesTemp++;
-         }
-      }
       if(accept==0) mRefParList.RestoreParamSet(lastParSavedSetIndex);
 
       if( (mNbTrial % nbTryReport) == 0)
@@ -1068,7 +1569,7 @@ void MonteCarloObj::RunSimulatedAnnealing(long &nbStep,const bool silent,
       #ifdef __WX__CRYST__
       mMutexStopAfterCycle.Lock();
       #endif
-      if((runBestCost<finalcost) || mStopAfterCycle ||( (maxTime>0)&&(chrono.seconds()>maxTime)))
+      if(((mResolutionFactor==1)&&(runBestCost<finalcost)) || mStopAfterCycle ||( (maxTime>0)&&(chrono.seconds()>maxTime)))
       {
          #ifdef __WX__CRYST__
          mMutexStopAfterCycle.Unlock();
@@ -1080,23 +1581,8 @@ void MonteCarloObj::RunSimulatedAnnealing(long &nbStep,const bool silent,
       mMutexStopAfterCycle.Unlock();
       #endif
       nbTriesSinceBest++;
-      if(  ((mXMLAutoSave.GetChoice()==1)&&((chrono.seconds()-secondsWhenAutoSave)>86400))
-         ||((mXMLAutoSave.GetChoice()==2)&&((chrono.seconds()-secondsWhenAutoSave)>3600))
-         ||((mXMLAutoSave.GetChoice()==3)&&((chrono.seconds()-secondsWhenAutoSave)> 600))
-         ||((mXMLAutoSave.GetChoice()==4)&&(accept==2)) )
-      {
-         secondsWhenAutoSave=(unsigned long)chrono.seconds();
-         string saveFileName=this->GetName();
-         time_t date=time(0);
-         char strDate[40];
-         strftime(strDate,sizeof(strDate),"%Y-%m-%d_%H-%M-%S",localtime(&date));//%Y-%m-%dT%H:%M:%S%Z
-         char costAsChar[30];
-         if(accept!=2) mRefParList.RestoreParamSet(mBestParSavedSetIndex);
-         sprintf(costAsChar,"-Cost-%f",this->GetLogLikelihood());
-         saveFileName=saveFileName+(string)strDate+(string)costAsChar+(string)".xml";
-         XMLCrystFileSaveGlobal(saveFileName);
-         if(accept!=2) mRefParList.RestoreParamSet(lastParSavedSetIndex);
-      }
+      this->XMLAutoSaveIfNeeded(chrono.seconds(),secondsWhenAutoSave,accept==2,mCurrentCost);
+      this->ProcessXMLAutoSave();
       if((mNbTrial%300==0)&&needUpdateDisplay)
       {
          this->UpdateDisplay();
@@ -1105,6 +1591,9 @@ void MonteCarloObj::RunSimulatedAnnealing(long &nbStep,const bool silent,
       }
 
    }
+   // Back to the full resolution, if the run was stopped before
+   if(mResolutionFactor!=1)
+      this->SimulatedAnnealingResolution(1,runBestIndex,lastParSavedSetIndex,runBestCost);
    //cout<<"Beginning final LSQ refinement? ... ";
    if(mAutoLSQ.GetChoice()>0)
    {// LSQ
@@ -1287,14 +1776,10 @@ void MonteCarloObj::RunRandomLSQMethod(long &nbCycle)
         this->UpdateDisplay();
 
         //save it to the file
-        string saveFileName=this->GetName();
-        time_t date=time(0);
-        char strDate[40];
-        strftime(strDate,sizeof(strDate),"%Y-%m-%d_%H-%M-%S",localtime(&date));//%Y-%m-%dT%H:%M:%S%Z
         char costAsChar[30];
         sprintf(costAsChar,"#Run%ld-Cost-%f",nbCycle, mCurrentCost);
-        saveFileName=saveFileName+(string)strDate+(string)costAsChar+(string)".xml";
-        XMLCrystFileSaveGlobal(saveFileName);
+        this->XMLAutoSaveSnapshot(-1,costAsChar);
+        this->ProcessXMLAutoSave();
 
          #ifdef __WX__CRYST__
           mMutexStopAfterCycle.Lock();
@@ -1339,6 +1824,231 @@ void MonteCarloObj::RunRandomLSQMethod(long &nbCycle)
     }
 }
 
+void MonteCarloObj::InitParallelTemperingWorlds(const long nbWorld,CrystVector_long &worldCurrentSetIndex,
+                                                const unsigned int nbTier,
+                                                vector<CrystVector_REAL> &worldTierCost)
+{
+   // All Worlds start from the same (current) configuration.
+   worldCurrentSetIndex.resize(nbWorld);
+   for(int i=nbWorld-1;i>=0;i--)
+   {
+      if((i!=(nbWorld-1))&&(i%2==0))
+         for(int j=0;j<mRecursiveRefinedObjList.GetNb();j++)
+            mRecursiveRefinedObjList.GetObj(j).RandomizeConfiguration();
+      worldCurrentSetIndex(i)=mRefParList.CreateParamSet();
+      mRefParList.RestoreParamSet(worldCurrentSetIndex(nbWorld-1));
+   }
+   worldTierCost.assign(nbWorld,CrystVector_REAL(nbTier-1));
+   if(nbTier>1)
+   {
+      for(int i=0;i<nbWorld;i++)
+      {
+         mRefParList.RestoreParamSet(worldCurrentSetIndex(i));
+         for(unsigned int t=0;(t+1)<nbTier;t++) worldTierCost[i](t)=this->GetTierLogLikelihood(t);
+      }
+      mRefParList.RestoreParamSet(worldCurrentSetIndex(nbWorld-1));
+   }
+}
+
+void MonteCarloObj::ParallelTemperingNewBest(const REAL cost,const long runBestIndex,REAL &runBestCost,
+                                             const long world,const REAL temperature,
+                                             const REAL mutationAmplitude,const bool silent)
+{
+   runBestCost=cost;
+   this->TagNewBestConfig();
+   mRefParList.SaveParamSet(runBestIndex);
+   if(runBestCost<mBestCost)
+   {
+      mBestCost=cost;
+      mRefParList.SaveParamSet(mBestParSavedSetIndex);
+      if(!silent) cout << "->Trial :" << mNbTrial
+                       << " World="<< world
+                       << " Temp="<< temperature
+                       << " Mutation Ampl.: "<<mutationAmplitude
+                       << " NEW OVERALL Best Cost="<<mBestCost<< endl;
+   }
+   else if(!silent) cout << "->Trial :" << mNbTrial
+                         << " World="<< world
+                         << " Temp="<< temperature
+                         << " Mutation Ampl.: "<<mutationAmplitude
+                         << " NEW RUN Best Cost="<<runBestCost<< endl;
+   if(!silent) this->DisplayReport();
+}
+
+void MonteCarloObj::ParallelTemperingSwapWorlds(const CrystVector_long &worldCurrentSetIndex,
+                                                const CrystVector_REAL &worldResolution,
+                                                const CrystVector_REAL &temperature,
+                                                const unsigned int nbTier,
+                                                CrystVector_REAL &currentCost,
+                                                vector<CrystVector_REAL> &worldTierCost,
+                                                CrystVector_long &worldSwapIndex)
+{
+   CrystVector_REAL swapPar;
+   for(int i=1;i<currentCost.numElements();i++)
+   {
+      // Cost of World (i-1) at the resolution of World (i)
+      REAL cost0=currentCost(i-1);
+      if(worldResolution(i-1)!=worldResolution(i))
+         cost0=this->GetLogLikelihoodAtResolution(worldCurrentSetIndex(i-1),worldResolution(i));
+      if( log((rand()+1)/(REAL)RAND_MAX)
+             < (-(cost0-currentCost(i))/temperature(i)))
+      {
+         swapPar=mRefParList.GetParamSet(worldCurrentSetIndex(i));
+         mRefParList.GetParamSet(worldCurrentSetIndex(i))=
+            mRefParList.GetParamSet(worldCurrentSetIndex(i-1));
+         mRefParList.GetParamSet(worldCurrentSetIndex(i-1))=swapPar;
+         const REAL tmp=currentCost(i);
+         currentCost(i)=currentCost(i-1);
+         currentCost(i-1)=tmp;
+         if(worldResolution(i-1)!=worldResolution(i))
+         {// Costs must be evaluated at the resolution of each World
+            currentCost(i)=cost0;
+            currentCost(i-1)=this->GetLogLikelihoodAtResolution(worldCurrentSetIndex(i-1),
+                                                                worldResolution(i-1));
+         }
+         if(nbTier>1)
+         {
+            const CrystVector_REAL tmpTierCost=worldTierCost[i];
+            worldTierCost[i]=worldTierCost[i-1];
+            worldTierCost[i-1]=tmpTierCost;
+         }
+         const long tmpIndex=worldSwapIndex(i);
+         worldSwapIndex(i)=worldSwapIndex(i-1);
+         worldSwapIndex(i-1)=tmpIndex;
+      }
+   }
+}
+
+void MonteCarloObj::ParallelTemperingReport(const long nbTrialsReport,const CrystVector_long &worldSwapIndex,
+                                            const CrystVector_REAL &currentCost,const REAL runBestCost,
+                                            CrystVector_long &worldNbAcceptedMoves,
+                                            CrystVector_REAL &temperature,CrystVector_REAL &mutationAmplitude,
+                                            Chronometer &chrono,const bool silent)
+{
+   const long nbWorld=currentCost.numElements();
+   worldNbAcceptedMoves*=nbWorld;
+   if(!silent)
+   {
+      #if 0
+      {// Experimental, dynamical weighting
+         REAL max=0.;
+         map<const RefinableObj*,REAL> ll,llvar;
+         map<const RefinableObj*,LogLikelihoodStats>::iterator pos;
+         for(pos=mvContextObjStats[0].begin();pos!=mvContextObjStats[0].end();++pos)
+         {
+            ll   [pos->first]=0.;
+            llvar[pos->first]=0.;
+         }
+         for(int i=0;i<nbWorld;i++)
+         {
+            for(pos=mvContextObjStats[0].begin();pos!=mvContextObjStats[0].end();++pos)
+            {
+               ll   [pos->first] += pos->second.mTotalLogLikelihood;
+               llvar[pos->first] += pos->second.mTotalLogLikelihoodDeltaSq;
+            }
+         }
+         for(pos=mvContextObjStats[0].begin();pos!=mvContextObjStats[0].end();++pos)
+         {
+            cout << pos->first->GetName()
+                 << " " << llvar[pos->first]
+                 << " " << mvObjWeight[pos->first].mWeight
+                 << " " << max<<endl;
+            llvar[pos->first] *= mvObjWeight[pos->first].mWeight;
+            if(llvar[pos->first]>max) max=llvar[pos->first];
+         }
+         map<const RefinableObj*,REAL>::iterator pos2;
+         for(pos2=llvar.begin();pos2!=llvar.end();++pos2)
+         {
+            const REAL d=pos2->second;
+            if(d<(max/mvObjWeight.size()/10.))
+            {
+               if(d<1) continue;
+               mvObjWeight[pos2->first].mWeight *=2;
+            }
+         }
+         REAL ll1=0;
+         REAL llt=0;
+         for(pos2=ll.begin();pos2!=ll.end();++pos2)
+         {
+            llt += pos2->second;
+            ll1 += pos2->second * mvObjWeight[pos2->first].mWeight;
+         }
+         map<const RefinableObj*,DynamicObjWeight>::iterator posw;
+         for(posw=mvObjWeight.begin();posw!=mvObjWeight.end();++posw)
+         {
+            posw->second.mWeight *= llt/ll1;
+         }
+      }
+      #endif //Experimental dynamical weighting
+      // The log(likelihood) statistics are not available from worker processes
+      if(mNbProcess==1)
+         for(int i=0;i<nbWorld;i++)
+         {
+            cout<<"   World :"<<worldSwapIndex(i)<<":";
+            map<const RefinableObj*,LogLikelihoodStats>::iterator pos;
+            for(pos=mvContextObjStats[i].begin();pos!=mvContextObjStats[i].end();++pos)
+            {
+               cout << pos->first->GetName()
+                    << "(LLK="
+                    << pos->second.mLastLogLikelihood
+                    << ", w="<<mvObjWeight[pos->first].mWeight
+                    <<")  ";
+               pos->second.mTotalLogLikelihood=0;
+               pos->second.mTotalLogLikelihoodDeltaSq=0;
+            }
+            cout << endl;
+         }
+      for(int i=0;i<nbWorld;i++)
+      {
+         cout <<"   World :" << worldSwapIndex(i)
+              <<" Temp.: " << temperature(i)
+              <<" Mutation Ampl.: " << mutationAmplitude(i)
+              <<" Current Cost=" << currentCost(i)
+              <<" Accepting "
+              << (int)((REAL)worldNbAcceptedMoves(i)/nbTrialsReport*100)
+              <<"% moves " <<endl;
+      }
+      cout <<"Trial :" << mNbTrial << " Best Cost=" << runBestCost<< " ";
+      chrono.print();
+   }
+   //Change the mutation rate and temperature if necessary for each world
+   this->UpdateParallelTemperingSchedule(worldNbAcceptedMoves,nbTrialsReport,temperature,mutationAmplitude);
+   worldNbAcceptedMoves=0;
+
+   #ifdef __WX__CRYST__
+   if(0!=mpWXCrystObj) mpWXCrystObj->UpdateDisplayNbTrial();
+   #endif
+}
+
+void MonteCarloObj::ParallelTemperingFinalLSQ(const long runBestIndex,REAL &runBestCost,const bool silent)
+{
+   if(!silent) cout<<"Beginning final LSQ refinement"<<endl;
+   for(int i=0;i<mRefinedObjList.GetNb();i++) mRefinedObjList.GetObj(i).SetApproximationFlag(false);
+   mRefParList.RestoreParamSet(runBestIndex);
+   mCurrentCost=this->GetLogLikelihood();
+   try {mLSQ.Refine(-50,true,true,false,0.001);}
+   catch(const ObjCrystException &except){};
+   if(!silent) cout<<"LSQ cost: "<<mCurrentCost<<" -> "<<this->GetLogLikelihood()<<endl;
+
+   // Need to go back to optimization with approximations allowed (they are not during LSQ)
+   for(int i=0;i<mRefinedObjList.GetNb();i++) mRefinedObjList.GetObj(i).SetApproximationFlag(true);
+
+   const REAL cost=this->GetLogLikelihood();
+   if(cost<runBestCost)
+   {
+      runBestCost=cost;
+      mRefParList.SaveParamSet(runBestIndex);
+      if(runBestCost<mBestCost)
+      {
+         mBestCost=runBestCost;
+         mRefParList.SaveParamSet(mBestParSavedSetIndex);
+         if(!silent) cout << "LSQ : NEW OVERALL Best Cost="<<runBestCost<< endl;
+      }
+      else if(!silent) cout << " LSQ : NEW Run Best Cost="<<runBestCost<< endl;
+   }
+   if(!silent) cout<<"Finished LSQ refinement"<<endl;
+}
+
 void MonteCarloObj::RunParallelTempering(long &nbStep,const bool silent,
                                          const REAL finalcost,const REAL maxTime)
 {
@@ -1347,6 +2057,11 @@ void MonteCarloObj::RunParallelTempering(long &nbStep,const bool silent,
    TAU_PROFILE_TIMER(timer0b,"MonteCarloObj::RunParallelTempering() Begin 2","", TAU_FIELD);
    TAU_PROFILE_TIMER(timer1,"MonteCarloObj::RunParallelTempering() New Config + LLK","", TAU_FIELD);
    TAU_PROFILE_TIMER(timerN,"MonteCarloObj::RunParallelTempering() Finish","", TAU_FIELD);
+   if(mNbProcess!=1)
+   {
+      this->RunParallelTemperingMultiProcess(nbStep,silent,finalcost,maxTime);
+      return;
+   }
    TAU_PROFILE_START(timer0a);
    //Keep a copy of the total number of steps, and decrement nbStep
    const long nbSteps=nbStep;
@@ -1374,74 +2089,22 @@ void MonteCarloObj::RunParallelTempering(long &nbStep,const bool silent,
       REAL runBestCost=mCurrentCost;
       CrystVector_REAL currentCost(nbWorld);
       currentCost=mCurrentCost;
-   // Init the different temperatures
+   // Init the different temperatures and mutation rate parameters
       CrystVector_REAL simAnnealTemp(nbWorld);
-      for(int i=0;i<nbWorld;i++)
-      {
-         switch(mAnnealingScheduleTemp.GetChoice())
-         {
-            case ANNEALING_BOLTZMANN:
-               simAnnealTemp(i)=
-                  mTemperatureMin*log((REAL)nbWorld)/log((REAL)(i+2));break;
-            case ANNEALING_CAUCHY:
-               simAnnealTemp(i)=mTemperatureMin*nbWorld/(i+1);break;
-            //case ANNEALING_QUENCHING:
-            case ANNEALING_EXPONENTIAL:
-               simAnnealTemp(i)=mTemperatureMax
-                              *pow(mTemperatureMin/mTemperatureMax,
-                                    i/(REAL)(nbWorld-1));break;
-            case ANNEALING_GAMMA:
-               simAnnealTemp(i)=mTemperatureMax+(mTemperatureMin-mTemperatureMax)
-                              *pow(i/(REAL)(nbWorld-1),mTemperatureGamma);break;
-            case ANNEALING_SMART:
-               simAnnealTemp(i)=mCurrentCost/(100.+(REAL)i/(REAL)nbWorld*900.);break;
-            default:
-               simAnnealTemp(i)=mCurrentCost/(100.+(REAL)i/(REAL)nbWorld*900.);break;
-         }
-      }
-   //Init the different mutation rate parameters
       CrystVector_REAL mutationAmplitude(nbWorld);
-      for(int i=0;i<nbWorld;i++)
-      {
-         switch(mAnnealingScheduleMutation.GetChoice())
-         {
-            case ANNEALING_BOLTZMANN:
-               mutationAmplitude(i)=
-                  mMutationAmplitudeMin*log((REAL)(nbWorld-1))/log((REAL)(i+2));
-               break;
-            case ANNEALING_CAUCHY:
-               mutationAmplitude(i)=mMutationAmplitudeMin*(REAL)(nbWorld-1)/(i+1);break;
-            //case ANNEALING_QUENCHING:
-            case ANNEALING_EXPONENTIAL:
-               mutationAmplitude(i)=mMutationAmplitudeMax
-                              *pow(mMutationAmplitudeMin/mMutationAmplitudeMax,
-                                    i/(REAL)(nbWorld-1));break;
-            case ANNEALING_GAMMA:
-               mutationAmplitude(i)=mMutationAmplitudeMax+(mMutationAmplitudeMin-mMutationAmplitudeMax)
-                              *pow(i/(REAL)(nbWorld-1),mMutationAmplitudeGamma);break;
-            case ANNEALING_SMART:
-               mutationAmplitude(i)=sqrt(mMutationAmplitudeMin*mMutationAmplitudeMax);break;
-            default:
-               mutationAmplitude(i)=sqrt(mMutationAmplitudeMin*mMutationAmplitudeMax);break;
-         }
-      }
-   // Init the parameter sets for each World
-   // All Worlds start from the same (current) configuration.
-      CrystVector_long worldCurrentSetIndex(nbWorld);
-      for(int i=nbWorld-1;i>=0;i--)
-      {
-         if((i!=(nbWorld-1))&&(i%2==0))
-            for(int j=0;j<mRecursiveRefinedObjList.GetNb();j++)
-               mRecursiveRefinedObjList.GetObj(j).RandomizeConfiguration();
-         worldCurrentSetIndex(i)=mRefParList.CreateParamSet();
-         mRefParList.RestoreParamSet(worldCurrentSetIndex(nbWorld-1));
-      }
+      this->InitParallelTemperingSchedule(nbWorld,simAnnealTemp,mutationAmplitude);
+   // Init the parameter sets for each World, and the costs of the lower tiers (delayed acceptance)
+      CrystVector_long worldCurrentSetIndex;
+      const unsigned int nbTier= mDelayedAcceptance.GetChoice()==1 ? this->GetNbLogLikelihoodTier() : 1;
+      vector<CrystVector_REAL> worldTierCost;
+      this->InitParallelTemperingWorlds(nbWorld,worldCurrentSetIndex,nbTier,worldTierCost);
+   // Adaptive resolution: the hottest Worlds use a lower resolution
+      CrystVector_REAL worldResolution;
+      this->InitParallelTemperingResolution(worldCurrentSetIndex,worldResolution,currentCost);
    TAU_PROFILE_STOP(timer0a);
    TAU_PROFILE_START(timer0b);
       //mNbTrial=nbSteps;;
-      const long lastParSavedSetIndex=mRefParList.CreateParamSet("MonteCarloObj:Last parameters (PT)");
       const long runBestIndex=mRefParList.CreateParamSet("Best parameters for current run (PT)");
-      CrystVector_REAL swapPar;
    //Keep track of how many trials are accepted for each World
       CrystVector_long worldNbAcceptedMoves(nbWorld);
       worldNbAcceptedMoves=0;
@@ -1487,6 +2150,7 @@ void MonteCarloObj::RunParallelTempering(long &nbStep,const bool silent,
          //mRefParList.RestoreParamSet(worldCurrentSetIndex(i));
          mMutationAmplitude=mutationAmplitude(i);
          mTemperature=simAnnealTemp(i);
+         this->SetDataResolutionFactor(worldResolution(i));
          for(int j=0;j<nbTryPerWorld;j++)
          {
             //mRefParList.SaveParamSet(lastParSavedSetIndex);
@@ -1494,69 +2158,35 @@ void MonteCarloObj::RunParallelTempering(long &nbStep,const bool silent,
             mRefParList.RestoreParamSet(worldCurrentSetIndex(i));
             this->NewConfiguration();
             accept=0;
-            REAL cost=this->GetLogLikelihood();
+            REAL cost;
+            bool accepted;
+            if(nbTier>1) accepted=this->DelayedAcceptance(currentCost(i),worldTierCost[i],cost,mTemperature);
+            else
+            {
+               cost=this->GetLogLikelihood();
+               accepted=  (cost<currentCost(i))
+                        ||(log((rand()+1)/(REAL)RAND_MAX)<(-(cost-currentCost(i))/mTemperature));
+            }
             TAU_PROFILE_STOP(timer1);
             //trialsDensity((long)(cost*100.),i+1)+=1;
-            if(cost<currentCost(i))
+            if(accepted)
             {
                accept=1;
                currentCost(i)=cost;
                mRefParList.SaveParamSet(worldCurrentSetIndex(i));
-               if(cost<runBestCost)
+               // Costs at a lower resolution cannot be compared to the best one
+               if((worldResolution(i)==1)&&(cost<runBestCost))
                {
                   accept=2;
-                  runBestCost=currentCost(i);
-                  this->TagNewBestConfig();
+                  this->ParallelTemperingNewBest(cost,runBestIndex,runBestCost,worldSwapIndex(i),
+                                                 mTemperature,mMutationAmplitude,silent);
                   needUpdateDisplay=true;
-
-                  mRefParList.SaveParamSet(runBestIndex);
-                  if(runBestCost<mBestCost)
-                  {
-                     mBestCost=currentCost(i);
-                     mRefParList.SaveParamSet(mBestParSavedSetIndex);
-                     if(!silent) cout << "->Trial :" << mNbTrial
-                                   << " World="<< worldSwapIndex(i)
-                                   << " Temp="<< mTemperature
-                                   << " Mutation Ampl.: "<<mMutationAmplitude
-                                   << " NEW OVERALL Best Cost="<<mBestCost<< endl;
-                  }
-                  else if(!silent) cout << "->Trial :" << mNbTrial
-                                   << " World="<< worldSwapIndex(i)
-                                   << " Temp="<< mTemperature
-                                   << " Mutation Ampl.: "<<mMutationAmplitude
-                                   << " NEW RUN Best Cost="<<runBestCost<< endl;
-                  if(!silent) this->DisplayReport();
                }
                worldNbAcceptedMoves(i)++;
             }
-            else
-            {
-               if(log((rand()+1)/(REAL)RAND_MAX)<(-(cost-currentCost(i))/mTemperature) )
-               {
-                  accept=1;
-                  currentCost(i)=cost;
-                  mRefParList.SaveParamSet(worldCurrentSetIndex(i));
-                  worldNbAcceptedMoves(i)++;
-               }
-            }
             //if(accept==1 && i==(nbWorld-1)){this->UpdateDisplay();}
-            if(  ((mXMLAutoSave.GetChoice()==1)&&((chrono.seconds()-secondsWhenAutoSave)>86400))
-               ||((mXMLAutoSave.GetChoice()==2)&&((chrono.seconds()-secondsWhenAutoSave)>3600))
-               ||((mXMLAutoSave.GetChoice()==3)&&((chrono.seconds()-secondsWhenAutoSave)> 600))
-               ||((mXMLAutoSave.GetChoice()==4)&&(accept==2)) )
-            {
-               secondsWhenAutoSave=(unsigned long)chrono.seconds();
-               string saveFileName=this->GetName();
-               time_t date=time(0);
-               char strDate[40];
-               strftime(strDate,sizeof(strDate),"%Y-%m-%d_%H-%M-%S",localtime(&date));//%Y-%m-%dT%H:%M:%S%Z
-               char costAsChar[30];
-               if(accept!=2) mRefParList.RestoreParamSet(mBestParSavedSetIndex);
-               sprintf(costAsChar,"-Cost-%f",this->GetLogLikelihood());
-               saveFileName=saveFileName+(string)strDate+(string)costAsChar+(string)".xml";
-               XMLCrystFileSaveGlobal(saveFileName);
-               //if(accept!=2) mRefParList.RestoreParamSet(lastParSavedSetIndex);
-            }
+            this->XMLAutoSaveIfNeeded(chrono.seconds(),secondsWhenAutoSave,accept==2,currentCost(i));
+            this->ProcessXMLAutoSave();
             //if(accept==0) mRefParList.RestoreParamSet(lastParSavedSetIndex);
             mNbTrial++;nbStep--;
             if((mNbTrial%nbTrialsReport)==0) makeReport=true;
@@ -1626,6 +2256,8 @@ void MonteCarloObj::RunParallelTempering(long &nbStep,const bool silent,
                mRefParList.RestoreParamSet(worldCurrentSetIndex(i));
                const REAL cost=this->GetLogLikelihood();
                if(!silent) cout<<"LSQ2:"<<currentCost(i)<<"->"<<cost<<endl;
+               // The configuration may have been changed by the LSQ
+               for(unsigned int t=0;(t+1)<nbTier;t++) worldTierCost[i](t)=this->GetTierLogLikelihood(t);
                if(cost<currentCost(i))
                {
                   const REAL oldcost=currentCost(i);
@@ -1671,54 +2303,9 @@ void MonteCarloObj::RunParallelTempering(long &nbStep,const bool silent,
          }
 
       //Try swapping worlds
-      for(int i=1;i<nbWorld;i++)
-      {
-         #if 0
-         mRefParList.RestoreParamSet(worldCurrentSetIndex(i));
-         mMutationAmplitude=mutationAmplitude(i);
-         cout<<i<<":"<<currentCost(i)<<":"<<this->GetLogLikelihood()<<endl;
-         #endif
-         #if 1
-         if( log((rand()+1)/(REAL)RAND_MAX)
-                < (-(currentCost(i-1)-currentCost(i))/simAnnealTemp(i)))
-         #else
-         // Compare World (i-1) and World (i) with the same amplitude,
-         // hence the same max likelihood error
-         mRefParList.RestoreParamSet(worldCurrentSetIndex(i-1));
-         mMutationAmplitude=mutationAmplitude(i);
-         if( log((rand()+1)/(REAL)RAND_MAX)
-                < (-(this->GetLogLikelihood()-currentCost(i))/simAnnealTemp(i)))
-         #endif
-         {
-         /*
-            if(i>2)
-            {
-               cout <<"->Swapping Worlds :" << i <<"(cost="<<currentCost(i)<<")"
-                    <<" with "<< (i-1) <<"(cost="<< currentCost(i-1)<<")"<<endl;
-            }
-            */
-            swapPar=mRefParList.GetParamSet(worldCurrentSetIndex(i));
-            mRefParList.GetParamSet(worldCurrentSetIndex(i))=
-               mRefParList.GetParamSet(worldCurrentSetIndex(i-1));
-            mRefParList.GetParamSet(worldCurrentSetIndex(i-1))=swapPar;
-            const REAL tmp=currentCost(i);
-            currentCost(i)=currentCost(i-1);
-            currentCost(i-1)=tmp;
-            const long tmpIndex=worldSwapIndex(i);
-            worldSwapIndex(i)=worldSwapIndex(i-1);
-            worldSwapIndex(i-1)=tmpIndex;
-            #if 0
-            // Compute correct costs in the case we use maximum likelihood
-            mRefParList.RestoreParamSet(worldCurrentSetIndex(i));
-            mMutationAmplitude=mutationAmplitude(i);
-            currentCost(i)=this->GetLogLikelihood();
-
-            mRefParList.RestoreParamSet(worldCurrentSetIndex(i-1));
-            mMutationAmplitude=mutationAmplitude(i-1);
-            currentCost(i-1)=this->GetLogLikelihood();
-            #endif
-         }
-      }
+      this->ParallelTemperingSwapWorlds(worldCurrentSetIndex,worldResolution,simAnnealTemp,nbTier,
+                                        currentCost,worldTierCost,worldSwapIndex);
+      this->SetDataResolutionFactor(1);
       #if 0
       //Try mating worlds- NEW !
       TAU_PROFILE_TIMER(timer1,\
@@ -1844,140 +2431,498 @@ void MonteCarloObj::RunParallelTempering(long &nbStep,const bool silent,
       if(true==makeReport)
       {
          makeReport=false;
-         worldNbAcceptedMoves*=nbWorld;
-         if(!silent)
+         this->ParallelTemperingReport(nbTrialsReport,worldSwapIndex,currentCost,runBestCost,
+                                       worldNbAcceptedMoves,simAnnealTemp,mutationAmplitude,chrono,silent);
+      }
+      if( (needUpdateDisplay&&(lastUpdateDisplayTime<(chrono.seconds()-1)))||(lastUpdateDisplayTime<(chrono.seconds()-10)))
+      {
+         mRefParList.RestoreParamSet(runBestIndex);
+         this->UpdateDisplay();
+         needUpdateDisplay=false;
+         lastUpdateDisplayTime=chrono.seconds();
+      }
+      #ifdef __WX__CRYST__
+      mMutexStopAfterCycle.Lock();
+      #endif
+      if((runBestCost<finalcost) || mStopAfterCycle ||( (maxTime>0)&&(chrono.seconds()>maxTime)))
+      {
+         #ifdef __WX__CRYST__
+         mMutexStopAfterCycle.Unlock();
+         #endif
+         if(!silent) cout << endl <<endl << "Refinement Stopped:"<<mBestCost<<endl;
+         break;
+      }
+      #ifdef __WX__CRYST__
+      mMutexStopAfterCycle.Unlock();
+      #endif
+   }//Trials
+
+   TAU_PROFILE_START(timerN);
+   if(mAutoLSQ.GetChoice()>0) this->ParallelTemperingFinalLSQ(runBestIndex,runBestCost,silent);
+
+   mLastOptimTime=chrono.seconds();
+   //Restore Best values
+      //mRefParList.Print();
+      if(!silent) this->DisplayReport();
+      mRefParList.RestoreParamSet(runBestIndex);
+      //for(int i=0;i<mRefinedObjList.GetNb();i++) mRefinedObjList.GetObj(i).Print();
+      mCurrentCost=this->GetLogLikelihood();
+      if(!silent) cout<<"Run Best Cost:"<<mCurrentCost<<endl;
+      if(!silent) chrono.print();
+   //Save density of states
+      //ofstream out("densityOfStates.txt");
+      //out << trialsDensity<<endl;
+      //out.close();
+   // Clear temporary param set
+      for(int i=0;i<nbWorld;i++)
+      {
+         mRefParList.ClearParamSet(worldCurrentSetIndex(i));
+         //mvSavedParamSet.push_back(make_pair(worldCurrentSetIndex(i),currentCost(i)));
+      }
+      mRefParList.ClearParamSet(runBestIndex);
+   TAU_PROFILE_STOP(timerN);
+}
+
+#ifndef _WIN32
+namespace
+{
+/// Read one command byte from a pipe, return false if the other end is closed
+bool ParallelTemperingPipeRead(const int fd,char &c)
+{
+   for(;;)
+   {
+      const ssize_t n=read(fd,&c,1);
+      if(n==1) return true;
+      if((n<0)&&(errno==EINTR)) continue;
+      return false;
+   }
+}
+/// Write one command byte to a pipe, return false if the other end is closed
+bool ParallelTemperingPipeWrite(const int fd,const char c)
+{
+   for(;;)
+   {
+      const ssize_t n=write(fd,&c,1);
+      if(n==1) return true;
+      if((n<0)&&(errno==EINTR)) continue;
+      return false;
+   }
+}
+}
+#endif
+
+namespace
+{
+/// Data exchanged with the worker processes for each World
+struct ParallelTemperingWorldExchange
+{
+   /// Temperature and mutation amplitude for this World (set by the parent)
+   REAL mTemperature;
+   REAL mMutationAmplitude;
+   /// Data resolution factor for this World (set by the parent)
+   REAL mResolution;
+   /// Current cost
+   REAL mCost;
+   /// Best cost reached by this World
+   REAL mBestCost;
+   /// Number of moves accepted during the last exchange
+   long mNbAcceptedMoves;
+};
+}
+
+/** Shared memory segment and worker processes used by
+* MonteCarloObj::RunParallelTemperingMultiProcess().
+*
+* SIGPIPE is ignored while this object exists, so that a dead worker does not
+* kill the parent process when a command is written to its pipe. If the
+* optimization is interrupted by an exception, the destructor kills the workers,
+* and releases all resources.
+*/
+struct MonteCarloObj::ParallelTemperingProcesses
+{
+   ParallelTemperingProcesses();
+   ~ParallelTemperingProcesses();
+   /** Stop all workers, close the pipes, release the shared memory segment
+   * and restore the SIGPIPE handler.
+   *
+   * \param kill: if true, kill the workers. Otherwise ask them to exit, and wait.
+   */
+   void Stop(const bool kill);
+   long mNbWorld;
+   /// Number of parameters in each parameter set
+   long mNbPar;
+   /// Number of cost tiers (delayed acceptance)
+   unsigned int mNbTier;
+   /// Number of tier costs stored for each World (at least 1)
+   unsigned int mNbTierCost;
+   int mNbTryPerWorld;
+   unsigned int mNbProcess;
+   /// The shared memory segment
+   void *mpShm;
+   size_t mShmSize;
+   /// Per-World data, current parameters, best parameters and tier costs, in the shared memory segment
+   ParallelTemperingWorldExchange *mpWorld;
+   REAL *mpPar;
+   REAL *mpBestPar;
+   REAL *mpTierCost;
+   /// For each worker: process id, and the parent's ends of the command and acknowledgement pipes
+   vector<int> mvPid;
+   vector<int> mvFdCmd;
+   vector<int> mvFdAck;
+   /// Number of times each worker was restarted
+   vector<unsigned int> mvNbRestart;
+   #ifndef _WIN32
+   /// SIGPIPE handler before this object was created
+   void (*mOldSigPipe)(int);
+   #endif
+};
+
+MonteCarloObj::ParallelTemperingProcesses::ParallelTemperingProcesses():
+mpShm(0),mShmSize(0)
+{
+   #ifndef _WIN32
+   mOldSigPipe=signal(SIGPIPE,SIG_IGN);
+   #endif
+}
+
+MonteCarloObj::ParallelTemperingProcesses::~ParallelTemperingProcesses()
+{
+   this->Stop(true);
+   #ifndef _WIN32
+   signal(SIGPIPE,mOldSigPipe);
+   #endif
+}
+
+void MonteCarloObj::ParallelTemperingProcesses::Stop(const bool kill)
+{
+   #ifndef _WIN32
+   for(unsigned int p=0;p<mvPid.size();p++)
+   {
+      if(mvFdCmd[p]>=0)
+      {
+         if(!kill) ParallelTemperingPipeWrite(mvFdCmd[p],0);
+         close(mvFdCmd[p]);
+      }
+      if(mvFdAck[p]>=0) close(mvFdAck[p]);
+      if(mvPid[p]>0)
+      {
+         if(kill) ::kill(mvPid[p],SIGKILL);
+         waitpid(mvPid[p],NULL,0);
+      }
+      mvPid[p]=-1;
+      mvFdCmd[p]=-1;
+      mvFdAck[p]=-1;
+   }
+   if(mpShm!=0) munmap(mpShm,mShmSize);
+   mpShm=0;
+   #endif
+}
+
+void MonteCarloObj::StartParallelTemperingWorker(ParallelTemperingProcesses &pt,const unsigned int process)
+{
+   #ifndef _WIN32
+   int fdCmd[2],fdAck[2];
+   if(pipe(fdCmd)!=0) throw ObjCrystException("MonteCarloObj::StartParallelTemperingWorker(): cannot create pipe");
+   if(pipe(fdAck)!=0)
+   {
+      close(fdCmd[0]);close(fdCmd[1]);
+      throw ObjCrystException("MonteCarloObj::StartParallelTemperingWorker(): cannot create pipe");
+   }
+   // Each worker needs its own random sequence
+   const unsigned int seed=rand()+process;
+   cout.flush();
+   cerr.flush();
+   // No background thread must be running while the process is created
+   this->ProcessXMLAutoSave(true);
+   this->StopXMLAutoSave();
+   const bool trackerExport=mMainTracker.IsExporting();
+   if(trackerExport) mMainTracker.PauseExport();
+   const unsigned int nbWorkerThread=mLogLikelihoodPool.GetNbWorker();
+   mLogLikelihoodPool.Stop();
+   const pid_t pid=fork();
+   if((pid!=0)&&trackerExport) mMainTracker.ResumeExport();
+   mLogLikelihoodPool.Start(nbWorkerThread);
+   if(pid<0)
+   {
+      close(fdCmd[0]);close(fdCmd[1]);close(fdAck[0]);close(fdAck[1]);
+      throw ObjCrystException("MonteCarloObj::StartParallelTemperingWorker(): cannot create process");
+   }
+   if(pid==0)
+   {// Worker: close the parent's ends of all pipes, so that the parent sees when any worker dies
+      for(unsigned int i=0;i<pt.mNbProcess;i++)
+      {
+         if(pt.mvFdCmd[i]>=0) close(pt.mvFdCmd[i]);
+         if(pt.mvFdAck[i]>=0) close(pt.mvFdAck[i]);
+      }
+      close(fdCmd[1]);
+      close(fdAck[0]);
+      pt.mvFdCmd[process]=fdCmd[0];
+      pt.mvFdAck[process]=fdAck[1];
+      srand(seed);
+      this->RunParallelTemperingWorker(pt,process);
+   }
+   close(fdCmd[0]);
+   close(fdAck[1]);
+   pt.mvPid[process]=pid;
+   pt.mvFdCmd[process]=fdCmd[1];
+   pt.mvFdAck[process]=fdAck[0];
+   #endif
+}
+
+void MonteCarloObj::RunParallelTemperingWorker(ParallelTemperingProcesses &pt,const unsigned int process)
+{
+   #ifndef _WIN32
+   int status=0;
+   try
+   {
+      const long set=mRefParList.CreateParamSet("Parallel Tempering worker");
+      CrystVector_REAL tierCost(pt.mNbTier-1);
+      char c;
+      while(ParallelTemperingPipeRead(pt.mvFdCmd[process],c)&&(c==1))
+      {
+         for(long i=process;i<pt.mNbWorld;i+=pt.mNbProcess)
          {
-            #if 0
-            {// Experimental, dynamical weighting
-               REAL max=0.;
-               map<const RefinableObj*,REAL> ll,llvar;
-               map<const RefinableObj*,LogLikelihoodStats>::iterator pos;
-               for(pos=mvContextObjStats[0].begin();pos!=mvContextObjStats[0].end();++pos)
-               {
-                  ll   [pos->first]=0.;
-                  llvar[pos->first]=0.;
-               }
-               for(int i=0;i<nbWorld;i++)
-               {
-                  for(pos=mvContextObjStats[0].begin();pos!=mvContextObjStats[0].end();++pos)
-                  {
-                     ll   [pos->first] += pos->second.mTotalLogLikelihood;
-                     llvar[pos->first] += pos->second.mTotalLogLikelihoodDeltaSq;
-                  }
-               }
-               for(pos=mvContextObjStats[0].begin();pos!=mvContextObjStats[0].end();++pos)
+            ParallelTemperingWorldExchange *pWorld=pt.mpWorld+i;
+            REAL *pPar=pt.mpPar+i*pt.mNbPar;
+            REAL *pBestPar=pt.mpBestPar+i*pt.mNbPar;
+            REAL *pTierCost=pt.mpTierCost+i*pt.mNbTierCost;
+            CrystVector_REAL *pSet=&(mRefParList.GetParamSet(set));
+            for(long k=0;k<pt.mNbPar;k++) (*pSet)(k)=pPar[k];
+            for(unsigned int t=0;(t+1)<pt.mNbTier;t++) tierCost(t)=pTierCost[t];
+            mContext=i;
+            mMutationAmplitude=pWorld->mMutationAmplitude;
+            mTemperature=pWorld->mTemperature;
+            this->SetDataResolutionFactor(pWorld->mResolution);
+            REAL currentCost=pWorld->mCost;
+            long nbAccepted=0;
+            for(int j=0;j<pt.mNbTryPerWorld;j++)
+            {
+               mRefParList.RestoreParamSet(set);
+               this->NewConfiguration();
+               REAL cost;
+               bool accepted;
+               if(pt.mNbTier>1) accepted=this->DelayedAcceptance(currentCost,tierCost,cost,mTemperature);
+               else
                {
-                  cout << pos->first->GetName()
-                       << " " << llvar[pos->first]
-                       << " " << mvObjWeight[pos->first].mWeight
-                       << " " << max<<endl;
-                  llvar[pos->first] *= mvObjWeight[pos->first].mWeight;
-                  if(llvar[pos->first]>max) max=llvar[pos->first];
+                  cost=this->GetLogLikelihood();
+                  accepted=  (cost<currentCost)
+                           ||(log((rand()+1)/(REAL)RAND_MAX)<(-(cost-currentCost)/mTemperature));
                }
-               map<const RefinableObj*,REAL>::iterator pos2;
-               for(pos2=llvar.begin();pos2!=llvar.end();++pos2)
+               if(accepted)
                {
-                  const REAL d=pos2->second;
-                  if(d<(max/mvObjWeight.size()/10.))
+                  currentCost=cost;
+                  mRefParList.SaveParamSet(set);
+                  nbAccepted++;
+                  if((pWorld->mResolution==1)&&(cost<pWorld->mBestCost))
                   {
-                     if(d<1) continue;
-                     mvObjWeight[pos2->first].mWeight *=2;
+                     pWorld->mBestCost=cost;
+                     for(long k=0;k<pt.mNbPar;k++) pBestPar[k]=(*pSet)(k);
                   }
                }
-               REAL ll1=0;
-               REAL llt=0;
-               for(pos2=ll.begin();pos2!=ll.end();++pos2)
-               {
-                  llt += pos2->second;
-                  ll1 += pos2->second * mvObjWeight[pos2->first].mWeight;
-               }
-               map<const RefinableObj*,DynamicObjWeight>::iterator posw;
-               for(posw=mvObjWeight.begin();posw!=mvObjWeight.end();++posw)
-               {
-                  posw->second.mWeight *= llt/ll1;
-               }
-            }
-            #endif //Experimental dynamical weighting
-            #if 1 //def __DEBUG__
-            for(int i=0;i<nbWorld;i++)
-            {
-               cout<<"   World :"<<worldSwapIndex(i)<<":";
-               map<const RefinableObj*,LogLikelihoodStats>::iterator pos;
-               for(pos=mvContextObjStats[i].begin();pos!=mvContextObjStats[i].end();++pos)
-               {
-                  cout << pos->first->GetName()
-                       << "(LLK="
-                       << pos->second.mLastLogLikelihood
-                       //<< "(<LLK>="
-                       //<< pos->second.mTotalLogLikelihood/nbTrialsReport
-                       //<< ", <delta(LLK)^2>="
-                       //<< pos->second.mTotalLogLikelihoodDeltaSq/nbTrialsReport
-                       << ", w="<<mvObjWeight[pos->first].mWeight
-                       <<")  ";
-                  pos->second.mTotalLogLikelihood=0;
-                  pos->second.mTotalLogLikelihoodDeltaSq=0;
-               }
-               cout << endl;
-            }
-            #endif
-            for(int i=0;i<nbWorld;i++)
-            {
-               //mRefParList.RestoreParamSet(worldCurrentSetIndex(i));
-               cout <<"   World :" << worldSwapIndex(i)
-                    <<" Temp.: " << simAnnealTemp(i)
-                    <<" Mutation Ampl.: " << mutationAmplitude(i)
-                    <<" Current Cost=" << currentCost(i)
-                    <<" Accepting "
-                    << (int)((REAL)worldNbAcceptedMoves(i)/nbTrialsReport*100)
-                    <<"% moves " <<endl;
-               //     <<"% moves " << mRefParList.GetPar("Pboccup").GetValue()<<endl;
             }
+            for(long k=0;k<pt.mNbPar;k++) pPar[k]=(*pSet)(k);
+            for(unsigned int t=0;(t+1)<pt.mNbTier;t++) pTierCost[t]=tierCost(t);
+            pWorld->mCost=currentCost;
+            pWorld->mNbAcceptedMoves=nbAccepted;
+         }
+         if(!ParallelTemperingPipeWrite(pt.mvFdAck[process],1)) break;
+      }
+   }
+   catch(...)
+   {
+      status=1;
+   }
+   // Do not return to the caller, nor run any destructor: all objects belong to the parent process
+   _exit(status);
+   #endif
+}
+
+void MonteCarloObj::RunParallelTemperingMultiProcess(long &nbStep,const bool silent,
+                                                     const REAL finalcost,const REAL maxTime)
+{
+   TAU_PROFILE("MonteCarloObj::RunParallelTemperingMultiProcess()","void ()",TAU_DEFAULT);
+   #ifdef _WIN32
+   throw ObjCrystException("MonteCarloObj::RunParallelTemperingMultiProcess(): not available on this platform");
+   #else
+   //Keep a copy of the total number of steps, and decrement nbStep
+   const long nbSteps=nbStep;
+   mNbTrial=0;
+   // time (in seconds) when last autoSave was made (if enabled)
+      unsigned long secondsWhenAutoSave=0;
+   // Same Worlds as in RunParallelTempering()
+      const long nbWorld=30;
+      CrystVector_long worldSwapIndex(nbWorld);
+      for(int i=0;i<nbWorld;++i) worldSwapIndex(i)=i;
+      const int nbTryPerWorld=10;
+   unsigned int nbProcess=mNbProcess;
+   if(nbProcess==0) nbProcess=thread::hardware_concurrency();
+   if(nbProcess<1) nbProcess=1;
+   if(nbProcess>(unsigned int)nbWorld) nbProcess=nbWorld;
+   if(!silent) cout << "Starting Parallel Tempering Optimization, using "<<nbProcess<<" processes"<<endl;
+   // Initialize the costs
+      mCurrentCost=this->GetLogLikelihood();
+      REAL runBestCost=mCurrentCost;
+      CrystVector_REAL currentCost(nbWorld);
+      currentCost=mCurrentCost;
+   // Init the different temperatures and mutation rate parameters
+      CrystVector_REAL simAnnealTemp(nbWorld);
+      CrystVector_REAL mutationAmplitude(nbWorld);
+      this->InitParallelTemperingSchedule(nbWorld,simAnnealTemp,mutationAmplitude);
+   // Init the parameter sets for each World, and the costs of the lower tiers (delayed acceptance)
+      CrystVector_long worldCurrentSetIndex;
+      const unsigned int nbTier= mDelayedAcceptance.GetChoice()==1 ? this->GetNbLogLikelihoodTier() : 1;
+      vector<CrystVector_REAL> worldTierCost;
+      this->InitParallelTemperingWorlds(nbWorld,worldCurrentSetIndex,nbTier,worldTierCost);
+   // Adaptive resolution: the hottest Worlds use a lower resolution
+      CrystVector_REAL worldResolution;
+      this->InitParallelTemperingResolution(worldCurrentSetIndex,worldResolution,currentCost);
+   // Best configuration reached by each World
+      CrystVector_REAL worldBestCost(nbWorld);
+      worldBestCost=numeric_limits<REAL>::max();
+      CrystVector_long worldBestSetIndex(nbWorld);
+      for(int i=0;i<nbWorld;i++)
+         worldBestSetIndex(i)=mRefParList.CreateParamSet((boost::format("Parallel Tempering World #%d")%i).str());
+      const long runBestIndex=mRefParList.CreateParamSet("Best parameters for current run (PT)");
+   //Keep track of how many trials are accepted for each World
+      CrystVector_long worldNbAcceptedMoves(nbWorld);
+      worldNbAcceptedMoves=0;
+   //Do a report each...
+      const int nbTrialsReport=3000;
+   // Shared memory segment and worker processes
+      ParallelTemperingProcesses pt;
+      pt.mNbWorld=nbWorld;
+      pt.mNbPar=mRefParList.GetParamSet(worldCurrentSetIndex(0)).numElements();
+      pt.mNbTier=nbTier;
+      pt.mNbTierCost=nbTier>1 ? nbTier-1 : 1;
+      pt.mNbTryPerWorld=nbTryPerWorld;
+      pt.mNbProcess=nbProcess;
+      pt.mShmSize= nbWorld*sizeof(ParallelTemperingWorldExchange)
+                  +(2*nbWorld*pt.mNbPar+nbWorld*pt.mNbTierCost)*sizeof(REAL);
+      void *pShm=mmap(NULL,pt.mShmSize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANON,-1,0);
+      if(pShm==MAP_FAILED)
+         throw ObjCrystException("MonteCarloObj::RunParallelTemperingMultiProcess(): cannot create shared memory segment");
+      pt.mpShm=pShm;
+      pt.mpWorld=(ParallelTemperingWorldExchange*)pt.mpShm;
+      pt.mpPar=(REAL*)(pt.mpWorld+nbWorld);
+      pt.mpBestPar=pt.mpPar+nbWorld*pt.mNbPar;
+      pt.mpTierCost=pt.mpBestPar+nbWorld*pt.mNbPar;
+      pt.mvPid.resize(nbProcess,-1);
+      pt.mvFdCmd.resize(nbProcess,-1);
+      pt.mvFdAck.resize(nbProcess,-1);
+      pt.mvNbRestart.resize(nbProcess,0);
+      string error;
+      try
+      {
+         for(unsigned int p=0;p<nbProcess;p++) this->StartParallelTemperingWorker(pt,p);
+      }
+      catch(const ObjCrystException &except)
+      {
+         error="MonteCarloObj::RunParallelTemperingMultiProcess(): cannot start worker processes";
+      }
+   // Do we need to update the display ?
+   bool needUpdateDisplay=false;
+   //Do the refinement
+   bool makeReport=false;
+   Chronometer chrono;
+   chrono.start();
+   float lastUpdateDisplayTime=chrono.seconds();
+   vector<bool> vWorkerOK(nbProcess);
+   for(;(mNbTrial<nbSteps)&&(error=="");)
+   {
+      // Send the Worlds to the workers
+      for(int i=0;i<nbWorld;i++)
+      {
+         ParallelTemperingWorldExchange *pWorld=pt.mpWorld+i;
+         pWorld->mTemperature=simAnnealTemp(i);
+         pWorld->mMutationAmplitude=mutationAmplitude(i);
+         pWorld->mResolution=worldResolution(i);
+         pWorld->mCost=currentCost(i);
+         pWorld->mBestCost=worldBestCost(i);
+         pWorld->mNbAcceptedMoves=0;
+         const CrystVector_REAL *pSet=&(mRefParList.GetParamSet(worldCurrentSetIndex(i)));
+         REAL *pPar=pt.mpPar+i*pt.mNbPar;
+         for(long k=0;k<pt.mNbPar;k++) pPar[k]=(*pSet)(k);
+         for(unsigned int t=0;(t+1)<nbTier;t++) pt.mpTierCost[i*pt.mNbTierCost+t]=worldTierCost[i](t);
+      }
+      for(unsigned int p=0;p<nbProcess;p++) ParallelTemperingPipeWrite(pt.mvFdCmd[p],1);
+      // Wait for all workers
+      for(unsigned int p=0;p<nbProcess;p++)
+      {
+         char c;
+         vWorkerOK[p]=ParallelTemperingPipeRead(pt.mvFdAck[p],c);
+         if(vWorkerOK[p]) continue;
+         // The worker died: its Worlds are unchanged, and a new worker is started
+         int status=0;
+         waitpid(pt.mvPid[p],&status,0);
+         close(pt.mvFdCmd[p]);
+         close(pt.mvFdAck[p]);
+         pt.mvFdCmd[p]=-1;
+         pt.mvFdAck[p]=-1;
+         pt.mvPid[p]=-1;
+         if(WIFSIGNALED(status))
+            cout<<"MonteCarloObj::RunParallelTemperingMultiProcess(): worker #"<<p
+                <<" killed by signal "<<WTERMSIG(status)<<endl;
+         else
+            cout<<"MonteCarloObj::RunParallelTemperingMultiProcess(): worker #"<<p
+                <<" exited with status "<<WEXITSTATUS(status)<<endl;
+         if(++pt.mvNbRestart[p]>3)
+         {
+            error="MonteCarloObj::RunParallelTemperingMultiProcess(): worker process failed too many times";
+            continue;
          }
-         if(!silent) cout <<"Trial :" << mNbTrial << " Best Cost=" << runBestCost<< " ";
-         if(!silent) chrono.print();
-         //Change the mutation rate if necessary for each world
-         if(ANNEALING_SMART==mAnnealingScheduleMutation.GetChoice())
+         try{this->StartParallelTemperingWorker(pt,p);}
+         catch(const ObjCrystException &except)
          {
-            for(int i=0;i<nbWorld;i++)
-            {
-               if((worldNbAcceptedMoves(i)/(REAL)nbTrialsReport)>0.30)
-                  mutationAmplitude(i)*=2.;
-               if((worldNbAcceptedMoves(i)/(REAL)nbTrialsReport)<0.10)
-                  mutationAmplitude(i)/=2.;
-               if(mutationAmplitude(i)>mMutationAmplitudeMax)
-                  mutationAmplitude(i)=mMutationAmplitudeMax;
-               if(mutationAmplitude(i)<mMutationAmplitudeMin)
-                  mutationAmplitude(i)=mMutationAmplitudeMin;
-            }
+            error="MonteCarloObj::RunParallelTemperingMultiProcess(): cannot restart worker process";
          }
-         if(ANNEALING_SMART==mAnnealingScheduleTemp.GetChoice())
+      }
+      // Get back the results
+      for(int i=0;i<nbWorld;i++)
+      {
+         if(!vWorkerOK[i%nbProcess]) continue;
+         const ParallelTemperingWorldExchange *pWorld=pt.mpWorld+i;
+         currentCost(i)=pWorld->mCost;
+         worldNbAcceptedMoves(i)+=pWorld->mNbAcceptedMoves;
+         CrystVector_REAL *pSet=&(mRefParList.GetParamSet(worldCurrentSetIndex(i)));
+         const REAL *pPar=pt.mpPar+i*pt.mNbPar;
+         for(long k=0;k<pt.mNbPar;k++) (*pSet)(k)=pPar[k];
+         for(unsigned int t=0;(t+1)<nbTier;t++) worldTierCost[i](t)=pt.mpTierCost[i*pt.mNbTierCost+t];
+         if(pWorld->mBestCost<worldBestCost(i))
          {
-            for(int i=0;i<nbWorld;i++)
-            {
-               if((worldNbAcceptedMoves(i)/(REAL)nbTrialsReport)>0.30)
-                  simAnnealTemp(i)/=1.5;
-               if((worldNbAcceptedMoves(i)/(REAL)nbTrialsReport)>0.80)
-                  simAnnealTemp(i)/=1.5;
-               if((worldNbAcceptedMoves(i)/(REAL)nbTrialsReport)>0.95)
-                  simAnnealTemp(i)/=1.5;
-
-               if((worldNbAcceptedMoves(i)/(REAL)nbTrialsReport)<0.10)
-                  simAnnealTemp(i)*=1.5;
-               if((worldNbAcceptedMoves(i)/(REAL)nbTrialsReport)<0.04)
-                   simAnnealTemp(i)*=1.5;
-               //if((worldNbAcceptedMoves(i)/(REAL)nbTrialsReport)<0.01)
-               //   simAnnealTemp(i)*=1.5;
-               //cout<<"World#"<<i<<":"<<worldNbAcceptedMoves(i)<<":"<<nbTrialsReport<<endl;
-               //if(simAnnealTemp(i)>mTemperatureMax) simAnnealTemp(i)=mTemperatureMax;
-               //if(simAnnealTemp(i)<mTemperatureMin) simAnnealTemp(i)=mTemperatureMin;
-            }
+            worldBestCost(i)=pWorld->mBestCost;
+            pSet=&(mRefParList.GetParamSet(worldBestSetIndex(i)));
+            const REAL *pBestPar=pt.mpBestPar+i*pt.mNbPar;
+            for(long k=0;k<pt.mNbPar;k++) (*pSet)(k)=pBestPar[k];
          }
-         worldNbAcceptedMoves=0;
-         //this->DisplayReport();
+      }
+      const long nbTrial0=mNbTrial;
+      mNbTrial+=nbTryPerWorld*nbWorld;
+      nbStep-=nbTryPerWorld*nbWorld;
+      if((mNbTrial/nbTrialsReport)!=(nbTrial0/nbTrialsReport)) makeReport=true;
+      // New best configuration ?
+      long newBest=-1;
+      for(int i=0;i<nbWorld;i++)
+         if(worldBestCost(i)<((newBest<0) ? runBestCost : worldBestCost(newBest))) newBest=i;
+      if(newBest>=0)
+      {
+         mRefParList.RestoreParamSet(worldBestSetIndex(newBest));
+         this->ParallelTemperingNewBest(worldBestCost(newBest),runBestIndex,runBestCost,
+                                        worldSwapIndex(newBest),simAnnealTemp(newBest),
+                                        mutationAmplitude(newBest),silent);
+         needUpdateDisplay=true;
+      }
+      this->XMLAutoSaveIfNeeded(chrono.seconds(),secondsWhenAutoSave,newBest>=0,runBestCost);
+      this->ProcessXMLAutoSave();
 
-         #ifdef __WX__CRYST__
-         if(0!=mpWXCrystObj) mpWXCrystObj->UpdateDisplayNbTrial();
-         #endif
+      //Try swapping worlds
+      this->ParallelTemperingSwapWorlds(worldCurrentSetIndex,worldResolution,simAnnealTemp,nbTier,
+                                        currentCost,worldTierCost,worldSwapIndex);
+      this->SetDataResolutionFactor(1);
+      if(true==makeReport)
+      {
+         makeReport=false;
+         this->ParallelTemperingReport(nbTrialsReport,worldSwapIndex,currentCost,runBestCost,
+                                       worldNbAcceptedMoves,simAnnealTemp,mutationAmplitude,chrono,silent);
       }
       if( (needUpdateDisplay&&(lastUpdateDisplayTime<(chrono.seconds()-1)))||(lastUpdateDisplayTime<(chrono.seconds()-10)))
       {
@@ -2001,64 +2946,127 @@ void MonteCarloObj::RunParallelTempering(long &nbStep,const bool silent,
       mMutexStopAfterCycle.Unlock();
       #endif
    }//Trials
+   // Stop the workers
+      pt.Stop(false);
 
-   TAU_PROFILE_START(timerN);
-   if(mAutoLSQ.GetChoice()>0)
-   {// LSQ
-      if(!silent) cout<<"Beginning final LSQ refinement"<<endl;
-      for(int i=0;i<mRefinedObjList.GetNb();i++) mRefinedObjList.GetObj(i).SetApproximationFlag(false);
-      mRefParList.RestoreParamSet(runBestIndex);
-      mCurrentCost=this->GetLogLikelihood();
-      try {mLSQ.Refine(-50,true,true,false,0.001);}
-      catch(const ObjCrystException &except){};
-      if(!silent) cout<<"LSQ cost: "<<mCurrentCost<<" -> "<<this->GetLogLikelihood()<<endl;
+   if((mAutoLSQ.GetChoice()>0)&&(error==""))
+      this->ParallelTemperingFinalLSQ(runBestIndex,runBestCost,silent);
 
-      // Need to go back to optimization with approximations allowed (they are not during LSQ)
-      for(int i=0;i<mRefinedObjList.GetNb();i++) mRefinedObjList.GetObj(i).SetApproximationFlag(true);
-
-      REAL cost=this->GetLogLikelihood();
-      if(cost<mCurrentCost)
+   mLastOptimTime=chrono.seconds();
+   // Keep the best configuration of each World
+      for(int i=0;i<nbWorld;i++)
       {
-         mCurrentCost=cost;
-         mRefParList.SaveParamSet(lastParSavedSetIndex);
-         if(mCurrentCost<runBestCost)
-         {
-            runBestCost=mCurrentCost;
-            mRefParList.SaveParamSet(runBestIndex);
-            if(runBestCost<mBestCost)
-            {
-               mBestCost=mCurrentCost;
-               mRefParList.SaveParamSet(mBestParSavedSetIndex);
-               if(!silent) cout << "LSQ : NEW OVERALL Best Cost="<<runBestCost<< endl;
-            }
-            else if(!silent) cout << " LSQ : NEW Run Best Cost="<<runBestCost<< endl;
-         }
+         mRefParList.ClearParamSet(worldCurrentSetIndex(i));
+         if(worldBestCost(i)<numeric_limits<REAL>::max())
+            mvSavedParamSet.push_back(make_pair(worldBestSetIndex(i),worldBestCost(i)));
+         else mRefParList.ClearParamSet(worldBestSetIndex(i));
       }
-      if(!silent) cout<<"Finished LSQ refinement"<<endl;
-   }
-
-   mLastOptimTime=chrono.seconds();
    //Restore Best values
-      //mRefParList.Print();
       if(!silent) this->DisplayReport();
       mRefParList.RestoreParamSet(runBestIndex);
-      //for(int i=0;i<mRefinedObjList.GetNb();i++) mRefinedObjList.GetObj(i).Print();
       mCurrentCost=this->GetLogLikelihood();
       if(!silent) cout<<"Run Best Cost:"<<mCurrentCost<<endl;
       if(!silent) chrono.print();
-   //Save density of states
-      //ofstream out("densityOfStates.txt");
-      //out << trialsDensity<<endl;
-      //out.close();
-   // Clear temporary param set
+      mRefParList.ClearParamSet(runBestIndex);
+   if(error!="") throw ObjCrystException(error);
+   #endif
+}
+
+void MonteCarloObj::InitParallelTemperingSchedule(const long nbWorld,CrystVector_REAL &temperature,
+                                                  CrystVector_REAL &mutationAmplitude)const
+{
+   temperature.resize(nbWorld);
+   mutationAmplitude.resize(nbWorld);
+   for(int i=0;i<nbWorld;i++)
+   {
+      switch(mAnnealingScheduleTemp.GetChoice())
+      {
+         case ANNEALING_BOLTZMANN:
+            temperature(i)=
+               mTemperatureMin*log((REAL)nbWorld)/log((REAL)(i+2));break;
+         case ANNEALING_CAUCHY:
+            temperature(i)=mTemperatureMin*nbWorld/(i+1);break;
+         //case ANNEALING_QUENCHING:
+         case ANNEALING_EXPONENTIAL:
+            temperature(i)=mTemperatureMax
+                           *pow(mTemperatureMin/mTemperatureMax,
+                                 i/(REAL)(nbWorld-1));break;
+         case ANNEALING_GAMMA:
+            temperature(i)=mTemperatureMax+(mTemperatureMin-mTemperatureMax)
+                           *pow(i/(REAL)(nbWorld-1),mTemperatureGamma);break;
+         case ANNEALING_SMART:
+            temperature(i)=mCurrentCost/(100.+(REAL)i/(REAL)nbWorld*900.);break;
+         default:
+            temperature(i)=mCurrentCost/(100.+(REAL)i/(REAL)nbWorld*900.);break;
+      }
+   }
+   for(int i=0;i<nbWorld;i++)
+   {
+      switch(mAnnealingScheduleMutation.GetChoice())
+      {
+         case ANNEALING_BOLTZMANN:
+            mutationAmplitude(i)=
+               mMutationAmplitudeMin*log((REAL)(nbWorld-1))/log((REAL)(i+2));
+            break;
+         case ANNEALING_CAUCHY:
+            mutationAmplitude(i)=mMutationAmplitudeMin*(REAL)(nbWorld-1)/(i+1);break;
+         //case ANNEALING_QUENCHING:
+         case ANNEALING_EXPONENTIAL:
+            mutationAmplitude(i)=mMutationAmplitudeMax
+                           *pow(mMutationAmplitudeMin/mMutationAmplitudeMax,
+                                 i/(REAL)(nbWorld-1));break;
+         case ANNEALING_GAMMA:
+            mutationAmplitude(i)=mMutationAmplitudeMax+(mMutationAmplitudeMin-mMutationAmplitudeMax)
+                           *pow(i/(REAL)(nbWorld-1),mMutationAmplitudeGamma);break;
+         case ANNEALING_SMART:
+            mutationAmplitude(i)=sqrt(mMutationAmplitudeMin*mMutationAmplitudeMax);break;
+         default:
+            mutationAmplitude(i)=sqrt(mMutationAmplitudeMin*mMutationAmplitudeMax);break;
+      }
+   }
+}
+
+void MonteCarloObj::UpdateParallelTemperingSchedule(const CrystVector_long &worldNbAcceptedMoves,
+                                                    const long nbTrial,CrystVector_REAL &temperature,
+                                                    CrystVector_REAL &mutationAmplitude)const
+{
+   const long nbWorld=worldNbAcceptedMoves.numElements();
+   if(ANNEALING_SMART==mAnnealingScheduleMutation.GetChoice())
+   {
       for(int i=0;i<nbWorld;i++)
       {
-         mRefParList.ClearParamSet(worldCurrentSetIndex(i));
-         //mvSavedParamSet.push_back(make_pair(worldCurrentSetIndex(i),currentCost(i)));
+         if((worldNbAcceptedMoves(i)/(REAL)nbTrial)>0.30)
+            mutationAmplitude(i)*=2.;
+         if((worldNbAcceptedMoves(i)/(REAL)nbTrial)<0.10)
+            mutationAmplitude(i)/=2.;
+         if(mutationAmplitude(i)>mMutationAmplitudeMax)
+            mutationAmplitude(i)=mMutationAmplitudeMax;
+         if(mutationAmplitude(i)<mMutationAmplitudeMin)
+            mutationAmplitude(i)=mMutationAmplitudeMin;
       }
-      mRefParList.ClearParamSet(lastParSavedSetIndex);
-      mRefParList.ClearParamSet(runBestIndex);
-   TAU_PROFILE_STOP(timerN);
+   }
+   if(ANNEALING_SMART==mAnnealingScheduleTemp.GetChoice())
+   {
+      for(int i=0;i<nbWorld;i++)
+      {
+         if((worldNbAcceptedMoves(i)/(REAL)nbTrial)>0.30)
+            temperature(i)/=1.5;
+         if((worldNbAcceptedMoves(i)/(REAL)nbTrial)>0.80)
+            temperature(i)/=1.5;
+         if((worldNbAcceptedMoves(i)/(REAL)nbTrial)>0.95)
+            temperature(i)/=1.5;
+
+         if((worldNbAcceptedMoves(i)/(REAL)nbTrial)<0.10)
+            temperature(i)*=1.5;
+         if((worldNbAcceptedMoves(i)/(REAL)nbTrial)<0.04)
+             temperature(i)*=1.5;
+         //if((worldNbAcceptedMoves(i)/(REAL)nbTrial)<0.01)
+         //   temperature(i)*=1.5;
+         //cout<<"World#"<<i<<":"<<worldNbAcceptedMoves(i)<<":"<<nbTrial<<endl;
+         //if(temperature(i)>mTemperatureMax) temperature(i)=mTemperatureMax;
+         //if(temperature(i)<mTemperatureMin) temperature(i)=mTemperatureMin;
+      }
+   }
 }
 
 void MonteCarloObj::XMLOutput(ostream &os,int indent)const
@@ -2084,6 +3092,12 @@ void MonteCarloObj::XMLOutput(ostream &os,int indent)const
    mAutoLSQ.XMLOutput(os,indent);
    os<<endl;
 
+   mDelayedAcceptance.XMLOutput(os,indent);
+   os<<endl;
+
+   mAdaptiveResolution.XMLOutput(os,indent);
+   os<<endl;
+
    {
       XMLCrystTag tag2("TempMaxMin");
       for(int i=0;i<indent;i++) os << "  " ;
@@ -2180,6 +3194,16 @@ void MonteCarloObj::XMLInput(istream &is,const XMLCrystTag &tagg)
                   mAutoLSQ.XMLInput(is,tag);
                   break;
                }
+               if("Delayed Acceptance"==tag.GetAttributeValue(i))
+               {
+                  mDelayedAcceptance.XMLInput(is,tag);
+                  break;
+               }
+               if("Adaptive Resolution"==tag.GetAttributeValue(i))
+               {
+                  mAdaptiveResolution.XMLInput(is,tag);
+                  break;
+               }
             }
          continue;
       }
@@ -2220,10 +3244,11 @@ void MonteCarloObj::NewConfiguration(const RefParType *type)
 {
    TAU_PROFILE("MonteCarloObj::NewConfiguration()","void ()",TAU_DEFAULT);
    VFN_DEBUG_ENTRY("MonteCarloObj::NewConfiguration()",4)
-   for(int i=0;i<mRefinedObjList.GetNb();i++)
-      mRefinedObjList.GetObj(i).BeginGlobalOptRandomMove();
-   for(int i=0;i<mRefinedObjList.GetNb();i++)
-      mRefinedObjList.GetObj(i).GlobalOptRandomMove(mMutationAmplitude,type);
+   if((!mCostGraphIsValid)||(mCostGraphClock<mRefinedObjList.GetRegistryClock())) this->CompileCostGraph();
+   for(vector<RefinableObj*>::const_iterator pos=mvpMoveObj.begin();pos!=mvpMoveObj.end();++pos)
+      (*pos)->BeginGlobalOptRandomMove();
+   for(vector<RefinableObj*>::const_iterator pos=mvpMoveObj.begin();pos!=mvpMoveObj.end();++pos)
+      (*pos)->GlobalOptRandomMove(mMutationAmplitude,type);
    VFN_DEBUG_EXIT("MonteCarloObj::NewConfiguration()",4)
 }
 
@@ -2245,7 +3270,15 @@ void MonteCarloObj::InitOptions()
    static string saveTrackedDataName;
    static string saveTrackedDataChoices[2];
 
+   static string delayedAcceptanceName;
+   static string delayedAcceptanceChoices[2];
+
+   static string adaptiveResolutionName;
+   static string adaptiveResolutionChoices[2];
+
    static bool needInitNames=true;
+   static mutex needInitNamesMutex;
+   lock_guard<mutex> needInitNamesLock(needInitNamesMutex);
    if(true==needInitNames)
    {
       GlobalOptimTypeName="Algorithm";
@@ -2271,6 +3304,14 @@ void MonteCarloObj::InitOptions()
       saveTrackedDataChoices[0]="No (recommended!)";
       saveTrackedDataChoices[1]="Yes (for tests ONLY)";
 
+      delayedAcceptanceName="Delayed Acceptance";
+      delayedAcceptanceChoices[0]="No";
+      delayedAcceptanceChoices[1]="Yes (reject on cheap costs first)";
+
+      adaptiveResolutionName="Adaptive Resolution";
+      adaptiveResolutionChoices[0]="No (always use the full resolution)";
+      adaptiveResolutionChoices[1]="Yes (low resolution at high temperatures)";
+
       needInitNames=false;//Only once for the class
    }
    mGlobalOptimType.Init(2,&GlobalOptimTypeName,GlobalOptimTypeChoices);
@@ -2278,11 +3319,15 @@ void MonteCarloObj::InitOptions()
    mAnnealingScheduleMutation.Init(6,&AnnealingScheduleMutationName,AnnealingScheduleChoices);
    mSaveTrackedData.Init(2,&saveTrackedDataName,saveTrackedDataChoices);
    mAutoLSQ.Init(3,&runAutoLSQName,runAutoLSQChoices);
+   mDelayedAcceptance.Init(2,&delayedAcceptanceName,delayedAcceptanceChoices);
+   mAdaptiveResolution.Init(2,&adaptiveResolutionName,adaptiveResolutionChoices);
    this->AddOption(&mGlobalOptimType);
    this->AddOption(&mAnnealingScheduleTemp);
    this->AddOption(&mAnnealingScheduleMutation);
    this->AddOption(&mSaveTrackedData);
    this->AddOption(&mAutoLSQ);
+   this->AddOption(&mDelayedAcceptance);
+   this->AddOption(&mAdaptiveResolution);
    VFN_DEBUG_MESSAGE("MonteCarloObj::InitOptions():End",5)
 }
 
@@ -30,19 +30,26 @@ namespace ObjCryst
 {
    class OptimizationObj;
    class MonteCarloObj;
+   class Crystal;
 }
 
 #include "ObjCryst/RefinableObj/RefinableObj.h"
 #include "ObjCryst/RefinableObj/LSQNumObj.h"
 #include "ObjCryst/RefinableObj/IO.h"
 #include "ObjCryst/RefinableObj/Tracker.h"
+#include "ObjCryst/RefinableObj/WorkerPool.h"
 #include <string>
 #include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #ifdef __WX__CRYST__
    //#undef GetClassName // Conflict from wxMSW headers ? (cygwin)
 #include "ObjCryst/wxCryst/wxGlobalOptimObj.h"
 #endif
 
+class Chronometer;
+
 namespace ObjCryst
 {
 /** Annealing schedule type. Used to determine the variation of the
@@ -162,8 +169,35 @@ class OptimizationObj
       *
       * This function is the weighted sum of the chosen Cost Functions for
       * the refined objects.
+      *
+      * If more than one thread is allowed (see SetNbThread()), the costs of
+      * independent data objects (PowderPattern and DiffractionDataSingleCrystal)
+      * are computed concurrently, after the other objects (including the Crystal
+      * and its ScatteringComponentList) have been updated in the calling thread.
+      * The sum is made in the same order, so the result does not depend on the
+      * number of threads.
       */
       virtual REAL GetLogLikelihood()const;
+      /** Set the number of threads used to compute the log(likelihood) of
+      * independent data objects. The default is 1, 0 means all cores.
+      *
+      * Data objects must not share anything but the Crystal (and its
+      * sub-objects), which is only read during their computation.
+      *
+      * The worker threads are started by BeginOptimization() and stopped by
+      * EndOptimization(), so a change only takes effect for the next optimization.
+      * Outside an optimization, the log(likelihood) is computed in the calling thread.
+      */
+      void SetNbThread(const unsigned int nbThread);
+      /// Number of threads used to compute the log(likelihood), see SetNbThread().
+      unsigned int GetNbThread()const;
+      /** Weighted sum of the log(likelihood) of the refined objects with a given
+      * cost tier (see RefinableObj::GetLogLikelihoodTier()). If tier<0, this is
+      * the same as GetLogLikelihood().
+      */
+      REAL GetTierLogLikelihood(const int tier)const;
+      /// Number of cost tiers (highest tier+1) for the refined objects
+      unsigned int GetNbLogLikelihoodTier()const;
 
       /// Stop after the current cycle. USed for interactive refinement.
       void StopAfterCycle();
@@ -265,12 +299,62 @@ class OptimizationObj
 
       /// Initialization of options.
       virtual void InitOptions();
+      /** Build the flat arrays used to compute the log(likelihood) during
+      * the optimization (objects, their tiers, weights and statistics), so that
+      * GetLogLikelihood() does not need any lookup in maps or registries.
+      *
+      * This is done by BeginOptimization(), and automatically by GetLogLikelihood()
+      * if the list of refined objects has changed.
+      */
+      void CompileCostGraph()const;
       /// (Re)build OptimizationObj::mRecursiveRefinedObjList, if an
       /// object has been added or modified. If no object has been
       /// added and no sub-object has been added/removed, then nothing is done.
       void BuildRecursiveRefObjList();
       /// \internal Add an option for this parameter
       void AddOption(RefObjOpt *opt);
+      /** Record a configuration to be saved as an xml file (see mXMLAutoSave).
+      *
+      * Only the parameter values are copied, so this can be called from
+      * the optimization loop. The file is written later by ProcessXMLAutoSave().
+      * If a previous snapshot has not been written yet, it is replaced.
+      *
+      * \param setId: index of the saved parameter set (in mRefParList), or -1
+      * to use the current parameter values.
+      * \param tag: added to the file name, after the object's name and the date.
+      */
+      void XMLAutoSaveSnapshot(const long setId,const string &tag);
+      /** Write the last snapshot recorded with XMLAutoSaveSnapshot(), if any.
+      *
+      * Only the snapshot's parameter values are handed to a background thread,
+      * which keeps its own copy of all objects (in a private ObjRegistryIsolation
+      * scope), serialises it with the new values, and writes and syncs the file.
+      * That copy is loaded from an xml template, which is serialised here once
+      * per optimization. If the copy cannot be matched to the refined parameters,
+      * the snapshots are serialised here instead (restoring the parameters
+      * afterwards), as a fallback.
+      *
+      * If the background thread is still writing a previous file, nothing is done
+      * unless \e wait is true, so that snapshots are coalesced.
+      *
+      * \param wait: if true, wait until all files have been written.
+      */
+      void ProcessXMLAutoSave(const bool wait=false);
+      /** \internal Record a snapshot with XMLAutoSaveSnapshot() if one is due,
+      * according to the mXMLAutoSave option.
+      *
+      * \param seconds: time elapsed since the beginning of the optimization
+      * \param secondsWhenAutoSave: time of the last snapshot, updated if a new one is recorded
+      * \param newBest: true if the current configuration is a new best one for this run
+      * \param cost: cost of the current configuration
+      */
+      void XMLAutoSaveIfNeeded(const REAL seconds,unsigned long &secondsWhenAutoSave,
+                               const bool newBest,const REAL cost);
+      /// Stop the background autosave thread, after all files have been written.
+      /// Its copy of the objects is deleted.
+      void StopXMLAutoSave();
+      /// Background autosave loop, see ProcessXMLAutoSave().
+      void XMLAutoSaveLoop();
       /// The refinable par list used during refinement. Only a condensed version
       /// of all objects. This is useful to keep an history of modifications, and to
       /// restore previous values.
@@ -317,6 +401,28 @@ class OptimizationObj
          /// Weights for each objects in each context
          /// (mutable for dynamic update during optimization)
          mutable map<const RefinableObj*,DynamicObjWeight> mvObjWeight;
+      // Compiled cost graph, see CompileCostGraph()
+         /// Time of the last compilation
+         mutable RefinableObjClock mCostGraphClock;
+         /// False if the cost graph must be compiled again, even if the registries have
+         /// not changed (when the weights or statistics it points to are cleared)
+         mutable bool mCostGraphIsValid;
+         /// The refined objects (all sub-objects included)
+         mutable vector<const RefinableObj*> mvpCostObj;
+         /// Cost tier of each object (RefinableObj::GetLogLikelihoodTier())
+         mutable vector<unsigned int> mvCostObjTier;
+         /// Is the object an independent data object, whose cost can be computed
+         /// concurrently (PowderPattern, DiffractionDataSingleCrystal)
+         mutable vector<bool> mvCostObjIsData;
+         /// Weight of each object, in mvObjWeight
+         mutable vector<DynamicObjWeight*> mvpCostObjWeight;
+         /// Statistics of each object in mvContextObjStats, for each context. These
+         /// are null until the object has a non-zero contribution.
+         mutable vector<vector<LogLikelihoodStats*> > mvpCostObjStats;
+         /// Crystals, which must be updated before data objects are computed concurrently
+         mutable vector<const Crystal*> mvpCostCrystal;
+         /// Top-level refined objects, for random moves
+         mutable vector<RefinableObj*> mvpMoveObj;
 
          /// List of saved parameter sets. This is used to save possible
          /// solutions during the optimization, so that the user can check them
@@ -342,6 +448,56 @@ class OptimizationObj
 
       /// Periodic save of complete environment as an xml file
          RefObjOpt mXMLAutoSave;
+      /// Number of threads used to compute the log(likelihood) of data objects (0=all cores)
+         unsigned int mNbThread;
+         /// Worker threads computing the log(likelihood) of data objects, running
+         /// between BeginOptimization() and EndOptimization()
+         mutable WorkerPool mLogLikelihoodPool;
+         /// Index of the data objects computed by mLogLikelihoodPool (kept to avoid allocations)
+         mutable vector<long> mvParallelIndex;
+         /// Log(likelihood) of the objects, when computed by mLogLikelihoodPool
+         mutable vector<REAL> mvParallelLLK;
+      // Asynchronous autosave, see XMLAutoSaveSnapshot()
+         /// Saved parameter set holding the configuration to be saved
+         long mAutoSaveParSavedSetIndex;
+         /// Saved parameter set for the current values, while a snapshot is serialised
+         /// by the optimization thread (fallback, see ProcessXMLAutoSave())
+         long mAutoSaveCurrentParSavedSetIndex;
+         /// File name for the pending snapshot (empty if there is none)
+         string mAutoSaveFileName;
+         /// Has the xml template been handed to the autosave thread ?
+         bool mAutoSaveTemplateSent;
+         /// File name of the last snapshot handed as values only, until it is written
+         string mAutoSaveSentFileName;
+         /// Background thread writing the autosave files
+         std::thread mAutoSaveThread;
+         /// Mutex protecting the file handed to the autosave thread
+         std::mutex mAutoSaveMutex;
+         /// Condition used to wake up the autosave thread, or wait for it
+         std::condition_variable mAutoSaveCond;
+         /// Name of the file handed to the autosave thread
+         string mAutoSaveWriteFileName;
+         /// Content of the file handed to the autosave thread, if it was serialised
+         /// by the optimization thread (otherwise empty)
+         string mAutoSaveWriteContent;
+         /// xml template for the autosave thread's copy of the objects (empty if unchanged)
+         string mAutoSaveWriteTemplate;
+         /// Index of this object in gOptimizationObjRegistry, when the template was made
+         long mAutoSaveWriteObjIndex;
+         /// Class and name of the objects in mRecursiveRefinedObjList when the template
+         /// was made, to find their copies in the autosave thread
+         vector<string> mAutoSaveWriteObjName;
+         /// Number of parameters of the objects in mRecursiveRefinedObjList, when the
+         /// template was made (their parameters are listed in that order in mRefParList)
+         vector<long> mAutoSaveWriteObjNbPar;
+         /// Parameter values of the snapshot handed to the autosave thread
+         CrystVector_REAL mAutoSaveWriteValues;
+         /// True while a file is being written by the autosave thread
+         bool mAutoSaveBusy;
+         /// Stop the autosave thread when the last file is written
+         bool mAutoSaveStop;
+         /// Set by the autosave thread if its copy of the objects could not be used
+         bool mAutoSaveCloneFailed;
 
       /// The time elapsed after the last optimization, in seconds
          REAL mLastOptimTime;
@@ -464,7 +620,58 @@ class MonteCarloObj:public OptimizationObj
       void RunParallelTempering(long &nbSteps,const bool silent=false,const REAL finalcost=0,
                                 const REAL maxTime=-1);
 
+      /** \internal Do a single Parallel Tempering run, with the Worlds distributed
+      * among worker processes (see SetNbProcess()). This is called by
+      * RunParallelTempering() if more than one process is used.
+      *
+      * Each worker is a copy of this process (created with fork()), and so
+      * starts with the same objects, as if it had loaded the same xml file.
+      * Workers run the trials for their Worlds, and exchange costs and
+      * parameter values with this (parent) process through a shared memory
+      * segment. The parent process makes the swaps between Worlds, keeps
+      * the best configuration, and at the end stores the best configuration
+      * of each World in the list of saved parameter sets.
+      *
+      * If a worker process dies, its Worlds restart from their configuration
+      * before the last exchange in a new worker.
+      *
+      * Automatic least-squares refinements during the run (mAutoLSQ=2) are
+      * not done in this mode, only the final one.
+      */
+      void RunParallelTemperingMultiProcess(long &nbSteps,const bool silent=false,const REAL finalcost=0,
+                                            const REAL maxTime=-1);
       void RunRandomLSQMethod(long &nbCycle);
+      /** \internal Delayed acceptance test of a new configuration, used
+      * by RunSimulatedAnnealing() and RunParallelTempering() if the corresponding
+      * option is set.
+      *
+      * The cost tiers (see RefinableObj::GetLogLikelihoodTier()) are computed in
+      * increasing order, and each one must pass a Metropolis test on its own
+      * variation, so that expensive tiers are only computed for configurations
+      * which pass the cheap ones. This is the two-stage (or multi-stage) acceptance
+      * test, and it samples the same distribution as the test on the total cost.
+      *
+      * \param currentCost: the total cost of the current configuration
+      * \param currentTierCost: the costs of all tiers but the last one, for the
+      * current configuration. They are updated if the configuration is accepted.
+      * \param cost: the total cost of the new configuration, if accepted
+      * \return true if the new configuration is accepted
+      */
+      bool DelayedAcceptance(const REAL currentCost,CrystVector_REAL &currentTierCost,
+                             REAL &cost,const REAL temperature);
+      /** Set the number of processes used for parallel tempering.
+      *
+      * If more than one process is used, the Worlds are run by separate
+      * worker processes (see RunParallelTemperingMultiProcess()), so that
+      * a crash only affects one worker, and each worker has its own global
+      * registries. This is only available on POSIX systems.
+      *
+      * \param nb: number of worker processes. 0 will use as many processes
+      * as there are cores, and 1 (the default) runs all Worlds in this process.
+      */
+      void SetNbProcess(const unsigned int nb);
+      /// Number of processes used for parallel tempering (0=all cores)
+      unsigned int GetNbProcess()const;
 
       //Parameter Access by name
       //RefinablePar& GetPar(const string& parName);
@@ -510,6 +717,84 @@ class MonteCarloObj:public OptimizationObj
       virtual void NewConfiguration(const RefParType *type=gpRefParTypeObjCryst);
 
       virtual void InitOptions();
+      /// \internal Shared memory segment and worker processes used by RunParallelTemperingMultiProcess()
+      struct ParallelTemperingProcesses;
+      /// \internal Create a worker process for RunParallelTemperingMultiProcess()
+      void StartParallelTemperingWorker(ParallelTemperingProcesses &pt,const unsigned int process);
+      /// \internal Main loop of a worker process for RunParallelTemperingMultiProcess(). This never returns.
+      void RunParallelTemperingWorker(ParallelTemperingProcesses &pt,const unsigned int process);
+      /** \internal Resolution factor used for the data (see RefinableObj::SetResolutionFactor()),
+      * if the adaptive resolution option is used.
+      *
+      * \param progress: from 0 (beginning of a simulated annealing run, or hottest
+      * parallel tempering World) to 1 (end of the run, or coldest World). The data is
+      * used with a few increasing resolution levels, the full resolution being used for
+      * the last part of the run or the coldest Worlds.
+      */
+      REAL GetAdaptiveResolutionFactor(const REAL progress)const;
+      /// \internal Set the resolution factor of all refined objects, if it has changed
+      void SetDataResolutionFactor(const REAL factor);
+      /// \internal Cost of a saved configuration, at a given resolution factor
+      REAL GetLogLikelihoodAtResolution(const long parSetIndex,const REAL resolution);
+      /** \internal Change the resolution factor during a simulated annealing run.
+      *
+      * The costs of the best configuration of the run and of the current configuration
+      * are re-computed, since costs computed at different resolutions cannot be compared.
+      * The overall best configuration is only updated at full resolution.
+      */
+      void SimulatedAnnealingResolution(const REAL factor,const long runBestIndex,
+                                        const long currentIndex,REAL &runBestCost);
+      /// \internal Resolution factor of each World for parallel tempering, and the
+      /// corresponding costs for the Worlds which do not use the full resolution.
+      void InitParallelTemperingResolution(const CrystVector_long &worldCurrentSetIndex,
+                                           CrystVector_REAL &worldResolution,
+                                           CrystVector_REAL &currentCost);
+      /** \internal Create the parameter set of each World for parallel tempering. All
+      * Worlds start from the current configuration, but one in two is randomized.
+      * The costs of the lower tiers (delayed acceptance) are also computed.
+      */
+      void InitParallelTemperingWorlds(const long nbWorld,CrystVector_long &worldCurrentSetIndex,
+                                       const unsigned int nbTier,
+                                       vector<CrystVector_REAL> &worldTierCost);
+      /** \internal Parallel tempering: the current configuration is a new best one
+      * for this run. It is saved as the run best configuration, and as the overall
+      * best configuration if it is better.
+      *
+      * \param cost: cost of the current configuration
+      * \param world, temperature, mutationAmplitude: the World the configuration
+      * comes from, for the report.
+      */
+      void ParallelTemperingNewBest(const REAL cost,const long runBestIndex,REAL &runBestCost,
+                                    const long world,const REAL temperature,
+                                    const REAL mutationAmplitude,const bool silent);
+      /// \internal Parallel tempering: try to swap the configurations of successive Worlds
+      void ParallelTemperingSwapWorlds(const CrystVector_long &worldCurrentSetIndex,
+                                       const CrystVector_REAL &worldResolution,
+                                       const CrystVector_REAL &temperature,
+                                       const unsigned int nbTier,
+                                       CrystVector_REAL &currentCost,
+                                       vector<CrystVector_REAL> &worldTierCost,
+                                       CrystVector_long &worldSwapIndex);
+      /** \internal Parallel tempering: print the state of all Worlds, and update
+      * their temperature and mutation amplitude from the number of accepted moves,
+      * which is then reset.
+      */
+      void ParallelTemperingReport(const long nbTrialsReport,const CrystVector_long &worldSwapIndex,
+                                   const CrystVector_REAL &currentCost,const REAL runBestCost,
+                                   CrystVector_long &worldNbAcceptedMoves,
+                                   CrystVector_REAL &temperature,CrystVector_REAL &mutationAmplitude,
+                                   Chronometer &chrono,const bool silent);
+      /// \internal Parallel tempering: final least squares refinement of the run best
+      /// configuration, if the mAutoLSQ option is used.
+      void ParallelTemperingFinalLSQ(const long runBestIndex,REAL &runBestCost,const bool silent);
+      /// \internal Initial temperature and mutation amplitude of each World, for parallel tempering
+      void InitParallelTemperingSchedule(const long nbWorld,CrystVector_REAL &temperature,
+                                         CrystVector_REAL &mutationAmplitude)const;
+      /// \internal Change the temperature and mutation amplitude of each World for the
+      /// 'smart' schedules, from the number of moves accepted in each World during nbTrial trials.
+      void UpdateParallelTemperingSchedule(const CrystVector_long &worldNbAcceptedMoves,
+                                           const long nbTrial,CrystVector_REAL &temperature,
+                                           CrystVector_REAL &mutationAmplitude)const;
 
       /// Method used for the global optimization. Should be removed when we switch
       /// to using several classes for different algorithms.
@@ -559,6 +844,15 @@ class MonteCarloObj:public OptimizationObj
       LSQNumObj mLSQ;
       /// Option to run automatic least-squares refinements
       RefObjOpt mAutoLSQ;
+      /// Option to use delayed acceptance, see DelayedAcceptance()
+      RefObjOpt mDelayedAcceptance;
+      /// Number of processes for parallel tempering, see SetNbProcess()
+      unsigned int mNbProcess;
+      /// Option to use coarse data (low resolution) for the beginning of simulated
+      /// annealing runs, or the hottest parallel tempering Worlds.
+      RefObjOpt mAdaptiveResolution;
+      /// Resolution factor currently used for the refined objects
+      REAL mResolutionFactor;
    private:
    #ifdef __WX__CRYST__
    public:
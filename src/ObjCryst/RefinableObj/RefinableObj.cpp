@@ -71,7 +71,7 @@ const string& RefParType::GetName() const{ return mName;}
 
 void RefParType::InitId()
 {
-   static unsigned long nbRefParType=0;
+   static atomic<unsigned long> nbRefParType(0);
    mId=nbRefParType++;
 }
 
@@ -83,8 +83,10 @@ long NiftyStaticGlobalObjectsInitializer_RefinableObj::mCount=0;
 //
 //######################################################################
 
-unsigned long RefinableObjClock::msTick0=0;
-unsigned long RefinableObjClock::msTick1=0;
+std::atomic<unsigned long> gObjNameChangeCounter(0);
+
+std::atomic<unsigned long> RefinableObjClock::msTick0(0);
+std::atomic<unsigned long> RefinableObjClock::msTick1(0);
 RefinableObjClock::RefinableObjClock()
 {
    //this->Click();
@@ -131,8 +133,10 @@ bool RefinableObjClock::operator>=(const RefinableObjClock &rhs)const
 void RefinableObjClock::Click()
 {
    //return;
-   if(++msTick0==0) ++msTick1;//Update ObjCryst++ static event counter
-   mTick0=msTick0;
+   //Update ObjCryst++ static event counter
+   const unsigned long tick0=++msTick0;
+   if(tick0==0) ++msTick1;
+   mTick0=tick0;
    mTick1=msTick1;
    for(std::set<RefinableObjClock*>::iterator pos=mvParent.begin();
        pos!=mvParent.end();++pos) (*pos)->Click();
@@ -302,7 +306,7 @@ void RefinablePar::Init(const string &name,
    mpClock=0;
 }
 RefinablePar::RefinablePar(const RefinablePar &old):
-Restraint(old)
+Restraint(old),mName(old.mName)
 {
    mpValue=old.mpValue;
    #ifdef __WX__CRYST__
@@ -315,7 +319,7 @@ Restraint(old)
 
 void RefinablePar::CopyAttributes(const RefinablePar&old)
 {
-   mName=old.mName;
+   this->SetName(old.mName);
    mMin=old.GetMin();
    mMax=old.GetMax();
    mHasLimits=old.mHasLimits;
@@ -395,11 +399,9 @@ void RefinablePar::SetValue(const REAL value)
    }
 }
 
-const REAL& RefinablePar::GetHumanValue() const
+REAL RefinablePar::GetHumanValue() const
 {
-   static REAL val;
-   val = *mpValue * mHumanScale;
-   return val;
+   return *mpValue * mHumanScale;
 }
 
 void RefinablePar::SetHumanValue(const REAL &value)
@@ -543,7 +545,12 @@ void RefinablePar::Print() const
 }
 
 string RefinablePar::GetName()const {return mName;}
-void RefinablePar::SetName(const string &name) {mName=name;}
+void RefinablePar::SetName(const string &name)
+{
+   if(name==mName) return;
+   mName=name;
+   ++gObjNameChangeCounter;
+}
 
 bool RefinablePar::IsFixed()const {return mIsFixed;}
 void RefinablePar::SetIsFixed(const bool b)
@@ -864,7 +871,7 @@ bool operator==(const string&str,const wxString&wx)
 #endif
 
 template<class T> ObjRegistry<T>::ObjRegistry():
-mName(""),mAutoUpdateUI(true)
+mIsGlobal(false),mIndexIsValid(true),mIndexNameChange(gObjNameChangeCounter),mName(""),mAutoUpdateUI(true)
 #ifdef __WX__CRYST__
 ,mpWXRegistry(0)
 #endif
@@ -873,7 +880,7 @@ mName(""),mAutoUpdateUI(true)
 }
 
 template<class T> ObjRegistry<T>::ObjRegistry(const string &name):
-mName(name),mAutoUpdateUI(true)
+mIsGlobal(false),mIndexIsValid(true),mIndexNameChange(gObjNameChangeCounter),mName(name),mAutoUpdateUI(true)
 #ifdef __WX__CRYST__
 ,mpWXRegistry(0)
 #endif
@@ -881,7 +888,27 @@ mName(name),mAutoUpdateUI(true)
    VFN_DEBUG_MESSAGE("ObjRegistry::ObjRegistry(name):"<<mName,5)
 }
 
-//:TODO: a copy constructor
+template<class T> ObjRegistry<T>::ObjRegistry(const string &name,const bool global):
+mIsGlobal(global),mIndexIsValid(true),mIndexNameChange(gObjNameChangeCounter),mName(name),mAutoUpdateUI(true)
+#ifdef __WX__CRYST__
+,mpWXRegistry(0)
+#endif
+{
+   VFN_DEBUG_MESSAGE("ObjRegistry::ObjRegistry(name,global):"<<mName,5)
+}
+
+template<class T> ObjRegistry<T>::ObjRegistry(const ObjRegistry<T> &old):
+mIsGlobal(false),mvpRegistry(old.mvpRegistry),mvpRegistryList(old.mvpRegistryList),
+mIndexIsValid(false),mIndexNameChange(gObjNameChangeCounter),mName(old.mName),
+mAutoUpdateUI(old.mAutoUpdateUI)
+#ifdef __WX__CRYST__
+,mpWXRegistry(0)
+#endif
+{
+   VFN_DEBUG_MESSAGE("ObjRegistry::ObjRegistry(&old):"<<mName,5)
+   mListClock.Click();
+}
+
 template<class T> ObjRegistry<T>::~ObjRegistry()
 {
    VFN_DEBUG_MESSAGE("ObjRegistry::~ObjRegistry():"<<mName,5)
@@ -892,15 +919,23 @@ template<class T> ObjRegistry<T>::~ObjRegistry()
 
 template<class T> void ObjRegistry<T>::Register(T &obj)
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) {pIsolated->Register(obj);return;}
    VFN_DEBUG_ENTRY("ObjRegistry("<<mName<<")::Register():"<<obj.GetName(),2)
-   typename vector<T*>::iterator pos=find(mvpRegistry.begin(),mvpRegistry.end(),&obj);
-   if(pos!=mvpRegistry.end())
+   if(this->Find(&obj)>=0)
    {
       VFN_DEBUG_EXIT("ObjRegistry("<<mName<<")::Register():"<<obj.GetName()<<"Already registered!",2)
       return;
    }
    mvpRegistry.push_back(&obj);
    mvpRegistryList.push_back(&obj);
+   {
+      // Find() made sure the indices are valid. If names changed in the meantime
+      // the name index will be rebuilt anyway at the next search.
+      lock_guard<mutex> lock(mIndexMutex);
+      mvPtrIndex[&obj]=mvpRegistry.size()-1;
+      mvNameIndex[obj.GetName()]=mvpRegistry.size()-1;
+   }
    mListClock.Click();
    #ifdef __WX__CRYST__
    if((0!=mpWXRegistry) && mAutoUpdateUI)
@@ -912,6 +947,8 @@ template<class T> void ObjRegistry<T>::Register(T &obj)
 
 template<class T> void ObjRegistry<T>::DeRegister(T &obj)
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) {pIsolated->DeRegister(obj);return;}
    VFN_DEBUG_ENTRY("ObjRegistry("<<mName<<")::Deregister(&obj)"<<mvpRegistry.size(),2)
    if (mvpRegistry.size() == 0)
    {// This may happen if an object is deleted several times due to inherited destructors
@@ -921,8 +958,8 @@ template<class T> void ObjRegistry<T>::DeRegister(T &obj)
       return;
    }
    //this->Print();
-   typename vector<T*>::iterator pos=find(mvpRegistry.begin(),mvpRegistry.end(),&obj);
-   if(pos==mvpRegistry.end())
+   const long i=this->Find(&obj);
+   if(i<0)
    {
       VFN_DEBUG_EXIT("ObjRegistry("<<mName<<")::Deregister(&obj):NOT FOUND !!!",2)
       return; //:TODO: throw something ?
@@ -930,17 +967,30 @@ template<class T> void ObjRegistry<T>::DeRegister(T &obj)
    #ifdef __WX__CRYST__
    if(0!=mpWXRegistry) mpWXRegistry->Remove(obj.WXGet());
    #endif
-   mvpRegistry.erase(pos);
-   
-   typename list<T*>::iterator pos2=find(mvpRegistryList.begin(),mvpRegistryList.end(),&obj);
-   mvpRegistryList.erase(pos2);
-   
+   mvpRegistry.erase(mvpRegistry.begin()+i);
+
+   typename list<T*>::iterator pos2=find(mvpRegistryList.rbegin(),mvpRegistryList.rend(),&obj).base();
+   mvpRegistryList.erase(--pos2);
+
+   {
+      lock_guard<mutex> lock(mIndexMutex);
+      if(i==(long)mvpRegistry.size())
+      {// Last object removed (the usual case for temporary objects): indices are still valid
+         mvPtrIndex.erase(&obj);
+         typename std::unordered_map<string,long>::iterator posn=mvNameIndex.find(obj.GetName());
+         if((posn!=mvNameIndex.end()) && (posn->second==i)) mvNameIndex.erase(posn);
+      }
+      else mIndexIsValid=false;
+   }
+
    mListClock.Click();
    VFN_DEBUG_EXIT("ObjRegistry("<<mName<<")::Deregister(&obj)",2)
 }
 
 template<class T> void ObjRegistry<T>::DeRegister(const string &objName)
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) {pIsolated->DeRegister(objName);return;}
    VFN_DEBUG_ENTRY("ObjRegistry("<<mName<<")::Deregister(name):"<<objName,2)
 
    const long i=this->Find(objName);
@@ -949,23 +999,14 @@ template<class T> void ObjRegistry<T>::DeRegister(const string &objName)
       VFN_DEBUG_EXIT("ObjRegistry("<<mName<<")::Deregister(name): NOT FOUND !!!",2)
       return; //:TODO: throw something ?
    }
-   //:KLUDGE: should directly do an iterator search on the name...
-   typename vector<T*>::iterator pos=find(mvpRegistry.begin(),mvpRegistry.end(),mvpRegistry[i]);
-
-   #ifdef __WX__CRYST__
-   if(0!=mpWXRegistry) mpWXRegistry->Remove((*pos)->WXGet());
-   #endif
-   mvpRegistry.erase(pos);
-
-   typename list<T*>::iterator pos2=find(mvpRegistryList.begin(),mvpRegistryList.end(),mvpRegistry[i]);
-   mvpRegistryList.erase(pos2);
-
-   mListClock.Click();
+   this->DeRegister(*(mvpRegistry[i]));
    VFN_DEBUG_EXIT("ObjRegistry("<<mName<<")::Deregister(name):",2)
 }
 
 template<class T> void ObjRegistry<T>::DeRegisterAll()
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) {pIsolated->DeRegisterAll();return;}
    VFN_DEBUG_ENTRY("ObjRegistry("<<mName<<")::DeRegisterAll():",5)
    #ifdef __WX__CRYST__
    if(0!=mpWXRegistry)
@@ -977,42 +1018,64 @@ template<class T> void ObjRegistry<T>::DeRegisterAll()
    #endif
    mvpRegistry.clear();
    mvpRegistryList.clear();
+   {
+      lock_guard<mutex> lock(mIndexMutex);
+      mvNameIndex.clear();
+      mvPtrIndex.clear();
+      mIndexIsValid=true;
+   }
    mListClock.Click();
    VFN_DEBUG_EXIT("ObjRegistry("<<mName<<")::DeRegisterAll():",5)
 }
 
 template<class T> void ObjRegistry<T>::DeleteAll()
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) {pIsolated->DeleteAll();return;}
    VFN_DEBUG_ENTRY("ObjRegistry("<<mName<<")::DeleteAll():",5)
    vector<T*> reg=mvpRegistry;//mvpRegistry will be modified as objects are deleted, so use a copy
    typename vector<T*>::iterator pos;
    for(pos=reg.begin();pos!=reg.end();++pos) delete *pos;
    mvpRegistry.clear();
    mvpRegistryList.clear();
+   {
+      lock_guard<mutex> lock(mIndexMutex);
+      mvNameIndex.clear();
+      mvPtrIndex.clear();
+      mIndexIsValid=true;
+   }
    mListClock.Click();
    VFN_DEBUG_EXIT("ObjRegistry("<<mName<<")::DeleteAll():",5)
 }
 
 template<class T> T& ObjRegistry<T>::GetObj(const unsigned int i)
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) return pIsolated->GetObj(i);
    if(i>=this->GetNb()) throw ObjCrystException("ObjRegistry<T>::GetObj(i): i >= nb!");
    return *(mvpRegistry[i]);
 }
 
 template<class T> const T& ObjRegistry<T>::GetObj(const unsigned int i) const
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) return pIsolated->GetObj(i);
    if(i>=this->GetNb()) throw ObjCrystException("ObjRegistry<T>::GetObj(i): i >= nb!");
    return *(mvpRegistry[i]);
 }
 
 template<class T> T& ObjRegistry<T>::GetObj(const string &objName)
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) return pIsolated->GetObj(objName);
    const long i=this->Find(objName);
    return *(mvpRegistry[i]);
 }
 
 template<class T> const T& ObjRegistry<T>::GetObj(const string &objName) const
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) return pIsolated->GetObj(objName);
    const long i=this->Find(objName);
    return *(mvpRegistry[i]);
 }
@@ -1020,6 +1083,8 @@ template<class T> const T& ObjRegistry<T>::GetObj(const string &objName) const
 template<class T> T& ObjRegistry<T>::GetObj(const string &objName,
                                                   const string& className)
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) return pIsolated->GetObj(objName,className);
    const long i=this->Find(objName,className);
    return *(mvpRegistry[i]);
 }
@@ -1027,14 +1092,23 @@ template<class T> T& ObjRegistry<T>::GetObj(const string &objName,
 template<class T> const T& ObjRegistry<T>::GetObj(const string &objName,
                                                         const string& className) const
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) return pIsolated->GetObj(objName,className);
    const long i=this->Find(objName,className);
    return *(mvpRegistry[i]);
 }
 
-template<class T> long ObjRegistry<T>::GetNb()const{return (long)mvpRegistry.size();}
+template<class T> long ObjRegistry<T>::GetNb()const
+{
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) return pIsolated->GetNb();
+   return (long)mvpRegistry.size();
+}
 
 template<class T> void ObjRegistry<T>::Print()const
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) {pIsolated->Print();return;}
    VFN_DEBUG_MESSAGE("ObjRegistry::Print():",2)
    cout <<mName<<" :"<<this->GetNb()<<" object registered:" <<endl;
 
@@ -1048,11 +1122,26 @@ template<class T> const string& ObjRegistry<T>::GetName()const { return mName;}
 
 template<class T> long ObjRegistry<T>::Find(const string &objName) const
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) return pIsolated->Find(objName);
    VFN_DEBUG_MESSAGE("ObjRegistry::Find(objName)",2)
    long index=-1;
-   //bool error=false;
-   for(long i=this->GetNb()-1;i>=0;i--)
-      if( mvpRegistry[i]->GetName() == objName) return i;
+   {
+      lock_guard<mutex> lock(mIndexMutex);
+      if((!mIndexIsValid) || (mIndexNameChange!=gObjNameChangeCounter)) this->BuildIndex();
+      typename std::unordered_map<string,long>::const_iterator pos=mvNameIndex.find(objName);
+      if(pos!=mvNameIndex.end())
+         if((pos->second<this->GetNb()) && (mvpRegistry[pos->second]->GetName()==objName))
+            return pos->second;
+      // Some objects change their name without notification, so search again
+      //bool error=false;
+      for(long i=this->GetNb()-1;i>=0;i--)
+         if( mvpRegistry[i]->GetName() == objName)
+         {
+            mvNameIndex[objName]=i;
+            return i;
+         }
+   }
    //      if(-1 != index) error=true ;else index=i;
    //if(true == error)
    //{
@@ -1072,8 +1161,18 @@ template<class T> long ObjRegistry<T>::Find(const string &objName,
                                             const string &className,
                                              const bool nothrow) const
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) return pIsolated->Find(objName,className,nothrow);
    VFN_DEBUG_MESSAGE("ObjRegistry::Find(objName,className)",2)
    long index=-1;
+   {
+      lock_guard<mutex> lock(mIndexMutex);
+      if((!mIndexIsValid) || (mIndexNameChange!=gObjNameChangeCounter)) this->BuildIndex();
+      typename std::unordered_map<string,long>::const_iterator pos=mvNameIndex.find(objName);
+      if(pos!=mvNameIndex.end())
+         if((pos->second<this->GetNb()) && (mvpRegistry[pos->second]->GetName()==objName)
+            && (className==mvpRegistry[pos->second]->GetClassName())) return pos->second;
+   }
    //bool error=false;
    for(long i=this->GetNb()-1;i>=0;i--)
       if( mvpRegistry[i]->GetName() == objName)
@@ -1097,22 +1196,28 @@ template<class T> long ObjRegistry<T>::Find(const string &objName,
 template<class T> long ObjRegistry<T>::Find(const T &obj) const
 {
    VFN_DEBUG_MESSAGE("ObjRegistry::Find(&obj)",2)
-   for(long i=this->GetNb()-1;i>=0;i--)
-      if( mvpRegistry[i]== &obj)  return i;
-   //:TODO: throw something
-   return -1;
+   return this->Find(&obj);
 }
 
 template<class T> long ObjRegistry<T>::Find(const T *pobj) const
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) return pIsolated->Find(pobj);
    VFN_DEBUG_MESSAGE("ObjRegistry::Find(&obj)",2)
-   for(long i=this->GetNb()-1;i>=0;i--)
-      if( mvpRegistry[i]== pobj)  return i;
+   lock_guard<mutex> lock(mIndexMutex);
+   if(!mIndexIsValid) this->BuildIndex();
+   typename std::unordered_map<const T*,long>::const_iterator pos=mvPtrIndex.find(pobj);
+   if(pos!=mvPtrIndex.end()) return pos->second;
    //:TODO: throw something
    return -1;
 }
 
-template<class T> const RefinableObjClock& ObjRegistry<T>::GetRegistryClock()const{return mListClock;}
+template<class T> const RefinableObjClock& ObjRegistry<T>::GetRegistryClock()const
+{
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) return pIsolated->GetRegistryClock();
+   return mListClock;
+}
 
 template<class T> void ObjRegistry<T>::AutoUpdateUI(const bool autoup)
 {
@@ -1132,29 +1237,89 @@ template<class T> void ObjRegistry<T>::UpdateUI()
 
 template<class T> std::size_t ObjRegistry<T>::size() const
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) return pIsolated->size();
    return (std::size_t) mvpRegistry.size();
 }
 
 template<class T> typename vector<T*>::const_iterator ObjRegistry<T>::begin() const
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) return pIsolated->begin();
    return mvpRegistry.begin();
 }
 
 template<class T> typename vector<T*>::const_iterator ObjRegistry<T>::end() const
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) return pIsolated->end();
    return mvpRegistry.end();
 }
 
 template<class T> typename list<T*>::const_iterator ObjRegistry<T>::list_begin() const
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) return pIsolated->list_begin();
    return mvpRegistryList.begin();
 }
 
 template<class T> typename list<T*>::const_iterator ObjRegistry<T>::list_end() const
 {
+   ObjRegistry<T> *pIsolated=this->GetIsolatedRegistry();
+   if(pIsolated!=0) return pIsolated->list_end();
    return mvpRegistryList.end();
 }
 
+template<class T> void ObjRegistry<T>::BuildIndex()const
+{// mIndexMutex must be locked
+   VFN_DEBUG_MESSAGE("ObjRegistry::BuildIndex():"<<mName,2)
+   mvNameIndex.clear();
+   mvPtrIndex.clear();
+   for(long i=0;i<this->GetNb();i++)
+   {
+      mvNameIndex[mvpRegistry[i]->GetName()]=i;
+      mvPtrIndex[mvpRegistry[i]]=i;
+   }
+   mIndexIsValid=true;
+   mIndexNameChange=gObjNameChangeCounter;
+}
+
+template<class T> ObjRegistry<T>* ObjRegistry<T>::GetIsolatedRegistry()const
+{
+   if(!mIsGlobal) return 0;
+   ObjRegistryIsolation *pIsolation=ObjRegistryIsolation::GetCurrent();
+   if(pIsolation==0) return 0;
+   return &(pIsolation->GetRegistry(*this));
+}
+
+//######################################################################
+//    ObjRegistryIsolation
+//######################################################################
+/// The isolation scope of the current thread, if any
+static thread_local ObjRegistryIsolation *spObjRegistryIsolation=0;
+
+ObjRegistryIsolation::ObjRegistryIsolation():
+mpPrevious(spObjRegistryIsolation)
+{
+   VFN_DEBUG_MESSAGE("ObjRegistryIsolation::ObjRegistryIsolation()",5)
+   spObjRegistryIsolation=this;
+}
+
+ObjRegistryIsolation::~ObjRegistryIsolation()
+{
+   VFN_DEBUG_MESSAGE("ObjRegistryIsolation::~ObjRegistryIsolation()",5)
+   spObjRegistryIsolation=mpPrevious;
+}
+
+ObjRegistryIsolation* ObjRegistryIsolation::GetCurrent(){return spObjRegistryIsolation;}
+
+ObjRegistryIsolation* ObjRegistryIsolation::SetCurrent(ObjRegistryIsolation *pIsolation)
+{
+   ObjRegistryIsolation *pPrevious=spObjRegistryIsolation;
+   spObjRegistryIsolation=pIsolation;
+   return pPrevious;
+}
+
 #ifdef __WX__CRYST__
 template<class T> WXRegistry<T>* ObjRegistry<T>::WXCreate(wxWindow *parent)
 {
@@ -1207,11 +1372,12 @@ void GetSubRefObjListClockRecursive(ObjRegistry<RefinableObj> &reg,RefinableObjC
 //    RefinableObj
 //######################################################################
 
-ObjRegistry<RefinableObj> gRefinableObjRegistry("Global RefinableObj registry");
-ObjRegistry<RefinableObj> gTopRefinableObjRegistry("Global Top RefinableObj registry");
+ObjRegistry<RefinableObj> gRefinableObjRegistry("Global RefinableObj registry",true);
+ObjRegistry<RefinableObj> gTopRefinableObjRegistry("Global Top RefinableObj registry",true);
 
 RefinableObj::RefinableObj():
 mName(""),
+mRefParIndexIsValid(true),mRefParIndexNameChange(gObjNameChangeCounter),
 mNbRefParNotFixed(-1),mOptimizationDepth(0),mDeleteRefParInDestructor(true)
 #ifdef __WX__CRYST__
 ,mpWXCrystObj(0)
@@ -1226,6 +1392,7 @@ mNbRefParNotFixed(-1),mOptimizationDepth(0),mDeleteRefParInDestructor(true)
 }
 RefinableObj::RefinableObj(const bool internalUseOnly):
 mName(""),
+mRefParIndexIsValid(true),mRefParIndexNameChange(gObjNameChangeCounter),
 mNbRefParNotFixed(-1),mOptimizationDepth(0),mDeleteRefParInDestructor(true)
 #ifdef __WX__CRYST__
 ,mpWXCrystObj(0)
@@ -1239,7 +1406,9 @@ mNbRefParNotFixed(-1),mOptimizationDepth(0),mDeleteRefParInDestructor(true)
    VFN_DEBUG_MESSAGE("RefinableObj::RefinableObj(bool):End",2)
 }
 
-RefinableObj::RefinableObj(const RefinableObj &old) {}
+RefinableObj::RefinableObj(const RefinableObj &old):
+mRefParIndexIsValid(true),mRefParIndexNameChange(gObjNameChangeCounter)
+{}
 /*
 RefinableObj::RefinableObj(const RefinableObj &old):
 mName(old.mName),mMaxNbRefPar(old.mMaxNbRefPar),mSavedValuesSetIsUsed(mMaxNbSavedSets),
@@ -1289,6 +1458,7 @@ const string& RefinableObj::GetName() const {return mName;}
 void RefinableObj::SetName(const string &name)
 {
    VFN_DEBUG_MESSAGE("RefinableObj::SetName()to :"<<name,6)
+   if(mName!=name) ++gObjNameChangeCounter;
    mName=name;
    mSubObjRegistry.SetName("Registry for sub-objects of "+mName);
 }
@@ -1348,6 +1518,9 @@ void RefinableObj::SetParIsFixed(const long parIndex,const bool fix)
 
 void RefinableObj::SetParIsFixed(const string& name,const bool fix)
 {
+   const long idx=this->FindParIndex(name);
+   if(idx>=0) this->GetPar(idx).SetIsFixed(fix);
+   if(idx!=-2) return;
    for(long i=this->GetNbPar()-1;i>=0;i--)
       if( this->GetPar(i).GetName() == name)
          this->GetPar(i).SetIsFixed(fix);
@@ -1367,6 +1540,9 @@ void RefinableObj::SetParIsFixed(const RefParType *type,const bool fix)
 
 void RefinableObj::SetParIsUsed(const string& name,const bool use)
 {
+   const long idx=this->FindParIndex(name);
+   if(idx>=0) this->GetPar(idx).SetIsUsed(use);
+   if(idx!=-2) return;
    for(long i=this->GetNbPar()-1;i>=0;i--)
       if( this->GetPar(i).GetName() == name)
          this->GetPar(i).SetIsUsed(use);
@@ -1467,6 +1643,10 @@ void RefinableObj::AddPar(const RefinablePar &newRefPar)
 
    mvpRefPar.push_back(new RefinablePar(newRefPar));
    mvpRefPar.back()->SetName(name);
+   {
+      lock_guard<mutex> lock(mRefParIndexMutex);
+      this->AddRefParToIndex(mvpRefPar.size()-1);
+   }
    mRefParListClock.Click();
 }
 
@@ -1484,6 +1664,10 @@ void RefinableObj::AddPar(RefinablePar *newRefPar)
       }
    mvpRefPar.push_back(newRefPar);
    mvpRefPar.back()->SetName(name);
+   {
+      lock_guard<mutex> lock(mRefParIndexMutex);
+      this->AddRefParToIndex(mvpRefPar.size()-1);
+   }
    mRefParListClock.Click();
 }
 
@@ -1508,6 +1692,7 @@ vector<RefinablePar *>::iterator RefinableObj::RemovePar(RefinablePar *refPar)
       throw ObjCrystException("RefinableObj::RemovePar():"+refPar->GetName()
                               +"is not in this object:"+this->GetName());
    }
+   mRefParIndexIsValid=false;
    return mvpRefPar.erase(pos);
 }
 
@@ -1622,6 +1807,9 @@ const string& RefinableObj::GetParamSetName(const unsigned long id)const
 
 void RefinableObj::SetLimitsAbsolute(const string &name,const REAL min,const REAL max)
 {
+   const long idx=this->FindParIndex(name);
+   if(idx>=0) this->GetPar(idx).SetLimitsAbsolute(min,max);
+   if(idx!=-2) return;
    for(long i=this->GetNbPar()-1;i>=0;i--)
       if( this->GetPar(i).GetName() == name)
          this->GetPar(i).SetLimitsAbsolute(min,max);
@@ -1637,6 +1825,9 @@ void RefinableObj::SetLimitsAbsolute(const RefParType *type,
 }
 void RefinableObj::SetLimitsRelative(const string &name, const REAL min, const REAL max)
 {
+   const long idx=this->FindParIndex(name);
+   if(idx>=0) this->GetPar(idx).SetLimitsRelative(min,max);
+   if(idx!=-2) return;
    for(long i=this->GetNbPar()-1;i>=0;i--)
       if( this->GetPar(i).GetName() == name)
          this->GetPar(i).SetLimitsRelative(min,max);
@@ -1656,6 +1847,9 @@ void RefinableObj::SetLimitsRelative(const RefParType *type,
 }
 void RefinableObj::SetLimitsProportional(const string &name,const REAL min,const REAL max)
 {
+   const long idx=this->FindParIndex(name);
+   if(idx>=0) this->GetPar(idx).SetLimitsProportional(min,max);
+   if(idx!=-2) return;
    for(long i=this->GetNbPar()-1;i>=0;i--)
       if( this->GetPar(i).GetName() == name)
          this->GetPar(i).SetLimitsProportional(min,max);
@@ -1745,6 +1939,12 @@ for(int i=0;i<mSubObjRegistry.GetNb();i++)
       mSubObjRegistry.GetObj(i).SetApproximationFlag(allow);
 }
 
+void RefinableObj::SetResolutionFactor(const REAL factor)
+{
+   for(int i=0;i<mSubObjRegistry.GetNb();i++)
+      mSubObjRegistry.GetObj(i).SetResolutionFactor(factor);
+}
+
 void RefinableObj::RandomizeConfiguration()
 {
    VFN_DEBUG_ENTRY("RefinableObj::RandomizeConfiguration():"<<mName,5)
@@ -1815,6 +2015,8 @@ REAL RefinableObj::GetLogLikelihood()const
    return loglike;
 }
 
+unsigned int RefinableObj::GetLogLikelihoodTier()const{return 0;}
+
 // std::map<RefinablePar*, REAL>& RefinableObj::GetLogLikelihood_FullDeriv(std::set<RefinablePar *> &vPar)
 // {
 //    //TODO
@@ -1877,6 +2079,7 @@ void RefinableObj::ResetParList()
       }
       mvpRefPar.clear();
    }
+   mRefParIndexIsValid=false;
    mNbRefParNotFixed=-1;
 
    VFN_DEBUG_MESSAGE("RefinableObj::ResetParList():Deleting Saved Sets....",2)
@@ -1994,14 +2197,8 @@ void RefinableObj::UpdateDisplay()const
 
 long RefinableObj::FindPar(const string &name) const
 {
-   long index=-1;
-   bool warning=false;
-   for(long i=this->GetNbPar()-1;i>=0;i--)
-      if( this->GetPar(i).GetName() == name)
-      {
-         if(-1 != index) warning=true ;else index=i;
-      }
-   if(true == warning)
+   const long index=this->FindParIndex(name);
+   if(-2 == index)
    {
       throw ObjCrystException("RefinableObj::FindPar("+name+"): found duplicate refinable variable name in object:"+this->GetName());
    }
@@ -2010,19 +2207,51 @@ long RefinableObj::FindPar(const string &name) const
 
 long RefinableObj::FindPar(const REAL *p) const
 {
-   long index=-1;
-   bool warning=false;
-   for(long i=this->GetNbPar()-1;i>=0;i--)
-      if( p == mvpRefPar[i]->mpValue ) //&(this->GetPar(i).GetValue())
-      {
-         if(-1 != index) warning=true ;else index=i;
-      }
-   if(true == warning)
+   lock_guard<mutex> lock(mRefParIndexMutex);
+   if((!mRefParIndexIsValid) || (mRefParIndexNameChange!=gObjNameChangeCounter))
+      this->BuildRefParIndex();
+   unordered_map<const REAL*,long>::const_iterator pos=mvRefParValueIndex.find(p);
+   if(pos==mvRefParValueIndex.end()) return -1;
+   if(-2 == pos->second)
    {
       throw ObjCrystException("RefinableObj::FindPar(*p): Found duplicate parameter in object:"+this->GetName());
    }
+   return pos->second;
+}
 
-   return index;
+long RefinableObj::FindParIndex(const string &name) const
+{
+   lock_guard<mutex> lock(mRefParIndexMutex);
+   if((!mRefParIndexIsValid) || (mRefParIndexNameChange!=gObjNameChangeCounter))
+      this->BuildRefParIndex();
+   unordered_map<string,long>::const_iterator pos=mvRefParNameIndex.find(name);
+   if(pos==mvRefParNameIndex.end()) return -1;
+   return pos->second;
+}
+
+void RefinableObj::BuildRefParIndex() const
+{// mRefParIndexMutex must be locked
+   VFN_DEBUG_MESSAGE("RefinableObj::BuildRefParIndex():"<<this->GetName(),2)
+   mvRefParNameIndex.clear();
+   mvRefParValueIndex.clear();
+   mRefParIndexIsValid=true;
+   mRefParIndexNameChange=gObjNameChangeCounter;
+   for(long i=0;i<this->GetNbPar();i++) this->AddRefParToIndex(i);
+}
+
+void RefinableObj::AddRefParToIndex(const long i) const
+{// mRefParIndexMutex must be locked
+   if((!mRefParIndexIsValid) || (mRefParIndexNameChange!=gObjNameChangeCounter))
+   {// Out of date, will be rebuilt at the next search
+      mRefParIndexIsValid=false;
+      return;
+   }
+   pair<unordered_map<string,long>::iterator,bool> posn=
+      mvRefParNameIndex.insert(make_pair(mvpRefPar[i]->GetName(),i));
+   if(!posn.second) posn.first->second=-2;
+   pair<unordered_map<const REAL*,long>::iterator,bool> posv=
+      mvRefParValueIndex.insert(make_pair((const REAL*)(mvpRefPar[i]->mpValue),i));
+   if(!posv.second) posv.first->second=-2;
 }
 
 void RefinableObj::AddSubRefObj(RefinableObj &obj)
@@ -31,6 +31,12 @@
 #include <list>
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <functional>
 
 #include "ObjCryst/CrystVector/CrystVector.h"
 #include "ObjCryst/ObjCryst/General.h"
@@ -171,7 +177,9 @@ class RefinableObjClock
    private:
       bool HasParent(const RefinableObjClock &) const;
       unsigned long mTick0, mTick1;
-      static unsigned long msTick0,msTick1;
+      /// Global event counter. This is atomic so that objects can be used
+      /// in different threads (each object being used by only one thread).
+      static std::atomic<unsigned long> msTick0,msTick1;
       /// List of 'child' clocks, which will click this clock whenever they are clicked.
       std::set<const RefinableObjClock*> mvChild;
       /// List of parent clocks, which will be clicked whenever this one is. This
@@ -180,6 +188,14 @@ class RefinableObjClock
       mutable std::set<RefinableObjClock*> mvParent;
 };
 
+/// Number of times an object or a refinable parameter has been renamed (using SetName()).
+///
+/// ObjRegistry and RefinableObj keep hash indices of names to avoid linear
+/// searches. Since objects and parameters can be renamed after they have
+/// been registered, these indices are rebuilt (at the next search) whenever this
+/// counter has changed. This is purely internal.
+extern std::atomic<unsigned long> gObjNameChangeCounter;
+
 /** Restraint: generic class for a restraint of a given model. This
 * defines only the category (RefParType) of restraint, and the function
 * to access the log(likelihood) associated to this restraint and the current model.
@@ -328,8 +344,11 @@ class RefinablePar:public Restraint
 
          /** \brief Current value of parameter, scaled if necessary (for angles) to a
          * human-understandable value.
+         *
+         * This is returned by value (not a reference to an internal buffer),
+         * so it can safely be called from several threads.
          */
-         const REAL& GetHumanValue() const;
+         REAL GetHumanValue() const;
 
          /** \brief Current value of parameter, scaled if necessary (for angles) to a
          * human-understandable value.
@@ -646,6 +665,16 @@ template<class T> class ObjRegistry
    public:
       ObjRegistry();
       ObjRegistry(const string &name);
+      /** Constructor
+      *
+      * \param global: if true, this is one of the global registries (gCrystalRegistry,
+      * gRefinableObjRegistry,...). In a thread where an ObjRegistryIsolation object exists,
+      * a global registry is transparently replaced by a registry private to that thread.
+      */
+      ObjRegistry(const string &name,const bool global);
+      /// Copy constructor. The copy lists the same objects, but it is not a global
+      /// registry and it is not displayed in the user interface.
+      ObjRegistry(const ObjRegistry<T> &old);
       ~ObjRegistry();
       /// Register a new object. Already registered objects are skipped.
       void Register(T &obj);
@@ -689,21 +718,19 @@ template<class T> class ObjRegistry
       void Print()const;
       void SetName(const string &);
       const string& GetName()const;
-      /// Find the number of an object in the registry from its name (slow !)
-      /// The search starts at the *end* of the registry.
+      /// Find the number of an object in the registry from its name.
+      /// If several objects have the same name, the last one registered is returned.
       long Find(const string &objName)const;
-      /// Find the number of an object in the registry from its name (slow !)
-      /// The search starts at the *end* of the registry.
+      /// Find the number of an object in the registry from its name.
+      /// If several objects have the same name, the last one registered is returned.
       /// Also check the class of the object (inheritance...).
       /// use nothrow=true to avoid having an exception thrown if no object
       /// is found (instead the index returned will be -1)
       long Find(const string &objName, const string& className,
                 const bool nothrow=false)const;
       /// Find the number of an object in the registry
-      /// The search starts at the *end* of the registry.
       long Find(const T &obj)const;
       /// Find the number of an object in the registry
-      /// The search starts at the *end* of the registry.
       long Find(const T *pobj)const;
       /// Last time an object was added or removed from the registry
       const RefinableObjClock& GetRegistryClock()const;
@@ -744,11 +771,30 @@ template<class T> class ObjRegistry
        */
       typename std::list<T*>::const_iterator list_end() const;
    private:
+      /// \internal Rebuild the hash indices of object names and addresses
+      void BuildIndex()const;
+      /// \internal For a global registry, the registry replacing it in the current
+      /// thread (see ObjRegistryIsolation), or null.
+      ObjRegistry<T>* GetIsolatedRegistry()const;
+      /// Is this a global registry (see ObjRegistryIsolation) ?
+      bool mIsGlobal;
       /// The registry of objects
       vector<T*> mvpRegistry;
       /// Another view of the registry of objects - this time as a std::list, which
       /// will not be invalidated if one object is deleted
       std::list<T*> mvpRegistryList;
+      /// Hash index of the object names, giving the position in mvpRegistry.
+      /// For duplicate names, the last registered object is indexed.
+      mutable std::unordered_map<string,long> mvNameIndex;
+      /// Hash index of the object addresses, giving the position in mvpRegistry.
+      mutable std::unordered_map<const T*,long> mvPtrIndex;
+      /// Are the hash indices in sync with mvpRegistry ?
+      mutable bool mIndexIsValid;
+      /// Value of gObjNameChangeCounter when mvNameIndex was last built.
+      mutable unsigned long mIndexNameChange;
+      /// Protects the hash indices, which are rebuilt by the const Find() functions,
+      /// possibly from several threads.
+      mutable std::mutex mIndexMutex;
       /// Name of this registry
       string mName;
       /// Last time an object was added or removed
@@ -771,6 +817,74 @@ template<class T> class ObjRegistry
    #endif
 };
 
+/** \brief Private global registries for the current thread.
+*
+* All ObjCryst++ objects are listed in global registries (gRefinableObjRegistry,
+* gTopRefinableObjRegistry, gCrystalRegistry, gPowderPatternRegistry...), which are
+* also used to find objects by name, e.g. when loading an XML file. While an
+* ObjRegistryIsolation object exists, these global registries are replaced, \e only
+* for the thread which created it, by new and empty registries. Other threads still
+* use the normal global registries.
+*
+* This allows to create, refine and destroy independent sets of objects in
+* several threads at the same time (see BatchRefinement), without any interference
+* between the threads' registries. Objects created in an isolated thread must be
+* destroyed before the ObjRegistryIsolation object, and must not be shared with
+* other threads. Read-only data (tabulated functions, scattering factor tables,
+* space group tables) is still shared.
+*
+* Isolation scopes can be nested, the innermost one being used.
+*
+* Threads started by the library on behalf of an isolated thread (parallel
+* log-likelihood and simplex evaluation, Le Bail extraction, file loaders, XML
+* autosave...) must be created with StartThread(), so that they use the same
+* isolation scope as their parent thread.
+*/
+class ObjRegistryIsolation
+{
+   public:
+      ObjRegistryIsolation();
+      ~ObjRegistryIsolation();
+      /// \internal Get the registry replacing a global registry in this scope.
+      /// It is created when first needed.
+      template<class T> ObjRegistry<T>& GetRegistry(const ObjRegistry<T> &global)
+      {
+         std::lock_guard<std::mutex> lock(mMutex);
+         std::shared_ptr<void> &p=mvRegistry[&global];
+         if(!p) p=std::shared_ptr<void>(new ObjRegistry<T>(global.GetName()));
+         return *static_cast<ObjRegistry<T>*>(p.get());
+      }
+      /// The current isolation scope for the calling thread, or null.
+      static ObjRegistryIsolation* GetCurrent();
+      /** Start a thread running f(args...) (as std::thread(f,args...) would),
+      * which uses the isolation scope of the calling thread, if any.
+      *
+      * The thread must be joined before the calling thread's isolation scope
+      * is destroyed.
+      */
+      template<class F,class... Args> static std::thread StartThread(F f,Args... args)
+      {
+         return std::thread(&ObjRegistryIsolation::RunInScope<F,Args...>,GetCurrent(),f,args...);
+      }
+   private:
+      /// \internal Set the isolation scope of the calling thread, return the previous one
+      static ObjRegistryIsolation* SetCurrent(ObjRegistryIsolation *pIsolation);
+      /// \internal Run f(args...) in the given isolation scope (see StartThread)
+      template<class F,class... Args> static void RunInScope(ObjRegistryIsolation *pIsolation,
+                                                             F f,Args... args)
+      {
+         ObjRegistryIsolation *pPrevious=SetCurrent(pIsolation);
+         std::bind(f,args...)();
+         SetCurrent(pPrevious);
+      }
+      /// The private registries, indexed by the address of the global registry
+      std::map<const void*,std::shared_ptr<void> > mvRegistry;
+      /// Protects mvRegistry, which may be used from the threads sharing this scope
+      std::mutex mMutex;
+      /// The isolation scope which was active when this one was created
+      ObjRegistryIsolation *mpPrevious;
+};
+
 /** \brief Generic Refinable Object
 *
 * This is basically a list of refinable parameters, with other basic common properties
@@ -1031,6 +1145,19 @@ class RefinableObj
       * Also see:
       */
       virtual void SetApproximationFlag(const bool allow);
+      /** Restrict the data used during a global optimization to a fraction of its
+      * full resolution, for faster (but coarser) likelihood calculations.
+      *
+      * For diffraction data this multiplies the maximum sin(theta)/lambda (or
+      * the highest one reached by the data, if lower), so only the first (sorted)
+      * reflections and pattern points are used. The full resolution is used
+      * for factor=1. Objects which have no data ignore
+      * this, and the base RefinableObj only calls this function for all sub-objects.
+      *
+      * \note This is only meant to be used by optimization algorithms, and the
+      * likelihood values obtained for different factors cannot be compared.
+      */
+      virtual void SetResolutionFactor(const REAL factor);
 
       /// Randomize Configuration (before a global optimization). This
       /// Affects only parameters which are limited and not fixed.
@@ -1081,6 +1208,15 @@ class RefinableObj
          * object to give the optimized likelihood (possibly with user options).
          */
          virtual REAL GetLogLikelihood()const;
+         /** Cost tier of GetLogLikelihood(), used for delayed acceptance during
+         * Monte-Carlo optimizations (see MonteCarloObj).
+         *
+         * Tier 0 (the default) is for cheap terms like restraints or the
+         * bump-merge cost, and higher tiers for expensive terms like the cost
+         * of diffraction data, which are computed only if the new configuration
+         * has passed the Metropolis test on the lower tiers.
+         */
+         virtual unsigned int GetLogLikelihoodTier()const;
          /* Get log(likelihood) and all its first derivative versus a list of parameters.
          *
          *  \return: a map, with a RefinablePar pointer as key, and as value the corresponding
@@ -1241,10 +1377,20 @@ class RefinableObj
       /// Access to the integer address of this object, for unique identification from python
       size_t int_ptr() const;
    protected:
-      /// Find a refinable parameter with a given name
+      /// Find a refinable parameter with a given name (-1 if not found).
+      /// An exception is thrown if several parameters have the same name.
       long FindPar(const string &name) const;
-      /// Find a refinable parameter from the adress of its value
+      /// Find a refinable parameter from the adress of its value (-1 if not found).
+      /// An exception is thrown if several parameters share the same value.
       long FindPar(const REAL*) const;
+      /// \internal Find a refinable parameter with a given name from the hash index,
+      /// without throwing an exception. Returns -1 if the parameter is not found,
+      /// and -2 if several parameters have that name.
+      long FindParIndex(const string &name) const;
+      /// \internal Rebuild the hash indices of parameter names and value addresses.
+      void BuildRefParIndex() const;
+      /// \internal Add the parameter #i to the hash indices, if they are up-to-date.
+      void AddRefParToIndex(const long i) const;
 
       /// \internal Add an object in the registry of used objects.
       void AddSubRefObj(RefinableObj &);
@@ -1264,6 +1410,19 @@ class RefinableObj
       // Parameters
          /// Vector of pointers to the refinable parameters
          vector<RefinablePar *> mvpRefPar;
+         /// Hash index of parameter names, giving the position in mvpRefPar
+         /// (-2 if several parameters have the same name).
+         mutable std::unordered_map<string,long> mvRefParNameIndex;
+         /// Hash index of parameter value addresses, giving the position in mvpRefPar
+         /// (-2 if several parameters share the same value).
+         mutable std::unordered_map<const REAL*,long> mvRefParValueIndex;
+         /// Are the parameter hash indices in sync with mvpRefPar ?
+         mutable bool mRefParIndexIsValid;
+         /// Value of gObjNameChangeCounter when the parameter indices were last built.
+         mutable unsigned long mRefParIndexNameChange;
+         /// Protects the parameter hash indices, which are rebuilt by the const
+         /// FindPar() functions, possibly from several threads.
+         mutable std::mutex mRefParIndexMutex;
       // Restraints
          /// Vector of pointers to the restraints for this object. This excludes
          /// all RefinablePar declared in RefinableObj::mpRefPar, which also
@@ -20,6 +20,8 @@
 *  source file for Conjugate Gradient Algorithm object
 *
 */
+#include <thread>
+#include <random>
 #include "ObjCryst/RefinableObj/Simplex.h"
 #include "ObjCryst/Quirks/VFNStreamFormat.h"
 
@@ -31,29 +33,63 @@ OptimizationObj(name)
 }
 void SimplexObj::Optimize(long &nbSteps,const bool silent,const REAL finalcost,
                           const REAL maxTime)
+{
+   this->OptimizeSimplex(nbSteps,silent,true);
+}
+REAL SimplexObj::OptimizeSimplex(long &nbSteps,const bool silent,const bool useWorkers)
 {
    VFN_DEBUG_ENTRY("SimplexObj::Optimize()",10)
+   TAU_PROFILE("SimplexObj::Optimize()","REAL (long&,bool,bool)",TAU_DEFAULT);
    for(int i=0;i<mRefinedObjList.GetNb();i++) mRefinedObjList.GetObj(i).BeginOptimization(true);
    this->PrepareRefParList();
    const unsigned long n=mRefParList.GetNbParNotFixed();
+   const bool parallel=useWorkers && (mvpWorker.size()>0);
+   if(parallel)
+   {
+      mWorkerPool.Start(mvpWorker.size());
+      for(vector<SimplexObj*>::iterator pos=mvpWorker.begin();pos!=mvpWorker.end();++pos)
+      {
+         for(int i=0;i<(*pos)->mRefinedObjList.GetNb();i++)
+            (*pos)->mRefinedObjList.GetObj(i).BeginOptimization(true);
+         (*pos)->PrepareRefParList();
+      }
+      for(vector<SimplexObj*>::iterator pos=mvpWorker.begin();pos!=mvpWorker.end();++pos)
+         if((unsigned long)((*pos)->mRefParList.GetNbParNotFixed())!=n)
+         {
+            const string name=(*pos)->GetName();
+            for(int i=0;i<mRefinedObjList.GetNb();i++) mRefinedObjList.GetObj(i).EndOptimization();
+            for(vector<SimplexObj*>::iterator w=mvpWorker.begin();w!=mvpWorker.end();++w)
+               for(int i=0;i<(*w)->mRefinedObjList.GetNb();i++) (*w)->mRefinedObjList.GetObj(i).EndOptimization();
+            mWorkerPool.Stop();
+            VFN_DEBUG_EXIT("SimplexObj::Optimize(): worker with a different number of parameters",10)
+            throw ObjCrystException("SimplexObj::Optimize(): worker "+name
+                                    +" does not have the same number of parameters");
+         }
+   }
    // Create the n+1 set of parameters (n+1 vertices for the initial simplex)
    // To obtain the n new vertices we just move from the starting point
    // by the amount of the declared global optimization step.
-      CrystVector_long vIndex(n+1);
-      vIndex(0)=mRefParList.CreateParamSet();
-      CrystVector_REAL vLLK(n+1);
-      vLLK(0)=this->GetLogLikelihood();
+      vector<CrystVector_REAL> vx(n+1);
+      this->GetConfiguration(vx[0]);
       for(unsigned long i=0;i<n;i++)
       {
-         vIndex(0)=mRefParList.CreateParamSet();
          mRefParList.GetParNotFixed(i).
             Mutate(mRefParList.GetParNotFixed(i).GetGlobalOptimStep()*100.0);
-         vIndex(i+1)=mRefParList.CreateParamSet();
-         vLLK(i+1)=this->GetLogLikelihood();
-         mRefParList.RestoreParamSet(vIndex(0));
+         this->GetConfiguration(vx[i+1]);
+         mRefParList.GetParNotFixed(i).MutateTo(vx[0](i));
       }
+      CrystVector_REAL vLLK(n+1);
+      this->EvaluateConfigurations(vx,vLLK,parallel);
    unsigned long best=0,worst=0,nextworst=0;
-   for(;nbSteps>=0;--nbSteps)
+   // Candidate configurations: reflection of the worst vertex, expansion and
+   // contraction of the reflected vertex, contraction of the worst vertex.
+   // Without workers, they are computed only when needed. With workers, the
+   // reflection is computed together with the next candidates which may be needed.
+   vector<CrystVector_REAL> vCandidate(4);
+   CrystVector_REAL vCandidateLLK(4);
+   bool vCandidateDone[4];
+   CrystVector_REAL center(n);
+   for(;(nbSteps>=0)&&(n>0);--nbSteps)
    {
       // determine best, worst and next worst points
          if(vLLK(0)>vLLK(1)){worst=0;nextworst=1;}
@@ -69,16 +105,15 @@ void SimplexObj::Optimize(long &nbSteps,const bool silent,const REAL finalcost,
             else if((vLLK(i)>vLLK(nextworst)) && (i!=worst)) nextworst=i;
          }
       {
-         CrystVector_REAL center(n);
          center = 0.0;
          for(unsigned long i=0;i<=n;i++)
          {
             if(i==worst) continue;
-            center += mRefParList.GetParamSet(vIndex(i));
+            center += vx[i];
          }
          center /= (REAL)n;
          CrystVector_REAL worstdiff;
-         worstdiff=mRefParList.GetParamSet(vIndex(worst));
+         worstdiff=vx[worst];
          worstdiff-=center;
          for(unsigned long i=0;i<n;i++) worstdiff(i)/=mRefParList.GetParNotFixed(i).GetGlobalOptimStep();
 
@@ -87,42 +122,97 @@ void SimplexObj::Optimize(long &nbSteps,const bool silent,const REAL finalcost,
                          <<", Worst diff="<<abs(worstdiff.min())+abs(worstdiff.max())<<endl;
          if((abs(worstdiff.min())+abs(worstdiff.max()))<0.01) break;
       }
-      #if 0
-      cout<<FormatHorizVector<REAL>(vLLK)<<endl;
-      cout<<FormatVertVector<REAL>(mRefParList.GetParamSet(vIndex(best)),
-                                   mRefParList.GetParamSet(vIndex(worst)),
-                                   mRefParList.GetParamSet(vIndex(nextworst)),
-                                   mRefParList.GetParamSet(vIndex(6)),
-                                   mRefParList.GetParamSet(vIndex(8)),
-                                   mRefParList.GetParamSet(vIndex(10)))<<endl;
-      #endif
-      mRefParList.RestoreParamSet(vIndex(best));
-      REAL llktry=this->GenerateNewSimplexConfiguration(vLLK,vIndex,worst,-1.0);
-      if(llktry<=vLLK(best))
-         llktry=this->GenerateNewSimplexConfiguration(vLLK,vIndex,worst,2.0);
-      else if(llktry>=vLLK(nextworst))
+      // The candidates. Limits are applied to the reflected vertex, from which
+      // the expansion and contraction are computed.
+      {
+         vCandidate[0].resize(n);
+         for(unsigned long i=0;i<n;i++) vCandidate[0](i)=center(i)-(vx[worst](i)-center(i));
+         this->SetConfiguration(vCandidate[0]);
+         const REAL vf[4]={-1.0,2.0,0.5,0.5};
+         for(unsigned int k=1;k<4;k++)
+         {
+            const CrystVector_REAL *pFrom= k==3 ? &(vx[worst]) : &(vCandidate[0]);
+            vCandidate[k].resize(n);
+            for(unsigned long i=0;i<n;i++) vCandidate[k](i)=center(i)+vf[k]*((*pFrom)(i)-center(i));
+            this->SetConfiguration(vCandidate[k]);
+         }
+         for(unsigned int k=0;k<4;k++) vCandidateDone[k]=false;
+         if(parallel)
+         {
+            const unsigned long nb= mvpWorker.size()+1<4 ? mvpWorker.size()+1 : 4;
+            vector<CrystVector_REAL> vx1(vCandidate.begin(),vCandidate.begin()+nb);
+            CrystVector_REAL vllk1;
+            this->EvaluateConfigurations(vx1,vllk1,true);
+            for(unsigned int k=0;k<nb;k++)
+            {
+               vCandidateLLK(k)=vllk1(k);
+               vCandidateDone[k]=true;
+            }
+         }
+      }
+      if(!vCandidateDone[0])
+      {
+         this->SetConfiguration(vCandidate[0]);
+         vCandidateLLK(0)=this->GetLogLikelihood();
+         vCandidateDone[0]=true;
+      }
+      // Try a new configuration: if it is better than the worst vertex, it replaces it
+      unsigned int candidate=0;
+      REAL llktry=vCandidateLLK(0);
+      const bool reflected= llktry<vLLK(worst);
+      if(reflected)
+      {
+         vx[worst]=vCandidate[0];
+         vLLK(worst)=llktry;
+      }
+      if(llktry<=vLLK(best)) candidate=1;
+      else if(llktry>=vLLK(nextworst)) candidate= reflected ? 2 : 3;
+      if(candidate>0)
       {
          const REAL llksave=vLLK(worst);
-         llktry=this->GenerateNewSimplexConfiguration(vLLK,vIndex,worst,0.5);
-         if(llktry>=llksave)
+         if(!vCandidateDone[candidate])
+         {
+            this->SetConfiguration(vCandidate[candidate]);
+            vCandidateLLK(candidate)=this->GetLogLikelihood();
+            vCandidateDone[candidate]=true;
+         }
+         llktry=vCandidateLLK(candidate);
+         if(llktry<vLLK(worst))
          {
-            CrystVector_REAL *p0=&(mRefParList.GetParamSet(vIndex(best)));
+            vx[worst]=vCandidate[candidate];
+            vLLK(worst)=llktry;
+         }
+         if((candidate>1) && (llktry>=llksave))
+         {// Contraction failed, shrink the simplex around the best vertex
+            vector<CrystVector_REAL> vShrink;
             for(unsigned long i=0;i<=n;i++)
             {
                if(i==best) continue;
-               CrystVector_REAL *pi=&(mRefParList.GetParamSet(vIndex(i)));
-               for(unsigned long j=0;j<n;j++)
-                  {(*pi)(j) = 0.5*((*p0)(j) + (*pi)(j));}
-               mRefParList.RestoreParamSet(vIndex(i));
-               vLLK(i)=this->GetLogLikelihood();
+               for(unsigned long j=0;j<n;j++) vx[i](j) = 0.5*(vx[best](j) + vx[i](j));
+               this->SetConfiguration(vx[i]);
+               vShrink.push_back(vx[i]);
+            }
+            CrystVector_REAL vllk1;
+            this->EvaluateConfigurations(vShrink,vllk1,parallel);
+            for(unsigned long i=0,j=0;i<=n;i++)
+            {
+               if(i==best) continue;
+               vLLK(i)=vllk1(j++);
             }
          }
       }
    }
-   mRefParList.RestoreParamSet(vIndex(best));
-   mRefParList.EraseAllParamSet();
+   for(unsigned long i=0;i<=n;i++) if(vLLK(i)<vLLK(best)) best=i;
+   this->SetConfiguration(vx[best]);
    for(int i=0;i<mRefinedObjList.GetNb();i++) mRefinedObjList.GetObj(i).EndOptimization();
+   if(parallel)
+   {
+      mWorkerPool.Stop();
+      for(vector<SimplexObj*>::iterator pos=mvpWorker.begin();pos!=mvpWorker.end();++pos)
+         for(int i=0;i<(*pos)->mRefinedObjList.GetNb();i++) (*pos)->mRefinedObjList.GetObj(i).EndOptimization();
+   }
    VFN_DEBUG_EXIT("SimplexObj::Optimize()",10)
+   return vLLK(best);
 }
 void SimplexObj::MultiRunOptimize(long &nbCycle,long &nbSteps,const bool silent,
                                     const REAL finalcost,const REAL maxTime)
@@ -136,41 +226,151 @@ void SimplexObj::MultiRunOptimize(long &nbCycle,long &nbSteps,const bool silent,
       if(!silent) cout <<"SimplexObj::MultiRunOptimize: Finished Run#"<<abs(float(nbCycle))<<endl;
    }
 }
+REAL SimplexObj::MultiStartOptimize(const unsigned int nbStart,const long nbSteps,const bool silent,
+                                    const REAL amplitude,const unsigned long seed)
+{
+   VFN_DEBUG_ENTRY("SimplexObj::MultiStartOptimize()",10)
+   TAU_PROFILE("SimplexObj::MultiStartOptimize()","REAL (...)",TAU_DEFAULT);
+   if(nbStart==0) throw ObjCrystException("SimplexObj::MultiStartOptimize(): no run !");
+   // The starting points are generated in the main thread
+   this->PrepareRefParList();
+   const unsigned long n=mRefParList.GetNbParNotFixed();
+   CrystVector_REAL x0;
+   this->GetConfiguration(x0);
+   vector<CrystVector_REAL> vStart(nbStart,x0);
+   for(unsigned int k=1;k<nbStart;k++)
+   {
+      std::mt19937 rng(seed+k);
+      std::uniform_real_distribution<REAL> dist(-1.0,1.0);
+      for(unsigned long i=0;i<n;i++)
+         vStart[k](i)+=amplitude*100*mRefParList.GetParNotFixed(i).GetGlobalOptimStep()*dist(rng);
+      this->SetConfiguration(vStart[k]);
+   }
+   this->SetConfiguration(x0);
+   // Distribute runs between this object and workers
+   vector<SimplexObj*> vpObj(1,this);
+   for(vector<SimplexObj*>::iterator pos=mvpWorker.begin();pos!=mvpWorker.end();++pos)
+   {
+      if(vpObj.size()>=nbStart) break;
+      (*pos)->PrepareRefParList();
+      if((unsigned long)((*pos)->mRefParList.GetNbParNotFixed())!=n)
+         throw ObjCrystException("SimplexObj::MultiStartOptimize(): worker "+(*pos)->GetName()
+                                 +" does not have the same number of parameters");
+      vpObj.push_back(*pos);
+   }
+   vector<CrystVector_REAL> vResult(nbStart);
+   CrystVector_REAL vLLK(nbStart);
+   vector<exception_ptr> vException(vpObj.size());
+   vector<thread> vThread;
+   for(unsigned long i=1;i<vpObj.size();i++)
+      vThread.push_back(ObjRegistryIsolation::StartThread(&SimplexObj::OptimizeStartRange,
+                               vpObj[i],&vStart,&vResult,&vLLK,
+                               i,vpObj.size(),nbSteps,&(vException[i])));
+   this->OptimizeStartRange(&vStart,&vResult,&vLLK,0,vpObj.size(),nbSteps,&(vException[0]));
+   for(vector<thread>::iterator pos=vThread.begin();pos!=vThread.end();++pos) pos->join();
+   for(vector<exception_ptr>::const_iterator pos=vException.begin();pos!=vException.end();++pos)
+      if(*pos) rethrow_exception(*pos);
+   unsigned int best=0;
+   for(unsigned int k=0;k<nbStart;k++)
+   {
+      if(!silent) cout<<"SimplexObj::MultiStartOptimize: Run#"<<k<<", cost="<<vLLK(k)<<endl;
+      if(vLLK(k)<vLLK(best)) best=k;
+   }
+   this->PrepareRefParList();
+   this->SetConfiguration(vResult[best]);
+   if(!silent) cout<<"SimplexObj::MultiStartOptimize: best run#"<<best<<", cost="<<vLLK(best)<<endl;
+   VFN_DEBUG_EXIT("SimplexObj::MultiStartOptimize()",10)
+   return vLLK(best);
+}
+void SimplexObj::AddWorker(SimplexObj &worker)
+{
+   if(&worker==this) throw ObjCrystException("SimplexObj::AddWorker(): cannot use itself as a worker");
+   mvpWorker.push_back(&worker);
+}
+void SimplexObj::ClearWorkers(){mvpWorker.clear();}
 void SimplexObj::XMLOutput(ostream &os,int indent)const
 {
 }
 void SimplexObj::XMLInput(istream &is,const XMLCrystTag &tag)
 {
 }
-REAL SimplexObj::GenerateNewSimplexConfiguration(CrystVector_REAL &vLLK,
-                                                 CrystVector_long &vIndex,
-                                                 unsigned long worst,
-                                                 REAL f)
+void SimplexObj::SetConfiguration(CrystVector_REAL &x)
 {
-   // Compute center of vertices
    const unsigned long n=mRefParList.GetNbParNotFixed();
-   const unsigned long iworst=vIndex(worst);
-   CrystVector_REAL center(n);
-   center = 0.0;
-   for(unsigned long i=0;i<=n;i++)
+   for(unsigned long i=0;i<n;i++)
    {
-      if(i==worst) continue;
-      center += mRefParList.GetParamSet(vIndex(i));
+      mRefParList.GetParNotFixed(i).MutateTo(x(i));
+      x(i)=mRefParList.GetParNotFixed(i).GetValue();
    }
-   center /= (REAL)n;
-   for(unsigned long i=0;i<n;i++)
+}
+void SimplexObj::GetConfiguration(CrystVector_REAL &x)const
+{
+   const unsigned long n=mRefParList.GetNbParNotFixed();
+   x.resize(n);
+   for(unsigned long i=0;i<n;i++) x(i)=mRefParList.GetParNotFixed(i).GetValue();
+}
+/// Computes the log(likelihood) of configurations, split between a SimplexObj
+/// (part 0) and its workers (part i>0), in the threads of SimplexObj::mWorkerPool.
+class SimplexObj::EvaluateConfigurationTask:public WorkerPoolTask
+{
+   public:
+      EvaluateConfigurationTask(SimplexObj &obj,const vector<CrystVector_REAL> &vx,CrystVector_REAL &vLLK):
+      mObj(obj),mvx(vx),mvLLK(vLLK)
+      {}
+      virtual void Run(const unsigned int i,const unsigned int nb)
+      {
+         SimplexObj *pObj= i==0 ? &mObj : mObj.mvpWorker[i-1];
+         pObj->EvaluateConfigurationRange(mvx,mvLLK,i,nb);
+      }
+   private:
+      SimplexObj &mObj;
+      const vector<CrystVector_REAL> &mvx;
+      CrystVector_REAL &mvLLK;
+};
+
+void SimplexObj::EvaluateConfigurations(const vector<CrystVector_REAL> &vx,CrystVector_REAL &vLLK,
+                                        const bool useWorkers)
+{
+   const unsigned long nb=vx.size();
+   vLLK.resize(nb);
+   if(!useWorkers)
    {
-      mRefParList.GetParNotFixed(i)
-         .MutateTo(center(i)+f*(mRefParList.GetParamSet(iworst)(i)-center(i)));
+      this->EvaluateConfigurationRange(vx,vLLK,0,1);
+      return;
+   }
+   EvaluateConfigurationTask task(*this,vx,vLLK);
+   mWorkerPool.Run(task,nb);
+}
+void SimplexObj::EvaluateConfigurationRange(const vector<CrystVector_REAL> &vx,CrystVector_REAL &vLLK,
+                                            unsigned long first,const unsigned long step)
+{
+   const unsigned long n=mRefParList.GetNbParNotFixed();
+   for(;first<vx.size();first+=step)
+   {
+      for(unsigned long i=0;i<n;i++) mRefParList.GetParNotFixed(i).MutateTo(vx[first](i));
+      vLLK(first)=this->GetLogLikelihood();
+   }
+}
+void SimplexObj::OptimizeStartRange(const vector<CrystVector_REAL> *pvStart,
+                                    vector<CrystVector_REAL> *pvResult,CrystVector_REAL *pvLLK,
+                                    unsigned long first,const unsigned long step,const long nbSteps,
+                                    exception_ptr *pException)
+{
+   try
+   {
+      for(;first<pvStart->size();first+=step)
+      {
+         CrystVector_REAL x=(*pvStart)[first];
+         this->SetConfiguration(x);
+         long nb=nbSteps;
+         (*pvLLK)(first)=this->OptimizeSimplex(nb,true,false);
+         this->GetConfiguration((*pvResult)[first]);
+      }
    }
-   const REAL llk=this->GetLogLikelihood();
-   //cout<<"New,f="<<f<<",worst="<<worst<<":"<<llk<<endl;
-   if(llk<vLLK(worst))
+   catch(...)
    {
-      vLLK(worst)=llk;
-      mRefParList.SaveParamSet(iworst);
+      *pException=current_exception();
    }
-   return llk;
 }
 #ifdef __WX__CRYST__
 WXCrystObjBasic* SimplexObj::WXCreate(wxWindow*)
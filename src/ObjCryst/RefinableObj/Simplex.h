@@ -25,6 +25,7 @@
 #define _SIMPLEX_H
 
 #include "ObjCryst/RefinableObj/GlobalOptimObj.h"
+#include <exception>
 
 namespace ObjCryst
 {
@@ -42,16 +43,74 @@ class SimplexObj:public OptimizationObj
                             const REAL maxTime=-1);
       virtual void MultiRunOptimize(long &nbCycle,long &nbSteps,const bool silent=false,
                                     const REAL finalcost=0,const REAL maxTime=-1);
+      /** Run independent simplex optimizations from different starting points,
+      * and keep the best result.
+      *
+      * The first run starts from the current configuration, and the others from
+      * the current configuration with each parameter moved randomly by up to
+      * amplitude*100*(global optimization step), i.e. the size of the initial simplex.
+      * Runs are distributed between this object and its workers (see AddWorker()),
+      * which are used in parallel. The random starting points only depend on the
+      * seed and the run index, so the result does not depend on the number of workers.
+      *
+      * \param nbStart: the number of runs
+      * \param nbSteps: the maximum number of steps for each run
+      * \param seed: seed used to generate the random starting points
+      * \return the log(likelihood) of the best configuration, which is restored
+      */
+      REAL MultiStartOptimize(const unsigned int nbStart,const long nbSteps,const bool silent=false,
+                              const REAL amplitude=1,const unsigned long seed=0);
+      /** Add a worker, used to compute log(likelihood) in parallel.
+      *
+      * The worker must optimize copies of the objects optimized by this SimplexObj,
+      * so that it has the same parameters, in the same order, and gives the same
+      * log(likelihood) for the same parameters. During Optimize(), the reflection,
+      * expansion and contraction candidates and the vertices of the initial and
+      * shrunk simplex are then computed in parallel (one thread for this object
+      * and one for each worker), with the same result as without workers.
+      *
+      * The worker is not owned by this object, and must not be used by another
+      * thread during the optimization.
+      */
+      void AddWorker(SimplexObj &worker);
+      /// Remove all workers
+      void ClearWorkers();
       virtual void XMLOutput(ostream &os,int indent=0)const;
       virtual void XMLInput(istream &is,const XMLCrystTag &tag);
    private:
-      /// Try a new configuration by expanding the worst vertex from the
-      /// center by a factor f. If it is better, store it as new worst.
-      /// Return the new obtained llk
-      REAL GenerateNewSimplexConfiguration(CrystVector_REAL &vLLK,
-                                           CrystVector_long &vIndex,
-                                           unsigned long worst,
-                                           REAL f);
+      /// The simplex optimization.
+      /// \param useWorkers: if false, the workers are not used (they are used for multi-start runs)
+      /// \return the log(likelihood) of the best configuration
+      REAL OptimizeSimplex(long &nbSteps,const bool silent,const bool useWorkers);
+      /// Set the not-fixed parameters (this takes into account limits and periodicity),
+      /// and get back their actual value in x.
+      void SetConfiguration(CrystVector_REAL &x);
+      /// Get the current values of the not-fixed parameters
+      void GetConfiguration(CrystVector_REAL &x)const;
+      /** Compute the log(likelihood) of a list of configurations of the not-fixed parameters,
+      * using this object and the workers in parallel (if useWorkers is true).
+      *
+      * The configurations must already take into account limits (see SetConfiguration()).
+      * When this returns, the parameters of this object are set to the last configuration.
+      */
+      void EvaluateConfigurations(const vector<CrystVector_REAL> &vx,CrystVector_REAL &vLLK,
+                                  const bool useWorkers);
+      /// Compute the log(likelihood) for configurations first, first+step,...
+      /// (used to distribute configurations between workers).
+      void EvaluateConfigurationRange(const vector<CrystVector_REAL> &vx,CrystVector_REAL &vLLK,
+                                      unsigned long first,const unsigned long step);
+      class EvaluateConfigurationTask;
+      /// Run simplex optimizations from starting points first, first+step,...
+      /// and store the resulting configurations and log(likelihood) (used by MultiStartOptimize()).
+      /// Any exception is stored in pException.
+      void OptimizeStartRange(const vector<CrystVector_REAL> *pvStart,
+                              vector<CrystVector_REAL> *pvResult,CrystVector_REAL *pvLLK,
+                              unsigned long first,const unsigned long step,const long nbSteps,
+                              exception_ptr *pException);
+      /// Workers, to evaluate configurations in parallel
+      vector<SimplexObj*> mvpWorker;
+      /// Threads used with the workers, running during OptimizeSimplex()
+      WorkerPool mWorkerPool;
    #ifdef __WX__CRYST__
    public:
       // :TODO: This should not be required !
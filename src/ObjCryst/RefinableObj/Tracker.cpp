@@ -19,6 +19,10 @@
 *  source file ObjCryst++ Tracker class
 *
 */
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
 #include "ObjCryst/RefinableObj/Tracker.h"
 
 using namespace std;
@@ -31,7 +35,7 @@ namespace ObjCryst
 //
 ////////////////////////////////////////////////////////////////////////
 Tracker::Tracker(const string &name)
-:mName(name)
+:mName(name),mpMainTracker(0),mColumn(0)
 {}
 
 Tracker::~Tracker()
@@ -39,25 +43,62 @@ Tracker::~Tracker()
 
 const string& Tracker::GetName()const{return mName;}
 void Tracker::AppendValue(const long n)
-{mvValues[n]=this->ReadValue();}
+{
+   mvTrial.push_back(n);
+   mvValue.push_back(this->ReadValue());
+   mClockValues.Click();
+}
 
 void Tracker::Clear()
 {
+   mvTrial.clear();
+   mvValue.clear();
    mvValues.clear();
+   mClockValues.Click();
 }
 
-const std::map<long,REAL>& Tracker::GetValues()const{return mvValues;}
-std::map<long,REAL>& Tracker::GetValues(){return mvValues;}
-
+const std::map<long,REAL>& Tracker::GetValues()const
+{
+   if(0!=mpMainTracker)
+   {
+      if(mpMainTracker->GetClockValues()>mClockValuesMap)
+      {
+         mpMainTracker->GetTrackerValues(mColumn,mvValues);
+         mClockValuesMap.Click();
+      }
+   }
+   else if(mClockValues>mClockValuesMap)
+   {
+      mvValues.clear();
+      for(unsigned long i=0;i<mvTrial.size();++i) mvValues[mvTrial[i]]=mvValue[i];
+      mClockValuesMap.Click();
+   }
+   return mvValues;
+}
 
+std::map<long,REAL>& Tracker::GetValues()
+{
+   const Tracker *t=this;
+   t->GetValues();
+   return mvValues;
+}
 
 ////////////////////////////////////////////////////////////////////////
 //
 //    MainTracker
 //
 ////////////////////////////////////////////////////////////////////////
+/// Number of rows allocated at once
+static const unsigned long sTrackerChunkNbRow=4096;
+/// Number of rows buffered before they are passed to the export thread
+static const unsigned long sTrackerExportNbRow=1024;
+/// Maximum number of rows waiting for the export thread
+static const unsigned long sTrackerExportMaxNbRow=64*sTrackerExportNbRow;
 
-MainTracker::MainTracker()
+MainTracker::MainTracker():
+mNbRow(0),mStorageMode(TRACKER_STORE_ALL),mMaxNbRow(100000),mNbAppend(0),mDecimation(1),
+mRandomState(88172645463325252ULL),mExportNewHeader(false),mExportStop(false),mExportBinary(false),
+mExportPaused(false),mExportAppend(false)
 {
    #ifdef __WX__CRYST__
    mpWXTrackerGraph=0;
@@ -66,6 +107,7 @@ MainTracker::MainTracker()
 
 MainTracker::~MainTracker()
 {
+   this->StopExport();
    #ifdef __WX__CRYST__
    this->WXDelete();
    #endif
@@ -73,15 +115,67 @@ MainTracker::~MainTracker()
 }
 void MainTracker::AddTracker(Tracker *t)
 {
-   mvpTracker.insert(t);
+   if(mvpTracker.insert(t).second)
+   {
+      t->mpMainTracker=this;
+      t->mColumn=mvpTrackerColumn.size();
+      mvpTrackerColumn.push_back(t);
+      mvRow.resize(mvpTrackerColumn.size());
+      this->ExportHeader();
+   }
    mClockTrackerList.Click();
    this->UpdateDisplay();
 }
 
 void MainTracker::AppendValues(const long nb)
 {
-   for(std::set<Tracker*>::iterator pos=mvpTracker.begin(); pos!=mvpTracker.end();++pos)
-      (*pos)->AppendValue(nb);
+   const unsigned int nbcol=mvpTrackerColumn.size();
+   REAL *p=mvRow.data();
+   for(std::vector<Tracker*>::iterator pos=mvpTrackerColumn.begin(); pos!=mvpTrackerColumn.end();++pos)
+      *p++ = (*pos)->ReadValue();
+   ++mNbAppend;
+   switch(mStorageMode)
+   {
+      case TRACKER_STORE_ALL:
+      {
+         this->StoreRow(nb,mvRow.data(),nbcol);
+         break;
+      }
+      case TRACKER_STORE_DECIMATE:
+      {
+         if(((mNbAppend-1)%mDecimation)!=0) break;
+         if(mNbRow>=mMaxNbRow) this->Decimate();
+         this->StoreRow(nb,mvRow.data(),nbcol);
+         break;
+      }
+      case TRACKER_STORE_RESERVOIR:
+      {
+         if(mNbRow<mMaxNbRow)
+         {
+            this->StoreRow(nb,mvRow.data(),nbcol);
+            break;
+         }
+         // xorshift64*
+         mRandomState^=mRandomState>>12;
+         mRandomState^=mRandomState<<25;
+         mRandomState^=mRandomState>>27;
+         const unsigned long row=(unsigned long)((mRandomState*2685821657736338717ULL)%mNbAppend);
+         if(row>=mNbRow) break;
+         unsigned long chunk,i;
+         this->LocateRow(row,chunk,i);
+         Chunk *c=&mvChunk[chunk];
+         if(c->mNbCol!=nbcol) break;// Recorded before a tracker was added
+         c->mvTrial[i]=nb;
+         for(unsigned int j=0;j<nbcol;++j) c->mvValue[i*nbcol+j]=mvRow[j];
+         break;
+      }
+   }
+   if(mExportThread.joinable()||mExportPaused)
+   {// Rows are passed to the export thread in batches
+      mvExportPendingTrial.push_back(nb);
+      mvExportPendingValue.insert(mvExportPendingValue.end(),mvRow.begin(),mvRow.end());
+      if((mvExportPendingTrial.size()>=sTrackerExportNbRow)&&!mExportPaused) this->ExportFlush();
+   }
    mClockValues.Click();
 }
 
@@ -90,7 +184,15 @@ void MainTracker::ClearTrackers()
    std::set<Tracker*>::iterator pos;
    for(pos=mvpTracker.begin();pos!=mvpTracker.end();++pos) delete *pos;
    mvpTracker.clear();
+   mvpTrackerColumn.clear();
+   mvRow.clear();
+   mvChunk.clear();
+   mNbRow=0;
+   mNbAppend=0;
+   mDecimation=1;
+   this->ExportHeader();
    mClockTrackerList.Click();
+   mClockValues.Click();
    this->UpdateDisplay();
 }
 
@@ -98,31 +200,291 @@ void MainTracker::ClearValues()
 {
    std::set<Tracker*>::iterator pos;
    for(pos=mvpTracker.begin();pos!=mvpTracker.end();++pos) (*pos)->Clear();
+   mvChunk.clear();
+   mNbRow=0;
+   mNbAppend=0;
+   mDecimation=1;
    mClockValues.Click();
    this->UpdateDisplay();
 }
 
 void MainTracker::SaveAll(std::ostream &os)const
 {
-   std::set<Tracker*>::const_iterator posT,posT0;
    os<<"#Trial ";
-   for(posT=mvpTracker.begin();posT!=mvpTracker.end();++posT) os<<(*posT)->GetName()<<" ";
+   for(std::vector<Tracker*>::const_iterator posT=mvpTrackerColumn.begin();posT!=mvpTrackerColumn.end();++posT)
+      os<<(*posT)->GetName()<<" ";
    os<<endl;
 
-   posT0=mvpTracker.begin();
-   std::map<long,REAL>::const_iterator pos0,pos;
-   for(pos0=(*posT0)->GetValues().begin();pos0!=(*posT0)->GetValues().end();++pos0)
+   // Rows are only out of order with reservoir sampling
+   std::vector<std::pair<long,unsigned long> > vRow;
+   vRow.reserve(mNbRow);
+   for(unsigned long i=0;i<mNbRow;++i) vRow.push_back(std::make_pair(this->GetRowTrial(i),i));
+   if(mStorageMode==TRACKER_STORE_RESERVOIR) std::sort(vRow.begin(),vRow.end());
+
+   for(std::vector<std::pair<long,unsigned long> >::const_iterator pos=vRow.begin();pos!=vRow.end();++pos)
+   {
+      os<<pos->first<<" ";
+      for(unsigned int j=0;j<mvpTrackerColumn.size();j++) os<<this->GetRowValue(pos->second,j)<<" ";
+      os<<endl;
+   }
+}
+
+void MainTracker::SetStorageMode(const TrackerStorageMode mode,const unsigned long maxNbRow)
+{
+   mStorageMode=mode;
+   mMaxNbRow=maxNbRow;
+   if(mMaxNbRow<2) mMaxNbRow=2;
+   this->ClearValues();
+}
+
+TrackerStorageMode MainTracker::GetStorageMode()const{return mStorageMode;}
+
+unsigned long MainTracker::GetNbRow()const{return mNbRow;}
+
+long MainTracker::GetRowTrial(const unsigned long row)const
+{
+   unsigned long chunk,i;
+   this->LocateRow(row,chunk,i);
+   return mvChunk[chunk].mvTrial[i];
+}
+
+REAL MainTracker::GetRowValue(const unsigned long row,const unsigned int tracker)const
+{
+   unsigned long chunk,i;
+   this->LocateRow(row,chunk,i);
+   const Chunk *c=&mvChunk[chunk];
+   if(tracker>=c->mNbCol) return -1;
+   return c->mvValue[i*c->mNbCol+tracker];
+}
+
+void MainTracker::StartExport(const std::string &filename,const bool binary)
+{
+   this->StopExport();
+   mExportFileName=filename;
+   mExportBinary=binary;
+   mExportStop=false;
+   mExportAppend=false;
+   mvExportTrial.clear();
+   mvExportValue.clear();
+   mvExportPendingTrial.clear();
+   mvExportPendingValue.clear();
+   mExportThread=std::thread(&MainTracker::ExportLoop,this);
+   this->ExportHeader();
+}
+
+void MainTracker::StopExport()
+{
+   if(mExportPaused) this->ResumeExport();
+   if(!mExportThread.joinable()) return;
+   this->ExportFlush();
    {
-      const long k=pos0->first;
-      os<<k<<" ";
-      for(posT=mvpTracker.begin();posT!=mvpTracker.end();posT++)
+      std::unique_lock<std::mutex> lock(mExportMutex);
+      mExportStop=true;
+      mExportCond.notify_all();
+   }
+   mExportThread.join();
+}
+
+void MainTracker::PauseExport()
+{
+   if(!mExportThread.joinable()) return;
+   this->StopExport();
+   mExportPaused=true;
+}
+
+void MainTracker::ResumeExport()
+{
+   if(!mExportPaused) return;
+   mExportPaused=false;
+   mExportStop=false;
+   mExportAppend=true;
+   mExportThread=std::thread(&MainTracker::ExportLoop,this);
+   this->ExportFlush();
+}
+
+bool MainTracker::IsExporting()const{return mExportThread.joinable()||mExportPaused;}
+
+void MainTracker::StoreRow(const long trial,const REAL *values,const unsigned int nbCol)
+{
+   if(  (mvChunk.size()==0) || (mvChunk.back().mNbCol!=nbCol)
+      ||(mvChunk.back().mNbRow==sTrackerChunkNbRow))
+   {
+      mvChunk.push_back(Chunk());
+      Chunk *c=&mvChunk.back();
+      c->mFirstRow=mNbRow;
+      c->mNbCol=nbCol;
+      c->mNbRow=0;
+      c->mvTrial.resize(sTrackerChunkNbRow);
+      c->mvValue.resize(sTrackerChunkNbRow*nbCol);
+   }
+   Chunk *c=&mvChunk.back();
+   c->mvTrial[c->mNbRow]=trial;
+   REAL *p=c->mvValue.data()+c->mNbRow*nbCol;
+   for(unsigned int j=0;j<nbCol;++j) *p++ = *values++;
+   c->mNbRow++;
+   mNbRow++;
+}
+
+void MainTracker::LocateRow(const unsigned long row,unsigned long &chunk,unsigned long &pos)const
+{
+   if(row>=mNbRow) throw ObjCrystException("MainTracker::LocateRow(): row index out of range");
+   // Binary search for the last chunk with mFirstRow<=row
+   unsigned long i0=0,i1=mvChunk.size();
+   while((i1-i0)>1)
+   {
+      const unsigned long i=(i0+i1)/2;
+      if(mvChunk[i].mFirstRow<=row) i0=i;
+      else i1=i;
+   }
+   chunk=i0;
+   pos=row-mvChunk[i0].mFirstRow;
+}
+
+void MainTracker::Decimate()
+{
+   std::vector<Chunk> vChunk;
+   vChunk.swap(mvChunk);
+   mNbRow=0;
+   unsigned long n=0;
+   for(std::vector<Chunk>::const_iterator pos=vChunk.begin();pos!=vChunk.end();++pos)
+      for(unsigned long i=0;i<pos->mNbRow;++i)
+         if((n++%2)==0)
+            this->StoreRow(pos->mvTrial[i],pos->mvValue.data()+i*pos->mNbCol,pos->mNbCol);
+   mDecimation*=2;
+}
+
+void MainTracker::GetTrackerValues(const unsigned int col,std::map<long,REAL> &values)const
+{
+   values.clear();
+   for(std::vector<Chunk>::const_iterator pos=mvChunk.begin();pos!=mvChunk.end();++pos)
+   {
+      if(col>=pos->mNbCol) continue;
+      for(unsigned long i=0;i<pos->mNbRow;++i)
+         values[pos->mvTrial[i]]=pos->mvValue[i*pos->mNbCol+col];
+   }
+}
+
+void MainTracker::ExportFlush()
+{
+   if(mvExportPendingTrial.size()==0) return;
+   std::unique_lock<std::mutex> lock(mExportMutex);
+   // Limit the memory used if the export thread cannot keep up: wait for it
+   while(mvExportTrial.size()>=sTrackerExportMaxNbRow) mExportCond.wait(lock);
+   if(mvExportTrial.size()==0)
+   {
+      mvExportTrial.swap(mvExportPendingTrial);
+      mvExportValue.swap(mvExportPendingValue);
+   }
+   else
+   {
+      mvExportTrial.insert(mvExportTrial.end(),mvExportPendingTrial.begin(),mvExportPendingTrial.end());
+      mvExportValue.insert(mvExportValue.end(),mvExportPendingValue.begin(),mvExportPendingValue.end());
+   }
+   mvExportPendingTrial.clear();
+   mvExportPendingValue.clear();
+   mExportCond.notify_all();
+}
+
+void MainTracker::ExportHeader()
+{
+   if(!mExportThread.joinable()) return;
+   this->ExportFlush();
+   std::unique_lock<std::mutex> lock(mExportMutex);
+   // Make sure rows for the previous list of trackers have been taken by the export thread
+   mExportCond.notify_all();
+   while((mvExportTrial.size()>0) || mExportNewHeader) mExportCond.wait(lock);
+   mvExportHeader.clear();
+   for(std::vector<Tracker*>::const_iterator pos=mvpTrackerColumn.begin();pos!=mvpTrackerColumn.end();++pos)
+      mvExportHeader.push_back((*pos)->GetName());
+   mExportNewHeader=true;
+   mExportCond.notify_all();
+}
+
+void MainTracker::ExportLoop()
+{
+   ofstream out;
+   ios::openmode mode=ios::out;
+   if(mExportBinary) mode|=ios::binary;
+   if(mExportAppend) mode|=ios::app;
+   if(!mExportBinary)
+   {
+      out.imbue(std::locale::classic());
+      out<<std::setprecision(10);
+   }
+   out.open(mExportFileName.c_str(),mode);
+   if(out.fail()) cout<<"MainTracker::ExportLoop(): cannot open "<<mExportFileName<<endl;
+   else if(mExportBinary && !mExportAppend) out.write("OBJCTRK1",8);
+   std::vector<long> vTrial;
+   std::vector<REAL> vValue;
+   std::vector<std::string> vHeader;
+   std::unique_lock<std::mutex> lock(mExportMutex);
+   // When the export is resumed, the header has already been written
+   unsigned int nbcol= mExportAppend ? mvExportHeader.size() : 0;
+   while(true)
+   {
+      if((mvExportTrial.size()==0) && !mExportNewHeader)
       {
-         pos=(*posT)->GetValues().find(k);
-         if(pos==(*posT)->GetValues().end()) os << -1.0 <<" ";
-         else os << pos->second <<" ";
+         if(mExportStop) break;
+         mExportCond.wait_for(lock,std::chrono::seconds(1));
       }
-      os<<endl;
+      vTrial.swap(mvExportTrial);
+      vValue.swap(mvExportValue);
+      const bool newHeader=mExportNewHeader;
+      if(newHeader) vHeader=mvExportHeader;
+      mExportNewHeader=false;
+      mExportCond.notify_all();
+      lock.unlock();
+      if(newHeader)
+      {
+         nbcol=vHeader.size();
+         if(mExportBinary)
+         {
+            const long long flag=-1;
+            const unsigned int nb=nbcol;
+            out.write((const char*)&flag,sizeof(flag));
+            out.write((const char*)&nb,sizeof(nb));
+            for(std::vector<std::string>::const_iterator pos=vHeader.begin();pos!=vHeader.end();++pos)
+            {
+               const unsigned int len=pos->size();
+               out.write((const char*)&len,sizeof(len));
+               out.write(pos->c_str(),len);
+            }
+         }
+         else
+         {
+            out<<"Trial";
+            for(std::vector<std::string>::const_iterator pos=vHeader.begin();pos!=vHeader.end();++pos)
+               out<<","<<*pos;
+            out<<endl;
+         }
+      }
+      for(unsigned long i=0;i<vTrial.size();++i)
+      {
+         const REAL *p=vValue.data()+i*nbcol;
+         if(mExportBinary)
+         {
+            const long long trial=vTrial[i];
+            out.write((const char*)&trial,sizeof(trial));
+            for(unsigned int j=0;j<nbcol;++j)
+            {
+               const double v=p[j];
+               out.write((const char*)&v,sizeof(v));
+            }
+         }
+         else
+         {
+            out<<vTrial[i];
+            for(unsigned int j=0;j<nbcol;++j) out<<","<<p[j];
+            out<<"\n";
+         }
+      }
+      out.flush();
+      vTrial.clear();
+      vValue.clear();
+      lock.lock();
    }
+   lock.unlock();
+   out.close();
 }
 
 const std::set<Tracker*> &MainTracker::GetTrackerList()const
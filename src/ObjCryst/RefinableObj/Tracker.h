@@ -24,8 +24,13 @@
 #define _REFINABLEOBJ_TRACKER_H_
 
 #include <set>
+#include <map>
 #include <vector>
 #include <utility>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "ObjCryst/RefinableObj/RefinableObj.h"
 
 #ifdef __WX__CRYST__
@@ -38,11 +43,16 @@ class Tracker;
 #endif
 namespace ObjCryst
 {
+class MainTracker;
 
 /** A class to track the variation of parameters as a function
 * of a number of cycles/trials.
 *
 * This is an abstract base class.
+*
+* When the Tracker belongs to a MainTracker (the usual case), the values are
+* stored by the MainTracker, for all trackers at once. Otherwise they can be
+* recorded using Tracker::AppendValue().
 */
 class Tracker
 {
@@ -50,20 +60,64 @@ class Tracker
       Tracker(const std::string &name);
       virtual ~Tracker();
       const std::string& GetName()const;
+      /// Record the current value. Only used for a Tracker which does not belong
+      /// to a MainTracker: otherwise use MainTracker::AppendValues().
       void AppendValue(const long trial);
       /// Removes all stored values
       void Clear();
+      /// Get all recorded values, as a (trial, value) map.
+      ///
+      /// The map is built from the recorded values whenever they have changed,
+      /// so avoid calling this after each trial.
       const std::map<long,REAL>& GetValues() const;
+      /// Get all recorded values, as a (trial, value) map.
+      ///
+      /// \note the map is rebuilt from the recorded values whenever they have
+      /// changed, so any modification of the map will be lost.
       std::map<long,REAL>& GetValues();
    protected:
       virtual REAL ReadValue()=0;
-      std::map<long,REAL> mvValues;
+      /// (trial,value) map, built on request from the recorded values
+      mutable std::map<long,REAL> mvValues;
       std::string mName;
+   private:
+      friend class MainTracker;
+      /// Trial numbers recorded with AppendValue()
+      std::vector<long> mvTrial;
+      /// Values recorded with AppendValue()
+      std::vector<REAL> mvValue;
+      /// Last time a value was recorded with AppendValue()
+      RefinableObjClock mClockValues;
+      /// Last time mvValues was built
+      mutable RefinableObjClock mClockValuesMap;
+      /// The MainTracker this Tracker belongs to (or null)
+      const MainTracker *mpMainTracker;
+      /// Index of this Tracker in the MainTracker
+      unsigned int mColumn;
+};
+
+/// How values are kept in memory by a MainTracker
+enum TrackerStorageMode
+{
+   /// Keep all values
+   TRACKER_STORE_ALL,
+   /// Keep at most N values: when the storage is full, every other value is
+   /// discarded and only one every 2,4,8... trial is recorded from then on.
+   TRACKER_STORE_DECIMATE,
+   /// Keep at most N values, randomly selected with a uniform probability
+   /// among all trials (reservoir sampling).
+   TRACKER_STORE_RESERVOIR
 };
 
 /** A class to hold all trackers
 *
-* All trackers need not have the same
+* Values for all trackers are stored together, as rows of (trial number,
+* value for each tracker) in pre-allocated blocks, so that recording values
+* does not require a memory allocation for each trial.
+*
+* The number of rows kept in memory can be limited (see SetStorageMode()),
+* and all values can be streamed to a file by a background thread
+* (see StartExport()), without slowing down the optimization.
 */
 class MainTracker
 {
@@ -76,8 +130,8 @@ class MainTracker
       void ClearTrackers();
       /// Removes all stored values
       void ClearValues();
-      /// Will save to a single file if all recorded trial numbers are the same
-      /// Otherwise ?
+      /// Save all values kept in memory, one row per trial (sorted by trial number).
+      /// A value of -1 is written for trackers which were added after this trial.
       void SaveAll(std::ostream &out)const;
       const std::set<Tracker*> &GetTrackerList()const;
       /// Update display, if any
@@ -86,8 +140,132 @@ class MainTracker
       const RefinableObjClock& GetClockTrackerList()const;
       /// Get last time values were whanged
       const RefinableObjClock& GetClockValues()const;
+      /** Choose how values are kept in memory.
+      *
+      * \param mode: see TrackerStorageMode
+      * \param maxNbRow: the maximum number of rows (trials) kept in memory,
+      * for TRACKER_STORE_DECIMATE and TRACKER_STORE_RESERVOIR.
+      *
+      * This clears all stored values.
+      */
+      void SetStorageMode(const TrackerStorageMode mode,const unsigned long maxNbRow=100000);
+      TrackerStorageMode GetStorageMode()const;
+      /// Number of rows (trials) currently kept in memory
+      unsigned long GetNbRow()const;
+      /// Trial number for a given row. Rows are in increasing trial order,
+      /// except for TRACKER_STORE_RESERVOIR.
+      long GetRowTrial(const unsigned long row)const;
+      /// Value for a given row and Tracker (using the order in which they
+      /// were added), or -1 if the tracker was added after this row was recorded.
+      REAL GetRowValue(const unsigned long row,const unsigned int tracker)const;
+      /** Stream all values to a file, from a background thread.
+      *
+      * All values recorded with AppendValues() from now on are written to the file,
+      * regardless of the storage mode.
+      *
+      * \param filename: name of the output file
+      * \param binary: if false, write a CSV file, with a header line giving
+      * the tracker names. If true, the file starts with an 8-byte "OBJCTRK1"
+      * signature, and is followed by header and data records, all in native
+      * byte order. A header record is: int64 -1, uint32 nbTracker, then for
+      * each tracker uint32 length and name. Each data record is an int64 trial
+      * number followed by nbTracker doubles.
+      *
+      * A new header (line or record) is written if the list of trackers changes.
+      *
+      * Rows are passed to the export thread in batches. If the file cannot be written
+      * fast enough, AppendValues() waits for the export thread, so that the number
+      * of rows waiting to be written remains bounded.
+      */
+      void StartExport(const std::string &filename,const bool binary=false);
+      /// Finish writing all values and stop the background export.
+      void StopExport();
+      /** Suspend the export: the values already recorded are written, and the
+      * export thread is stopped. New values are kept in memory until ResumeExport()
+      * is called. This must be used before fork(), as only the calling thread
+      * exists in the child process. The list of trackers must not change
+      * while the export is suspended.
+      */
+      void PauseExport();
+      /// Restart an export suspended by PauseExport(), appending to the same file.
+      void ResumeExport();
+      /// Is an export to a file running (or suspended) ?
+      bool IsExporting()const;
    private:
+      friend class Tracker;
+      /// A block of rows, each with the trial number and the values of all trackers
+      struct Chunk
+      {
+         /// Index of the first row in this chunk
+         unsigned long mFirstRow;
+         /// Number of trackers (columns) for all rows in this chunk
+         unsigned int mNbCol;
+         /// Number of rows used in this chunk
+         unsigned long mNbRow;
+         std::vector<long> mvTrial;
+         std::vector<REAL> mvValue;
+      };
+      /// Store a new row
+      void StoreRow(const long trial,const REAL *values,const unsigned int nbCol);
+      /// Find the chunk and the position in the chunk for a given row
+      void LocateRow(const unsigned long row,unsigned long &chunk,unsigned long &pos)const;
+      /// Discard every other row (TRACKER_STORE_DECIMATE)
+      void Decimate();
+      /// Fill a (trial,value) map for a given Tracker
+      void GetTrackerValues(const unsigned int col,std::map<long,REAL> &values)const;
+      /// Pass the pending rows to the export thread.
+      void ExportFlush();
+      /// Send the list of tracker names to the export thread.
+      void ExportHeader();
+      /// Background export loop.
+      void ExportLoop();
       std::set<Tracker*> mvpTracker;
+      /// Trackers in the order they were added
+      std::vector<Tracker*> mvpTrackerColumn;
+      /// Stored rows
+      std::vector<Chunk> mvChunk;
+      /// Total number of rows stored
+      unsigned long mNbRow;
+      /// Temporary storage for the current row
+      std::vector<REAL> mvRow;
+      /// Storage mode
+      TrackerStorageMode mStorageMode;
+      /// Maximum number of rows in memory (decimation & reservoir modes)
+      unsigned long mMaxNbRow;
+      /// Number of calls to AppendValues() since values were cleared
+      unsigned long mNbAppend;
+      /// Only one every mDecimation calls to AppendValues() is stored (TRACKER_STORE_DECIMATE)
+      unsigned long mDecimation;
+      /// Random number generator state (TRACKER_STORE_RESERVOIR)
+      unsigned long long mRandomState;
+      /// Background export thread
+      std::thread mExportThread;
+      /// Mutex protecting the export buffers
+      std::mutex mExportMutex;
+      /// Condition used to wake up the export thread, or wait for it
+      std::condition_variable mExportCond;
+      /// Trial numbers waiting to be written
+      std::vector<long> mvExportTrial;
+      /// Values waiting to be written
+      std::vector<REAL> mvExportValue;
+      /// Trial numbers recorded but not yet passed to the export thread
+      std::vector<long> mvExportPendingTrial;
+      /// Values recorded but not yet passed to the export thread
+      std::vector<REAL> mvExportPendingValue;
+      /// Tracker names for the next header
+      std::vector<std::string> mvExportHeader;
+      /// Does a new header need to be written ?
+      bool mExportNewHeader;
+      /// Stop the export thread when all values are written
+      bool mExportStop;
+      /// Binary or CSV export
+      bool mExportBinary;
+      /// Is the export suspended (see PauseExport()) ?
+      bool mExportPaused;
+      /// Append to the export file (when the export is resumed)
+      bool mExportAppend;
+      /// Export file name
+      std::string mExportFileName;
       /// Last time a tracker was added
       RefinableObjClock mClockTrackerList;
       /// Last time values were whanged
@@ -0,0 +1,125 @@
+/*  ObjCryst++ Object-Oriented Crystallographic Library
+    (c) 2000- Vincent Favre-Nicolin vincefn@users.sourceforge.net
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+/*
+*  source file for the WorkerPool class
+*
+*/
+#include "ObjCryst/RefinableObj/WorkerPool.h"
+#include "ObjCryst/RefinableObj/RefinableObj.h"
+#include "ObjCryst/Quirks/VFNDebug.h"
+
+using namespace std;
+
+namespace ObjCryst
+{
+WorkerPoolTask::~WorkerPoolTask(){}
+
+WorkerPool::WorkerPool():
+mpTask(0),mNbPart(0),mTaskCounter(0),mNbPending(0),mStop(false)
+{}
+
+WorkerPool::~WorkerPool()
+{
+   this->Stop();
+}
+
+void WorkerPool::Start(const unsigned int nbWorker)
+{
+   if(nbWorker==mvThread.size()) return;
+   VFN_DEBUG_MESSAGE("WorkerPool::Start():"<<nbWorker<<" worker threads",5)
+   this->Stop();
+   for(unsigned int i=1;i<=nbWorker;i++)
+      mvThread.push_back(ObjRegistryIsolation::StartThread(&WorkerPool::WorkerLoop,this,i,mTaskCounter));
+}
+
+void WorkerPool::Stop()
+{
+   if(mvThread.size()==0) return;
+   VFN_DEBUG_MESSAGE("WorkerPool::Stop()",5)
+   {
+      lock_guard<mutex> lock(mMutex);
+      mStop=true;
+   }
+   mCondTask.notify_all();
+   for(vector<thread>::iterator pos=mvThread.begin();pos!=mvThread.end();++pos) pos->join();
+   mvThread.clear();
+   mStop=false;
+}
+
+unsigned int WorkerPool::GetNbWorker()const{return mvThread.size();}
+
+void WorkerPool::Run(WorkerPoolTask &task,unsigned int nb)
+{
+   if(nb>mvThread.size()+1) nb=mvThread.size()+1;
+   if(nb<=1)
+   {
+      task.Run(0,1);
+      return;
+   }
+   {
+      lock_guard<mutex> lock(mMutex);
+      mpTask=&task;
+      mNbPart=nb;
+      mNbPending=nb-1;
+      mvException.assign(nb,exception_ptr());
+      mTaskCounter++;
+   }
+   mCondTask.notify_all();
+   try
+   {
+      task.Run(0,nb);
+   }
+   catch(...)
+   {
+      mvException[0]=current_exception();
+   }
+   unique_lock<mutex> lock(mMutex);
+   while(mNbPending>0) mCondDone.wait(lock);
+   mpTask=0;
+   for(vector<exception_ptr>::const_iterator pos=mvException.begin();pos!=mvException.end();++pos)
+      if(*pos) rethrow_exception(*pos);
+}
+
+void WorkerPool::WorkerLoop(const unsigned int i,unsigned long taskCounter)
+{
+   unique_lock<mutex> lock(mMutex);
+   while(true)
+   {
+      while((!mStop)&&(mTaskCounter==taskCounter)) mCondTask.wait(lock);
+      if(mStop) return;
+      taskCounter=mTaskCounter;
+      if(i>=mNbPart) continue;
+      WorkerPoolTask *pTask=mpTask;
+      const unsigned int nb=mNbPart;
+      lock.unlock();
+      exception_ptr e;
+      try
+      {
+         pTask->Run(i,nb);
+      }
+      catch(...)
+      {
+         e=current_exception();
+      }
+      lock.lock();
+      mvException[i]=e;
+      if(--mNbPending==0) mCondDone.notify_one();
+   }
+}
+
+}//namespace
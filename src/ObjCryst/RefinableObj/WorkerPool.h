@@ -0,0 +1,108 @@
+/*  ObjCryst++ Object-Oriented Crystallographic Library
+    (c) 2000- Vincent Favre-Nicolin vincefn@users.sourceforge.net
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+/*
+*  header file for the WorkerPool class
+*
+*/
+
+#ifndef _REFINABLEOBJ_WORKERPOOL_H_
+#define _REFINABLEOBJ_WORKERPOOL_H_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+namespace ObjCryst
+{
+/// \brief A task which can be split between the threads of a WorkerPool.
+class WorkerPoolTask
+{
+   public:
+      virtual ~WorkerPoolTask();
+      /** Do the part \b i of the task, out of \b nb parts. This is called at the
+      * same time from \b nb threads, with i=0...nb-1.
+      */
+      virtual void Run(const unsigned int i,const unsigned int nb)=0;
+};
+
+/** \brief A set of persistent worker threads.
+*
+* This is used to split a task between threads many times (e.g. for each trial
+* of an optimization), without creating and joining threads for each of them.
+* The threads are started by Start() and wait for tasks until Stop() is called.
+* The threads use the ObjRegistryIsolation scope of the thread calling Start().
+*
+* Run() and Start() must only be called by one thread at a time (the owner of the pool).
+*/
+class WorkerPool
+{
+   public:
+      WorkerPool();
+      /// Stops the worker threads
+      ~WorkerPool();
+      /// Start nbWorker worker threads, in addition to the calling thread. Any running
+      /// worker thread is stopped first, unless the number of threads is unchanged.
+      void Start(const unsigned int nbWorker);
+      /// Stop the worker threads
+      void Stop();
+      /// The number of worker threads running (not including the calling thread)
+      unsigned int GetNbWorker()const;
+      /** Run the task, split in nb parts: part 0 is run in the calling thread, and
+      * the others by the worker threads. This returns when all parts are finished.
+      *
+      * nb is limited to GetNbWorker()+1, so if no worker thread is running, the
+      * whole task is run in the calling thread (with nb=1).
+      *
+      * If a part of the task throws an exception, the first one (in the order
+      * of the parts) is rethrown after all parts are finished.
+      */
+      void Run(WorkerPoolTask &task,unsigned int nb);
+   private:
+      /// Not copyable
+      WorkerPool(const WorkerPool&);
+      WorkerPool& operator=(const WorkerPool&);
+      /// The loop of worker thread i (i>=1). taskCounter is the value of
+      /// mTaskCounter when the thread was started.
+      void WorkerLoop(const unsigned int i,unsigned long taskCounter);
+      /// The worker threads
+      std::vector<std::thread> mvThread;
+      /// Protects all the members below
+      std::mutex mMutex;
+      /// Signals a new task (or the end of the threads) to the workers
+      std::condition_variable mCondTask;
+      /// Signals the end of a part of the task to Run()
+      std::condition_variable mCondDone;
+      /// The current task
+      WorkerPoolTask *mpTask;
+      /// Number of parts of the current task
+      unsigned int mNbPart;
+      /// Incremented for each new task
+      unsigned long mTaskCounter;
+      /// Number of parts of the current task not finished by the worker threads
+      unsigned int mNbPending;
+      /// Exceptions thrown by each part of the current task
+      std::vector<std::exception_ptr> mvException;
+      /// Are the worker threads asked to stop ?
+      bool mStop;
+};
+
+}//namespace
+
+#endif //_REFINABLEOBJ_WORKERPOOL_H_
@@ -0,0 +1,532 @@
+/*  ObjCryst++ Object-Oriented Crystallographic Library
+    (c) 2000- Vincent Favre-Nicolin vincefn@users.sourceforge.net
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+/*   objcryst-bench.cpp
+*  Benchmark suite for libobjcryst. Build with "scons bench", then run:
+*
+*     objcryst-bench [--time=2] [--filter=powder] [--seed=1] [--output=bench.json] [--list]
+*
+*  Each scenario is run for (at least) the given time, and all results are written
+*  as a JSON document, to compare performance between releases.
+*/
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <functional>
+#include <boost/format.hpp>
+
+#include "ObjCryst/version.h"
+#include "ObjCryst/ObjCryst/test.h"
+#include "ObjCryst/ObjCryst/Crystal.h"
+#include "ObjCryst/ObjCryst/Atom.h"
+#include "ObjCryst/ObjCryst/Molecule.h"
+#include "ObjCryst/ObjCryst/DiffractionDataSingleCrystal.h"
+#include "ObjCryst/ObjCryst/PowderPattern.h"
+#include "ObjCryst/ObjCryst/ReflectionProfile.h"
+#include "ObjCryst/ObjCryst/PDF.h"
+#include "ObjCryst/ObjCryst/Indexing.h"
+#include "ObjCryst/ObjCryst/CIF.h"
+#include "ObjCryst/ObjCryst/IO.h"
+#include "ObjCryst/RefinableObj/IO.h"
+#include "ObjCryst/RefinableObj/LSQNumObj.h"
+#include "ObjCryst/Quirks/Chronometer.h"
+
+using namespace ObjCryst;
+using namespace std;
+
+/// Result of one benchmark scenario
+struct BenchResult
+{
+   BenchResult():mNbIteration(0),mTime(0),mValue(0){}
+   /// Number of times the benchmarked operation was performed
+   unsigned long mNbIteration;
+   /// Time (seconds) used for all iterations
+   REAL mTime;
+   /// Main figure of merit (larger is better), in mUnit
+   REAL mValue;
+   string mUnit;
+   /// Scenario parameters and secondary results, as (name, JSON value)
+   vector<pair<string,string> > mvInfo;
+   void AddInfo(const string &name,const REAL v)
+   {
+      mvInfo.push_back(make_pair(name,(boost::format("%g") % v).str()));
+   }
+   void AddInfo(const string &name,const string &v)
+   {
+      mvInfo.push_back(make_pair(name,"\""+v+"\""));
+   }
+};
+
+/// A benchmark scenario: the function gets the minimum run time in seconds
+struct Benchmark
+{
+   string mName;
+   string mDescription;
+   std::function<BenchResult(const REAL)> mFunc;
+};
+
+/// Stream buffer discarding everything, used to silence the library during benchmarks
+class NullBuffer:public streambuf
+{
+   protected:
+      virtual int overflow(int c){return c;}
+};
+
+/** Run f() repeatedly during at least minTime seconds (and at least once),
+* and record the number of iterations and the elapsed time.
+*/
+template<class F> void BenchLoop(F f,const REAL minTime,BenchResult &res,const string &unit)
+{
+   Chronometer chrono;
+   unsigned long nb=0;
+   REAL t=0;
+   do
+   {
+      f();
+      ++nb;
+      t=chrono.seconds();
+   }
+   while(t<minTime);
+   res.mNbIteration=nb;
+   res.mTime=t;
+   res.mValue=(t>0) ? nb/t : 0;
+   res.mUnit=unit;
+}
+
+/// Uniform random number in [0;1[, using rand() so that scenarios are reproducible with srand()
+static REAL BenchRand(){return rand()/(RAND_MAX+1.0);}
+
+/// Add nbAtom oxygen atoms at random positions in the crystal, using nbType scattering powers
+static void BenchAddRandomAtoms(Crystal &cryst,const unsigned int nbAtom,const unsigned int nbType,
+                                const REAL biso=1.0)
+{
+   const int nb0=cryst.GetScatteringPowerRegistry().GetNb();
+   for(unsigned int i=0;i<nbType;++i)
+      cryst.AddScatteringPower(new ScatteringPowerAtom((boost::format("O%d") % (nb0+i)).str(),"O",biso));
+   for(unsigned int i=0;i<nbAtom;++i)
+      cryst.AddScatterer(new Atom(BenchRand(),BenchRand(),BenchRand(),(boost::format("O%d") % i).str(),
+                                  &(cryst.GetScatteringPowerRegistry().GetObj(nb0+i%nbType)),1.));
+}
+
+static BenchResult BenchSpeedTest(const string &spg,const unsigned int dataType,const REAL time)
+{
+   const unsigned int nbAtom=20;
+   const unsigned long nbRefl=(dataType==0) ? 1000 : 500;
+   const SpeedTestReport rep=SpeedTest(nbAtom,2,spg,RAD_XRAY,nbRefl,dataType,time);
+   BenchResult res;
+   res.mTime=time;
+   res.mValue=rep.mBogoSPS;
+   res.mNbIteration=(unsigned long)(rep.mBogoSPS*time);
+   res.mUnit="structures/s";
+   res.AddInfo("spacegroup",spg);
+   res.AddInfo("atoms",nbAtom);
+   res.AddInfo("reflections",nbRefl);
+   res.AddInfo("bogo_mraps",rep.mBogoMRAPS);
+   res.AddInfo("bogo_mraps_reduced",rep.mBogoMRAPS_reduced);
+   return res;
+}
+
+static BenchResult BenchPowderProfile(const REAL time)
+{
+   const unsigned long nbPoint=100000;
+   Crystal cryst(9,11,15,1.5,1.65,1.55,"P21/c");
+   BenchAddRandomAtoms(cryst,20,2);
+
+   PowderPattern pattern;
+   pattern.SetWavelength(1.5406);
+   pattern.SetRadiationType(RAD_XRAY);
+   const REAL tth0=5*DEG2RAD,tth1=150*DEG2RAD;
+   pattern.SetPowderPatternPar(tth0,(tth1-tth0)/nbPoint,nbPoint);
+   CrystVector_REAL obs(nbPoint);
+   obs=1;
+   pattern.SetPowderPatternObs(obs);
+
+   PowderPatternBackground *pBackground=new PowderPatternBackground;
+   {
+      CrystVector_REAL tth(2),backgd(2);
+      tth(0)=tth0;tth(1)=tth1;
+      backgd(0)=1.;backgd(1)=9.;
+      pBackground->SetInterpPoints(tth,backgd);
+   }
+   pattern.AddPowderPatternComponent(*pBackground);
+
+   PowderPatternDiffraction *pDiff=new PowderPatternDiffraction;
+   pDiff->SetCrystal(cryst);
+   pattern.AddPowderPatternComponent(*pDiff);
+   pDiff->SetReflectionProfilePar(PROFILE_PSEUDO_VOIGT,.01*DEG2RAD*DEG2RAD,0.,0.,0.5,0);
+   pattern.Prepare();
+   pattern.GetPowderPatternCalc();
+
+   // Changing the width forces the re-computation of all reflection profiles
+   RefinablePar *pW=&(pDiff->GetProfile().GetPar("W"));
+   const REAL w0=pW->GetValue();
+   unsigned long i=0;
+   BenchResult res;
+   BenchLoop([&](){pW->SetValue(w0*(1+.01*(++i%2)));pattern.GetPowderPatternCalc();},time,res,"patterns/s");
+   res.AddInfo("points",nbPoint);
+   res.AddInfo("reflections",pDiff->GetNbRefl());
+   return res;
+}
+
+/// Zig-zag chain molecule with bond, bond angle and dihedral angle restraints
+static Molecule* BenchMakeChain(Crystal &cryst,const unsigned int nbAtom)
+{
+   ScatteringPowerAtom *pC=new ScatteringPowerAtom("C","C",1.0);
+   cryst.AddScatteringPower(pC);
+   Molecule *pMol=new Molecule(cryst,"chain");
+   for(unsigned int i=0;i<nbAtom;++i)
+      pMol->AddAtom(i*1.26,(i%2)*0.89,0.05*BenchRand(),pC,(boost::format("C%d") % i).str(),false);
+   for(unsigned int i=0;i<nbAtom-1;++i)
+      pMol->AddBond(pMol->GetAtom(i),pMol->GetAtom(i+1),1.54,.01,.02,1.,false);
+   for(unsigned int i=0;i<nbAtom-2;++i)
+      pMol->AddBondAngle(pMol->GetAtom(i),pMol->GetAtom(i+1),pMol->GetAtom(i+2),
+                         109.5*DEG2RAD,.01,.02,false);
+   for(unsigned int i=0;i<nbAtom-3;++i)
+      pMol->AddDihedralAngle(pMol->GetAtom(i),pMol->GetAtom(i+1),pMol->GetAtom(i+2),pMol->GetAtom(i+3),
+                             M_PI,.01,.02,false);
+   cryst.AddScatterer(pMol);
+   return pMol;
+}
+
+static BenchResult BenchMoleculeRestraints(const REAL time)
+{
+   const unsigned int nbAtom=50;
+   Crystal cryst(30,30,30,"P1");
+   Molecule *pMol=BenchMakeChain(cryst,nbAtom);
+   unsigned long i=0;
+   BenchResult res;
+   BenchLoop([&]()
+             {
+                const MolAtom &at=pMol->GetAtom(++i%nbAtom);
+                at.SetX(at.GetX()+.01*(BenchRand()-.5));
+                pMol->GetLogLikelihood();
+             },time,res,"evaluations/s");
+   res.AddInfo("atoms",nbAtom);
+   res.AddInfo("restraints",3*nbAtom-6);
+   return res;
+}
+
+static BenchResult BenchMoleculeMD(const REAL time)
+{
+   const unsigned int nbAtom=50,nbStep=10;
+   Crystal cryst(30,30,30,"P1");
+   Molecule *pMol=BenchMakeChain(cryst,nbAtom);
+   map<MolAtom*,XYZ> v0;
+   for(vector<MolAtom*>::iterator pos=pMol->GetAtomList().begin();pos!=pMol->GetAtomList().end();++pos)
+      v0[*pos]=XYZ(BenchRand()-.5,BenchRand()-.5,BenchRand()-.5);
+   const vector<MolBond*> vb;
+   const vector<MolBondAngle*> va;
+   const vector<MolDihedralAngle*> vd;
+   map<RigidGroup*,pair<XYZ,XYZ> > vr;
+   BenchResult res;
+   BenchLoop([&](){pMol->MolecularDynamicsEvolve(v0,nbStep,.004,vb,va,vd,vr);},time,res,"evolutions/s");
+   res.AddInfo("atoms",nbAtom);
+   res.AddInfo("steps",nbStep);
+   return res;
+}
+
+static BenchResult BenchDistTable(const REAL time)
+{
+   const unsigned int nbAtom=400;
+   Crystal cryst(30,32,34,"P21/c");
+   BenchAddRandomAtoms(cryst,nbAtom,1);
+   const ScatteringPower *pO=&(cryst.GetScatteringPowerRegistry().GetObj(0));
+   cryst.SetBumpMergeDistance(*pO,*pO,1.5);
+   cryst.GetBumpMergeCost();
+   unsigned long i=0;
+   BenchResult res;
+   BenchLoop([&]()
+             {
+                cryst.GetScatt(++i%nbAtom).SetX(BenchRand());
+                cryst.GetBumpMergeCost();
+             },time,res,"evaluations/s");
+   res.AddInfo("atoms",nbAtom);
+   res.AddInfo("symmetrics",cryst.GetSpaceGroup().GetNbSymmetrics());
+   return res;
+}
+
+static BenchResult BenchLSQ(const REAL time)
+{
+   const unsigned int nbAtom=10;
+   Crystal cryst(9,11,15,M_PI/2,1.65,M_PI/2,"P21/c");
+   BenchAddRandomAtoms(cryst,nbAtom,2);
+   DiffractionDataSingleCrystal data(cryst);
+   data.SetWavelength(0.71);
+   data.GenHKLFullSpace(0.5,true);
+   data.SetIobsToIcalc();
+   data.SetSigmaToSqrtIobs();
+   data.SetWeightToInvSigma2();
+   for(unsigned int i=0;i<nbAtom;++i) cryst.GetScatt(i).SetX(cryst.GetScatt(i).GetX()+.01);
+
+   LSQNumObj lsq;
+   lsq.SetRefinedObj(data,0,true,true);
+   lsq.PrepareRefParList(true);
+   lsq.SetParIsFixed(gpRefParTypeObjCryst,true);
+   lsq.SetParIsFixed(gpRefParTypeScattTransl,false);
+   BenchResult res;
+   BenchLoop([&](){lsq.Refine(1,true,true);},time,res,"cycles/s");
+   res.AddInfo("atoms",nbAtom);
+   res.AddInfo("reflections",data.GetNbRefl());
+   return res;
+}
+
+static BenchResult BenchPDF(const REAL time)
+{
+   const unsigned long nbR=2000;
+   Crystal cryst(4.59,4.59,2.96,"P42/mnm");
+   cryst.AddScatteringPower(new ScatteringPowerAtom("Ti","Ti",0.5));
+   cryst.AddScatteringPower(new ScatteringPowerAtom("O","O",0.8));
+   cryst.AddScatterer(new Atom(0,0,0,"Ti",&(cryst.GetScatteringPowerRegistry().GetObj(0)),1.));
+   cryst.AddScatterer(new Atom(.305,.305,0,"O",&(cryst.GetScatteringPowerRegistry().GetObj(1)),1.));
+   PDF pdf;
+   CrystVector_REAL r(nbR),obs(nbR);
+   for(unsigned long i=0;i<nbR;++i) r(i)=.5+i*.01;
+   obs=0;
+   pdf.SetPDFObs(r,obs);
+   PDFCrystal *pPhase=new PDFCrystal(pdf,cryst);
+   pdf.AddPDFPhase(*pPhase);
+   unsigned long i=0;
+   BenchResult res;
+   BenchLoop([&]()
+             {
+                cryst.GetScatt(1).SetX(.305+.001*(++i%2));
+                pdf.GetPDFCalc();
+             },time,res,"evaluations/s");
+   res.AddInfo("points",nbR);
+   return res;
+}
+
+static BenchResult BenchIndexing(const REAL time)
+{
+   PeakList peaks;
+   const float v=peaks.Simulate(0,5.21,7.93,11.31,90,101.5,90,true,20,0,0,0,false);
+   BenchResult res;
+   unsigned long nbSolution=0;
+   BenchLoop([&]()
+             {
+                CellExplorer cx(peaks,MONOCLINIC,0);
+                cx.SetLengthMinMax(4,13);
+                cx.SetAngleMinMax(90*DEG2RAD,120*DEG2RAD);
+                cx.SetVolumeMinMax(v*.8,v*1.2);
+                cx.SetD2Error(0);
+                cx.DicVol(10,4,50,4);
+                nbSolution=cx.GetSolutions().size();
+             },time,res,"runs/s");
+   res.AddInfo("peaks",20);
+   res.AddInfo("solutions",nbSolution);
+   return res;
+}
+
+static BenchResult BenchXMLLoad(const REAL time)
+{
+   const unsigned int nbAtom=200;
+   string xml;
+   {
+      Crystal cryst(9,11,15,1.5,1.65,1.55,"P21/c");
+      cryst.SetName("bench-xml");
+      BenchAddRandomAtoms(cryst,nbAtom,4);
+      stringstream ss;
+      XMLCrystTag tag("ObjCryst");
+      ss<<tag<<endl;
+      cryst.XMLOutput(ss,1);
+      tag.SetIsEndTag(true);
+      ss<<tag<<endl;
+      xml=ss.str();
+   }
+   BenchResult res;
+   BenchLoop([&]()
+             {
+                istringstream is(xml);
+                XMLCrystFileLoadAllObject(is);
+                delete &(gCrystalRegistry.GetObj(gCrystalRegistry.GetNb()-1));
+             },time,res,"files/s");
+   res.AddInfo("atoms",nbAtom);
+   res.AddInfo("bytes",xml.size());
+   return res;
+}
+
+static BenchResult BenchCIFLoad(const REAL time)
+{
+   const unsigned int nbAtom=200;
+   stringstream ss;
+   ss<<"data_bench"<<endl
+     <<"_symmetry_space_group_name_H-M   'P 1 21/c 1'"<<endl
+     <<"_cell_length_a 9.0"<<endl<<"_cell_length_b 11.0"<<endl<<"_cell_length_c 15.0"<<endl
+     <<"_cell_angle_alpha 90"<<endl<<"_cell_angle_beta 95.3"<<endl<<"_cell_angle_gamma 90"<<endl
+     <<"loop_"<<endl<<"_atom_site_label"<<endl<<"_atom_site_type_symbol"<<endl
+     <<"_atom_site_fract_x"<<endl<<"_atom_site_fract_y"<<endl<<"_atom_site_fract_z"<<endl
+     <<"_atom_site_U_iso_or_equiv"<<endl;
+   for(unsigned int i=0;i<nbAtom;++i)
+      ss<<boost::format("O%d O %.5f(3) %.5f(3) %.5f(3) 0.012(2)\n") % i % BenchRand() % BenchRand() % BenchRand();
+   const string cif=ss.str();
+   BenchResult res;
+   BenchLoop([&]()
+             {
+                istringstream is(cif);
+                CIF c(is);
+                delete CreateCrystalFromCIF(c,false);
+             },time,res,"files/s");
+   res.AddInfo("atoms",nbAtom);
+   res.AddInfo("bytes",cif.size());
+   return res;
+}
+
+static vector<Benchmark> BenchList()
+{
+   vector<Benchmark> v;
+   const char* spgs[]={"P1","P-1","P21/c","Cmma","I422","Ia-3d"};
+   for(unsigned int i=0;i<6;++i)
+   {
+      const string spg=spgs[i];
+      Benchmark b;
+      b.mName="speedtest/single-crystal/"+spg;
+      b.mDescription="SpeedTest() Monte-Carlo on single crystal data, 20 atoms, "+spg;
+      b.mFunc=[spg](const REAL t){return BenchSpeedTest(spg,0,t);};
+      v.push_back(b);
+      b.mName="speedtest/powder/"+spg;
+      b.mDescription="SpeedTest() Monte-Carlo on a powder pattern, 20 atoms, "+spg;
+      b.mFunc=[spg](const REAL t){return BenchSpeedTest(spg,1,t);};
+      v.push_back(b);
+   }
+   Benchmark b;
+   b.mName="powder/profile-100k";
+   b.mDescription="Powder pattern with all profiles re-computed, 100000 points";
+   b.mFunc=BenchPowderProfile;
+   v.push_back(b);
+   b.mName="molecule/restraints";
+   b.mDescription="Molecule restraints log-likelihood after moving one atom, 50-atom chain";
+   b.mFunc=BenchMoleculeRestraints;
+   v.push_back(b);
+   b.mName="molecule/md";
+   b.mDescription="Molecule::MolecularDynamicsEvolve(), 10 steps, 50-atom chain";
+   b.mFunc=BenchMoleculeMD;
+   v.push_back(b);
+   b.mName="crystal/disttable";
+   b.mDescription="Crystal::GetBumpMergeCost() after moving one atom, 400 atoms in a large cell";
+   b.mFunc=BenchDistTable;
+   v.push_back(b);
+   b.mName="lsq/single-crystal";
+   b.mDescription="LSQNumObj cycle refining atomic positions on single crystal data";
+   b.mFunc=BenchLSQ;
+   v.push_back(b);
+   b.mName="pdf/crystal";
+   b.mDescription="PDF calculation for TiO2, 2000 points";
+   b.mFunc=BenchPDF;
+   v.push_back(b);
+   b.mName="indexing/dicvol";
+   b.mDescription="CellExplorer::DicVol() on 20 simulated monoclinic peaks";
+   b.mFunc=BenchIndexing;
+   v.push_back(b);
+   b.mName="io/xml-load";
+   b.mDescription="Load a 200-atom Crystal from XML";
+   b.mFunc=BenchXMLLoad;
+   v.push_back(b);
+   b.mName="io/cif-load";
+   b.mDescription="Parse a 200-atom CIF and create the Crystal";
+   b.mFunc=BenchCIFLoad;
+   v.push_back(b);
+   return v;
+}
+
+int main(int argc, char* argv[])
+{
+   REAL time=2;
+   unsigned int seed=1;
+   string filter,output;
+   bool listOnly=false;
+   for(int i=1;i<argc;++i)
+   {
+      const string arg=argv[i];
+      if(arg.compare(0,7,"--time=")==0) time=atof(arg.c_str()+7);
+      else if(arg.compare(0,9,"--filter=")==0) filter=arg.substr(9);
+      else if(arg.compare(0,7,"--seed=")==0) seed=atoi(arg.c_str()+7);
+      else if(arg.compare(0,9,"--output=")==0) output=arg.substr(9);
+      else if(arg=="--list") listOnly=true;
+      else
+      {
+         cerr<<"Usage: "<<argv[0]<<" [--time=SECONDS] [--filter=SUBSTRING] [--seed=N] [--output=FILE.json] [--list]"<<endl;
+         return 1;
+      }
+   }
+   const vector<Benchmark> vBench=BenchList();
+   if(listOnly)
+   {
+      for(vector<Benchmark>::const_iterator pos=vBench.begin();pos!=vBench.end();++pos)
+         cout<<boost::format("%-32s %s") % pos->mName % pos->mDescription<<endl;
+      return 0;
+   }
+   // The library prints a lot of information, so the JSON report is
+   // only written when all benchmarks are finished.
+   ofstream fout;
+   if(output!="") fout.open(output.c_str());
+   ostream &out=(output!="") ? fout : cout;
+   NullBuffer nullBuffer;
+   streambuf *pCoutBuffer=cout.rdbuf();
+
+   stringstream json;
+   json<<"{"<<endl
+       <<"  \"library\": \"libobjcryst\","<<endl
+       <<"  \"version\": \""<<libobjcryst_version_info::version_str<<"\","<<endl
+       <<"  \"git_commit\": \""<<libobjcryst_version_info::git_commit<<"\","<<endl
+       <<"  \"min_time\": "<<time<<","<<endl
+       <<"  \"seed\": "<<seed<<","<<endl
+       <<"  \"benchmarks\": [";
+   bool first=true;
+   int nbFail=0;
+   for(vector<Benchmark>::const_iterator pos=vBench.begin();pos!=vBench.end();++pos)
+   {
+      if((filter!="") && (pos->mName.find(filter)==string::npos)) continue;
+      cerr<<boost::format("%-32s ") % pos->mName<<flush;
+      srand(seed);
+      BenchResult res;
+      string error;
+      cout.rdbuf(&nullBuffer);
+      try
+      {
+         res=pos->mFunc(time);
+      }
+      catch(const ObjCrystException &except)
+      {
+         error=except.message;
+      }
+      cout.rdbuf(pCoutBuffer);
+      json<<(first ? "\n" : ",\n")<<"    {\"name\": \""<<pos->mName<<"\"";
+      first=false;
+      if(error!="")
+      {
+         ++nbFail;
+         cerr<<"FAILED: "<<error<<endl;
+         json<<", \"error\": \"failed\"}";
+         continue;
+      }
+      cerr<<boost::format("%12.4g %s") % res.mValue % res.mUnit<<endl;
+      json<<boost::format(", \"value\": %g, \"unit\": \"%s\", \"iterations\": %d, \"time\": %g")
+            % res.mValue % res.mUnit % res.mNbIteration % res.mTime;
+      for(vector<pair<string,string> >::const_iterator p=res.mvInfo.begin();p!=res.mvInfo.end();++p)
+         json<<", \""<<p->first<<"\": "<<p->second;
+      json<<"}";
+   }
+   json<<endl<<"  ]"<<endl<<"}"<<endl;
+   out<<json.str();
+   return (nbFail>0) ? 1 : 0;
+}
@@ -901,14 +901,19 @@ namespace cctbx { namespace sgtbx {
       "Bbeb", "Bbcb"  // ambiguous: Bbab
     };
     typedef std::map<std::string, const char*> map_t;
-    static map_t adh_a38_map;
-    if (adh_a38_map.size() == 0) {
-      std::size_t n = sizeof(adh_a38_pairs) / sizeof(const char*);
-      for(int i=0;i<n;i+=2) {
-        adh_a38_map[adh_a38_pairs[i]] = adh_a38_pairs[i+1];
+    struct adh_a38_map_builder {
+      static map_t build() {
+        map_t result;
+        std::size_t n = sizeof(adh_a38_pairs) / sizeof(const char*);
+        for(int i=0;i<n;i+=2) {
+          result[adh_a38_pairs[i]] = adh_a38_pairs[i+1];
+        }
+        CCTBX_ASSERT(result.size()*2 == n);
+        return result;
       }
-      CCTBX_ASSERT(adh_a38_map.size()*2 == n);
-    }
+    };
+    // initialised once, also when several threads create space groups
+    static const map_t adh_a38_map = adh_a38_map_builder::build();
     map_t::const_iterator match = adh_a38_map.find(work_symbol);
     if (match != adh_a38_map.end()) work_symbol = match->second;
   }